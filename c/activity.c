@@ -0,0 +1,322 @@
+/*
+压缩域的活动分析：只读包，不解码像素
+
+视频包的大小反映了画面的变化：静止的画面 P/B 帧很小，运动与切换时变大；帧内编码的帧的位置可以推断场景切换。
+逐包统计到每一秒（activity_second_t）：
+    - activity：非关键帧的平均大小与各秒中位数之比，全部是帧内编码时用所有帧
+    - scene_cuts：不在常见间隔上的帧内编码帧（编码器在场景切换处插入）、比近期平均大很多的非关键帧
+帧类型取自解析器（只看 NAL 头与片头），没有解析器的格式只用包的关键帧标记。
+可以在已有的 av_read_frame() 循环中逐包调用 activity_add_packet()，也可以用 activity_scan() 单独扫描，
+后者只解复用视频流，速度接近读取数据的速度。
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "activity.h"
+
+// 时间线的最大长度，时间戳异常时不至于分配过多内存
+#define MAX_SECONDS (24 * 3600)
+// 非关键帧大于近期平均的 SPIKE_RATIO 倍时视为场景切换的候选，至少先看过 SPIKE_MIN_FRAMES 帧
+#define SPIKE_RATIO 4
+#define SPIKE_MIN_FRAMES 8
+// 近期平均按 1/2^AVG_SHIFT 的权重更新，avg 中存的是平均值 << AVG_SHIFT
+#define AVG_SHIFT 4
+// 帧内编码帧的间隔小于常见间隔的 GOP_RATIO 时视为场景切换
+#define GOP_RATIO 0.8
+
+// 每秒非关键帧的累计，结束时算出 activity
+typedef struct inter_acc {
+    int64_t bytes;
+    int nb;
+} inter_acc_t;
+
+typedef struct activity_context {
+    int stream_index;
+    AVRational time_base;
+    int64_t start_time;
+    AVCodecContext *avctx; // 只给解析器用
+    AVCodecParserContext *parser;
+    activity_second_t *seconds;
+    inter_acc_t *inter;
+    int nb_seconds, max_seconds;
+    double *intra_times; // 帧内编码帧的时刻
+    int nb_intra, max_intra;
+    int64_t avg; // 近期非关键帧的平均大小 << AVG_SHIFT
+    int nb_inter;
+} activity_context_t;
+
+/*
+st 为要分析的视频流，只在这里读取参数，之后不再引用
+ */
+void* activity_init(const AVStream* st)
+{
+    activity_context_t *a = (activity_context_t *)av_mallocz(sizeof(activity_context_t));
+
+    if (!a)
+        return NULL;
+    a->stream_index = st->index;
+    a->time_base = st->time_base;
+    a->start_time = st->start_time;
+    // 解析器需要 extradata（如 avcC），取不到时只用关键帧标记
+    a->parser = av_parser_init(st->codecpar->codec_id);
+    if (a->parser) {
+        a->avctx = avcodec_alloc_context3(NULL);
+        if (!a->avctx || avcodec_parameters_to_context(a->avctx, st->codecpar) < 0) {
+            av_parser_close(a->parser);
+            a->parser = NULL;
+        } else {
+            a->parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
+        }
+    }
+    return a;
+}
+
+void activity_free(void* ctx)
+{
+    activity_context_t *a = (activity_context_t *)ctx;
+
+    if (!a)
+        return;
+    av_parser_close(a->parser);
+    avcodec_free_context(&a->avctx);
+    av_free(a->seconds);
+    av_free(a->inter);
+    av_free(a->intra_times);
+    av_free(a);
+}
+
+static int grow_seconds(activity_context_t *a, int n)
+{
+    if (n > a->max_seconds) {
+        int max = FFMAX(n, a->max_seconds * 2);
+        activity_second_t *s = (activity_second_t *)av_realloc_array(a->seconds, max, sizeof(*s));
+        inter_acc_t *in;
+        if (!s)
+            return AVERROR(ENOMEM);
+        a->seconds = s;
+        in = (inter_acc_t *)av_realloc_array(a->inter, max, sizeof(*in));
+        if (!in)
+            return AVERROR(ENOMEM);
+        a->inter = in;
+        a->max_seconds = max;
+    }
+    if (n > a->nb_seconds) {
+        memset(a->seconds + a->nb_seconds, 0, (n - a->nb_seconds) * sizeof(*a->seconds));
+        memset(a->inter + a->nb_seconds, 0, (n - a->nb_seconds) * sizeof(*a->inter));
+        a->nb_seconds = n;
+    }
+    return 0;
+}
+
+/*
+送入一个包，其他流的包与没有时间戳的包忽略
+返回 0，内存不足时返回 < 0
+ */
+int activity_add_packet(void* ctx, const AVPacket* pkt)
+{
+    activity_context_t *a = (activity_context_t *)ctx;
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    activity_second_t *s;
+    double t;
+    int key = !!(pkt->flags & AV_PKT_FLAG_KEY), intra = key, idx, ret;
+
+    if (pkt->stream_index != a->stream_index || ts == AV_NOPTS_VALUE || pkt->size <= 0)
+        return 0;
+    if (a->start_time != AV_NOPTS_VALUE)
+        ts -= a->start_time;
+    t = ts * av_q2d(a->time_base);
+    if (t < 0 || t >= MAX_SECONDS)
+        return 0;
+    if (a->parser) {
+        uint8_t *out;
+        int out_size;
+        av_parser_parse2(a->parser, a->avctx, &out, &out_size, pkt->data, pkt->size, pkt->pts, pkt->dts, pkt->pos);
+        intra |= a->parser->pict_type == AV_PICTURE_TYPE_I;
+    }
+
+    idx = (int)t;
+    if ((ret = grow_seconds(a, idx + 1)) < 0)
+        return ret;
+    s = &a->seconds[idx];
+    s->bytes += pkt->size;
+    s->nb_packets++;
+    s->nb_keyframes += key;
+    s->nb_intra += intra;
+    if (intra) {
+        if (a->nb_intra == a->max_intra) {
+            int max = FFMAX(a->max_intra * 2, 64);
+            double *p = (double *)av_realloc_array(a->intra_times, max, sizeof(*p));
+            if (!p)
+                return AVERROR(ENOMEM);
+            a->intra_times = p;
+            a->max_intra = max;
+        }
+        a->intra_times[a->nb_intra++] = t;
+        return 0;
+    }
+
+    a->inter[idx].bytes += pkt->size;
+    a->inter[idx].nb++;
+    if (a->nb_inter >= SPIKE_MIN_FRAMES && ((int64_t)pkt->size << AVG_SHIFT) > a->avg * SPIKE_RATIO)
+        s->scene_cuts++;
+    a->avg = a->nb_inter ? a->avg - (a->avg >> AVG_SHIFT) + pkt->size : (int64_t)pkt->size << AVG_SHIFT;
+    a->nb_inter++;
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// 中位数，v 会被排序
+static double median(double *v, int n)
+{
+    if (!n)
+        return 0;
+    qsort(v, n, sizeof(*v), cmp_double);
+    return v[n / 2];
+}
+
+/*
+所有包送入后调用，算出各秒的 activity 与帧内编码帧推断的场景切换
+返回时间线的秒数，< 0 为错误
+ */
+int activity_finish(void* ctx)
+{
+    activity_context_t *a = (activity_context_t *)ctx;
+    int n = FFMAX(a->nb_seconds, a->nb_intra), i, m;
+    double *v, gop, typical;
+
+    if (!a->nb_seconds)
+        return 0;
+    v = (double *)av_malloc_array(n, sizeof(double));
+    if (!v)
+        return AVERROR(ENOMEM);
+
+    // 帧内编码帧按固定间隔出现时是 GOP 的边界，明显提前出现的是编码器在场景切换处插入的
+    for (i = 1, m = 0; i < a->nb_intra; i++)
+        v[m++] = a->intra_times[i] - a->intra_times[i - 1];
+    gop = median(v, m);
+    for (i = 1; i < a->nb_intra && gop > 0; i++)
+        if (a->intra_times[i] - a->intra_times[i - 1] < gop * GOP_RATIO)
+            a->seconds[(int)a->intra_times[i]].scene_cuts++;
+
+    // 全部是帧内编码（如 MJPEG）时用所有帧的平均大小
+    for (i = 0, m = 0; i < a->nb_seconds; i++) {
+        const activity_second_t *s = &a->seconds[i];
+        if (a->nb_inter ? a->inter[i].nb > 0 : s->nb_packets > 0)
+            v[m++] = a->nb_inter ? (double)a->inter[i].bytes / a->inter[i].nb : (double)s->bytes / s->nb_packets;
+    }
+    typical = median(v, m);
+    for (i = 0; i < a->nb_seconds; i++) {
+        activity_second_t *s = &a->seconds[i];
+        double mean = 0;
+        if (a->nb_inter && a->inter[i].nb > 0)
+            mean = (double)a->inter[i].bytes / a->inter[i].nb;
+        else if (!a->nb_inter && s->nb_packets > 0)
+            mean = (double)s->bytes / s->nb_packets;
+        s->activity = typical > 0 ? (float)(mean / typical) : 0;
+    }
+    av_free(v);
+    return a->nb_seconds;
+}
+
+/*
+activity_finish() 之后取时间线，*seconds 在 activity_free() 前有效，返回秒数
+ */
+int activity_timeline(void* ctx, const activity_second_t** seconds)
+{
+    activity_context_t *a = (activity_context_t *)ctx;
+
+    *seconds = a->seconds;
+    return a->nb_seconds;
+}
+
+/*
+单独打开内存中的视频（data, size），只读视频流前 max_seconds 秒（0 为全部）的包并分析
+返回的上下文用 activity_timeline() 取结果，用 activity_free() 释放；失败时返回 NULL
+ */
+void* activity_scan(const uint8_t* data, int size, double max_seconds)
+{
+    AVFormatContext *fmt_ctx = NULL;
+    AVIOContext *pb = NULL;
+    AVPacket *pkt = NULL;
+    AVStream *st;
+    void *a = NULL;
+    uint8_t *indata;
+    unsigned int i;
+    int ret, idx;
+
+    fmt_ctx = avformat_alloc_context();
+    indata = (uint8_t *)av_malloc(size);
+    if (!fmt_ctx || !indata) {
+        av_free(indata);
+        goto end;
+    }
+    memcpy(indata, data, size);
+    pb = avio_alloc_context(indata, size, 0, NULL, NULL, NULL, NULL);
+    if (!pb) {
+        av_free(indata);
+        goto end;
+    }
+    fmt_ctx->pb = pb;
+    // 打开失败时 fmt_ctx 会被释放，pb 由这里释放
+    if ((ret = avformat_open_input(&fmt_ctx, NULL, NULL, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open input for activity scan, err:%d\n", ret);
+        goto end;
+    }
+    // 文件头已经给出编码参数（mp4、mkv 等）时不用探测，探测会解码若干帧
+    ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (ret < 0 || fmt_ctx->streams[ret]->codecpar->codec_id == AV_CODEC_ID_NONE) {
+        if ((ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0 ||
+            (ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not find video stream for activity scan, err:%d\n", ret);
+            goto end;
+        }
+    }
+    idx = ret;
+    st = fmt_ctx->streams[idx];
+    // 其他流的包不读
+    for (i = 0; i < fmt_ctx->nb_streams; i++)
+        if ((int)i != idx)
+            fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+    a = activity_init(st);
+    pkt = av_packet_alloc();
+    if (!a || !pkt) {
+        activity_free(a);
+        a = NULL;
+        goto end;
+    }
+    while (av_read_frame(fmt_ctx, pkt) >= 0) {
+        if (pkt->stream_index == idx && max_seconds > 0 && pkt->pts != AV_NOPTS_VALUE &&
+            (pkt->pts - (st->start_time != AV_NOPTS_VALUE ? st->start_time : 0)) * av_q2d(st->time_base) > max_seconds) {
+            av_packet_unref(pkt);
+            break;
+        }
+        ret = activity_add_packet(a, pkt);
+        av_packet_unref(pkt);
+        if (ret < 0)
+            break;
+    }
+    if (ret < 0 || activity_finish(a) < 0) {
+        activity_free(a);
+        a = NULL;
+    }
+
+end:
+    av_packet_free(&pkt);
+    avformat_close_input(&fmt_ctx);
+    if (pb) {
+        av_freep(&pb->buffer);
+        av_freep(&pb);
+    }
+    return a;
+}
@@ -0,0 +1,27 @@
+
+#include <stdint.h>
+#include <libavformat/avformat.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 一秒内视频包的统计与由此推断的活动程度
+typedef struct activity_second {
+    int64_t bytes; // 视频包的总字节数
+    int nb_packets;
+    int nb_keyframes;
+    int nb_intra; // 解析器认出的 I 帧数，包括非关键帧的 I 帧
+    float activity; // 非关键帧的平均大小与全片中位数之比，1 为一般，没有包的秒为 0
+    int scene_cuts; // 场景切换的候选数
+} activity_second_t;
+
+void* activity_init(const AVStream* st);
+int activity_add_packet(void* ctx, const AVPacket* pkt);
+int activity_finish(void* ctx);
+int activity_timeline(void* ctx, const activity_second_t** seconds);
+void* activity_scan(const uint8_t* data, int size, double max_seconds);
+void activity_free(void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,393 @@
+/*
+边解码边缩小
+
+支持 draw_horiz_band 的解码器每解完一个条带（通常是一行宏块）就回调一次，
+这里在回调中立即把已完成的源行缩小到目标帧，源行还在缓存里时就被读走，
+整帧解完时缩小也基本完成，省掉一次对整帧的完整读取，大分辨率输入的首帧延迟也更低。
+
+    - 源格式被面积平均缩小支持时用原生的缩小（条带可以按行任意推进）
+    - 否则用 swscale 的 slice 接口，按从上到下的顺序喂入条带，同一时间只能处理一帧
+解码出的帧与回调中的帧按 data[0] 对应；条带不完整、场图、隔行帧、尺寸变化、槽位被淘汰等情况没有边解码边缩小的结果。
+隔行帧按帧缩小会把两场的行混在一起，缩小后的帧又是逐行的，muxing 无法再抽场，所以不边解码边缩小，取出时只取先显示的一场整帧缩小。
+muxing 的缩放流水线按第一帧的尺寸建立，之后不能混入另一种尺寸的帧，所以按第一个取出的帧定下模式：
+    - 第一帧是缩小过的：之后没能边解码边缩小的帧在取出时整帧缩小到同样的尺寸与格式
+    - 第一帧没能边解码边缩小：整个过程都不再边解码边缩小，调用者全部按普通流程缩放
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include "band_scale.h"
+#include "downscale.h"
+#include "frame_pool.h"
+
+// 同时在解码中的帧数上限，帧级重排序（B 帧）时会有多帧交替出现
+#define MAX_SLOTS 4
+
+typedef struct band_slot {
+    const uint8_t *key;     // 帧的 data[0]，为 NULL 表示空闲
+    uint8_t *rows;          // 每个源行是否已解码
+    int ready;              // 从顶部起连续解码完成的源行数
+    int fed;                // swscale 已喂入的源行数
+    int done;               // 已输出的目标行数
+    int valid;              // 为 0 时该帧不再处理，取出时回退
+    int64_t stamp;          // 最近一次使用，用于淘汰
+    AVFrame *out;
+} band_slot_t;
+
+typedef struct band_scale_context {
+    pthread_mutex_t lock;
+    int src_fmt, sw, sh, dw, dh;
+    int out_fmt;
+    int log2_chroma_h;
+    void *ds_ctx;
+    struct SwsContext *sws_ctx;
+    band_scale_want_fn want;
+    void *opaque;
+    band_slot_t slots[MAX_SLOTS];
+    int64_t clock;
+    int mode; // 0 还未取出过帧，1 输出都是缩小后的帧，-1 不再边解码边缩小
+    struct SwsContext *whole_sws; // 整帧缩小不能用原生缩小的帧（尺寸、格式中途变化）
+    int nb_hits, nb_misses;
+} band_scale_context_t;
+
+static void reset_slot(band_slot_t *s, int sh)
+{
+    s->key = NULL;
+    s->ready = s->fed = s->done = 0;
+    s->valid = 0;
+    memset(s->rows, 0, sh);
+    av_frame_unref(s->out);
+}
+
+// 颜色属性跟随源帧；swscale 把 RGB 转成 BT.601 的 MPEG 范围
+static void copy_color(const AVFrame *src, AVFrame *out, int rgb_to_yuv)
+{
+    if (!rgb_to_yuv) {
+        out->colorspace = src->colorspace;
+        out->color_range = src->color_range;
+    } else {
+        out->colorspace = AVCOL_SPC_BT470BG;
+        out->color_range = AVCOL_RANGE_MPEG;
+    }
+    out->color_primaries = src->color_primaries;
+    out->color_trc = src->color_trc;
+}
+
+static band_slot_t *find_slot(band_scale_context_t *bctx, const uint8_t *key)
+{
+    int i;
+    for (i = 0; i < MAX_SLOTS; i++)
+        if (bctx->slots[i].key == key)
+            return &bctx->slots[i];
+    return NULL;
+}
+
+// 为新帧分配一个槽位，没有空闲时淘汰最久未用的
+static band_slot_t *new_slot(band_scale_context_t *bctx, const AVFrame *src)
+{
+    band_slot_t *s = &bctx->slots[0];
+    int i;
+
+    for (i = 1; i < MAX_SLOTS && s->key; i++)
+        if (!bctx->slots[i].key || bctx->slots[i].stamp < s->stamp)
+            s = &bctx->slots[i];
+    reset_slot(s, bctx->sh);
+    s->key = src->data[0];
+
+    // swscale 的 slice 接口内部有状态，新帧开始时中断未完成的帧
+    if (bctx->sws_ctx) {
+        for (i = 0; i < MAX_SLOTS; i++) {
+            band_slot_t *o = &bctx->slots[i];
+            if (o != s && o->key && o->fed > 0 && o->fed < bctx->sh)
+                o->valid = 0;
+        }
+    }
+
+    s->out->format = bctx->out_fmt;
+    s->out->width = bctx->dw;
+    s->out->height = bctx->dh;
+    if (frame_pool_get_frame(s->out) < 0)
+        return s;
+    copy_color(src, s->out, !bctx->ds_ctx && (av_pix_fmt_desc_get(bctx->src_fmt)->flags & AV_PIX_FMT_FLAG_RGB));
+    s->valid = 1;
+    return s;
+}
+
+static int scale_ready_rows(band_scale_context_t *bctx, band_slot_t *s, const AVFrame *src)
+{
+    if (bctx->ds_ctx) {
+        // 找到已解码的源行够输出的最后一个目标行（按色度对齐）
+        int end = bctx->dh;
+        if (s->ready < bctx->sh) {
+            int lo = s->done, hi = bctx->dh;
+            while (hi - lo > 2) {
+                int mid = ((lo + hi) / 2) & ~1;
+                if (mid <= lo)
+                    break;
+                if (downscale_src_rows(bctx->ds_ctx, mid) <= s->ready)
+                    lo = mid;
+                else
+                    hi = mid;
+            }
+            end = lo;
+        }
+        if (end > s->done) {
+            int ret = downscale_frame(bctx->ds_ctx, src, s->out, s->done, end - s->done);
+            if (ret < 0)
+                return ret;
+            s->done = end;
+        }
+    } else {
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(bctx->src_fmt);
+        const uint8_t *slice[4] = {NULL};
+        int end = s->ready == bctx->sh ? bctx->sh : s->ready & ~((1 << bctx->log2_chroma_h) - 1);
+        int p;
+
+        if (end <= s->fed)
+            return 0;
+        for (p = 0; p < 4 && src->data[p]; p++) {
+            int shift = (p == 1 || p == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB) ? bctx->log2_chroma_h : 0;
+            slice[p] = src->data[p] + (ptrdiff_t)(s->fed >> shift) * src->linesize[p];
+        }
+        sws_scale(bctx->sws_ctx, slice, src->linesize, s->fed, end - s->fed,
+                  s->out->data, s->out->linesize);
+        s->fed = end;
+        if (end == bctx->sh)
+            s->done = bctx->dh;
+    }
+    return 0;
+}
+
+static void draw_band(AVCodecContext *avctx, const AVFrame *src, int offset[AV_NUM_DATA_POINTERS],
+                      int y, int type, int height)
+{
+    band_scale_context_t *bctx = (band_scale_context_t *)avctx->opaque;
+    band_slot_t *s;
+
+    (void)offset;
+    if (!bctx || !src || !src->data[0])
+        return;
+
+    pthread_mutex_lock(&bctx->lock);
+    if (bctx->mode < 0)
+        goto end;
+    s = find_slot(bctx, src->data[0]);
+    if (type != 3 || src->interlaced_frame ||
+        src->width != bctx->sw || src->height != bctx->sh || src->format != bctx->src_fmt) {
+        // 场图、隔行帧或中途变化的帧不处理
+        if (s)
+            s->valid = 0;
+        goto end;
+    }
+    y = av_clip(y, 0, bctx->sh);
+    height = av_clip(height, 0, bctx->sh - y);
+    // 缓存被复用：同一行再次解码说明这是使用同一块缓存的新帧
+    if (s && height > 0 && s->rows[y]) {
+        reset_slot(s, bctx->sh);
+        s = NULL;
+    }
+    if (!s) {
+        if (bctx->want && !bctx->want(bctx->opaque, src))
+            goto end;
+        s = new_slot(bctx, src);
+    }
+    s->stamp = ++bctx->clock;
+    if (!s->valid)
+        goto end;
+
+    memset(s->rows + y, 1, height);
+    while (s->ready < bctx->sh && s->rows[s->ready])
+        s->ready++;
+    if (scale_ready_rows(bctx, s, src) < 0)
+        s->valid = 0;
+end:
+    pthread_mutex_unlock(&bctx->lock);
+}
+
+/*
+为解码器装上条带回调，需在 avcodec_open2() 之前调用
+解码器不支持 draw_horiz_band、源尺寸未知或不是缩小时返回 NULL，调用者按普通流程处理
+want 可为 NULL，表示每一帧都缩小
+ */
+void* band_scale_init(AVCodecContext* dec_ctx, int dst_width, int dst_height, band_scale_want_fn want, void* opaque)
+{
+    band_scale_context_t *bctx;
+    const AVPixFmtDescriptor *desc;
+    int i, sw, sh;
+
+    if (!dec_ctx->codec || !(dec_ctx->codec->capabilities & AV_CODEC_CAP_DRAW_HORIZ_BAND))
+        return NULL;
+    if (dec_ctx->width <= 0 || dec_ctx->height <= 0 || dec_ctx->pix_fmt == AV_PIX_FMT_NONE)
+        return NULL;
+    // 设置了 lowres 时解码出的帧按比例缩小
+    sw = AV_CEIL_RSHIFT(dec_ctx->width, dec_ctx->lowres);
+    sh = AV_CEIL_RSHIFT(dec_ctx->height, dec_ctx->lowres);
+    if (dst_width <= 0 || dst_height <= 0 || dst_width > sw || dst_height > sh)
+        return NULL;
+    desc = av_pix_fmt_desc_get(dec_ctx->pix_fmt);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)))
+        return NULL;
+
+    bctx = (band_scale_context_t *)av_mallocz(sizeof(band_scale_context_t));
+    if (!bctx)
+        return NULL;
+    pthread_mutex_init(&bctx->lock, NULL);
+    bctx->src_fmt = dec_ctx->pix_fmt;
+    bctx->sw = sw;
+    bctx->sh = sh;
+    bctx->dw = dst_width;
+    bctx->dh = dst_height;
+    bctx->log2_chroma_h = desc->log2_chroma_h;
+    bctx->want = want;
+    bctx->opaque = opaque;
+
+    bctx->ds_ctx = downscale_init(bctx->src_fmt, bctx->sw, bctx->sh, dst_width, dst_height);
+    if (bctx->ds_ctx) {
+        bctx->out_fmt = downscale_dst_format(bctx->ds_ctx);
+    } else {
+        bctx->out_fmt = AV_PIX_FMT_YUV420P;
+        bctx->sws_ctx = sws_getContext(bctx->sw, bctx->sh, bctx->src_fmt, dst_width, dst_height,
+                                       bctx->out_fmt, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+        if (!bctx->sws_ctx)
+            goto fail;
+    }
+    for (i = 0; i < MAX_SLOTS; i++) {
+        bctx->slots[i].rows = (uint8_t *)av_mallocz(bctx->sh);
+        bctx->slots[i].out = av_frame_alloc();
+        if (!bctx->slots[i].rows || !bctx->slots[i].out)
+            goto fail;
+    }
+
+    dec_ctx->opaque = bctx;
+    dec_ctx->draw_horiz_band = draw_band;
+    dec_ctx->slice_flags = 0; // 按显示顺序回调，只接受帧图
+    // 帧级多线程下解码器不回调条带，改用条带级多线程
+    dec_ctx->thread_type = FF_THREAD_SLICE;
+    return bctx;
+
+fail:
+    band_scale_free(bctx);
+    return NULL;
+}
+
+/*
+没能边解码边缩小的帧整帧缩小到 out，尺寸、格式与边解码边缩小的输出一致
+隔行帧只取先显示的一场（行距加倍、高度减半），与 muxing 默认的抽场一致
+ */
+static int scale_whole(band_scale_context_t *bctx, const AVFrame *frame, AVFrame *out)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    const uint8_t *data[4] = {NULL};
+    int linesize[4] = {0};
+    int ret, native, field, h, p;
+
+    if (!desc)
+        return AVERROR(EINVAL);
+    field = frame->interlaced_frame && frame->height >= 8 &&
+            !(desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM));
+    h = field ? (frame->height >> 1) & ~((1 << desc->log2_chroma_h) - 1) : frame->height;
+    for (p = 0; p < 4 && frame->data[p]; p++) {
+        data[p] = frame->data[p];
+        linesize[p] = frame->linesize[p];
+        if (field) {
+            if (!frame->top_field_first)
+                data[p] += linesize[p];
+            linesize[p] *= 2;
+        }
+    }
+    native = bctx->ds_ctx && !field && frame->width == bctx->sw && frame->height == bctx->sh &&
+             frame->format == bctx->src_fmt;
+    if (!native) {
+        bctx->whole_sws = sws_getCachedContext(bctx->whole_sws, frame->width, h, frame->format,
+                                               bctx->dw, bctx->dh, bctx->out_fmt, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+        if (!bctx->whole_sws)
+            return AVERROR(EINVAL);
+    }
+    out->format = bctx->out_fmt;
+    out->width = bctx->dw;
+    out->height = bctx->dh;
+    if ((ret = frame_pool_get_frame(out)) < 0)
+        return ret;
+    if (native)
+        ret = downscale_frame(bctx->ds_ctx, frame, out, 0, bctx->dh);
+    else
+        ret = sws_scale(bctx->whole_sws, data, linesize, 0, h, out->data, out->linesize) == bctx->dh ?
+              0 : AVERROR_EXTERNAL;
+    if (ret < 0) {
+        av_frame_unref(out);
+        return ret;
+    }
+    copy_color(frame, out, !native && (desc->flags & AV_PIX_FMT_FLAG_RGB));
+    out->pts = frame->pts;
+    return 0;
+}
+
+/*
+取出 frame 对应的已缩小的帧
+返回 1 表示 out 中为缩小后的帧（没能边解码边缩小的帧这里整帧缩小）；
+返回 0 表示不再边解码边缩小（第一帧就没能边解码边缩小），该帧及之后的帧都按普通流程缩放；< 0 为错误
+out 为 NULL 时只丢弃该帧的缩小结果（如被跳过的帧），让槽位尽快复用
+ */
+int band_scale_take(void* ctx, const AVFrame* frame, AVFrame* out)
+{
+    band_scale_context_t *bctx = (band_scale_context_t *)ctx;
+    band_slot_t *s;
+    int ret = 0;
+
+    if (!bctx || !frame->data[0])
+        return 0;
+    pthread_mutex_lock(&bctx->lock);
+    s = find_slot(bctx, frame->data[0]);
+    if (s && s->valid && s->done == bctx->dh && out && bctx->mode >= 0) {
+        av_frame_move_ref(out, s->out);
+        out->pts = frame->pts;
+        ret = 1;
+    }
+    if (out) {
+        if (!bctx->mode)
+            bctx->mode = ret ? 1 : -1;
+        if (ret) {
+            bctx->nb_hits++;
+        } else if (bctx->mode > 0) {
+            bctx->nb_misses++;
+            ret = scale_whole(bctx, frame, out);
+            if (ret >= 0)
+                ret = 1;
+        }
+    }
+    if (s)
+        reset_slot(s, bctx->sh);
+    pthread_mutex_unlock(&bctx->lock);
+    return ret;
+}
+
+void band_scale_free(void* ctx)
+{
+    band_scale_context_t *bctx = (band_scale_context_t *)ctx;
+    int i;
+
+    if (!bctx)
+        return;
+    if (bctx->nb_hits || bctx->nb_misses)
+        av_log(NULL, AV_LOG_INFO, "band scale %dx%d -> %dx%d, frames %d, whole frame %d\n",
+                bctx->sw, bctx->sh, bctx->dw, bctx->dh, bctx->nb_hits, bctx->nb_misses);
+    else if (bctx->mode < 0)
+        av_log(NULL, AV_LOG_INFO, "band scale %dx%d -> %dx%d off, first frame missed\n",
+                bctx->sw, bctx->sh, bctx->dw, bctx->dh);
+    for (i = 0; i < MAX_SLOTS; i++) {
+        av_freep(&bctx->slots[i].rows);
+        av_frame_free(&bctx->slots[i].out);
+    }
+    downscale_free(bctx->ds_ctx);
+    sws_freeContext(bctx->sws_ctx);
+    sws_freeContext(bctx->whole_sws);
+    pthread_mutex_destroy(&bctx->lock);
+    av_free(bctx);
+}
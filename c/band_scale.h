@@ -0,0 +1,18 @@
+
+#include <libavcodec/avcodec.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+判断正在解码的帧是否需要缩小，返回 0 时该帧的条带直接忽略
+ */
+typedef int (*band_scale_want_fn)(void* opaque, const AVFrame* frame);
+
+void* band_scale_init(AVCodecContext* dec_ctx, int dst_width, int dst_height, band_scale_want_fn want, void* opaque);
+int band_scale_take(void* ctx, const AVFrame* frame, AVFrame* out);
+void band_scale_free(void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,657 @@
+/*
+常用像素格式对的专用转换
+
+编码器的输入格式只有几种：GIF 为 RGB8，JPEG 为 YUVJ420P，PNG 为 RGB24，
+而解码输出绝大多数是 yuv420p / nv12 / yuv420p10。swscale 对任意格式对都走通用的多级流水线，
+这里为这几个格式对各生成一个专用的行转换函数：
+    - convert_row() 是按 (源格式, 目标格式) 参数化的 always_inline 模板，参数在编译期是常量，
+      分支与无关的代码都会被编译器消掉
+    - 每个格式对实例化出通用版本；8 位源转 RGB24、RGB8 另有手写的 SSE2/AVX2 版本，初始化时按 CPU 特性选择
+系数按源帧的 colorspace（BT.601/BT.709）与 color_range 计算，全部为定点运算
+
+8 位源转 RGB8（固定的 3:3:2 调色板）时不经过 RGB：
+预先生成 YUV -> 调色板索引的 32x32x32 查找表（32KB，放得进 L1），每个像素一次查表，
+可选的有序抖动（4x4 Bayer）加在查表前的 luma 上，整个过程只有一遍
+
+RGB24 转 RGB8 用于加水印：水印只能叠加在 8 位的非调色板帧上，固定调色板的输出先缩放到 RGB24，
+叠加后再逐像素取最近的 3:3:2 级，抖动按各通道的级差加在量化前
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libavutil/common.h>
+#include <libavutil/frame.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixfmt.h>
+
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86 1
+#endif
+
+// 源的布局
+enum { SRC_PLANAR8, SRC_NV12, SRC_PLANAR10, SRC_RGB24 };
+// 目标的布局
+enum { DST_RGB24, DST_RGB8, DST_RGB8_LUT, DST_YUVJ420P };
+
+#define LUT_BITS 5
+#define LUT_SIZE (1 << (3 * LUT_BITS))
+
+// 4x4 Bayer 矩阵
+static const uint8_t bayer4[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+typedef struct convert_coeffs {
+    int y_off, c_off;       // 源位深下的黑电平、色度零点
+    int cy, crv, cgu, cgv, cbu; // YUV -> RGB 的矩阵，Q14，已包含位深与范围的缩放
+    int ly, lc;             // 转 full range YUV 时 luma/chroma 的缩放，Q14
+    int shift, round;
+    const uint8_t *lut;     // DST_RGB8_LUT 的查找表
+} convert_coeffs_t;
+
+typedef void (*convert_row_fn)(const convert_coeffs_t *k, const uint8_t *ys, const uint8_t *us,
+                               const uint8_t *vs, uint8_t *const *dst, int w, int j);
+
+typedef struct convert_context {
+    int src_fmt, dst_fmt;
+    int src_layout, dst_layout;
+    convert_coeffs_t k;
+    convert_row_fn row;
+} convert_context_t;
+
+static av_always_inline int load_y(const uint8_t *ys, int i, const int src)
+{
+    return src == SRC_PLANAR10 ? ((const uint16_t *)ys)[i] : ys[i];
+}
+
+static av_always_inline void load_uv(const uint8_t *us, const uint8_t *vs, int c, int *u, int *v, const int src)
+{
+    if (src == SRC_NV12) {
+        *u = us[2 * c];
+        *v = us[2 * c + 1];
+    } else if (src == SRC_PLANAR10) {
+        *u = ((const uint16_t *)us)[c];
+        *v = ((const uint16_t *)vs)[c];
+    } else {
+        *u = us[c];
+        *v = vs[c];
+    }
+}
+
+// RGB8 为 3:3:2，取最近的调色板级（R/G 级差 255/7，B 级差 255/3）
+static av_always_inline int rgb8_index(int r, int g, int b)
+{
+    return ((r * 7 + 127) / 255) << 5 | ((g * 7 + 127) / 255) << 2 | ((b * 3 + 127) / 255);
+}
+
+/*
+行转换的模板，src/dstl/dither 为编译期常量，j 为该行的 luma 行号
+转 YUVJ420P 时，奇数行的 dst[1]/dst[2] 传 NULL，只转换 luma
+ */
+static av_always_inline void convert_row(const convert_coeffs_t *k, const uint8_t *ys, const uint8_t *us,
+                                         const uint8_t *vs, uint8_t *const *dst, int w, int j,
+                                         const int src, const int dstl, const int dither)
+{
+    int i, y, u, v;
+
+    if (dstl == DST_RGB8_LUT) {
+        const uint8_t *lut = k->lut;
+        const uint8_t *bayer = bayer4[j & 3];
+        uint8_t *d = dst[0];
+        for (i = 0; i < w; i++) {
+            y = ys[i];
+            load_uv(us, vs, i >> 1, &u, &v, src);
+            // 抖动幅度约为一个调色板级对应的 luma（±15）
+            if (dither)
+                y = av_clip_uint8(y + 2 * bayer[i & 3] - 15);
+            d[i] = lut[(y >> (8 - LUT_BITS)) << (2 * LUT_BITS) |
+                       (u >> (8 - LUT_BITS)) << LUT_BITS | (v >> (8 - LUT_BITS))];
+        }
+        return;
+    }
+
+    if (src == SRC_RGB24) {
+        const uint8_t *bayer = bayer4[j & 3];
+        uint8_t *d = dst[0];
+        for (i = 0; i < w; i++) {
+            int r = ys[3 * i], g = ys[3 * i + 1], b = ys[3 * i + 2];
+            // 抖动为对称的 ±半个级差（R/G 约 36，B 为 85）
+            if (dither) {
+                int t = 2 * bayer[i & 3] + 1;
+                r = av_clip_uint8(r + (t * 36 >> 5) - 18);
+                g = av_clip_uint8(g + (t * 36 >> 5) - 18);
+                b = av_clip_uint8(b + (t * 85 >> 5) - 42);
+            }
+            d[i] = rgb8_index(r, g, b);
+        }
+        return;
+    }
+
+    if (dstl == DST_YUVJ420P) {
+        uint8_t *d = dst[0];
+        for (i = 0; i < w; i++) {
+            y = load_y(ys, i, src) - k->y_off;
+            d[i] = av_clip_uint8((y * k->ly + k->round) >> k->shift);
+        }
+        if (dst[1]) {
+            for (i = 0; i < (w + 1) >> 1; i++) {
+                load_uv(us, vs, i, &u, &v, src);
+                dst[1][i] = av_clip_uint8((((u - k->c_off) * k->lc + k->round) >> k->shift) + 128);
+                dst[2][i] = av_clip_uint8((((v - k->c_off) * k->lc + k->round) >> k->shift) + 128);
+            }
+        }
+        return;
+    }
+
+    for (i = 0; i < w; i++) {
+        int r, g, b, yy;
+        y = load_y(ys, i, src);
+        load_uv(us, vs, i >> 1, &u, &v, src);
+        yy = (y - k->y_off) * k->cy + k->round;
+        u -= k->c_off;
+        v -= k->c_off;
+        r = av_clip_uint8((yy + v * k->crv) >> k->shift);
+        g = av_clip_uint8((yy - u * k->cgu - v * k->cgv) >> k->shift);
+        b = av_clip_uint8((yy + u * k->cbu) >> k->shift);
+        if (dstl == DST_RGB24) {
+            dst[0][3 * i] = r;
+            dst[0][3 * i + 1] = g;
+            dst[0][3 * i + 2] = b;
+        } else {
+            dst[0][i] = rgb8_index(r, g, b);
+        }
+    }
+}
+
+#define DEFINE_ROW(name, src, dstl, dither) \
+static void name##_c(const convert_coeffs_t *k, const uint8_t *ys, const uint8_t *us, \
+                     const uint8_t *vs, uint8_t *const *dst, int w, int j) \
+{ \
+    convert_row(k, ys, us, vs, dst, w, j, src, dstl, dither); \
+}
+
+DEFINE_ROW(p8_rgb24, SRC_PLANAR8, DST_RGB24, 0)
+DEFINE_ROW(p8_rgb8, SRC_PLANAR8, DST_RGB8_LUT, 0)
+DEFINE_ROW(p8_rgb8_dither, SRC_PLANAR8, DST_RGB8_LUT, 1)
+DEFINE_ROW(p8_yuvj, SRC_PLANAR8, DST_YUVJ420P, 0)
+DEFINE_ROW(nv12_rgb24, SRC_NV12, DST_RGB24, 0)
+DEFINE_ROW(nv12_rgb8, SRC_NV12, DST_RGB8_LUT, 0)
+DEFINE_ROW(nv12_rgb8_dither, SRC_NV12, DST_RGB8_LUT, 1)
+DEFINE_ROW(nv12_yuvj, SRC_NV12, DST_YUVJ420P, 0)
+DEFINE_ROW(p10_rgb24, SRC_PLANAR10, DST_RGB24, 0)
+DEFINE_ROW(p10_rgb8, SRC_PLANAR10, DST_RGB8, 0)
+DEFINE_ROW(p10_yuvj, SRC_PLANAR10, DST_YUVJ420P, 0)
+DEFINE_ROW(rgb24_rgb8, SRC_RGB24, DST_RGB8, 0)
+DEFINE_ROW(rgb24_rgb8_dither, SRC_RGB24, DST_RGB8, 1)
+
+#ifdef CONVERT_X86
+/*
+8 位源转 RGB24、RGB8（查表）的 SIMD 版本，SSE2 一次 8 个像素，AVX2 一次 16 个像素，行尾交给通用版本
+YUV -> RGB 与通用版本逐位一致：(y, 1)、(u, v)、(u, u) 成对与 Q14 系数做 pmaddwd 得到 32 位的和，
+cbu 可能超过 int16，拆成 (cbu - 16384) * u + 16384 * u
+RGB8 查表时只有索引的计算是向量化的，查表仍逐个像素（gather 在多数 CPU 上并不比标量快）
+ */
+static av_always_inline int pair16(int lo, int hi)
+{
+    return (int)((uint32_t)(uint16_t)lo | (uint32_t)(uint16_t)hi << 16);
+}
+
+// RGB24 交织：第 n 个 16 字节取自 r/g/b 的哪些字节，-1 为置零
+static const int8_t rgb24_shuffle[3][3][16] = {
+    { {  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1,  5 },
+      { -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1 },
+      { -1, -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1 } },
+    { { -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10, -1 },
+      {  5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10 },
+      { -1,  5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1 } },
+    { { -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1 },
+      { -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1 },
+      { 10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15 } },
+};
+
+// SIMD 循环处理完前 i 个像素后，剩余部分交给通用版本；i 为 4 的倍数，抖动矩阵的列不变
+static av_always_inline void convert_tail(const convert_coeffs_t *k, const uint8_t *ys, const uint8_t *us,
+                                          const uint8_t *vs, uint8_t *const *dst, int w, int j, int i,
+                                          const int src, const int dstl, const int dither)
+{
+    uint8_t *d[3];
+
+    if (i >= w)
+        return;
+    d[0] = dst[0] + (dstl == DST_RGB24 ? 3 * i : i);
+    d[1] = d[2] = NULL;
+    if (src == SRC_NV12)
+        convert_row(k, ys + i, us + i, vs, d, w - i, j, src, dstl, dither);
+    else
+        convert_row(k, ys + i, us + (i >> 1), vs + (i >> 1), d, w - i, j, src, dstl, dither);
+}
+
+// 读 8 个像素的 y 与对应的 u、v（每个色度样本复制给两个像素），均扩展为 16 位
+static av_always_inline void load8_sse2(const uint8_t *ys, const uint8_t *us, const uint8_t *vs, int i,
+                                        __m128i *y, __m128i *u, __m128i *v, const int src)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    *y = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(ys + i)), zero);
+    if (src == SRC_NV12) {
+        __m128i uv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(us + i)), zero);
+        *u = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+        *v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+    } else {
+        int32_t u4, v4;
+        __m128i u8, v8;
+        memcpy(&u4, us + (i >> 1), 4);
+        memcpy(&v4, vs + (i >> 1), 4);
+        u8 = _mm_cvtsi32_si128(u4);
+        v8 = _mm_cvtsi32_si128(v4);
+        *u = _mm_unpacklo_epi8(_mm_unpacklo_epi8(u8, u8), zero);
+        *v = _mm_unpacklo_epi8(_mm_unpacklo_epi8(v8, v8), zero);
+    }
+}
+
+// (a, b) 成对交错后与系数对相乘相加，加上 y 项后移位，8 个结果饱和到 int16
+static av_always_inline __m128i madd8_sse2(__m128i ylo, __m128i yhi, __m128i a, __m128i b, __m128i m, __m128i shift)
+{
+    __m128i lo = _mm_add_epi32(ylo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), m));
+    __m128i hi = _mm_add_epi32(yhi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), m));
+    return _mm_packs_epi32(_mm_sra_epi32(lo, shift), _mm_sra_epi32(hi, shift));
+}
+
+static av_always_inline void rgb24_row_sse2(const convert_coeffs_t *k, const uint8_t *ys, const uint8_t *us,
+                                            const uint8_t *vs, uint8_t *const *dst, int w, int j, const int src)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i y_off = _mm_set1_epi16(k->y_off), c_off = _mm_set1_epi16(k->c_off);
+    const __m128i cy = _mm_set1_epi32(pair16(k->cy, k->round));
+    const __m128i rv = _mm_set1_epi32(pair16(0, k->crv));
+    const __m128i guv = _mm_set1_epi32(pair16(-k->cgu, -k->cgv));
+    const __m128i buu = _mm_set1_epi32(pair16(k->cbu - (1 << 14), 1 << 14));
+    const __m128i shift = _mm_cvtsi32_si128(k->shift);
+    uint8_t *d = dst[0];
+    int i, t;
+
+    // 每个像素按 4 字节 RGBX 写出，第 4 字节由下一个像素覆盖，所以最后一组要留给通用版本
+    for (i = 0; i + 8 < w; i += 8) {
+        __m128i y, u, v, ylo, yhi, r, g, b, rg, bx, p;
+        load8_sse2(ys, us, vs, i, &y, &u, &v, src);
+        y = _mm_sub_epi16(y, y_off);
+        u = _mm_sub_epi16(u, c_off);
+        v = _mm_sub_epi16(v, c_off);
+        ylo = _mm_madd_epi16(_mm_unpacklo_epi16(y, one), cy);
+        yhi = _mm_madd_epi16(_mm_unpackhi_epi16(y, one), cy);
+        r = madd8_sse2(ylo, yhi, u, v, rv, shift);
+        g = madd8_sse2(ylo, yhi, u, v, guv, shift);
+        b = madd8_sse2(ylo, yhi, u, u, buu, shift);
+        rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(g, g));
+        bx = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), zero);
+        p = _mm_unpacklo_epi16(rg, bx);
+        for (t = 0; t < 8; t++) {
+            int32_t x;
+            if (t == 4)
+                p = _mm_unpackhi_epi16(rg, bx);
+            x = _mm_cvtsi128_si32(p);
+            memcpy(d + 3 * (i + t), &x, 4);
+            p = _mm_srli_si128(p, 4);
+        }
+    }
+    convert_tail(k, ys, us, vs, dst, w, j, i, src, DST_RGB24, 0);
+}
+
+// 查表索引 (y >> 3) << 10 | (u >> 3) << 5 | v >> 3，y 已加抖动并截断到 [0, 255]
+static av_always_inline void rgb8_lut_row_sse2(const convert_coeffs_t *k, const uint8_t *ys, const uint8_t *us,
+                                               const uint8_t *vs, uint8_t *const *dst, int w, int j,
+                                               const int src, const int dither)
+{
+    const uint8_t *bayer = bayer4[j & 3];
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255), mask = _mm_set1_epi16(0xf8);
+    const __m128i bias = _mm_setr_epi16(2 * bayer[0] - 15, 2 * bayer[1] - 15, 2 * bayer[2] - 15, 2 * bayer[3] - 15,
+                                        2 * bayer[0] - 15, 2 * bayer[1] - 15, 2 * bayer[2] - 15, 2 * bayer[3] - 15);
+    const uint8_t *lut = k->lut;
+    uint8_t *d = dst[0];
+    uint16_t idx[8];
+    int i, t;
+
+    for (i = 0; i + 8 <= w; i += 8) {
+        __m128i y, u, v;
+        load8_sse2(ys, us, vs, i, &y, &u, &v, src);
+        if (dither)
+            y = _mm_max_epi16(_mm_min_epi16(_mm_add_epi16(y, bias), max), zero);
+        y = _mm_slli_epi16(_mm_and_si128(y, mask), 2 * LUT_BITS - (8 - LUT_BITS));
+        u = _mm_slli_epi16(_mm_and_si128(u, mask), LUT_BITS - (8 - LUT_BITS));
+        v = _mm_srli_epi16(v, 8 - LUT_BITS);
+        _mm_storeu_si128((__m128i *)idx, _mm_or_si128(_mm_or_si128(y, u), v));
+        for (t = 0; t < 8; t++)
+            d[i + t] = lut[idx[t]];
+    }
+    convert_tail(k, ys, us, vs, dst, w, j, i, src, DST_RGB8_LUT, dither);
+}
+
+// 读 16 个像素，每个 128 位 lane 的排列与 load8_sse2 相同
+__attribute__((target("avx2")))
+static av_always_inline void load16_avx2(const uint8_t *ys, const uint8_t *us, const uint8_t *vs, int i,
+                                         __m256i *y, __m256i *u, __m256i *v, const int src)
+{
+    *y = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(ys + i)));
+    if (src == SRC_NV12) {
+        __m256i uv = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(us + i)));
+        *u = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(uv, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+        *v = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(uv, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+    } else {
+        __m128i u8 = _mm_loadl_epi64((const __m128i *)(us + (i >> 1)));
+        __m128i v8 = _mm_loadl_epi64((const __m128i *)(vs + (i >> 1)));
+        *u = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(u8, u8));
+        *v = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(v8, v8));
+    }
+}
+
+// unpacklo/hi 按 lane 进行，packs 再按 lane 拼回，16 个结果仍按像素顺序
+__attribute__((target("avx2")))
+static av_always_inline __m256i madd16_avx2(__m256i ylo, __m256i yhi, __m256i a, __m256i b, __m256i m, __m128i shift)
+{
+    __m256i lo = _mm256_add_epi32(ylo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), m));
+    __m256i hi = _mm256_add_epi32(yhi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), m));
+    return _mm256_packs_epi32(_mm256_sra_epi32(lo, shift), _mm256_sra_epi32(hi, shift));
+}
+
+// 16 个 16 位值饱和为 16 个字节
+__attribute__((target("avx2")))
+static av_always_inline __m128i pack16_avx2(__m256i x)
+{
+    return _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(x, x), _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+__attribute__((target("avx2")))
+static av_always_inline void rgb24_row_avx2(const convert_coeffs_t *k, const uint8_t *ys, const uint8_t *us,
+                                            const uint8_t *vs, uint8_t *const *dst, int w, int j, const int src)
+{
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i y_off = _mm256_set1_epi16(k->y_off), c_off = _mm256_set1_epi16(k->c_off);
+    const __m256i cy = _mm256_set1_epi32(pair16(k->cy, k->round));
+    const __m256i rv = _mm256_set1_epi32(pair16(0, k->crv));
+    const __m256i guv = _mm256_set1_epi32(pair16(-k->cgu, -k->cgv));
+    const __m256i buu = _mm256_set1_epi32(pair16(k->cbu - (1 << 14), 1 << 14));
+    const __m128i shift = _mm_cvtsi32_si128(k->shift);
+    uint8_t *d = dst[0];
+    int i, n;
+
+    for (i = 0; i + 16 <= w; i += 16) {
+        __m256i y, u, v, ylo, yhi;
+        __m128i r, g, b;
+        load16_avx2(ys, us, vs, i, &y, &u, &v, src);
+        y = _mm256_sub_epi16(y, y_off);
+        u = _mm256_sub_epi16(u, c_off);
+        v = _mm256_sub_epi16(v, c_off);
+        ylo = _mm256_madd_epi16(_mm256_unpacklo_epi16(y, one), cy);
+        yhi = _mm256_madd_epi16(_mm256_unpackhi_epi16(y, one), cy);
+        r = pack16_avx2(madd16_avx2(ylo, yhi, u, v, rv, shift));
+        g = pack16_avx2(madd16_avx2(ylo, yhi, u, v, guv, shift));
+        b = pack16_avx2(madd16_avx2(ylo, yhi, u, u, buu, shift));
+        for (n = 0; n < 3; n++) {
+            __m128i o = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(r, _mm_loadu_si128((const __m128i *)rgb24_shuffle[n][0])),
+                             _mm_shuffle_epi8(g, _mm_loadu_si128((const __m128i *)rgb24_shuffle[n][1]))),
+                _mm_shuffle_epi8(b, _mm_loadu_si128((const __m128i *)rgb24_shuffle[n][2])));
+            _mm_storeu_si128((__m128i *)(d + 3 * i + 16 * n), o);
+        }
+    }
+    convert_tail(k, ys, us, vs, dst, w, j, i, src, DST_RGB24, 0);
+}
+
+__attribute__((target("avx2")))
+static av_always_inline void rgb8_lut_row_avx2(const convert_coeffs_t *k, const uint8_t *ys, const uint8_t *us,
+                                               const uint8_t *vs, uint8_t *const *dst, int w, int j,
+                                               const int src, const int dither)
+{
+    const uint8_t *bayer = bayer4[j & 3];
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi16(255), mask = _mm256_set1_epi16(0xf8);
+    const __m256i bias = _mm256_set1_epi64x((int64_t)(uint16_t)(2 * bayer[0] - 15) |
+                                            (int64_t)(uint16_t)(2 * bayer[1] - 15) << 16 |
+                                            (int64_t)(uint16_t)(2 * bayer[2] - 15) << 32 |
+                                            (int64_t)(uint16_t)(2 * bayer[3] - 15) << 48);
+    const uint8_t *lut = k->lut;
+    uint8_t *d = dst[0];
+    uint16_t idx[16];
+    int i, t;
+
+    for (i = 0; i + 16 <= w; i += 16) {
+        __m256i y, u, v;
+        load16_avx2(ys, us, vs, i, &y, &u, &v, src);
+        if (dither)
+            y = _mm256_max_epi16(_mm256_min_epi16(_mm256_add_epi16(y, bias), max), zero);
+        y = _mm256_slli_epi16(_mm256_and_si256(y, mask), 2 * LUT_BITS - (8 - LUT_BITS));
+        u = _mm256_slli_epi16(_mm256_and_si256(u, mask), LUT_BITS - (8 - LUT_BITS));
+        v = _mm256_srli_epi16(v, 8 - LUT_BITS);
+        _mm256_storeu_si256((__m256i *)idx, _mm256_or_si256(_mm256_or_si256(y, u), v));
+        for (t = 0; t < 16; t++)
+            d[i + t] = lut[idx[t]];
+    }
+    convert_tail(k, ys, us, vs, dst, w, j, i, src, DST_RGB8_LUT, dither);
+}
+
+#define DEFINE_RGB24_SIMD(name, src) \
+static void name##_sse2(const convert_coeffs_t *k, const uint8_t *ys, const uint8_t *us, \
+                        const uint8_t *vs, uint8_t *const *dst, int w, int j) \
+{ \
+    rgb24_row_sse2(k, ys, us, vs, dst, w, j, src); \
+} \
+__attribute__((target("avx2"))) \
+static void name##_avx2(const convert_coeffs_t *k, const uint8_t *ys, const uint8_t *us, \
+                        const uint8_t *vs, uint8_t *const *dst, int w, int j) \
+{ \
+    rgb24_row_avx2(k, ys, us, vs, dst, w, j, src); \
+}
+#define DEFINE_RGB8_SIMD(name, src, dither) \
+static void name##_sse2(const convert_coeffs_t *k, const uint8_t *ys, const uint8_t *us, \
+                        const uint8_t *vs, uint8_t *const *dst, int w, int j) \
+{ \
+    rgb8_lut_row_sse2(k, ys, us, vs, dst, w, j, src, dither); \
+} \
+__attribute__((target("avx2"))) \
+static void name##_avx2(const convert_coeffs_t *k, const uint8_t *ys, const uint8_t *us, \
+                        const uint8_t *vs, uint8_t *const *dst, int w, int j) \
+{ \
+    rgb8_lut_row_avx2(k, ys, us, vs, dst, w, j, src, dither); \
+}
+
+DEFINE_RGB24_SIMD(p8_rgb24, SRC_PLANAR8)
+DEFINE_RGB24_SIMD(nv12_rgb24, SRC_NV12)
+DEFINE_RGB8_SIMD(p8_rgb8, SRC_PLANAR8, 0)
+DEFINE_RGB8_SIMD(p8_rgb8_dither, SRC_PLANAR8, 1)
+DEFINE_RGB8_SIMD(nv12_rgb8, SRC_NV12, 0)
+DEFINE_RGB8_SIMD(nv12_rgb8_dither, SRC_NV12, 1)
+
+#define SIMD_FUNCS(name) name##_c, name##_sse2, name##_avx2
+#else
+#define SIMD_FUNCS(name) name##_c, NULL, NULL
+#endif
+#define C_FUNCS(name) name##_c, NULL, NULL
+#define NO_DITHER NULL, NULL, NULL
+
+static const struct {
+    int src_fmt, dst_fmt;
+    int src_layout, dst_layout;
+    convert_row_fn c, sse2, avx2; // 没有 SIMD 版本时为 NULL
+    convert_row_fn dither_c, dither_sse2, dither_avx2; // 带抖动的版本，没有时为 NULL
+} converters[] = {
+    { AV_PIX_FMT_YUV420P,     AV_PIX_FMT_RGB24,    SRC_PLANAR8,  DST_RGB24,    SIMD_FUNCS(p8_rgb24),   NO_DITHER },
+    { AV_PIX_FMT_YUV420P,     AV_PIX_FMT_RGB8,     SRC_PLANAR8,  DST_RGB8_LUT, SIMD_FUNCS(p8_rgb8),    SIMD_FUNCS(p8_rgb8_dither) },
+    { AV_PIX_FMT_YUV420P,     AV_PIX_FMT_YUVJ420P, SRC_PLANAR8,  DST_YUVJ420P, C_FUNCS(p8_yuvj),       NO_DITHER },
+    { AV_PIX_FMT_YUVJ420P,    AV_PIX_FMT_RGB24,    SRC_PLANAR8,  DST_RGB24,    SIMD_FUNCS(p8_rgb24),   NO_DITHER },
+    { AV_PIX_FMT_YUVJ420P,    AV_PIX_FMT_RGB8,     SRC_PLANAR8,  DST_RGB8_LUT, SIMD_FUNCS(p8_rgb8),    SIMD_FUNCS(p8_rgb8_dither) },
+    { AV_PIX_FMT_NV12,        AV_PIX_FMT_RGB24,    SRC_NV12,     DST_RGB24,    SIMD_FUNCS(nv12_rgb24), NO_DITHER },
+    { AV_PIX_FMT_NV12,        AV_PIX_FMT_RGB8,     SRC_NV12,     DST_RGB8_LUT, SIMD_FUNCS(nv12_rgb8),  SIMD_FUNCS(nv12_rgb8_dither) },
+    { AV_PIX_FMT_NV12,        AV_PIX_FMT_YUVJ420P, SRC_NV12,     DST_YUVJ420P, C_FUNCS(nv12_yuvj),     NO_DITHER },
+    { AV_PIX_FMT_YUV420P10LE, AV_PIX_FMT_RGB24,    SRC_PLANAR10, DST_RGB24,    C_FUNCS(p10_rgb24),     NO_DITHER },
+    { AV_PIX_FMT_YUV420P10LE, AV_PIX_FMT_RGB8,     SRC_PLANAR10, DST_RGB8,     C_FUNCS(p10_rgb8),      NO_DITHER },
+    { AV_PIX_FMT_YUV420P10LE, AV_PIX_FMT_YUVJ420P, SRC_PLANAR10, DST_YUVJ420P, C_FUNCS(p10_yuvj),      NO_DITHER },
+    { AV_PIX_FMT_RGB24,       AV_PIX_FMT_RGB8,     SRC_RGB24,    DST_RGB8,     C_FUNCS(rgb24_rgb8),    C_FUNCS(rgb24_rgb8_dither) },
+};
+
+static int find_converter(int src_fmt, int dst_fmt)
+{
+    int i;
+    for (i = 0; i < (int)FF_ARRAY_ELEMS(converters); i++)
+        if (converters[i].src_fmt == src_fmt && converters[i].dst_fmt == dst_fmt)
+            return i;
+    return -1;
+}
+
+int convert_supported(int src_fmt, int dst_fmt)
+{
+    return find_converter(src_fmt, dst_fmt) >= 0;
+}
+
+/*
+按源帧的色彩空间与范围计算定点系数
+未标明色彩空间时与 swscale 的默认一致，按 BT.601 处理
+ */
+static void init_coeffs(convert_coeffs_t *k, const AVFrame *src, int depth)
+{
+    double kr = 0.299, kb = 0.114, kg, yscale = 255.0 / 219, cscale = 255.0 / 224;
+    int full = src->format == AV_PIX_FMT_YUVJ420P || src->color_range == AVCOL_RANGE_JPEG;
+    double q;
+
+    if (src->colorspace == AVCOL_SPC_BT709) {
+        kr = 0.2126;
+        kb = 0.0722;
+    }
+    kg = 1 - kr - kb;
+    if (full)
+        yscale = cscale = 1;
+
+    k->shift = 14 + depth - 8;
+    k->round = 1 << (k->shift - 1);
+    k->y_off = full ? 0 : 16 << (depth - 8);
+    k->c_off = 128 << (depth - 8);
+    q = 1 << 14;
+    k->cy  = (int)lrint(yscale * q);
+    k->crv = (int)lrint(2 * (1 - kr) * cscale * q);
+    k->cbu = (int)lrint(2 * (1 - kb) * cscale * q);
+    k->cgu = (int)lrint(2 * (1 - kb) * kb / kg * cscale * q);
+    k->cgv = (int)lrint(2 * (1 - kr) * kr / kg * cscale * q);
+    k->ly = k->cy;
+    k->lc = (int)lrint(cscale * q);
+}
+
+/*
+YUV -> RGB8 调色板索引的查找表
+只与矩阵（BT.601/BT.709）、范围（limited/full）有关，进程内各生成一次，所有请求共享
+每个格子取其中心点的颜色
+ */
+static uint8_t rgb8_luts[2][2][LUT_SIZE];
+static int rgb8_lut_ready[2][2];
+static pthread_mutex_t rgb8_lut_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const uint8_t *get_rgb8_lut(const convert_coeffs_t *k, int bt709, int full)
+{
+    uint8_t *lut = rgb8_luts[bt709][full];
+    const int half = 1 << (7 - LUT_BITS);
+    int yi, ui, vi;
+
+    pthread_mutex_lock(&rgb8_lut_lock);
+    if (!rgb8_lut_ready[bt709][full]) {
+        for (yi = 0; yi < 1 << LUT_BITS; yi++) {
+            for (ui = 0; ui < 1 << LUT_BITS; ui++) {
+                for (vi = 0; vi < 1 << LUT_BITS; vi++) {
+                    int y = (yi << (8 - LUT_BITS)) + half;
+                    int u = (ui << (8 - LUT_BITS)) + half - k->c_off;
+                    int v = (vi << (8 - LUT_BITS)) + half - k->c_off;
+                    int yy = (y - k->y_off) * k->cy + k->round;
+                    int r = av_clip_uint8((yy + v * k->crv) >> k->shift);
+                    int g = av_clip_uint8((yy - u * k->cgu - v * k->cgv) >> k->shift);
+                    int b = av_clip_uint8((yy + u * k->cbu) >> k->shift);
+                    lut[yi << (2 * LUT_BITS) | ui << LUT_BITS | vi] = rgb8_index(r, g, b);
+                }
+            }
+        }
+        rgb8_lut_ready[bt709][full] = 1;
+    }
+    pthread_mutex_unlock(&rgb8_lut_lock);
+    return lut;
+}
+
+static convert_row_fn pick_row(convert_row_fn c, convert_row_fn sse2, convert_row_fn avx2)
+{
+#ifdef CONVERT_X86
+    if (avx2 && __builtin_cpu_supports("avx2"))
+        return avx2;
+    if (sse2)
+        return sse2;
+#endif
+    return c;
+}
+
+/*
+按第一帧的格式与色彩属性初始化，格式对不支持时返回 NULL
+flags 为 CONVERT_FLAG_*
+ */
+void* convert_init(const AVFrame* src, int dst_fmt, int flags)
+{
+    convert_context_t *ctx;
+    int idx = find_converter(src->format, dst_fmt);
+
+    if (idx < 0)
+        return NULL;
+    ctx = (convert_context_t *)av_mallocz(sizeof(convert_context_t));
+    if (!ctx)
+        return NULL;
+    ctx->src_fmt = src->format;
+    ctx->dst_fmt = dst_fmt;
+    ctx->src_layout = converters[idx].src_layout;
+    ctx->dst_layout = converters[idx].dst_layout;
+    init_coeffs(&ctx->k, src, ctx->src_layout == SRC_PLANAR10 ? 10 : 8);
+    if (ctx->dst_layout == DST_RGB8_LUT)
+        ctx->k.lut = get_rgb8_lut(&ctx->k, src->colorspace == AVCOL_SPC_BT709, ctx->k.y_off == 0);
+
+    if ((flags & CONVERT_FLAG_DITHER) && converters[idx].dither_c)
+        ctx->row = pick_row(converters[idx].dither_c, converters[idx].dither_sse2, converters[idx].dither_avx2);
+    else
+        ctx->row = pick_row(converters[idx].c, converters[idx].sse2, converters[idx].avx2);
+    return ctx;
+}
+
+void convert_free(void* ctx)
+{
+    av_free(ctx);
+}
+
+/*
+转换 [y, y + h) 行，y 需为偶数，便于按条带并行
+src 与 dst 尺寸相同
+ */
+int convert_frame(void* ctx, const AVFrame* src, AVFrame* dst, int y, int h)
+{
+    convert_context_t *cctx = (convert_context_t *)ctx;
+    int j;
+
+    if (!cctx || src->format != cctx->src_fmt || dst->format != cctx->dst_fmt ||
+        src->width != dst->width || src->height != dst->height || (y & 1) || y + h > src->height)
+        return AVERROR(EINVAL);
+
+    for (j = y; j < y + h; j++) {
+        const uint8_t *ys = src->data[0] + (ptrdiff_t)j * src->linesize[0];
+        const uint8_t *us = src->data[1] ? src->data[1] + (ptrdiff_t)(j >> 1) * src->linesize[1] : NULL;
+        const uint8_t *vs = src->data[2] ? src->data[2] + (ptrdiff_t)(j >> 1) * src->linesize[2] : NULL;
+        uint8_t *d[3];
+
+        d[0] = dst->data[0] + (ptrdiff_t)j * dst->linesize[0];
+        d[1] = d[2] = NULL;
+        if (cctx->dst_layout == DST_YUVJ420P && !(j & 1)) {
+            d[1] = dst->data[1] + (ptrdiff_t)(j >> 1) * dst->linesize[1];
+            d[2] = dst->data[2] + (ptrdiff_t)(j >> 1) * dst->linesize[2];
+        }
+        cctx->row(&cctx->k, ys, us, vs, d, src->width, j);
+    }
+    return 0;
+}
@@ -0,0 +1,17 @@
+
+#include <libavutil/frame.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 输出 RGB8 时使用有序抖动
+#define CONVERT_FLAG_DITHER 1
+
+int convert_supported(int src_fmt, int dst_fmt);
+void* convert_init(const AVFrame* src, int dst_fmt, int flags);
+int convert_frame(void* ctx, const AVFrame* src, AVFrame* dst, int y, int h);
+void convert_free(void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,288 @@
+/*
+黑边检测：找出画面中固定的上下（letterbox）、左右（pillarbox）黑边
+
+每帧只扫描亮度平面（8 位、平面存储的 YUV 或灰度）：
+    - 行：从上、下两端向内，每行用 SIMD 数出比黑色亮 BLACK_MARGIN 以上的像素，
+      不超过行宽的 1/NOISE_RATIO 时算黑行（容忍噪点、台标的边角）
+    - 列：在非黑的行中均匀取最多 MAX_COL_ROWS 行，按列累计亮像素数（SIMD 的 8 位计数器），再从左右两端向内找黑列
+多帧的结果取并集（各边取最小值），黑场等几乎全黑的帧不参与。
+裁剪量向下对齐到偶数，色度平面（4:2:0）与隔行源的场都不会错位；由 muxing 在缩放前偏移数据指针完成裁剪，不复制像素。
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/pixdesc.h>
+
+#include "frame_pool.h"
+#include "cropdetect.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CROPDETECT_X86 1
+#endif
+
+// 比黑电平亮这么多以上的像素算亮像素
+#define BLACK_MARGIN 16
+// 亮像素不超过 1/NOISE_RATIO 的行、列算黑的
+#define NOISE_RATIO 32
+// 统计列时最多取的行数，8 位计数器不溢出
+#define MAX_COL_ROWS 255
+// 每边最多裁掉画面的 1/MAX_CROP_RATIO，到达这个位置的帧视为几乎全黑
+#define MAX_CROP_RATIO 3
+
+typedef struct cropdetect_context {
+    int width, height; // 第一个参与检测的帧的尺寸，尺寸不同的帧不参与
+    int nb_frames; // 参与检测的帧数
+    crop_rect_t rect; // 各帧的并集
+    uint8_t *counts; // 按列的亮像素计数
+} cropdetect_context_t;
+
+// 一行中亮于 thr 的像素数
+static int count_bright(const uint8_t *p, int n, int thr)
+{
+    int cnt = 0, x = 0;
+#ifdef CROPDETECT_X86
+    __m128i vthr = _mm_set1_epi8((char)thr), zero = _mm_setzero_si128();
+
+    // v <= thr 时饱和减为 0
+    for (; x + 16 <= n; x += 16) {
+        __m128i d = _mm_subs_epu8(_mm_loadu_si128((const __m128i *)(p + x)), vthr);
+        cnt += 16 - __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(d, zero)));
+    }
+#endif
+    for (; x < n; x++)
+        cnt += p[x] > thr;
+    return cnt;
+}
+
+// 按列累计亮于 thr 的像素数，counts 为 8 位计数器
+static void count_bright_cols(const uint8_t *p, int n, int thr, uint8_t *counts)
+{
+    int x = 0;
+#ifdef CROPDETECT_X86
+    __m128i vthr = _mm_set1_epi8((char)thr), zero = _mm_setzero_si128();
+
+    // 亮像素处比较结果为 0，暗处为 -1；计数器先加 1 再加比较结果
+    for (; x + 16 <= n; x += 16) {
+        __m128i d = _mm_subs_epu8(_mm_loadu_si128((const __m128i *)(p + x)), vthr);
+        __m128i c = _mm_loadu_si128((const __m128i *)(counts + x));
+        c = _mm_add_epi8(_mm_sub_epi8(c, _mm_set1_epi8(-1)), _mm_cmpeq_epi8(d, zero));
+        _mm_storeu_si128((__m128i *)(counts + x), c);
+    }
+#endif
+    for (; x < n; x++)
+        counts[x] += p[x] > thr;
+}
+
+void* cropdetect_init(void)
+{
+    return av_mallocz(sizeof(cropdetect_context_t));
+}
+
+void cropdetect_free(void* ctx)
+{
+    cropdetect_context_t *cd = (cropdetect_context_t *)ctx;
+
+    if (!cd)
+        return;
+    av_free(cd->counts);
+    av_free(cd);
+}
+
+/*
+送入一帧参与检测
+返回 1 表示参与，0 表示几乎全黑或尺寸与之前的帧不同而忽略，< 0 为错误（像素格式不支持等）
+ */
+int cropdetect_add_frame(void* ctx, const AVFrame* frame)
+{
+    cropdetect_context_t *cd = (cropdetect_context_t *)ctx;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    const uint8_t *base;
+    int w = frame->width, h = frame->height, linesize;
+    int thr, max_x, max_y, top, bottom, left, right, nb_rows, y, step;
+
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM |
+                                 AV_PIX_FMT_FLAG_HWACCEL)) ||
+        desc->comp[0].depth != 8 || desc->comp[0].step != 1 || desc->comp[0].shift)
+        return AVERROR(ENOSYS);
+    if (w < 16 || h < 16)
+        return 0;
+    if (!cd->nb_frames && !cd->counts) {
+        cd->width = w;
+        cd->height = h;
+        cd->counts = (uint8_t *)av_malloc(w);
+        if (!cd->counts)
+            return AVERROR(ENOMEM);
+    }
+    if (w != cd->width || h != cd->height)
+        return 0;
+
+    base = frame->data[desc->comp[0].plane] + desc->comp[0].offset;
+    linesize = frame->linesize[desc->comp[0].plane];
+    thr = (frame->color_range == AVCOL_RANGE_JPEG ? 0 : 16) + BLACK_MARGIN;
+    max_x = w / MAX_CROP_RATIO;
+    max_y = h / MAX_CROP_RATIO;
+
+    for (top = 0; top < max_y; top++)
+        if (count_bright(base + (ptrdiff_t)top * linesize, w, thr) > w / NOISE_RATIO)
+            break;
+    for (bottom = 0; bottom < max_y; bottom++)
+        if (count_bright(base + (ptrdiff_t)(h - 1 - bottom) * linesize, w, thr) > w / NOISE_RATIO)
+            break;
+    if (top == max_y && bottom == max_y)
+        return 0;
+
+    // 只在非黑的行中统计列
+    nb_rows = FFMIN(h - top - bottom, MAX_COL_ROWS);
+    step = (h - top - bottom) / nb_rows;
+    memset(cd->counts, 0, w);
+    for (y = 0; y < nb_rows; y++)
+        count_bright_cols(base + (ptrdiff_t)(top + y * step) * linesize, w, thr, cd->counts);
+    for (left = 0; left < max_x; left++)
+        if (cd->counts[left] > nb_rows / NOISE_RATIO)
+            break;
+    for (right = 0; right < max_x; right++)
+        if (cd->counts[w - 1 - right] > nb_rows / NOISE_RATIO)
+            break;
+    if (left == max_x && right == max_x)
+        return 0;
+
+    if (!cd->nb_frames) {
+        cd->rect.left = left;
+        cd->rect.top = top;
+        cd->rect.right = right;
+        cd->rect.bottom = bottom;
+    } else {
+        cd->rect.left = FFMIN(cd->rect.left, left);
+        cd->rect.top = FFMIN(cd->rect.top, top);
+        cd->rect.right = FFMIN(cd->rect.right, right);
+        cd->rect.bottom = FFMIN(cd->rect.bottom, bottom);
+    }
+    cd->nb_frames++;
+    return 1;
+}
+
+/*
+检测结果写到 rect，各边向下对齐到偶数
+返回 1 表示需要裁剪，0 表示没有黑边或没有参与检测的帧（rect 全为 0）
+ */
+int cropdetect_result(void* ctx, crop_rect_t* rect)
+{
+    cropdetect_context_t *cd = (cropdetect_context_t *)ctx;
+
+    memset(rect, 0, sizeof(*rect));
+    if (!cd->nb_frames)
+        return 0;
+    rect->left = cd->rect.left & ~1;
+    rect->top = cd->rect.top & ~1;
+    rect->right = cd->rect.right & ~1;
+    rect->bottom = cd->rect.bottom & ~1;
+    if (!rect->left && !rect->top && !rect->right && !rect->bottom)
+        return 0;
+    av_log(NULL, AV_LOG_INFO, "crop %dx%d: left %d top %d right %d bottom %d, %d frames\n",
+           cd->width, cd->height, rect->left, rect->top, rect->right, rect->bottom, cd->nb_frames);
+    return 1;
+}
+
+/*
+单独打开内存中的视频（data, size），只解码关键帧，在前 nb_frames 个关键帧上检测黑边
+返回值同 cropdetect_result()，< 0 为错误
+ */
+int cropdetect_scan(const uint8_t* data, int size, int nb_frames, crop_rect_t* rect)
+{
+    cropdetect_context_t *cd = NULL;
+    AVFormatContext *fmt_ctx = NULL;
+    AVIOContext *pb = NULL;
+    AVCodecContext *c = NULL;
+    AVCodec *dec = NULL;
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL;
+    uint8_t *indata;
+    int ret, idx, nb = 0;
+
+    memset(rect, 0, sizeof(*rect));
+    cd = (cropdetect_context_t *)cropdetect_init();
+    fmt_ctx = avformat_alloc_context();
+    indata = (uint8_t *)av_malloc(size);
+    if (!cd || !fmt_ctx || !indata) {
+        av_free(indata);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    memcpy(indata, data, size);
+    pb = avio_alloc_context(indata, size, 0, NULL, NULL, NULL, NULL);
+    if (!pb) {
+        av_free(indata);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    fmt_ctx->pb = pb;
+    // 打开失败时 fmt_ctx 会被释放，pb 由这里释放
+    if ((ret = avformat_open_input(&fmt_ctx, NULL, NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0 ||
+        (ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open input for crop detection, err:%d\n", ret);
+        goto end;
+    }
+    idx = ret;
+    c = avcodec_alloc_context3(dec);
+    if (!c) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avcodec_parameters_to_context(c, fmt_ctx->streams[idx]->codecpar)) < 0)
+        goto end;
+    c->get_buffer2 = frame_pool_get_buffer2;
+    c->thread_safe_callbacks = 1;
+    // 黑边在关键帧上一样可见，其余的帧只读包不解码
+    c->skip_frame = AVDISCARD_NONKEY;
+    if ((ret = avcodec_open2(c, dec, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to open codec for crop detection, err:%d\n", ret);
+        goto end;
+    }
+
+    pkt = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!pkt || !frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    // 读取、解码出错按读完处理
+    while (nb < nb_frames && av_read_frame(fmt_ctx, pkt) >= 0) {
+        if (pkt->stream_index == idx && (pkt->flags & AV_PKT_FLAG_KEY) && avcodec_send_packet(c, pkt) >= 0) {
+            while (nb < nb_frames && avcodec_receive_frame(c, frame) >= 0) {
+                ret = cropdetect_add_frame(cd, frame);
+                av_frame_unref(frame);
+                if (ret < 0)
+                    goto end;
+                nb++;
+            }
+        }
+        av_packet_unref(pkt);
+    }
+    if (nb < nb_frames && avcodec_send_packet(c, NULL) >= 0) {
+        while (nb < nb_frames && avcodec_receive_frame(c, frame) >= 0) {
+            ret = cropdetect_add_frame(cd, frame);
+            av_frame_unref(frame);
+            if (ret < 0)
+                goto end;
+            nb++;
+        }
+    }
+    ret = cropdetect_result(cd, rect);
+
+end:
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&c);
+    avformat_close_input(&fmt_ctx);
+    if (pb) {
+        av_freep(&pb->buffer);
+        av_freep(&pb);
+    }
+    cropdetect_free(cd);
+    return ret;
+}
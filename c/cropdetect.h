@@ -0,0 +1,24 @@
+
+#include <stdint.h>
+#include <libavutil/frame.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 各边要裁掉的像素数
+typedef struct crop_rect {
+    int left;
+    int top;
+    int right;
+    int bottom;
+} crop_rect_t;
+
+void* cropdetect_init(void);
+int cropdetect_add_frame(void* ctx, const AVFrame* frame);
+int cropdetect_result(void* ctx, crop_rect_t* rect);
+int cropdetect_scan(const uint8_t* data, int size, int nb_frames, crop_rect_t* rect);
+void cropdetect_free(void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
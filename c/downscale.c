@@ -0,0 +1,468 @@
+/*
+面积平均（box/area）缩小
+
+大比例缩小（如 3840 -> 320）时，swscale 的 SWS_FAST_BILINEAR 每个输出像素只采样源图的几个点，
+高频细节会混叠成摩尔纹，同时按列跳读源图，缓存利用很差。
+这里把每个输出像素覆盖的源像素全部取平均：
+    - 纵向：把一个输出行覆盖的源行按顺序逐行累加到 16 位累加行（SSE2/AVX2），源图只被顺序读一次
+    - 横向：对累加行按列边界求和，乘以面积的倒数
+整数比例时所有输出像素的面积相同，横向只需一个乘数；分数比例时列边界、行边界取整，按实际面积归一化
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+
+#include "downscale.h"
+#include "frame_pool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DOWNSCALE_X86 1
+#endif
+
+// 16 位累加行最多容纳 257 行 8 位像素之和、64 行 10 位像素之和，超过时隔行采样
+#define MAX_ACC_ROWS 257
+#define MAX_ACC_ROWS_10 64
+
+typedef struct ds_plane {
+    int sw, sh, dw, dh;
+    int comps;          // 每个像素交错存放的分量数，NV12 的 UV 平面为 2，packed RGB 为 3 或 4
+    int bytes;          // 每个分量的字节数，10 位的格式为 2
+    int log2_h;         // 相对 luma 的纵向下采样
+    int src_idx;        // 源帧的平面索引
+    int dst_idx[4];     // 每个分量写到目标帧的平面索引
+    int dst_off[4];     // 每个分量在目标像素中的字节偏移
+    int dst_step;       // 目标像素的字节步长
+    int fx;             // 整数比例时的列宽，否则为 0
+    int *xb;            // dw + 1 个列边界（以像素计）
+    float *xinv;        // 每列的 1 / 列宽
+} ds_plane_t;
+
+typedef struct downscale_context {
+    int src_fmt, dst_fmt;
+    int sw, sh, dw, dh;
+    int nb_planes;
+    int acc_size;
+    ds_plane_t planes[3];
+    void (*vcopy)(uint16_t *acc, const uint8_t *src, int n);
+    void (*vadd)(uint16_t *acc, const uint8_t *src, int n);
+    void (*vadd16)(uint16_t *acc, const uint16_t *src, int n);
+} downscale_context_t;
+
+static void vcopy_c(uint16_t *acc, const uint8_t *src, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        acc[i] = src[i];
+}
+
+static void vadd_c(uint16_t *acc, const uint8_t *src, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        acc[i] += src[i];
+}
+
+static void vadd16_c(uint16_t *acc, const uint16_t *src, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        acc[i] += src[i];
+}
+
+#ifdef DOWNSCALE_X86
+static void vcopy_sse2(uint16_t *acc, const uint8_t *src, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i;
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(acc + i), _mm_unpacklo_epi8(s, zero));
+        _mm_storeu_si128((__m128i *)(acc + i + 8), _mm_unpackhi_epi8(s, zero));
+    }
+    vcopy_c(acc + i, src + i, n - i);
+}
+
+static void vadd_sse2(uint16_t *acc, const uint8_t *src, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i;
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(acc + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(acc + i + 8));
+        _mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi16(a0, _mm_unpacklo_epi8(s, zero)));
+        _mm_storeu_si128((__m128i *)(acc + i + 8), _mm_add_epi16(a1, _mm_unpackhi_epi8(s, zero)));
+    }
+    vadd_c(acc + i, src + i, n - i);
+}
+
+static void vadd16_sse2(uint16_t *acc, const uint16_t *src, int n)
+{
+    int i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + i));
+        _mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi16(a, s));
+    }
+    vadd16_c(acc + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void vcopy_avx2(uint16_t *acc, const uint8_t *src, int n)
+{
+    int i;
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i s0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i)));
+        __m256i s1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i + 16)));
+        _mm256_storeu_si256((__m256i *)(acc + i), s0);
+        _mm256_storeu_si256((__m256i *)(acc + i + 16), s1);
+    }
+    vcopy_c(acc + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void vadd_avx2(uint16_t *acc, const uint8_t *src, int n)
+{
+    int i;
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i s0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i)));
+        __m256i s1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i + 16)));
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(acc + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(acc + i + 16));
+        _mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi16(a0, s0));
+        _mm256_storeu_si256((__m256i *)(acc + i + 16), _mm256_add_epi16(a1, s1));
+    }
+    vadd_c(acc + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void vadd16_avx2(uint16_t *acc, const uint16_t *src, int n)
+{
+    int i;
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+        _mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi16(a, s));
+    }
+    vadd16_c(acc + i, src + i, n - i);
+}
+#endif
+
+static int init_plane(ds_plane_t *p, int sw, int sh, int dw, int dh, int comps)
+{
+    int i;
+
+    p->sw = sw;
+    p->sh = sh;
+    p->dw = dw;
+    p->dh = dh;
+    p->comps = comps;
+    p->bytes = 1;
+    p->fx = (sw % dw == 0) ? sw / dw : 0;
+    p->xb = (int *)av_malloc_array(dw + 1, sizeof(*p->xb));
+    p->xinv = (float *)av_malloc_array(dw, sizeof(*p->xinv));
+    if (!p->xb || !p->xinv)
+        return AVERROR(ENOMEM);
+    for (i = 0; i <= dw; i++)
+        p->xb[i] = (int)((int64_t)i * sw / dw);
+    for (i = 0; i < dw; i++)
+        p->xinv[i] = 1.0f / (p->xb[i + 1] - p->xb[i]);
+    return 0;
+}
+
+/*
+支持的源格式与对应的输出格式
+planar 的 YUV（8 位、10 位）、packed 的 8 位 RGB 原样输出，NV12/NV21 输出拆分后的 YUV420P
+ */
+static int setup_format(downscale_context_t *ctx)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(ctx->src_fmt);
+    int cw, ch, i, ret;
+
+    if (!desc)
+        return AVERROR(EINVAL);
+    cw = AV_CEIL_RSHIFT(ctx->sw, desc->log2_chroma_w);
+    ch = AV_CEIL_RSHIFT(ctx->sh, desc->log2_chroma_h);
+
+    switch (ctx->src_fmt) {
+    case AV_PIX_FMT_GRAY8:
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUVJ422P:
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUVJ444P:
+    case AV_PIX_FMT_YUV420P10LE:
+    case AV_PIX_FMT_YUV422P10LE:
+    case AV_PIX_FMT_YUV444P10LE:
+        ctx->dst_fmt = ctx->src_fmt;
+        ctx->nb_planes = desc->nb_components;
+        for (i = 0; i < ctx->nb_planes; i++) {
+            ds_plane_t *p = &ctx->planes[i];
+            if (i == 0)
+                ret = init_plane(p, ctx->sw, ctx->sh, ctx->dw, ctx->dh, 1);
+            else
+                ret = init_plane(p, cw, ch, AV_CEIL_RSHIFT(ctx->dw, desc->log2_chroma_w),
+                                 AV_CEIL_RSHIFT(ctx->dh, desc->log2_chroma_h), 1);
+            if (ret < 0)
+                return ret;
+            p->log2_h = i ? desc->log2_chroma_h : 0;
+            p->bytes = desc->comp[0].depth > 8 ? 2 : 1;
+            p->src_idx = i;
+            p->dst_idx[0] = i;
+            p->dst_step = 1;
+        }
+        return 0;
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_NV21:
+        ctx->dst_fmt = AV_PIX_FMT_YUV420P;
+        ctx->nb_planes = 2;
+        if ((ret = init_plane(&ctx->planes[0], ctx->sw, ctx->sh, ctx->dw, ctx->dh, 1)) < 0 ||
+            (ret = init_plane(&ctx->planes[1], cw, ch, AV_CEIL_RSHIFT(ctx->dw, 1),
+                              AV_CEIL_RSHIFT(ctx->dh, 1), 2)) < 0)
+            return ret;
+        ctx->planes[0].dst_step = 1;
+        ctx->planes[1].src_idx = 1;
+        ctx->planes[1].log2_h = 1;
+        ctx->planes[1].dst_idx[0] = ctx->src_fmt == AV_PIX_FMT_NV12 ? 1 : 2;
+        ctx->planes[1].dst_idx[1] = ctx->src_fmt == AV_PIX_FMT_NV12 ? 2 : 1;
+        ctx->planes[1].dst_step = 1;
+        return 0;
+    case AV_PIX_FMT_RGB24:
+    case AV_PIX_FMT_BGR24:
+    case AV_PIX_FMT_RGBA:
+    case AV_PIX_FMT_BGRA:
+    case AV_PIX_FMT_ARGB:
+    case AV_PIX_FMT_ABGR:
+    case AV_PIX_FMT_RGB0:
+    case AV_PIX_FMT_BGR0:
+    case AV_PIX_FMT_0RGB:
+    case AV_PIX_FMT_0BGR:
+    case AV_PIX_FMT_YA8:
+    {
+        // 交错存放的各分量分别平均，原样输出（PNG、TIFF 等图片常见的格式）
+        ds_plane_t *p = &ctx->planes[0];
+        int comps = desc->comp[0].step;
+
+        ctx->dst_fmt = ctx->src_fmt;
+        ctx->nb_planes = 1;
+        if ((ret = init_plane(p, ctx->sw, ctx->sh, ctx->dw, ctx->dh, comps)) < 0)
+            return ret;
+        for (i = 0; i < comps; i++)
+            p->dst_off[i] = i;
+        p->dst_step = comps;
+        return 0;
+    }
+    default:
+        return AVERROR(ENOSYS);
+    }
+}
+
+static void free_planes(downscale_context_t *ctx)
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        av_freep(&ctx->planes[i].xb);
+        av_freep(&ctx->planes[i].xinv);
+    }
+}
+
+/*
+初始化缩小的上下文，源格式不支持或不是缩小时返回 NULL，调用者应回退到 swscale
+ */
+void* downscale_init(int src_fmt, int src_width, int src_height, int dst_width, int dst_height)
+{
+    downscale_context_t *ctx;
+    int i;
+
+    if (dst_width <= 0 || dst_height <= 0 || src_width < dst_width || src_height < dst_height)
+        return NULL;
+    ctx = (downscale_context_t *)av_mallocz(sizeof(downscale_context_t));
+    if (!ctx)
+        return NULL;
+    ctx->src_fmt = src_fmt;
+    ctx->sw = src_width;
+    ctx->sh = src_height;
+    ctx->dw = dst_width;
+    ctx->dh = dst_height;
+    if (setup_format(ctx) < 0) {
+        free_planes(ctx);
+        av_free(ctx);
+        return NULL;
+    }
+    for (i = 0; i < ctx->nb_planes; i++) {
+        int n = ctx->planes[i].sw * ctx->planes[i].comps;
+        if (n > ctx->acc_size)
+            ctx->acc_size = n;
+    }
+
+    ctx->vcopy = vcopy_c;
+    ctx->vadd = vadd_c;
+    ctx->vadd16 = vadd16_c;
+#ifdef DOWNSCALE_X86
+    ctx->vcopy = vcopy_sse2;
+    ctx->vadd = vadd_sse2;
+    ctx->vadd16 = vadd16_sse2;
+    if (__builtin_cpu_supports("avx2")) {
+        ctx->vcopy = vcopy_avx2;
+        ctx->vadd = vadd_avx2;
+        ctx->vadd16 = vadd16_avx2;
+    }
+#endif
+    return ctx;
+}
+
+int downscale_dst_format(void* ctx)
+{
+    if (!ctx)
+        return AV_PIX_FMT_NONE;
+    return ((downscale_context_t *)ctx)->dst_fmt;
+}
+
+void downscale_free(void* ctx)
+{
+    if (!ctx)
+        return;
+    free_planes((downscale_context_t *)ctx);
+    av_free(ctx);
+}
+
+static av_always_inline void put_pixel(const ds_plane_t *p, uint8_t *d, int i, float v)
+{
+    if (p->bytes == 2)
+        ((uint16_t *)d)[i * p->dst_step] = (uint16_t)v;
+    else
+        d[i * p->dst_step] = (uint8_t)v;
+}
+
+/*
+横向求和并归一化，写出一个输出行
+inv_y 为该输出行实际累加行数的倒数
+ */
+static void hpass(const ds_plane_t *p, const uint16_t *acc, float inv_y, uint8_t *const dst[])
+{
+    int i, k, c;
+
+    if (p->comps == 1 && p->fx) {
+        // 整数比例：列宽固定，乘数只有一个
+        const int fx = p->fx;
+        const float inv = inv_y / fx;
+        uint8_t *d = dst[0];
+        for (i = 0; i < p->dw; i++, acc += fx) {
+            uint32_t s = 0;
+            for (k = 0; k < fx; k++)
+                s += acc[k];
+            put_pixel(p, d, i, s * inv + 0.5f);
+        }
+        return;
+    }
+
+    for (c = 0; c < p->comps; c++) {
+        uint8_t *d = dst[c];
+        for (i = 0; i < p->dw; i++) {
+            const uint16_t *a = acc + p->xb[i] * p->comps + c;
+            int nx = p->xb[i + 1] - p->xb[i];
+            uint32_t s = 0;
+            for (k = 0; k < nx; k++, a += p->comps)
+                s += *a;
+            put_pixel(p, d, i, s * p->xinv[i] * inv_y + 0.5f);
+        }
+    }
+}
+
+static void scale_plane(const downscale_context_t *ctx, const ds_plane_t *p, uint16_t *acc,
+                        const AVFrame *src, AVFrame *dst, int y0, int y1)
+{
+    const uint8_t *sdata = src->data[p->src_idx];
+    const int sstride = src->linesize[p->src_idx];
+    const int n = p->sw * p->comps;
+    const int max_rows = p->bytes == 2 ? MAX_ACC_ROWS_10 : MAX_ACC_ROWS;
+    uint8_t *drow[4];
+    int j, y, c;
+
+    for (j = y0; j < y1; j++) {
+        int sy0 = (int)((int64_t)j * p->sh / p->dh);
+        int sy1 = (int)((int64_t)(j + 1) * p->sh / p->dh);
+        int step = (sy1 - sy0 + max_rows - 1) / max_rows;
+        int rows = 0;
+
+        for (y = sy0; y < sy1; y += step, rows++) {
+            const uint8_t *row = sdata + (ptrdiff_t)y * sstride;
+            if (p->bytes == 2) {
+                if (rows == 0)
+                    memcpy(acc, row, n * sizeof(uint16_t));
+                else
+                    ctx->vadd16(acc, (const uint16_t *)row, n);
+            } else if (rows == 0) {
+                ctx->vcopy(acc, row, n);
+            } else {
+                ctx->vadd(acc, row, n);
+            }
+        }
+        for (c = 0; c < p->comps; c++)
+            drow[c] = dst->data[p->dst_idx[c]] + (ptrdiff_t)j * dst->linesize[p->dst_idx[c]] + p->dst_off[c];
+        hpass(p, acc, 1.0f / rows, drow);
+    }
+}
+
+/*
+输出 [0, dst_y) 行（以 luma 行计，按色度对齐）需要源图顶部的多少行
+边解码边缩小时，据此判断已解码的行够输出到哪里
+ */
+int downscale_src_rows(void* ctx, int dst_y)
+{
+    downscale_context_t *dctx = (downscale_context_t *)ctx;
+    int i, rows = 0;
+
+    if (dst_y >= dctx->dh)
+        return dctx->sh;
+    for (i = 0; i < dctx->nb_planes; i++) {
+        const ds_plane_t *p = &dctx->planes[i];
+        int sy = (int)((int64_t)(dst_y >> p->log2_h) * p->sh / p->dh) << p->log2_h;
+        if (sy > rows)
+            rows = sy;
+    }
+    return FFMIN(rows, dctx->sh);
+}
+
+/*
+缩小源帧，只写出目标帧 [dst_y, dst_y + dst_h) 的输出行（以 luma 行计）
+dst_y 需按色度的纵向下采样对齐，便于把一帧切成多个条带并行处理
+dst 需为 downscale_dst_format() 的格式、初始化时的目标尺寸
+ */
+int downscale_frame(void* ctx, const AVFrame* src, AVFrame* dst, int dst_y, int dst_h)
+{
+    downscale_context_t *dctx = (downscale_context_t *)ctx;
+    AVBufferRef *acc_buf;
+    uint16_t *acc;
+    int i;
+
+    if (!dctx || !src || !dst)
+        return AVERROR(EINVAL);
+    if (src->width != dctx->sw || src->height != dctx->sh || src->format != dctx->src_fmt)
+        return AVERROR(EINVAL);
+    if (dst_y < 0 || dst_h <= 0 || dst_y + dst_h > dctx->dh)
+        return AVERROR(EINVAL);
+
+    // 累加行也从缓存池取，避免每帧分配
+    acc_buf = frame_pool_get(dctx->acc_size * sizeof(uint16_t));
+    if (!acc_buf)
+        return AVERROR(ENOMEM);
+    acc = (uint16_t *)acc_buf->data;
+
+    for (i = 0; i < dctx->nb_planes; i++) {
+        const ds_plane_t *p = &dctx->planes[i];
+        int y0 = dst_y >> p->log2_h;
+        int y1 = dst_y + dst_h == dctx->dh ? p->dh : (dst_y + dst_h) >> p->log2_h;
+        scale_plane(dctx, p, acc, src, dst, y0, y1);
+    }
+
+    av_buffer_unref(&acc_buf);
+    return 0;
+}
@@ -0,0 +1,15 @@
+
+#include <libavutil/frame.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void* downscale_init(int src_fmt, int src_width, int src_height, int dst_width, int dst_height);
+int downscale_dst_format(void* ctx);
+int downscale_src_rows(void* ctx, int dst_y);
+int downscale_frame(void* ctx, const AVFrame* src, AVFrame* dst, int dst_y, int dst_h);
+void downscale_free(void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
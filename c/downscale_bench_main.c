@@ -0,0 +1,153 @@
+#ifdef __DOWNSCALE_BENCH_PROGRAM__
+/*
+面积平均缩小与 swscale 各模式的对比
+
+源图为 3840x2160 的 YUV420P 波带片（zone plate），中心频率为 0，四角接近源图的 Nyquist 频率。
+理想的缩小结果：低于目标 Nyquist 频率的部分保留，高于的部分应是均匀的灰（128），
+出现的任何条纹都是混叠。以此作为参考图计算 luma 的 PSNR，同时统计每帧耗时。
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+
+#include "downscale.h"
+#include "frame_pool.h"
+
+#define SRC_WIDTH 3840
+#define SRC_HEIGHT 2160
+#define ITERATIONS 20
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static AVFrame *new_frame(int fmt, int w, int h)
+{
+    AVFrame *f = av_frame_alloc();
+    f->format = fmt;
+    f->width = w;
+    f->height = h;
+    if (frame_pool_get_frame(f) < 0) {
+        fprintf(stderr, "alloc frame fail\n");
+        exit(1);
+    }
+    return f;
+}
+
+// 波带片的局部频率 k*r（周期/像素），四角约为 0.5
+static double zone_k(void)
+{
+    return 0.5 / sqrt(SRC_WIDTH * SRC_WIDTH / 4.0 + SRC_HEIGHT * SRC_HEIGHT / 4.0);
+}
+
+static double zone(double x, double y)
+{
+    x -= SRC_WIDTH / 2.0;
+    y -= SRC_HEIGHT / 2.0;
+    return 128 + 100 * cos(M_PI * zone_k() * (x * x + y * y));
+}
+
+static void fill_source(AVFrame *f)
+{
+    int x, y;
+    for (y = 0; y < f->height; y++)
+        for (x = 0; x < f->width; x++)
+            f->data[0][y * f->linesize[0] + x] = (uint8_t)lrint(zone(x, y));
+    for (y = 0; y < f->height / 2; y++) {
+        memset(f->data[1] + y * f->linesize[1], 128, f->width / 2);
+        memset(f->data[2] + y * f->linesize[2], 128, f->width / 2);
+    }
+}
+
+static double luma_psnr(const AVFrame *out)
+{
+    double sx = (double)SRC_WIDTH / out->width, sy = (double)SRC_HEIGHT / out->height;
+    double nyquist = 0.5 / sx, k = zone_k(), mse = 0;
+    int i, j;
+
+    for (j = 0; j < out->height; j++) {
+        for (i = 0; i < out->width; i++) {
+            double x = (i + 0.5) * sx - 0.5, y = (j + 0.5) * sy - 0.5;
+            double dx = x - SRC_WIDTH / 2.0, dy = y - SRC_HEIGHT / 2.0;
+            double ref = k * sqrt(dx * dx + dy * dy) < nyquist ? zone(x, y) : 128;
+            double d = out->data[0][j * out->linesize[0] + i] - ref;
+            mse += d * d;
+        }
+    }
+    mse /= out->width * out->height;
+    return mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : 99;
+}
+
+static void report(const char *name, const AVFrame *out, double ms)
+{
+    printf("%-14s %4dx%-4d %8.3f ms/frame %8.1f Mpix/s  PSNR %6.2f dB\n", name, out->width, out->height,
+            ms, SRC_WIDTH * SRC_HEIGHT / ms / 1e3, luma_psnr(out));
+}
+
+static void bench_area(const AVFrame *src, int w, int h)
+{
+    AVFrame *out = new_frame(AV_PIX_FMT_YUV420P, w, h);
+    void *ctx = downscale_init(src->format, src->width, src->height, w, h);
+    double t;
+    int i;
+
+    t = now_ms();
+    for (i = 0; i < ITERATIONS; i++)
+        downscale_frame(ctx, src, out, 0, h);
+    report("area", out, (now_ms() - t) / ITERATIONS);
+    downscale_free(ctx);
+    av_frame_free(&out);
+}
+
+static void bench_sws(const AVFrame *src, int w, int h, int flags, const char *name)
+{
+    AVFrame *out = new_frame(AV_PIX_FMT_YUV420P, w, h);
+    struct SwsContext *sws = sws_getContext(src->width, src->height, src->format,
+                                            w, h, AV_PIX_FMT_YUV420P, flags, NULL, NULL, NULL);
+    double t;
+    int i;
+
+    t = now_ms();
+    for (i = 0; i < ITERATIONS; i++)
+        sws_scale(sws, (const uint8_t *const *)src->data, src->linesize, 0, src->height,
+                  out->data, out->linesize);
+    report(name, out, (now_ms() - t) / ITERATIONS);
+    sws_freeContext(sws);
+    av_frame_free(&out);
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[][2] = { {320, 180}, {640, 360}, {1280, 720}, {500, 282} };
+    AVFrame *src;
+    int i;
+
+    (void)argc;
+    (void)argv;
+    src = new_frame(AV_PIX_FMT_YUV420P, SRC_WIDTH, SRC_HEIGHT);
+    fill_source(src);
+
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        int w = sizes[i][0], h = sizes[i][1];
+        bench_area(src, w, h);
+        bench_sws(src, w, h, SWS_FAST_BILINEAR, "fast_bilinear");
+        bench_sws(src, w, h, SWS_BILINEAR, "bilinear");
+        bench_sws(src, w, h, SWS_BICUBIC, "bicubic");
+        bench_sws(src, w, h, SWS_AREA, "sws_area");
+        bench_sws(src, w, h, SWS_LANCZOS, "lanczos");
+        printf("\n");
+    }
+
+    av_frame_free(&src);
+    frame_pool_uninit();
+    return 0;
+}
+#endif
@@ -6,6 +6,8 @@
 #include <libavfilter/buffersrc.h>
 #include <libavutil/opt.h>
 
+#include "thread_pool.h"
+
 typedef struct filtering_context {
     AVFilterContext *buffersink_ctx;
     AVFilterContext *buffersrc_ctx;
@@ -14,6 +16,31 @@ typedef struct filtering_context {
     AVFilterInOut *inputs;
 }filtering_context_t;
 
+typedef struct filter_job {
+    AVFilterContext *ctx;
+    avfilter_action_func *func;
+    void *arg;
+    int *ret;
+} filter_job_t;
+
+static int run_filter_job(void* arg, int job, int nb_jobs)
+{
+    filter_job_t *fj = (filter_job_t*)arg;
+    int r = fj->func(fj->ctx, fj->arg, job, nb_jobs);
+    if (fj->ret)
+        fj->ret[job] = r;
+    return r;
+}
+
+// 滤镜的条带任务交给进程级线程池执行，不为每个滤镜图单独创建线程
+static int execute_filter_jobs(AVFilterContext *ctx, avfilter_action_func *func,
+                               void *arg, int *ret, int nb_jobs)
+{
+    filter_job_t fj = { ctx, func, arg, ret };
+    thread_pool_execute(run_filter_job, &fj, nb_jobs);
+    return 0;
+}
+
 void* init_filters(const char *filters_descr, AVCodecContext* dec_ctx, int enc_pix_fmt)
 {
     filtering_context_t* fctx = (filtering_context_t*)av_mallocz(sizeof(filtering_context_t));;
@@ -29,6 +56,10 @@ void* init_filters(const char *filters_descr, AVCodecContext* dec_ctx, int enc_p
         ret = AVERROR(ENOMEM);
         goto end;
     }
+    // 必须在创建任何滤镜之前设置
+    fctx->filter_graph->thread_type = AVFILTER_THREAD_SLICE;
+    fctx->filter_graph->nb_threads = thread_pool_threads();
+    fctx->filter_graph->execute = execute_filter_jobs;
 
     /* buffer video source: the decoded frames from the decoder will be inserted here. */
     snprintf(args, sizeof(args),
@@ -0,0 +1,274 @@
+/*
+进程级的帧缓存池
+
+每次请求都 av_frame_get_buffer() 分配解码帧、编码帧的内存，高并发时 malloc/free 非常频繁。
+这里按大小分级（size class）维护一组 AVBufferPool，所有请求共享：
+    - 解码器通过自定义的 get_buffer2 从池中取帧缓存
+    - 编码前的缩放帧通过 frame_pool_get_frame() 从池中取缓存
+AVBufferRef 引用计数归零时缓存自动回到池中，稳定运行后基本不再有新的内存分配
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "frame_pool.h"
+
+#define POOL_MIN_SHIFT 12 // 最小的分级 4KB
+#define POOL_MAX_SHIFT 30 // 超过 1GB 的缓存不入池
+#define POOL_NB_CLASSES ((POOL_MAX_SHIFT - POOL_MIN_SHIFT) * 4 + 1)
+
+static AVBufferPool *pools[POOL_NB_CLASSES];
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+计算 size 所属的分级
+每个 2 的幂区间再分 4 级，浪费的内存不超过 25%
+ */
+static int size_class(int size, int *class_size)
+{
+    int shift, step, k;
+
+    if (size <= (1 << POOL_MIN_SHIFT)) {
+        *class_size = 1 << POOL_MIN_SHIFT;
+        return 0;
+    }
+    shift = 31 - __builtin_clz(size - 1); // 2^shift < size <= 2^(shift+1)
+    step = 1 << (shift - 2);
+    k = (size - (1 << shift) + step - 1) / step;
+    *class_size = (1 << shift) + k * step;
+    return (shift - POOL_MIN_SHIFT) * 4 + k;
+}
+
+static void pool_free(void *opaque, uint8_t *data)
+{
+    (void)opaque;
+    free(data);
+}
+
+// 池中缓存的分配函数，保证 FRAME_POOL_ALIGN 字节对齐
+static AVBufferRef* pool_alloc(int size)
+{
+    AVBufferRef *buf;
+    void *data = NULL;
+
+    if (posix_memalign(&data, FRAME_POOL_ALIGN, size) != 0)
+        return NULL;
+    buf = av_buffer_create((uint8_t *)data, size, pool_free, NULL, 0);
+    if (!buf)
+        free(data);
+    return buf;
+}
+
+/*
+按请求统计帧缓存的占用
+统计只记在调用 frame_pool_stats_begin() 的线程上；该线程取到的缓存包一层引用，
+引用释放时（可能在其他线程）再从统计中减去
+ */
+static __thread frame_pool_stats_t *cur_stats;
+
+typedef struct tracked_buf {
+    AVBufferRef *inner;
+    frame_pool_stats_t *stats;
+    int size;
+} tracked_buf_t;
+
+static void tracked_free(void *opaque, uint8_t *data)
+{
+    tracked_buf_t *t = (tracked_buf_t *)opaque;
+
+    (void)data;
+    __atomic_sub_fetch(&t->stats->cur, t->size, __ATOMIC_RELAXED);
+    av_buffer_unref(&t->inner);
+    av_free(t);
+}
+
+static AVBufferRef* track(AVBufferRef *inner, frame_pool_stats_t *stats)
+{
+    tracked_buf_t *t = (tracked_buf_t *)av_malloc(sizeof(tracked_buf_t));
+    AVBufferRef *buf;
+    int64_t cur, peak;
+
+    if (!t) {
+        av_buffer_unref(&inner);
+        return NULL;
+    }
+    buf = av_buffer_create(inner->data, inner->size, tracked_free, t, 0);
+    if (!buf) {
+        av_buffer_unref(&inner);
+        av_free(t);
+        return NULL;
+    }
+    t->inner = inner;
+    t->stats = stats;
+    t->size = inner->size;
+
+    cur = __atomic_add_fetch(&stats->cur, t->size, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&stats->peak, __ATOMIC_RELAXED);
+    while (cur > peak &&
+           !__atomic_compare_exchange_n(&stats->peak, &peak, cur, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    __atomic_add_fetch(&stats->nb_allocs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+AVBufferRef* frame_pool_get(int size)
+{
+    AVBufferPool *pool;
+    AVBufferRef *buf;
+    int class_size, idx;
+
+    if (size <= 0)
+        return NULL;
+    if (size > (1 << POOL_MAX_SHIFT)) {
+        buf = pool_alloc(size);
+    } else {
+        idx = size_class(size, &class_size);
+        pthread_mutex_lock(&pools_lock);
+        if (!pools[idx])
+            pools[idx] = av_buffer_pool_init(class_size, pool_alloc);
+        pool = pools[idx];
+        pthread_mutex_unlock(&pools_lock);
+        if (!pool)
+            return NULL;
+        // av_buffer_pool_get 自身是线程安全的
+        buf = av_buffer_pool_get(pool);
+    }
+    if (buf && cur_stats)
+        buf = track(buf, cur_stats);
+    return buf;
+}
+
+/*
+开始统计当前线程本次请求的帧缓存，stats 需在本次请求的帧全部释放之后才能失效
+ */
+void frame_pool_stats_begin(frame_pool_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    cur_stats = stats;
+}
+
+void frame_pool_stats_end(void)
+{
+    cur_stats = NULL;
+}
+
+/*
+把当前线程取的缓存也记到 stats 上（NULL 表示不统计），返回之前的设置
+请求把工作分给线程池时，任务在开始时调用、结束时恢复
+ */
+frame_pool_stats_t* frame_pool_stats_attach(frame_pool_stats_t *stats)
+{
+    frame_pool_stats_t *prev = cur_stats;
+
+    cur_stats = stats;
+    return prev;
+}
+
+/*
+按 format/width/height 与给定的行对齐，把整帧的所有平面放进一块池化缓存
+linesize 向 FRAME_POOL_ALIGN 对齐，每行首地址也就都是对齐的
+ */
+static int fill_frame(AVFrame *frame, int width, int height, const int *linesize_align)
+{
+    uint8_t *data[4] = {NULL};
+    int linesize[4] = {0};
+    int i, ret, size, align;
+
+    ret = av_image_fill_linesizes(linesize, frame->format, width);
+    if (ret < 0)
+        return ret;
+    for (i = 0; i < 4; i++) {
+        align = FRAME_POOL_ALIGN;
+        if (linesize_align && linesize_align[i] > align)
+            align = linesize_align[i];
+        linesize[i] = FFALIGN(linesize[i], align);
+    }
+
+    // ptr 传 NULL 时 data[] 得到的是各平面相对缓存首地址的偏移
+    size = av_image_fill_pointers(data, frame->format, height, NULL, linesize);
+    if (size < 0)
+        return size;
+    // 与 libavcodec 相同，尾部留出 SIMD 越界读取的余量
+    size += 16 + FRAME_POOL_ALIGN - 1;
+
+    frame->buf[0] = frame_pool_get(size);
+    if (!frame->buf[0])
+        return AVERROR(ENOMEM);
+    for (i = 0; i < 4; i++) {
+        // data[0] 的偏移就是 0，其余平面为 NULL 表示不存在
+        if (i > 0 && !data[i])
+            break;
+        frame->data[i] = frame->buf[0]->data + (data[i] - data[0]);
+        frame->linesize[i] = linesize[i];
+    }
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+/*
+解码器的 get_buffer2 回调
+不支持直接渲染（AV_CODEC_CAP_DR1）的解码器、硬件解码仍走 libavcodec 默认的分配
+ */
+int frame_pool_get_buffer2(AVCodecContext *s, AVFrame *frame, int flags)
+{
+    int w = frame->width, h = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    int ret;
+
+    if (!(s->codec->capabilities & AV_CODEC_CAP_DR1) || s->hw_frames_ctx ||
+        !desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) ||
+        s->codec_type != AVMEDIA_TYPE_VIDEO)
+        return avcodec_default_get_buffer2(s, frame, flags);
+
+    // 解码器可能会写出图像边界（按宏块对齐），按要求放大宽高
+    avcodec_align_dimensions2(s, &w, &h, linesize_align);
+    ret = fill_frame(frame, w, h, linesize_align);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Could not get pooled buffer for %dx%d %s\n",
+                w, h, desc->name);
+    return ret;
+}
+
+/*
+替代 av_frame_get_buffer()，调用前需设置好 frame 的 format/width/height
+ */
+int frame_pool_get_frame(AVFrame *frame)
+{
+    if (frame->format < 0 || frame->width <= 0 || frame->height <= 0)
+        return AVERROR(EINVAL);
+    return fill_frame(frame, frame->width, frame->height, NULL);
+}
+
+/*
+编码器可能仍持有 frame 缓存的引用，此时换一块新的池化缓存
+与 av_frame_make_writable() 不同，旧的内容不会被拷贝，调用者随后会整帧覆盖
+ */
+int frame_pool_renew_frame(AVFrame *frame)
+{
+    int i;
+
+    if (av_frame_is_writable(frame))
+        return 0;
+    for (i = 0; i < AV_NUM_DATA_POINTERS; i++) {
+        av_buffer_unref(&frame->buf[i]);
+        frame->data[i] = NULL;
+        frame->linesize[i] = 0;
+    }
+    return frame_pool_get_frame(frame);
+}
+
+void frame_pool_uninit(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pools_lock);
+    for (i = 0; i < POOL_NB_CLASSES; i++)
+        av_buffer_pool_uninit(&pools[i]);
+    pthread_mutex_unlock(&pools_lock);
+}
@@ -0,0 +1,27 @@
+
+#include <libavcodec/avcodec.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 帧缓存的对齐字节数，满足 AVX-512 的加载要求
+#define FRAME_POOL_ALIGN 64
+
+typedef struct frame_pool_stats {
+    int64_t cur;    // 当前占用的字节数
+    int64_t peak;   // 占用的峰值
+    int nb_allocs;  // 取缓存的次数
+} frame_pool_stats_t;
+
+AVBufferRef* frame_pool_get(int size);
+int frame_pool_get_buffer2(AVCodecContext *s, AVFrame *frame, int flags);
+int frame_pool_get_frame(AVFrame *frame);
+int frame_pool_renew_frame(AVFrame *frame);
+void frame_pool_stats_begin(frame_pool_stats_t *stats);
+void frame_pool_stats_end(void);
+frame_pool_stats_t* frame_pool_stats_attach(frame_pool_stats_t *stats);
+void frame_pool_uninit(void);
+
+#ifdef __cplusplus
+}
+#endif
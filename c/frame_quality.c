@@ -0,0 +1,244 @@
+/*
+缩略图候选帧的画面质量打分
+
+在最近邻缩小到不超过 SAMPLE_W x SAMPLE_H 的画面上计算（最近邻保留细节，模糊的判断不受缩小影响）：
+    - 亮度：均值，过暗、过亮（黑场、白场、淡入淡出）的帧降分
+    - 对比度：亮度的标准差
+    - 清晰度：亮度拉普拉斯响应的方差（SIMD），对焦不准、运动模糊的帧小
+    - 色彩度：Hasler-Süsstrunk 的 σ + 0.3μ，用 YUV 的色度近似 rg/yb 两个对立色分量
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <libavutil/log.h>
+#include <libavutil/pixdesc.h>
+
+#include "frame_quality.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUALITY_X86 1
+#endif
+
+#define SAMPLE_W 320
+#define SAMPLE_H 320
+// 拉普拉斯方差到此值时清晰度得分为 1（对数刻度）
+#define SHARPNESS_FULL 1000.0
+// 标准差 / 色彩度到此值时对应的得分为 1
+#define CONTRAST_FULL 64.0
+#define COLORFULNESS_FULL 64.0
+
+// 读取一个分量的方式
+typedef struct comp_src {
+    const AVFrame *frame;
+    const AVPixFmtDescriptor *desc;
+    int c;
+    const uint8_t *base; // 8 位且不需要移位的分量直接读字节
+    int linesize;
+    int step; // 相邻像素的字节距离
+    int depth;
+    int log2_w, log2_h; // 色度缩小
+} comp_src_t;
+
+static void comp_src_init(const AVFrame *frame, const AVPixFmtDescriptor *desc, int i, comp_src_t *src)
+{
+    const AVComponentDescriptor *c = &desc->comp[i];
+    int chroma = i > 0 && i < 3 && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+
+    src->frame = frame;
+    src->desc = desc;
+    src->c = i;
+    src->base = c->depth == 8 && !c->shift ? frame->data[c->plane] + c->offset : NULL;
+    src->linesize = frame->linesize[c->plane];
+    src->step = c->step;
+    src->depth = c->depth;
+    src->log2_w = chroma ? desc->log2_chroma_w : 0;
+    src->log2_h = chroma ? desc->log2_chroma_h : 0;
+}
+
+// (x, y) 处分量的值，缩放到 8 位
+static inline int comp_read(const comp_src_t *src, int x, int y)
+{
+    uint16_t v;
+
+    x >>= src->log2_w;
+    y >>= src->log2_h;
+    if (src->base)
+        return src->base[(ptrdiff_t)y * src->linesize + x * src->step];
+    av_read_image_line(&v, (const uint8_t **)src->frame->data, src->frame->linesize, src->desc, x, y, src->c, 1, 0);
+    return src->depth >= 8 ? v >> (src->depth - 8) : v << (8 - src->depth);
+}
+
+// 和与平方和（8 位样本）
+static void stats_u8(const uint8_t *p, int n, int64_t *sum, int64_t *sum2)
+{
+    int64_t s = 0, s2 = 0;
+    int x = 0;
+#ifdef QUALITY_X86
+    __m128i acc = _mm_setzero_si128(), acc2 = _mm_setzero_si128(), zero = _mm_setzero_si128();
+    int32_t tmp[4];
+
+    for (; x + 16 <= n; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + x));
+        __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+        // 每行不超过 SAMPLE_W 个样本，32 位累加不会溢出
+        acc2 = _mm_add_epi32(acc2, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+    s = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+    _mm_storeu_si128((__m128i *)tmp, acc2);
+    s2 = (int64_t)tmp[0] + tmp[1] + tmp[2] + tmp[3];
+#endif
+    for (; x < n; x++) {
+        s += p[x];
+        s2 += p[x] * p[x];
+    }
+    *sum += s;
+    *sum2 += s2;
+}
+
+// 一行内部像素 [1, w - 1) 的拉普拉斯响应 4c - l - r - u - d 的和与平方和
+static void laplacian_row(const uint8_t *up, const uint8_t *row, const uint8_t *down, int w,
+                          int64_t *sum, int64_t *sum2)
+{
+    int64_t s = 0, s2 = 0;
+    int x = 1;
+#ifdef QUALITY_X86
+    __m128i acc = _mm_setzero_si128(), acc2 = _mm_setzero_si128(), zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi16(1);
+    int32_t tmp[4];
+
+    for (; x + 8 <= w - 1; x += 8) {
+        __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row + x)), zero);
+        __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row + x - 1)), zero);
+        __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row + x + 1)), zero);
+        __m128i u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(up + x)), zero);
+        __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(down + x)), zero);
+        __m128i lap = _mm_sub_epi16(_mm_slli_epi16(c, 2),
+                                    _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d)));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(lap, one));
+        // |lap| <= 1020，每行不超过 SAMPLE_W 个样本，32 位累加不会溢出
+        acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(lap, lap));
+    }
+    _mm_storeu_si128((__m128i *)tmp, acc);
+    s = (int64_t)tmp[0] + tmp[1] + tmp[2] + tmp[3];
+    _mm_storeu_si128((__m128i *)tmp, acc2);
+    s2 = (int64_t)tmp[0] + tmp[1] + tmp[2] + tmp[3];
+#endif
+    for (; x < w - 1; x++) {
+        int lap = 4 * row[x] - row[x - 1] - row[x + 1] - up[x] - down[x];
+        s += lap;
+        s2 += lap * lap;
+    }
+    *sum += s;
+    *sum2 += s2;
+}
+
+static double variance(int64_t sum, int64_t sum2, int64_t n)
+{
+    double mean = (double)sum / n;
+    return FFMAX((double)sum2 / n - mean * mean, 0);
+}
+
+int frame_quality(const AVFrame* frame, frame_quality_t* q)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    comp_src_t src[3];
+    int xs[SAMPLE_W];
+    uint8_t *luma = NULL;
+    int sw, sh, x, y, i, nb_comps, rgb, pal;
+    int64_t sum = 0, sum2 = 0, lsum = 0, lsum2 = 0;
+    int64_t usum = 0, usum2 = 0, vsum = 0, vsum2 = 0;
+    double su, sv, mu, mv, expo;
+
+    memset(q, 0, sizeof(*q));
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)) ||
+        frame->width < 3 || frame->height < 3) {
+        av_log(NULL, AV_LOG_ERROR, "frame_quality unsupported frame format:%d size:%dx%d\n",
+               frame->format, frame->width, frame->height);
+        return AVERROR(EINVAL);
+    }
+    pal = !!(desc->flags & AV_PIX_FMT_FLAG_PAL);
+    rgb = pal || (desc->flags & AV_PIX_FMT_FLAG_RGB);
+    nb_comps = pal ? 1 : desc->nb_components >= 3 ? 3 : 1;
+    for (i = 0; i < nb_comps; i++) {
+        if (desc->comp[i].depth > 16)
+            return AVERROR(EINVAL);
+        comp_src_init(frame, desc, i, &src[i]);
+    }
+
+    // 保持宽高比缩小
+    sw = FFMIN(frame->width, SAMPLE_W);
+    sh = (int)((int64_t)frame->height * sw / frame->width);
+    if (sh > SAMPLE_H) {
+        sh = SAMPLE_H;
+        sw = (int)((int64_t)frame->width * sh / frame->height);
+    }
+    sw = FFMAX(sw, 3);
+    sh = FFMAX(sh, 3);
+    luma = av_malloc(sw * sh);
+    if (!luma)
+        return AVERROR(ENOMEM);
+    for (x = 0; x < sw; x++)
+        xs[x] = (int)(((int64_t)x * 2 + 1) * frame->width / (2 * sw));
+
+    for (y = 0; y < sh; y++) {
+        int fy = (int)(((int64_t)y * 2 + 1) * frame->height / (2 * sh));
+        uint8_t *row = luma + y * sw;
+        for (x = 0; x < sw; x++) {
+            int l, u = 128, v = 128;
+            if (pal || (rgb && nb_comps == 3)) {
+                int r, g, b;
+                if (pal) {
+                    uint32_t c = ((const uint32_t *)frame->data[1])[comp_read(&src[0], xs[x], fy)];
+                    r = c >> 16 & 0xff;
+                    g = c >> 8 & 0xff;
+                    b = c & 0xff;
+                } else {
+                    r = comp_read(&src[0], xs[x], fy);
+                    g = comp_read(&src[1], xs[x], fy);
+                    b = comp_read(&src[2], xs[x], fy);
+                }
+                // BT.601
+                l = (77 * r + 150 * g + 29 * b) >> 8;
+                u = av_clip_uint8(128 + ((-43 * r - 85 * g + 128 * b) >> 8));
+                v = av_clip_uint8(128 + ((128 * r - 107 * g - 21 * b) >> 8));
+            } else {
+                l = comp_read(&src[0], xs[x], fy);
+                if (nb_comps == 3) {
+                    u = comp_read(&src[1], xs[x], fy);
+                    v = comp_read(&src[2], xs[x], fy);
+                }
+            }
+            row[x] = l;
+            usum += u - 128;
+            usum2 += (u - 128) * (u - 128);
+            vsum += v - 128;
+            vsum2 += (v - 128) * (v - 128);
+        }
+        stats_u8(row, sw, &sum, &sum2);
+    }
+    for (y = 1; y < sh - 1; y++)
+        laplacian_row(luma + (y - 1) * sw, luma + y * sw, luma + (y + 1) * sw, sw, &lsum, &lsum2);
+    av_free(luma);
+
+    q->brightness = (double)sum / (sw * sh);
+    q->contrast = sqrt(variance(sum, sum2, (int64_t)sw * sh));
+    q->sharpness = variance(lsum, lsum2, (int64_t)(sw - 2) * (sh - 2));
+    su = variance(usum, usum2, (int64_t)sw * sh);
+    sv = variance(vsum, vsum2, (int64_t)sw * sh);
+    mu = (double)usum / (sw * sh);
+    mv = (double)vsum / (sw * sh);
+    q->colorfulness = sqrt(su + sv) + 0.3 * sqrt(mu * mu + mv * mv);
+
+    // 黑场、白场直接压到接近 0，偏暗偏亮的按距离线性降分
+    expo = av_clipd((q->brightness - 16) / 48, 0, 1) * av_clipd((240 - q->brightness) / 48, 0, 1);
+    q->score = expo * (FFMIN(log1p(q->sharpness) / log1p(SHARPNESS_FULL), 1.5) +
+                       FFMIN(q->contrast / CONTRAST_FULL, 1.5) +
+                       FFMIN(q->colorfulness / COLORFULNESS_FULL, 1.5));
+    return 0;
+}
@@ -0,0 +1,20 @@
+
+#include <libavutil/frame.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 一帧的画面质量，在缩小的画面上计算
+typedef struct frame_quality {
+    double brightness; // 亮度均值，0 - 255
+    double contrast; // 亮度的标准差
+    double sharpness; // 亮度的拉普拉斯响应的方差，模糊的画面小
+    double colorfulness; // 色彩度（Hasler-Süsstrunk，按色度近似），黑白画面为 0
+    double score; // 综合得分，越大越适合做缩略图
+} frame_quality_t;
+
+int frame_quality(const AVFrame* frame, frame_quality_t* q);
+
+#ifdef __cplusplus
+}
+#endif
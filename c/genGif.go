@@ -4,7 +4,7 @@ package c
 #include <stdlib.h>
 #include "gen_gif.h"
 #include "log.h"
-#cgo LDFLAGS: -lavcodec -lavformat -lswscale -lavutil -lavfilter -lm
+#cgo LDFLAGS: -lavcodec -lavformat -lswscale -lavutil -lavfilter -lm -lpthread
 */
 import "C"
 
@@ -4,15 +4,207 @@
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/intreadwrite.h>
 
 #include "muxing.h"
+#include "frame_pool.h"
 #include "filtering_video.h"
+#include "band_scale.h"
+#include "cropdetect.h"
+#include "gif_resize.h"
+#include "highlight.h"
+#include "activity.h"
+#include "motion.h"
+#include "gen_gif.h"
 
 static const int k_gif_framerate = 5; // 默认 gif 的帧率为 5，即每秒 5 帧
+static const int k_gif_width = 320;
+// 精彩片段打分的采样间隔（秒）；片段之间相距超过 k_seek_gap 秒时 seek 过去，否则顺序解码
+static const double k_highlight_interval = 0.5;
+static const double k_seek_gap = 2.0;
+// 精彩片段默认只在开头的这么多秒内打分
+static const int k_highlight_scan = 120;
+// 运动强度（每帧移动画面宽度的百分比）低于此值的帧视为静止
+static const double k_static_motion = 0.05;
+// 检测黑边时解码的关键帧数
+static const int k_crop_frames = 5;
 
-static int decode(void** mctx, void** fctx, const int gifSeconds, const int rotate, 
+// 边解码边缩小时预测某帧是否会被 decode() 选中，预测不准只会让该帧回退到普通缩放
+typedef struct band_select {
+    AVStream *st;
+    AVRational framerate;
+    int skip_step;
+    int gif_seconds;
+} band_select_t;
+
+static int band_want(void* opaque, const AVFrame* frame)
+{
+    band_select_t *sel = (band_select_t *)opaque;
+    int64_t pts = frame->pts;
+    int64_t idx;
+
+    if (sel->skip_step <= 0 || pts == AV_NOPTS_VALUE)
+        return 1;
+    if (sel->st->start_time != AV_NOPTS_VALUE)
+        pts -= sel->st->start_time;
+    if (pts * av_q2d(sel->st->time_base) > sel->gif_seconds)
+        return 0;
+    // decode() 按解码计数选帧：frame_number % skip_step == 1，即从 0 计数的序号整除 skip_step
+    idx = av_rescale_q(pts, sel->st->time_base, av_inv_q(sel->framerate));
+    return idx % sel->skip_step == 0;
+}
+
+// 精彩片段模式下按时间选帧
+typedef struct segment_select {
+    highlight_segment_t segs[HIGHLIGHT_MAX_SEGMENTS];
+    int nb_segs;
+    int cur; // 当前的片段
+    double next_t; // 下一个选中帧的时刻
+    int seek; // 需要 seek 到 segs[cur].start
+} segment_select_t;
+
+static double frame_time(const AVFrame *frame, const AVStream *st)
+{
+    int64_t pts = frame->pts;
+
+    if (pts == AV_NOPTS_VALUE)
+        return -1;
+    if (st->start_time != AV_NOPTS_VALUE)
+        pts -= st->start_time;
+    return pts * av_q2d(st->time_base);
+}
+
+/*
+返回 1 表示选中，0 表示跳过，AVERROR_EOF 表示所有片段都已取完
+进入下一个片段且相距较远时置 sel->seek，调用者 seek 之前的帧都跳过
+ */
+static int segment_want(segment_select_t *sel, double t)
+{
+    if (t < 0)
+        return 0;
+    while (sel->cur < sel->nb_segs && t >= sel->segs[sel->cur].end) {
+        sel->cur++;
+        if (sel->cur < sel->nb_segs) {
+            sel->next_t = sel->segs[sel->cur].start;
+            sel->seek = sel->next_t - t > k_seek_gap;
+        }
+    }
+    if (sel->cur == sel->nb_segs)
+        return AVERROR_EOF;
+    // 时刻按浮点累加，留一点余量
+    if (sel->seek || t + 1e-3 < sel->next_t)
+        return 0;
+    sel->next_t = FFMAX(sel->next_t + 1.0 / k_gif_framerate, t);
+    return 1;
+}
+
+// seek 失败时接着顺序解码，只是慢一些
+static void seek_segment(AVFormatContext *fmt_ctx, AVCodecContext *dec_ctx, int stream_index, segment_select_t *sel)
+{
+    AVStream *st = fmt_ctx->streams[stream_index];
+    int64_t ts = (int64_t)(sel->segs[sel->cur].start / av_q2d(st->time_base));
+
+    sel->seek = 0;
+    if (st->start_time != AV_NOPTS_VALUE)
+        ts += st->start_time;
+    if (av_seek_frame(fmt_ctx, stream_index, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Could not seek to %.3fs, decode sequentially\n", sel->segs[sel->cur].start);
+        return;
+    }
+    avcodec_flush_buffers(dec_ctx);
+}
+
+// 按压缩域的活动程度给每一秒打分，场景切换的秒额外加分
+static int score_compressed(void* h, const void* data, int data_size, double max_seconds)
+{
+    void *a = activity_scan((const uint8_t *)data, data_size, max_seconds);
+    const activity_second_t *s;
+    int n, i, ret = 0;
+
+    if (!a)
+        return AVERROR_INVALIDDATA;
+    n = activity_timeline(a, &s);
+    for (i = 0; i < n && ret >= 0; i++)
+        if (s[i].nb_packets > 0)
+            ret = highlight_add_score(h, i, s[i].activity + (s[i].scene_cuts > 0));
+    activity_free(a);
+    return ret < 0 ? ret : n;
+}
+
+/*
+低成本地打分（解码一遍，或只读包），挑出精彩片段写到 sel
+返回片段数，0 表示按原来的方式取开头
+ */
+static int pick_highlight(const int gifSeconds, const void* data, int data_size, const gen_gif_opts_t* opts,
+                          segment_select_t *sel)
+{
+    void *h = highlight_init(opts->highlight_compressed ? 1.0 : k_highlight_interval);
+    int ret, i;
+
+    if (!h)
+        return 0;
+    if (opts->highlight_compressed)
+        ret = score_compressed(h, data, data_size, opts->highlight_scan);
+    else
+        ret = highlight_scan(h, (const uint8_t *)data, data_size, opts->highlight_scan);
+    if (ret > 0)
+        ret = highlight_pick(h, gifSeconds, opts->highlight, sel->segs);
+    highlight_free(h);
+    if (ret <= 0)
+        return 0;
+    sel->nb_segs = ret;
+    sel->cur = 0;
+    sel->next_t = sel->segs[0].start;
+    sel->seek = sel->segs[0].start > k_seek_gap;
+    for (i = 0; i < ret; i++)
+        av_log(NULL, AV_LOG_INFO, "highlight segment %d: %.3fs - %.3fs\n", i, sel->segs[i].start, sel->segs[i].end);
+    return ret;
+}
+
+// 静止片段的加速：连续静止的帧每 factor 帧只保留一帧，按写出的帧数截止
+typedef struct motion_select {
+    int factor;
+    int nb_static; // 连续静止的帧数
+    int nb_frames, max_frames; // 已写出、最多写出的帧数
+    double max_seconds; // 源视频最多读到的时刻
+} motion_select_t;
+
+// 返回 1 表示保留，0 表示跳过；没有运动矢量的帧（关键帧等）按运动计
+static int motion_want(motion_select_t *sel, const AVFrame *frame)
+{
+    double m = motion_frame(frame);
+
+    if (m < 0 || m >= k_static_motion) {
+        sel->nb_static = 0;
+        return 1;
+    }
+    return sel->nb_static++ % sel->factor == 0;
+}
+
+// 已经边解码边缩小过的帧只需做像素格式转换
+static int write_frame(void* mctx, void* bctx, AVFrame *frame, AVFrame *band_frame)
+{
+    int ret = band_scale_take(bctx, frame, band_frame);
+
+    if (ret < 0)
+        return ret;
+    if (ret > 0) {
+        ret = muxing_write_video(mctx, band_frame);
+        av_frame_unref(band_frame);
+        return ret;
+    }
+    return muxing_write_video(mctx, frame);
+}
+
+/*
+seg 非 NULL 时为精彩片段模式，按 segment_want() 选帧，不再取开头的 gifSeconds 秒
+mot 非 NULL 时静止的片段加速，写满 mot->max_frames 帧截止
+返回 AVERROR_EOF 表示不再需要帧（取够了，或解码出错，已写出的帧照常输出），其他 < 0 为写出失败
+ */
+static int decode(void** mctx, void** fctx, void* bctx, const muxing_opts_t* mopts, const int gifSeconds, const int rotate, 
                     const char* outFormat, const int skip_step, AVCodecContext *dec_ctx, 
-                    AVFrame *frame, AVFrame *filt_frame, AVPacket *pkt, AVStream *st)
+                    AVFrame *frame, AVFrame *filt_frame, AVFrame *band_frame, AVPacket *pkt, AVStream *st,
+                    segment_select_t *seg, motion_select_t *mot)
 {
     int ret;
 
@@ -20,7 +212,7 @@ static int decode(void** mctx, void** fctx, const int gifSeconds, const int rota
     ret = avcodec_send_packet(dec_ctx, pkt);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Error sending a packet for decoding, outfilename:%s, ret:%d\n", outFormat, ret);
-        return -1;
+        return AVERROR_EOF;
     }
 
     while (ret >= 0) {
@@ -36,15 +228,27 @@ static int decode(void** mctx, void** fctx, const int gifSeconds, const int rota
             break;
         } else if (ret < 0) {
             //av_log(NULL, AV_LOG_ERROR, "Error during decoding, outfilename:%s, ret:%d\n", outFormat, ret);
+            ret = AVERROR_EOF;
             break;
         }
 
-        if((frame->pts * av_q2d(st->time_base)) > gifSeconds){
+        if (seg) {
+            ret = segment_want(seg, frame_time(frame, st));
+            if (ret <= 0) {
+                band_scale_take(bctx, frame, NULL);
+                // 要 seek 时解码器中剩下的帧都不需要了
+                if (ret < 0 || seg->seek)
+                    break;
+                continue;
+            }
+        } else if (mot ? mot->nb_frames >= mot->max_frames || frame_time(frame, st) > mot->max_seconds
+                       : (frame->pts * av_q2d(st->time_base)) > gifSeconds) {
+            band_scale_take(bctx, frame, NULL);
             ret = AVERROR_EOF;
             break;
         }
 
-        if (dec_ctx->frame_number == 1) {
+        if (!*mctx) {
             if (rotate != 0) {
                 char filters_descr[64];
                 /*
@@ -61,26 +265,43 @@ static int decode(void** mctx, void** fctx, const int gifSeconds, const int rota
                 frame = filt_frame;
             }
 
-            *mctx = muxing_begin(outFormat, NULL, k_gif_framerate, 320, 320*frame->height/frame->width);
-            ret = muxing_write_video(*mctx, frame);
+            // 裁黑边后的尺寸，裁剪量不适用于这一帧时 muxing 不裁剪
+            int w = frame->width - mopts->crop_left - mopts->crop_right;
+            int h = frame->height - mopts->crop_top - mopts->crop_bottom;
+            if (w <= 0 || h <= 0) {
+                w = frame->width;
+                h = frame->height;
+            }
+            *mctx = muxing_begin2(outFormat, NULL, k_gif_framerate, k_gif_width, k_gif_width*h/w, mopts);
+            ret = write_frame(*mctx, bctx, frame, band_frame);
             if (ret < 0)
                 break;
+            if (mot)
+                mot->nb_frames++;
         }
-        else if (dec_ctx->frame_number % skip_step == 1)
+        else if ((seg || dec_ctx->frame_number % skip_step == 1) && (!mot || motion_want(mot, frame)))
         {
             if (*fctx) {
                 filtering(*fctx, frame, filt_frame);
                 frame = filt_frame;
             }
-            ret = muxing_write_video(*mctx, frame);
+            ret = write_frame(*mctx, bctx, frame, band_frame);
             if (ret < 0)
                 break;
+            if (mot)
+                mot->nb_frames++;
+        }
+        else
+        {
+            // 跳过的帧，丢弃可能已经做过的边解码边缩小
+            band_scale_take(bctx, frame, NULL);
         }
     }
     return ret;
 }
 
-static int open_codec_context(AVCodecContext **dec_ctx, int *stream_index, AVFormatContext *fmt_ctx, enum AVMediaType type)
+static int open_codec_context(AVCodecContext **dec_ctx, int *stream_index, void **bctx, band_select_t *sel,
+                              AVFormatContext *fmt_ctx, enum AVMediaType type, int flags2)
 {
     int ret; // 整型的返回值、流索引
     AVStream *st; // AV 流的指针
@@ -119,6 +340,18 @@ static int open_codec_context(AVCodecContext **dec_ctx, int *stream_index, AVFor
             return ret;
         }
 
+        // 解码帧的缓存从进程级的缓存池中获取，回调本身是线程安全的
+        (*dec_ctx)->get_buffer2 = frame_pool_get_buffer2;
+        (*dec_ctx)->thread_safe_callbacks = 1;
+        (*dec_ctx)->flags2 |= flags2;
+
+        // 边解码边缩小，目标尺寸与 decode() 中 muxing_begin() 的一致
+        if (sel && (*dec_ctx)->width > 0) {
+            sel->st = st;
+            *bctx = band_scale_init(*dec_ctx, k_gif_width, k_gif_width * (*dec_ctx)->height / (*dec_ctx)->width,
+                                    band_want, sel);
+        }
+
         // 初始化解码器
         if ((ret = avcodec_open2(*dec_ctx, dec, NULL)) < 0) {
             av_log(NULL, AV_LOG_ERROR, "Failed to open %s codec\n",
@@ -134,7 +367,61 @@ static int open_codec_context(AVCodecContext **dec_ctx, int *stream_index, AVFor
     return 0;
 }
 
+void gen_gif_opts_default(gen_gif_opts_t* opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->gif_fast_path = 1;
+    opts->gif_filter = GIF_RESIZE_NEAREST;
+    opts->highlight_scan = k_highlight_scan;
+}
+
+/*
+GIF 输入的快速路径：不解码成 RGB，沿用源文件的调色板、处置方式与时长，在调色板索引上缩放
+返回 < 0 时调用者回退到解码重新编码的路径
+ */
+static int resize_gif(const int gifSeconds, const uint8_t* data, int data_size, void* outBuf, int outBufLen, int *outSize,
+                      const gen_gif_opts_t* opts)
+{
+    AVIOContext *pb = NULL;
+    uint8_t *buffer = NULL;
+    int width, height, size, ret;
+
+    if (data_size < 10 || memcmp(data, "GIF8", 4))
+        return AVERROR_INVALIDDATA;
+    width = AV_RL16(data + 6);
+    height = AV_RL16(data + 8);
+    if (width <= 0 || height <= 0)
+        return AVERROR_INVALIDDATA;
+    if ((ret = avio_open_dyn_buf(&pb)) < 0)
+        return ret;
+    ret = gif_resize(data, data_size, k_gif_width, FFMAX(k_gif_width * height / width, 1), gifSeconds * 100,
+                     opts->gif_filter, opts->lossy, pb);
+    size = avio_close_dyn_buf(pb, &buffer);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Could not resize gif in palette space, err:%d\n", ret);
+    } else if (opts->max_bytes > 0 && size > opts->max_bytes) {
+        // 快速路径不能控制大小，交给重新编码的路径
+        ret = AVERROR(ENOSPC);
+    } else if (outBufLen < size) {
+        av_log(NULL, AV_LOG_ERROR, "outsz:%d larger than outbufflen:%d", size, outBufLen);
+        *outSize = 0;
+    } else {
+        memcpy(outBuf, buffer, size);
+        *outSize = size;
+    }
+    av_free(buffer);
+    return ret;
+}
+
 int gen_gif(const int gifSeconds, const int rotate, void* data, int data_size, void* outBuf, int outBufLen, int *outSize)
+{
+    return gen_gif2(gifSeconds, rotate, data, data_size, outBuf, outBufLen, outSize, NULL);
+}
+
+/*
+opts 为 NULL 时使用默认选项
+ */
+int gen_gif2(const int gifSeconds, const int rotate, void* data, int data_size, void* outBuf, int outBufLen, int *outSize, const gen_gif_opts_t* opts)
 {
     const AVCodec *codec = NULL; // AV 解码器指针
     AVFormatContext *fmt_ctx = NULL; // AV 格式上下文
@@ -148,6 +435,61 @@ int gen_gif(const int gifSeconds, const int rotate, void* data, int data_size, v
     unsigned char *indata = NULL; // avcodec 的输入的指针
     int video_stream_index = 0;
     const char * outFormat = "gif";
+    void* bctx = NULL; // 边解码边缩小的上下文
+    AVFrame *band_frame = NULL; // 边解码边缩小的结果
+    band_select_t band_sel = {0};
+    segment_select_t seg_sel = {0};
+    segment_select_t *seg = NULL;
+    motion_select_t mot_sel = {0};
+    motion_select_t *mot = NULL;
+    crop_rect_t crop;
+    int cropped = 0;
+    gen_gif_opts_t def_opts;
+    muxing_opts_t mopts;
+
+    if (!opts) {
+        gen_gif_opts_default(&def_opts);
+        opts = &def_opts;
+    }
+    muxing_opts_default(&mopts);
+    if (opts->native_writer || opts->lossy > 0)
+        mopts.gif_writer = MUXING_GIF_WRITER_NATIVE;
+    mopts.gif_lossy = opts->lossy;
+    mopts.max_bytes = opts->max_bytes;
+    // 自带的写出器、有损压缩与字节预算都建立在自适应调色板上
+    mopts.palette = opts->palette;
+    if (!mopts.palette && (opts->native_writer || opts->lossy > 0 || opts->max_bytes > 0))
+        mopts.palette = MUXING_PALETTE_GLOBAL;
+    mopts.watermark = opts->watermark;
+    mopts.watermark_size = opts->watermark_size;
+    mopts.watermark_position = opts->watermark_position;
+    mopts.watermark_percent = opts->watermark_percent;
+    mopts.expected_frames = gifSeconds * k_gif_framerate;
+
+    // 快速路径在调色板索引上缩放，不能叠加水印
+    if (opts->gif_fast_path && rotate == 0 && !opts->highlight && !opts->watermark &&
+        resize_gif(gifSeconds, (const uint8_t *)data, data_size, outBuf, outBufLen, outSize, opts) >= 0)
+        return 0;
+
+    // 精彩片段先单独做一遍低成本的打分，再 seek 到选出的片段解码
+    if (opts->highlight > 0 && pick_highlight(gifSeconds, data, data_size, opts, &seg_sel) > 0)
+        seg = &seg_sel;
+    // 静止片段加速只用于取开头的方式，精彩片段已经挑过
+    if (!seg && opts->motion_compress > 1) {
+        mot_sel.factor = opts->motion_compress;
+        mot_sel.max_frames = gifSeconds * k_gif_framerate;
+        mot_sel.max_seconds = (double)gifSeconds * opts->motion_compress;
+        mot = &mot_sel;
+    }
+
+    // 黑边单独解码开头的几个关键帧检测，缩放前按指针偏移裁掉
+    if (opts->crop && rotate == 0 && cropdetect_scan(data, data_size, k_crop_frames, &crop) > 0) {
+        mopts.crop_left = crop.left;
+        mopts.crop_top = crop.top;
+        mopts.crop_right = crop.right;
+        mopts.crop_bottom = crop.bottom;
+        cropped = 1;
+    }
 
     // 分配相关的内存
     fmt_ctx = avformat_alloc_context();
@@ -184,9 +526,11 @@ int gen_gif(const int gifSeconds, const int rotate, void* data, int data_size, v
     }
 
     // 找到第一个视频流的索引，获得解码器ID
-    if (open_codec_context(&c, &video_stream_index, fmt_ctx, AVMEDIA_TYPE_VIDEO) < 0) {
+    // 旋转的滤镜会改变画面尺寸，只在不旋转时边解码边缩小；边解码边缩小的是整帧，裁黑边时也不用
+    if (open_codec_context(&c, &video_stream_index, &bctx, opts->band_scale && rotate == 0 && !seg && !cropped ? &band_sel : NULL,
+                           fmt_ctx, AVMEDIA_TYPE_VIDEO, mot ? AV_CODEC_FLAG2_EXPORT_MVS : 0) < 0) {
         av_log(NULL, AV_LOG_ERROR, "Could not open codec context\n");
-        goto clean1;
+        goto clean2;
     }
 
     // 视频与gif的帧率比，计算转码时跳过帧的间隔数
@@ -194,6 +538,9 @@ int gen_gif(const int gifSeconds, const int rotate, void* data, int data_size, v
     int skip_step = c->framerate.num / c->framerate.den / k_gif_framerate;
     if (skip_step == 0)
         skip_step = 1;
+    band_sel.framerate = c->framerate;
+    band_sel.skip_step = skip_step;
+    band_sel.gif_seconds = mot ? (int)mot->max_seconds : gifSeconds;
 
     // 分配压缩数据包的内存，返回指针
     pkt = av_packet_alloc();
@@ -208,11 +555,14 @@ int gen_gif(const int gifSeconds, const int rotate, void* data, int data_size, v
     }
 
     filt_frame = av_frame_alloc();
-    if (!filt_frame) {
+    band_frame = av_frame_alloc();
+    if (!filt_frame || !band_frame) {
         av_log(NULL, AV_LOG_ERROR, "Could not allocate video frame\n");
         goto clean4;
     }
 
+    if (seg && seg->seek)
+        seek_segment(fmt_ctx, c, video_stream_index, seg);
     while (av_read_frame(fmt_ctx, pkt) >= 0) {
         if (pkt->size) {
             // av_log(NULL, AV_LOG_INFO, "read frame stream index=%d", pkt->stream_index);
@@ -222,30 +572,43 @@ int gen_gif(const int gifSeconds, const int rotate, void* data, int data_size, v
                 continue;
             }
 
-            ret = decode(&mctx, &fctx, gifSeconds, rotate, outFormat, skip_step, c, frame, filt_frame, pkt, fmt_ctx->streams[video_stream_index]);
+            ret = decode(&mctx, &fctx, bctx, &mopts, gifSeconds, rotate, outFormat, skip_step, c, frame, filt_frame, band_frame, pkt, fmt_ctx->streams[video_stream_index], seg, mot);
             av_frame_unref(frame);
             av_frame_unref(filt_frame);
             av_packet_unref(pkt);
             if (ret < 0) {
-                av_log(NULL, AV_LOG_ERROR, "Error while decoding,err:%d\n", ret);
+                if (ret != AVERROR_EOF)
+                    av_log(NULL, AV_LOG_ERROR, "Error while writing gif frame,err:%d\n", ret);
                 goto clean5;
             }
+            if (seg && seg->seek)
+                seek_segment(fmt_ctx, c, video_stream_index, seg);
         }
     }
 
     // flush the decoder 不再传入packet, packet=NULL，将 fmt_ctx 中剩余的帧都处理完
-    decode(&mctx, &fctx, gifSeconds, rotate, outFormat, skip_step, c, frame, filt_frame, NULL, fmt_ctx->streams[video_stream_index]);
+    ret = decode(&mctx, &fctx, bctx, &mopts, gifSeconds, rotate, outFormat, skip_step, c, frame, filt_frame, band_frame, NULL, fmt_ctx->streams[video_stream_index], seg, mot);
+    if (ret < 0 && ret != AVERROR_EOF)
+        av_log(NULL, AV_LOG_ERROR, "Error while writing gif frame,err:%d\n", ret);
 clean5:
     free_filters(fctx);
-    ret = muxing_end(mctx, outBuf, outBufLen, outSize);
-    av_frame_free(&filt_frame);
+    // 写出失败时 GIF 不完整，不能当作成功返回
+    if (ret < 0 && ret != AVERROR_EOF) {
+        muxing_end(mctx, outBuf, outBufLen, outSize);
+        *outSize = 0;
+    } else {
+        ret = muxing_end(mctx, outBuf, outBufLen, outSize);
+    }
 clean4:
+    av_frame_free(&filt_frame);
+    av_frame_free(&band_frame);
     av_frame_free(&frame);
     //av_parser_close(parser);
 clean3:
     av_packet_free(&pkt);
 clean2:
     avcodec_free_context(&c);
+    band_scale_free(bctx);
 clean1:
     if(NULL != fmt_ctx->pb->buffer)
         av_freep(&fmt_ctx->pb->buffer);
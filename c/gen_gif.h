@@ -2,7 +2,28 @@
 extern "C" {
 #endif
 
+typedef struct gen_gif_opts {
+    int band_scale; // 解码器支持且不旋转时，在 draw_horiz_band 回调中边解码边缩小
+    int native_writer; // 使用自带的 GIF 写出器代替 libavcodec 的编码器与 libavformat 的封装
+    int lossy; // 有损压缩的程度，0 为无损，1 - 200 越大输出越小、失真越大（80 左右肉眼难以察觉），非 0 时总是使用自带的写出器
+    int max_bytes; // 输出大小的上限，超出时减少颜色、有损压缩、降低帧率，通常取 outBufLen，0 不限制
+    int palette; // MUXING_PALETTE_*（muxing.h），默认 FIXED；native_writer、lossy、max_bytes 需要自适应调色板，设置它们而未指定时用 GLOBAL
+    int gif_fast_path; // 输入是 GIF 且不旋转、不加水印时，沿用源调色板直接在索引上缩放（gif_resize.c），失败或超出 max_bytes 时回退到解码重新编码
+    int gif_filter; // 快速路径的缩放方式 GIF_RESIZE_*
+    int highlight; // 精彩片段：0 取开头的 gifSeconds 秒，1 取活动最多的一段，n > 1 取 n 段拼接（最多 HIGHLIGHT_MAX_SEGMENTS）
+    int highlight_scan; // 精彩片段打分时扫描的最长秒数，默认 120，0 为整个视频（解码打分的成本与扫描的时长成正比，长视频宜用 highlight_compressed）
+    int highlight_compressed; // 精彩片段按压缩域的活动程度打分（activity.c），只读包不解码，适合很长的视频
+    int motion_compress; // n > 1 时按运动矢量（motion.c）把静止的片段加速 n 倍，写满 gifSeconds 秒的帧为止，最多读源视频的 n * gifSeconds 秒
+    int crop; // 非 0 时先在开头的几个关键帧上检测黑边（cropdetect.c），缩放前裁掉；不用于旋转与 GIF 快速路径
+    const void *watermark; // 水印图片的文件数据（PNG 等，可带透明度），NULL 不加，在编码前叠加到输出帧上
+    int watermark_size;
+    int watermark_position; // WATERMARK_*（watermark.h），默认右下角
+    int watermark_percent; // 水印宽度占输出宽度的百分比，0 为默认值
+} gen_gif_opts_t;
+
+void gen_gif_opts_default(gen_gif_opts_t* opts);
 int gen_gif(const int gifSeconds, const int rotate, void* data, int data_size, void* outBuf, int outBufLen, int *outSize);
+int gen_gif2(const int gifSeconds, const int rotate, void* data, int data_size, void* outBuf, int outBufLen, int *outSize, const gen_gif_opts_t* opts);
 
 
 #ifdef __cplusplus
@@ -23,14 +23,21 @@ int main(int argc, char **argv)
     FILE *f, *outfile;
     uint8_t* data, *outData;
     size_t   data_size;
-    int outSize;
+    int outSize = 0, ret, rotate = 45;
+    gen_gif_opts_t opts;
 
     set_log_callback();
 
     if (argc <= 2) {
-        fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <input file> <output file> [rotate] [band_scale]\n", argv[0]);
         exit(0);
     }
+    gen_gif_opts_default(&opts);
+    if (argc > 3)
+        rotate = atoi(argv[3]);
+    // 用 MPEG-2 等支持 draw_horiz_band 的样本检查边解码边缩小：场图、B 帧等会让部分帧整帧缩小，两种帧混在一起仍应输出完整的 GIF
+    if (argc > 4)
+        opts.band_scale = atoi(argv[4]);
     filename    = argv[1];
     outfilename = argv[2];
     f = fopen(filename, "rb");
@@ -50,7 +57,12 @@ int main(int argc, char **argv)
     if (!data_size)
         exit(1);
 
-    gen_gif(5, 45, data, data_size, outData, OUTBUF_SIZE, &outSize);
+    ret = gen_gif2(5, rotate, data, data_size, outData, OUTBUF_SIZE, &outSize, &opts);
+    // 完整的 GIF 以 "GIF8" 开头、以 0x3B 结尾
+    if (ret != 0 || outSize < 14 || memcmp(outData, "GIF8", 4) || outData[outSize - 1] != 0x3B) {
+        fprintf(stderr, "gen_gif failed, ret:%d size:%d\n", ret, outSize);
+        exit(1);
+    }
 
     outfile = fopen(outfilename, "wb");
     if (!outfile) {
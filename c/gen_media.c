@@ -0,0 +1,537 @@
+/*
+一遍生成多个输出：缩略图、GIF 与媒体信息
+
+同一个上传分别调用 dump_info()、gen_thumbnail()、gen_gif() 时，输入要复制三次、探测三次，开头几秒也要解码三次。
+这里只复制、打开、探测一次，解码一遍，每个解码出的帧按引用计数分发给需要它的输出分支：
+    - 每个分支有自己的 muxing 上下文（缩放、转换、水印、编码器都是分支自己的），互不影响
+    - 同一帧要写给多个分支时在线程池中并行，分支内部的条带缩放、调色板映射照常使用线程池
+    - 分支写完（缩略图写完第一帧，GIF 到达 gifSeconds 秒）后不再收帧，所有分支都写完就停止读包，
+      总开销接近最贵的一个输出
+    - 黑边只在第一帧上检测一次，缩略图与 GIF 共用
+媒体信息在探测后直接读出，只要信息时不打开解码器。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "muxing.h"
+#include "frame_pool.h"
+#include "filtering_video.h"
+#include "smartcrop.h"
+#include "thread_pool.h"
+#include "gen_media.h"
+
+// 与 gen_gif.c 一致
+static const int k_gif_framerate = 5;
+static const int k_gif_width = 320;
+// 与 gen_thumbnail.c 一致
+static const int64_t k_max_pixels = 100000000;
+
+enum {
+    BRANCH_THUMBNAIL = 0,
+    BRANCH_GIF,
+    NB_BRANCHES,
+};
+
+typedef struct branch {
+    int active; // 还需要帧
+    void *mctx;
+    muxing_opts_t mopts;
+    AVFrame *frame; // 本帧分发给这个分支的引用
+    int ret; // 第一个错误
+} branch_t;
+
+typedef struct media_job {
+    AVCodecContext *dec_ctx;
+    AVStream *st;
+    const gen_media_opts_t *opts;
+    frame_pool_stats_t *stats; // 请求的帧缓存统计，分支在其他线程上写时也记到这里
+    branch_t branches[NB_BRANCHES];
+    int todo[NB_BRANCHES]; // 本帧要写的分支
+    int nb_todo;
+    int nb_frames; // 已解码的帧数
+    crop_rect_t crop; // 第一帧上检测出的黑边
+    // 缩略图
+    const char *thumb_format;
+    int thumb_width;
+    // GIF
+    int gif_seconds;
+    int rotate;
+    int skip_step;
+    void *fctx; // 旋转的滤镜
+    AVFrame *filt_frame;
+} media_job_t;
+
+// 封装格式名可能是逗号分隔的多个别名，只取第一个
+static void copy_name(char *dst, int size, const char *name)
+{
+    int n = 0;
+
+    if (name)
+        while (name[n] && name[n] != ',' && n < size - 1)
+            n++;
+    if (n)
+        memcpy(dst, name, n);
+    dst[n] = 0;
+}
+
+static void read_info(AVFormatContext *fmt_ctx, media_info_t *info)
+{
+    AVDictionaryEntry *tag;
+    AVStream *st;
+    int idx;
+
+    memset(info, 0, sizeof(*info));
+    copy_name(info->format_name, sizeof(info->format_name), fmt_ctx->iformat->name);
+    if (fmt_ctx->duration > 0 && fmt_ctx->duration != AV_NOPTS_VALUE)
+        info->duration = fmt_ctx->duration / (double)AV_TIME_BASE;
+    info->bit_rate = FFMAX(fmt_ctx->bit_rate, 0);
+    info->nb_streams = fmt_ctx->nb_streams;
+
+    idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (idx >= 0) {
+        AVRational fr;
+        st = fmt_ctx->streams[idx];
+        copy_name(info->video_codec, sizeof(info->video_codec), avcodec_get_name(st->codecpar->codec_id));
+        info->width = st->codecpar->width;
+        info->height = st->codecpar->height;
+        fr = av_guess_frame_rate(fmt_ctx, st, NULL);
+        if (fr.num > 0 && fr.den > 0)
+            info->framerate = av_q2d(fr);
+        if ((tag = av_dict_get(st->metadata, "rotate", NULL, 0)))
+            info->rotate = atoi(tag->value);
+        if (!info->duration && st->duration > 0 && st->duration != AV_NOPTS_VALUE)
+            info->duration = st->duration * av_q2d(st->time_base);
+    }
+    idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (idx >= 0) {
+        st = fmt_ctx->streams[idx];
+        copy_name(info->audio_codec, sizeof(info->audio_codec), avcodec_get_name(st->codecpar->codec_id));
+        info->sample_rate = st->codecpar->sample_rate;
+        info->channels = st->codecpar->channels;
+    }
+    av_log(NULL, AV_LOG_INFO, "media info: format %s, duration %.3fs, bit_rate %"PRId64", streams %d, "
+           "video %s %dx%d %.3ffps rotate %d, audio %s %dHz %dch\n",
+           info->format_name, info->duration, info->bit_rate, info->nb_streams,
+           info->video_codec, info->width, info->height, info->framerate, info->rotate,
+           info->audio_codec, info->sample_rate, info->channels);
+}
+
+// 探测流信息时也可能解码一帧，同样限制像素数
+static int find_stream_info(AVFormatContext *fmt_ctx, int64_t max_pixels)
+{
+    AVDictionary **stream_opts;
+    unsigned int i;
+    int ret;
+
+    stream_opts = (AVDictionary **)av_mallocz_array(fmt_ctx->nb_streams, sizeof(*stream_opts));
+    if (!stream_opts)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < fmt_ctx->nb_streams; i++)
+        av_dict_set_int(&stream_opts[i], "max_pixels", max_pixels, 0);
+    ret = avformat_find_stream_info(fmt_ctx, stream_opts);
+    for (i = 0; i < fmt_ctx->nb_streams; i++)
+        av_dict_free(&stream_opts[i]);
+    av_free(stream_opts);
+    return ret;
+}
+
+static int open_codec_context(AVCodecContext **dec_ctx, int *stream_index, AVFormatContext *fmt_ctx, int64_t max_pixels)
+{
+    AVStream *st;
+    AVCodec *dec = NULL;
+    int ret;
+
+    ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not find video stream\n");
+        return ret;
+    }
+    *stream_index = ret;
+    st = fmt_ctx->streams[ret];
+
+    *dec_ctx = avcodec_alloc_context3(dec);
+    if (!*dec_ctx) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to allocate the video codec context\n");
+        return AVERROR(ENOMEM);
+    }
+    if ((ret = avcodec_parameters_to_context(*dec_ctx, st->codecpar)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to copy video codec parameters to decoder context\n");
+        return ret;
+    }
+    // 解码帧的缓存从进程级的缓存池中获取，回调本身是线程安全的
+    (*dec_ctx)->get_buffer2 = frame_pool_get_buffer2;
+    (*dec_ctx)->thread_safe_callbacks = 1;
+    (*dec_ctx)->max_pixels = max_pixels;
+    if ((ret = avcodec_open2(*dec_ctx, dec, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to open video codec\n");
+        return ret;
+    }
+    (*dec_ctx)->framerate = av_guess_frame_rate(fmt_ctx, st, NULL);
+    return 0;
+}
+
+// 缩略图的第一帧：黑边用共享的检测结果，有固定宽高比时再按显著性选出窗口
+static int write_thumbnail(media_job_t *j, branch_t *b)
+{
+    const gen_thumbnail_opts_t *opts = &j->opts->thumbnail;
+    AVFrame *frame = b->frame;
+    crop_rect_t r = {0};
+    int w, h;
+
+    if (opts->crop && j->crop.left + j->crop.right < frame->width && j->crop.top + j->crop.bottom < frame->height)
+        r = j->crop;
+    if (opts->aspect_w > 0 && opts->aspect_h > 0 && smartcrop(frame, opts->aspect_w, opts->aspect_h, &r) < 0)
+        av_log(NULL, AV_LOG_WARNING, "smart crop failed, keep the aspect ratio\n");
+    b->mopts.crop_left = r.left;
+    b->mopts.crop_top = r.top;
+    b->mopts.crop_right = r.right;
+    b->mopts.crop_bottom = r.bottom;
+    w = frame->width - r.left - r.right;
+    h = frame->height - r.top - r.bottom;
+
+    // 与 gen_thumbnail() 一致，时间戳为解码计数
+    frame->pts = 1;
+    b->mctx = muxing_begin2(j->thumb_format, NULL, 1, j->thumb_width, j->thumb_width * h / w, &b->mopts);
+    b->active = 0;
+    return muxing_write_video(b->mctx, frame);
+}
+
+static int write_gif(media_job_t *j, branch_t *b)
+{
+    AVFrame *frame = b->frame;
+    int ret;
+
+    if (!b->mctx && !j->fctx && j->rotate != 0) {
+        char filters_descr[64];
+        snprintf(filters_descr, sizeof(filters_descr), "rotate='%d*PI/180:ow=rotw(%d*PI/180):oh=roth(%d*PI/180)'",
+                 j->rotate, j->rotate, j->rotate);
+        j->fctx = init_filters(filters_descr, j->dec_ctx, j->dec_ctx->pix_fmt);
+    }
+    if (j->fctx) {
+        // 滤镜还没有输出时跳过这一帧
+        if (filtering(j->fctx, frame, j->filt_frame) != 0)
+            return 0;
+        frame = j->filt_frame;
+    }
+    if (!b->mctx) {
+        // 裁黑边后的尺寸，裁剪量不适用于这一帧时 muxing 不裁剪
+        int w = frame->width - b->mopts.crop_left - b->mopts.crop_right;
+        int h = frame->height - b->mopts.crop_top - b->mopts.crop_bottom;
+        if (w <= 0 || h <= 0) {
+            w = frame->width;
+            h = frame->height;
+        }
+        b->mctx = muxing_begin2("gif", NULL, k_gif_framerate, k_gif_width, k_gif_width * h / w, &b->mopts);
+    }
+    ret = muxing_write_video(b->mctx, frame);
+    av_frame_unref(j->filt_frame);
+    return ret;
+}
+
+// 把本帧写给第 job 个要写的分支，各分支的状态互不共享，可以并行
+static int write_branch(void *arg, int job, int nb_jobs)
+{
+    media_job_t *j = (media_job_t *)arg;
+    int idx = j->todo[job];
+    branch_t *b = &j->branches[idx];
+    frame_pool_stats_t *prev_stats = frame_pool_stats_attach(j->stats);
+    int ret;
+
+    (void)nb_jobs;
+    ret = idx == BRANCH_THUMBNAIL ? write_thumbnail(j, b) : write_gif(j, b);
+    av_frame_unref(b->frame);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while writing %s, err:%d\n", idx == BRANCH_THUMBNAIL ? "thumbnail" : "gif", ret);
+        b->ret = ret;
+        b->active = 0;
+    }
+    frame_pool_stats_attach(prev_stats);
+    return 0;
+}
+
+// 第一帧上检测黑边，缩略图与 GIF 共用
+static void detect_crop(media_job_t *j, const AVFrame *frame)
+{
+    void *cd;
+
+    if (!(j->branches[BRANCH_THUMBNAIL].active && j->opts->thumbnail.crop) &&
+        !(j->branches[BRANCH_GIF].active && j->opts->gif.crop && j->rotate == 0))
+        return;
+    cd = cropdetect_init();
+    if (!cd)
+        return;
+    if (cropdetect_add_frame(cd, frame) > 0)
+        cropdetect_result(cd, &j->crop);
+    cropdetect_free(cd);
+    if (j->opts->gif.crop && j->rotate == 0) {
+        branch_t *b = &j->branches[BRANCH_GIF];
+        b->mopts.crop_left = j->crop.left;
+        b->mopts.crop_top = j->crop.top;
+        b->mopts.crop_right = j->crop.right;
+        b->mopts.crop_bottom = j->crop.bottom;
+    }
+}
+
+/*
+把一个解码出的帧分发给需要它的分支：每个分支拿到自己的引用，不复制像素
+返回仍需要帧的分支数
+ */
+static int fan_out(media_job_t *j, AVFrame *frame)
+{
+    branch_t *b;
+    int i, nb_active = 0;
+
+    j->nb_frames++;
+    if (j->nb_frames == 1)
+        detect_crop(j, frame);
+    j->nb_todo = 0;
+
+    b = &j->branches[BRANCH_THUMBNAIL];
+    if (b->active)
+        j->todo[j->nb_todo++] = BRANCH_THUMBNAIL;
+    b = &j->branches[BRANCH_GIF];
+    if (b->active) {
+        // 与 gen_gif() 一致：超过 gifSeconds 秒结束，之后按帧率比隔帧取
+        if (frame->pts * av_q2d(j->st->time_base) > j->gif_seconds)
+            b->active = 0;
+        else if (!b->mctx || (j->nb_frames - 1) % j->skip_step == 0)
+            j->todo[j->nb_todo++] = BRANCH_GIF;
+    }
+
+    for (i = 0; i < j->nb_todo; i++) {
+        b = &j->branches[j->todo[i]];
+        if (av_frame_ref(b->frame, frame) < 0) {
+            b->ret = AVERROR(ENOMEM);
+            b->active = 0;
+            j->todo[i--] = j->todo[--j->nb_todo];
+        }
+    }
+    thread_pool_execute(write_branch, j, j->nb_todo);
+
+    for (i = 0; i < NB_BRANCHES; i++)
+        nb_active += j->branches[i].active;
+    return nb_active;
+}
+
+/*
+返回仍需要帧的分支数，< 0 为解码出错
+ */
+static int decode(media_job_t *j, AVFrame *frame, AVPacket *pkt)
+{
+    int ret, nb_active = 1;
+
+    ret = avcodec_send_packet(j->dec_ctx, pkt);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error sending a packet for decoding, ret:%d\n", ret);
+        return ret;
+    }
+    while (nb_active > 0) {
+        ret = avcodec_receive_frame(j->dec_ctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            break;
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error during decoding, ret:%d\n", ret);
+            return ret;
+        }
+        nb_active = fan_out(j, frame);
+        av_frame_unref(frame);
+    }
+    return nb_active;
+}
+
+void gen_media_opts_default(gen_media_opts_t* opts)
+{
+    gen_thumbnail_opts_default(&opts->thumbnail);
+    gen_gif_opts_default(&opts->gif);
+}
+
+/*
+一遍生成缩略图、GIF 与媒体信息
+    - thumbBuf 为 NULL 时不生成缩略图，参数同 gen_thumbnail()
+    - gifBuf 为 NULL 时不生成 GIF，参数同 gen_gif()
+    - info 为 NULL 时不返回媒体信息
+opts 为 NULL 时使用默认选项
+某个输出失败不影响其他输出，没生成的输出大小为 0；返回 0 表示全部成功，否则返回第一个错误
+ */
+int gen_media(void* data, int data_size,
+              const char* thumbFormat, const int thumbWidth, void* thumbBuf, int thumbBufLen, int *thumbSize,
+              const int gifSeconds, const int rotate, void* gifBuf, int gifBufLen, int *gifSize,
+              media_info_t* info, const gen_media_opts_t* opts)
+{
+    AVFormatContext *fmt_ctx = NULL;
+    AVIOContext *pb = NULL;
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL;
+    unsigned char *indata = NULL;
+    media_job_t *j = NULL;
+    gen_media_opts_t def_opts;
+    frame_pool_stats_t mem_stats; // 本次请求的帧缓存统计
+    int64_t max_pixels;
+    int ret, i, idx = -1, nb_active;
+
+    if (!opts) {
+        gen_media_opts_default(&def_opts);
+        opts = &def_opts;
+    }
+    max_pixels = opts->thumbnail.max_pixels > 0 ? opts->thumbnail.max_pixels : k_max_pixels;
+    if (thumbSize)
+        *thumbSize = 0;
+    if (gifSize)
+        *gifSize = 0;
+    if (info)
+        memset(info, 0, sizeof(*info));
+    frame_pool_stats_begin(&mem_stats);
+
+    j = (media_job_t *)av_mallocz(sizeof(*j));
+    fmt_ctx = avformat_alloc_context();
+    indata = (unsigned char *)av_malloc(data_size);
+    if (!j || !fmt_ctx || !indata) {
+        av_log(NULL, AV_LOG_ERROR, "Could not alloc input\n");
+        av_free(indata);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    memcpy(indata, data, data_size);
+    pb = avio_alloc_context(indata, data_size, 0, NULL, NULL, NULL, NULL);
+    if (!pb) {
+        av_log(NULL, AV_LOG_ERROR, "Could not alloc io context\n");
+        av_free(indata);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    fmt_ctx->pb = pb;
+    // 打开失败时 fmt_ctx 会被释放，pb 由这里释放
+    if ((ret = avformat_open_input(&fmt_ctx, NULL, NULL, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open input data\n");
+        goto end;
+    }
+    if ((ret = find_stream_info(fmt_ctx, max_pixels)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not find stream information\n");
+        goto end;
+    }
+    if (info)
+        read_info(fmt_ctx, info);
+
+    j->opts = opts;
+    j->stats = &mem_stats;
+    j->thumb_format = thumbFormat;
+    j->thumb_width = thumbWidth;
+    j->gif_seconds = gifSeconds;
+    j->rotate = rotate;
+    for (i = 0; i < NB_BRANCHES; i++)
+        muxing_opts_default(&j->branches[i].mopts);
+    if (thumbBuf) {
+        branch_t *b = &j->branches[BRANCH_THUMBNAIL];
+        b->active = 1;
+        b->mopts.max_bytes = opts->thumbnail.max_bytes;
+        b->mopts.watermark = opts->thumbnail.watermark;
+        b->mopts.watermark_size = opts->thumbnail.watermark_size;
+        b->mopts.watermark_position = opts->thumbnail.watermark_position;
+        b->mopts.watermark_percent = opts->thumbnail.watermark_percent;
+    }
+    if (gifBuf) {
+        branch_t *b = &j->branches[BRANCH_GIF];
+        b->active = 1;
+        if (opts->gif.native_writer || opts->gif.lossy > 0)
+            b->mopts.gif_writer = MUXING_GIF_WRITER_NATIVE;
+        b->mopts.gif_lossy = opts->gif.lossy;
+        b->mopts.max_bytes = opts->gif.max_bytes;
+        // 自带的写出器、有损压缩与字节预算都建立在自适应调色板上
+        b->mopts.palette = opts->gif.palette;
+        if (!b->mopts.palette && (opts->gif.native_writer || opts->gif.lossy > 0 || opts->gif.max_bytes > 0))
+            b->mopts.palette = MUXING_PALETTE_GLOBAL;
+        b->mopts.watermark = opts->gif.watermark;
+        b->mopts.watermark_size = opts->gif.watermark_size;
+        b->mopts.watermark_position = opts->gif.watermark_position;
+        b->mopts.watermark_percent = opts->gif.watermark_percent;
+        b->mopts.expected_frames = gifSeconds * k_gif_framerate;
+    }
+    // 只要媒体信息时不解码
+    ret = 0;
+    if (!thumbBuf && !gifBuf)
+        goto end;
+
+    if ((ret = open_codec_context(&j->dec_ctx, &idx, fmt_ctx, max_pixels)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open codec context\n");
+        goto end;
+    }
+    j->st = fmt_ctx->streams[idx];
+    // 视频与 GIF 的帧率比，转码时跳过帧的间隔数
+    j->skip_step = j->dec_ctx->framerate.den > 0 ? j->dec_ctx->framerate.num / j->dec_ctx->framerate.den / k_gif_framerate : 0;
+    if (j->skip_step <= 0)
+        j->skip_step = 1;
+
+    pkt = av_packet_alloc();
+    frame = av_frame_alloc();
+    j->filt_frame = av_frame_alloc();
+    for (i = 0; i < NB_BRANCHES; i++)
+        j->branches[i].frame = av_frame_alloc();
+    if (!pkt || !frame || !j->filt_frame || !j->branches[BRANCH_THUMBNAIL].frame || !j->branches[BRANCH_GIF].frame) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate video frame\n");
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    // 所有分支都写完后不再读包
+    nb_active = 1;
+    while (nb_active > 0 && av_read_frame(fmt_ctx, pkt) >= 0) {
+        if (pkt->size && pkt->stream_index == idx) {
+            nb_active = decode(j, frame, pkt);
+            if (nb_active < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Error while decoding,err:%d\n", nb_active);
+                break;
+            }
+        }
+        av_packet_unref(pkt);
+    }
+    av_packet_unref(pkt);
+    // flush 解码器中剩下的帧
+    if (nb_active > 0)
+        decode(j, frame, NULL);
+    ret = nb_active < 0 ? nb_active : 0;
+
+end:
+    if (j) {
+        // 没有拿到任何帧的分支，muxing_end() 返回错误；失败的分支仍要收尾释放，但输出不完整，大小置 0
+        if (thumbBuf) {
+            int r = muxing_end(j->branches[BRANCH_THUMBNAIL].mctx, thumbBuf, thumbBufLen, thumbSize);
+            if (j->branches[BRANCH_THUMBNAIL].ret < 0)
+                r = j->branches[BRANCH_THUMBNAIL].ret;
+            if (r < 0 && thumbSize)
+                *thumbSize = 0;
+            if (ret >= 0)
+                ret = r;
+        }
+        if (gifBuf) {
+            int r = muxing_end(j->branches[BRANCH_GIF].mctx, gifBuf, gifBufLen, gifSize);
+            if (j->branches[BRANCH_GIF].ret < 0)
+                r = j->branches[BRANCH_GIF].ret;
+            if (r < 0 && gifSize)
+                *gifSize = 0;
+            if (ret >= 0)
+                ret = r;
+        }
+        free_filters(j->fctx);
+        av_frame_free(&j->filt_frame);
+        for (i = 0; i < NB_BRANCHES; i++)
+            av_frame_free(&j->branches[i].frame);
+        avcodec_free_context(&j->dec_ctx);
+        av_free(j);
+    }
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avformat_close_input(&fmt_ctx);
+    if (pb) {
+        av_freep(&pb->buffer);
+        av_freep(&pb);
+    }
+    frame_pool_stats_end();
+    av_log(NULL, AV_LOG_INFO, "media peak frame memory %.1f MB, buffers %d\n",
+           mem_stats.peak / 1048576.0, mem_stats.nb_allocs);
+    return ret;
+}
@@ -0,0 +1,45 @@
+
+#include <stdint.h>
+#include "gen_thumbnail.h"
+#include "gen_gif.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 媒体文件的基本信息，探测后即可得到，不需要解码
+typedef struct media_info {
+    char format_name[32]; // 封装格式的短名，如 "mov"、"matroska"
+    double duration; // 时长（秒），未知为 0
+    int64_t bit_rate; // 总码率（bit/s），未知为 0
+    int nb_streams;
+    char video_codec[32]; // 视频流的解码器名，没有视频流时为空串，以下视频字段都为 0
+    int width, height;
+    double framerate;
+    int rotate; // 元数据中的旋转角度（度）
+    char audio_codec[32]; // 音频流的解码器名，没有音频流时为空串，以下音频字段都为 0
+    int sample_rate;
+    int channels;
+} media_info_t;
+
+/*
+一遍生成多个输出时的选项，沿用单独生成时的选项结构，只用到其中适合共享一遍顺序解码的部分：
+    - 缩略图：max_pixels、max_bytes、crop、aspect_w/h、watermark*
+    - GIF：native_writer、lossy、max_bytes、palette、crop、watermark*
+需要单独 seek、单独打分或只缩放到一种尺寸的选项（best_frame、lowres、band_scale、highlight、motion_compress、
+gif_fast_path 等）不使用，需要时分别调用 gen_thumbnail2()、gen_gif2()
+ */
+typedef struct gen_media_opts {
+    gen_thumbnail_opts_t thumbnail;
+    gen_gif_opts_t gif;
+} gen_media_opts_t;
+
+void gen_media_opts_default(gen_media_opts_t* opts);
+int gen_media(void* data, int data_size,
+              const char* thumbFormat, const int thumbWidth, void* thumbBuf, int thumbBufLen, int *thumbSize,
+              const int gifSeconds, const int rotate, void* gifBuf, int gifBufLen, int *gifSize,
+              media_info_t* info, const gen_media_opts_t* opts);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,88 @@
+#ifdef __GEN_MEDIA_PROGRAM__
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "gen_media.h"
+#include "log.h"
+
+#define INBUF_SIZE (10<<20)
+#define OUTBUF_SIZE (1<<20)
+
+void Ffmpeglog(int l, char* t) {
+    if (l <= 32) {
+        fprintf(stdout, "%d\t%s\n", l, t);
+    }
+}
+
+static void write_file(const char *filename, const uint8_t *data, int size)
+{
+    FILE *f = fopen(filename, "wb");
+
+    if (!f) {
+        fprintf(stderr, "open file fail.%s", filename);
+        exit(1);
+    }
+    fwrite(data, 1, size, f);
+    fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+    char *filename, *thumbfilename, *giffilename;
+    FILE *f;
+    uint8_t *data, *thumbData, *gifData;
+    size_t   data_size, thumbfilenamelen;
+    int thumbSize, gifSize, ret;
+    media_info_t info;
+
+    set_log_callback();
+
+    if (argc <= 3) {
+        fprintf(stderr, "Usage: %s <input file> <thumbnail file> <gif file>\n", argv[0]);
+        exit(0);
+    }
+    filename      = argv[1];
+    thumbfilename = argv[2];
+    giffilename   = argv[3];
+
+    thumbfilenamelen = strlen(thumbfilename);
+    if (thumbfilenamelen < 3) {
+        fprintf(stderr, "outfilename err.%s", thumbfilename);
+        exit(1);
+    }
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        exit(1);
+    }
+
+    data = malloc(INBUF_SIZE + AV_INPUT_BUFFER_PADDING_SIZE);
+    /* set end of buffer to 0 (this ensures that no overreading happens for damaged MPEG streams) */
+    memset(data + INBUF_SIZE, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    thumbData = malloc(OUTBUF_SIZE);
+    gifData = malloc(OUTBUF_SIZE);
+
+    data_size = fread(data, 1, INBUF_SIZE, f);
+    if (!data_size)
+        exit(1);
+
+    ret = gen_media(data, data_size, &thumbfilename[thumbfilenamelen - 3], 320, thumbData, OUTBUF_SIZE, &thumbSize,
+                    5, 0, gifData, OUTBUF_SIZE, &gifSize, &info, NULL);
+    fprintf(stdout, "ret=%d format=%s duration=%.3f video=%s %dx%d audio=%s thumbnail=%d gif=%d\n",
+            ret, info.format_name, info.duration, info.video_codec, info.width, info.height, info.audio_codec,
+            thumbSize, gifSize);
+
+    write_file(thumbfilename, thumbData, thumbSize);
+    write_file(giffilename, gifData, gifSize);
+    free(thumbData);
+    free(gifData);
+    free(data);
+    fclose(f);
+
+}
+#endif
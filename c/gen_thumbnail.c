@@ -6,8 +6,53 @@
 #include <libavformat/avformat.h>
 
 #include "muxing.h"
+#include "frame_pool.h"
+#include "band_scale.h"
+#include "frame_quality.h"
+#include "smartcrop.h"
+#include "thread_pool.h"
+#include "gen_thumbnail.h"
 
-static int decode(void** mctx, const char *outformatname, const int width, AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt)
+// 默认的像素数上限，1 亿像素的 RGBA 解码帧约 400MB
+static const int64_t k_max_pixels = 100000000;
+// 候选帧数的上限
+#define BEST_FRAME_MAX 16
+// 候选帧各自打开输入时的 IO 缓存大小
+#define BEST_FRAME_IO_SIZE 32768
+
+/*
+缩放前的裁剪：opts->crop 时在 frames 上检测黑边，有 opts->aspect_w/h 时再在 frame 剩下的部分按显著性选出固定宽高比的窗口
+写入 mopts 的裁剪量，*w、*h 传入 frame 的尺寸，返回裁剪后的尺寸
+ */
+static void plan_crop(AVFrame *const *frames, int nb, const AVFrame *frame, const gen_thumbnail_opts_t *opts,
+                      muxing_opts_t *mopts, int *w, int *h)
+{
+    crop_rect_t r = {0};
+    int i;
+
+    if (opts->crop) {
+        void *cd = cropdetect_init();
+        if (cd) {
+            for (i = 0; i < nb; i++)
+                if (frames[i])
+                    cropdetect_add_frame(cd, frames[i]);
+            if (cropdetect_result(cd, &r) > 0 && (r.left + r.right >= *w || r.top + r.bottom >= *h))
+                memset(&r, 0, sizeof(r));
+            cropdetect_free(cd);
+        }
+    }
+    if (opts->aspect_w > 0 && opts->aspect_h > 0 && smartcrop(frame, opts->aspect_w, opts->aspect_h, &r) < 0)
+        av_log(NULL, AV_LOG_WARNING, "smart crop failed, keep the aspect ratio\n");
+    mopts->crop_left = r.left;
+    mopts->crop_top = r.top;
+    mopts->crop_right = r.right;
+    mopts->crop_bottom = r.bottom;
+    *w -= r.left + r.right;
+    *h -= r.top + r.bottom;
+}
+
+static int decode(void** mctx, void* bctx, const muxing_opts_t *mopts, const char *outformatname, const int width,
+                  const gen_thumbnail_opts_t *opts, AVCodecContext *dec_ctx, AVFrame *frame, AVFrame *band_frame, AVPacket *pkt)
 {
     int ret;
 
@@ -34,11 +79,23 @@ static int decode(void** mctx, const char *outformatname, const int width, AVCod
 
         // mctx 只设置一次
         if (NULL == *mctx) {
+            muxing_opts_t crop_opts = *mopts;
+            int w = frame->width, h = frame->height;
+
+            // 只有这一帧可用来检测黑边
+            plan_crop(&frame, 1, frame, opts, &crop_opts, &w, &h);
             // 音视频的解复用，而当前逻辑只处理视频，这里主要是做视频解码相关的内存分配、参数设置工作
-            *mctx = muxing_begin(outformatname, NULL, 1, width, width*frame->height/frame->width);
+            *mctx = muxing_begin2(outformatname, NULL, 1, width, width*h/w, &crop_opts);
         }
         // 将 frame 按自定义尺寸缩放，再压缩数据 packet，写入到 mctx 的输出流
-        ret = muxing_write_video(*mctx, frame);
+        // 已经边解码边缩小过的帧只需做像素格式转换
+        ret = band_scale_take(bctx, frame, band_frame);
+        if (ret > 0) {
+            ret = muxing_write_video(*mctx, band_frame);
+            av_frame_unref(band_frame);
+        } else if (ret == 0) {
+            ret = muxing_write_video(*mctx, frame);
+        }
         if (ret < 0)
             break;
     }
@@ -53,8 +110,40 @@ static int decode(void** mctx, const char *outformatname, const int width, AVCod
 stream_idx　缩略图在视频中的流索引
 dec_ctx 解码器上下文，找到的合适的解码器codec后，分配解码器上下文，解码器句柄赋值于 dec_ctx->codec
  */
-static int open_codec_context(int *stream_idx,
-                              AVCodecContext **dec_ctx, AVFormatContext *fmt_ctx, enum AVMediaType type)
+/*
+检查源图尺寸并选择 lowres
+帧内编码的格式按 1/2^n 分辨率解码时不会有参考帧误差的累积，在不小于缩略图尺寸的前提下取最大的 n
+lowres 之后仍超过像素数上限时报错，避免解码整帧时内存耗尽
+ */
+static int limit_size(AVCodecContext *dec_ctx, const AVCodec *dec, const gen_thumbnail_opts_t *opts, int width)
+{
+    const AVCodecDescriptor *desc = avcodec_descriptor_get(dec->id);
+    int64_t max_pixels = opts->max_pixels > 0 ? opts->max_pixels : k_max_pixels;
+    int w = dec_ctx->width, h = dec_ctx->height, l = 0;
+
+    // 解码器自身也检查，能拦住头部没有尺寸、或者中途变大的流
+    dec_ctx->max_pixels = max_pixels;
+    if (w <= 0 || h <= 0)
+        return 0;
+
+    if (opts->lowres && desc && (desc->props & AV_CODEC_PROP_INTRA_ONLY)) {
+        int th = FFMAX(width * h / w, 1);
+        while (l < dec->max_lowres && AV_CEIL_RSHIFT(w, l + 1) >= width && AV_CEIL_RSHIFT(h, l + 1) >= th)
+            l++;
+    }
+    if ((int64_t)AV_CEIL_RSHIFT(w, l) * AV_CEIL_RSHIFT(h, l) > max_pixels) {
+        av_log(NULL, AV_LOG_ERROR, "Image %dx%d exceeds max pixels %"PRId64"\n", w, h, max_pixels);
+        return AVERROR(ERANGE);
+    }
+    if (l > 0)
+        av_log(NULL, AV_LOG_INFO, "lowres %d: %dx%d -> %dx%d\n", l, w, h, AV_CEIL_RSHIFT(w, l), AV_CEIL_RSHIFT(h, l));
+    dec_ctx->lowres = l;
+    return 0;
+}
+
+static int open_codec_context(int *stream_idx, AVCodecContext **dec_ctx, void **bctx,
+                              const gen_thumbnail_opts_t *opts, int width,
+                              AVFormatContext *fmt_ctx, enum AVMediaType type)
 {
     int ret, stream_index; // 整型的返回值、流索引
     AVStream *st; // AV 流的指针
@@ -93,6 +182,20 @@ static int open_codec_context(int *stream_idx,
             return ret;
         }
 
+        // 解码帧的缓存从进程级的缓存池中获取，回调本身是线程安全的
+        (*dec_ctx)->get_buffer2 = frame_pool_get_buffer2;
+        (*dec_ctx)->thread_safe_callbacks = 1;
+
+        if ((ret = limit_size(*dec_ctx, dec, opts, width)) < 0)
+            return ret;
+
+        // 边解码边缩小，目标尺寸与 decode() 中 muxing_begin() 的一致；要裁剪时尺寸要等解码后才知道
+        if (opts->band_scale && !opts->crop && !(opts->aspect_w > 0 && opts->aspect_h > 0) && (*dec_ctx)->width > 0) {
+            int w = AV_CEIL_RSHIFT((*dec_ctx)->width, (*dec_ctx)->lowres);
+            int h = AV_CEIL_RSHIFT((*dec_ctx)->height, (*dec_ctx)->lowres);
+            *bctx = band_scale_init(*dec_ctx, width, width * h / w, NULL, NULL);
+        }
+
         // 初始化解码器
         if ((ret = avcodec_open2(*dec_ctx, dec, NULL)) < 0) {
             av_log(NULL, AV_LOG_ERROR, "Failed to open %s codec\n",
@@ -104,11 +207,258 @@ static int open_codec_context(int *stream_idx,
 
     return 0;
 }
+// 探测流信息时也可能解码一帧，同样限制像素数
+static int find_stream_info(AVFormatContext *fmt_ctx, int64_t max_pixels)
+{
+    AVDictionary **stream_opts;
+    unsigned int i;
+    int ret;
+
+    stream_opts = (AVDictionary **)av_mallocz_array(fmt_ctx->nb_streams, sizeof(*stream_opts));
+    if (!stream_opts)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < fmt_ctx->nb_streams; i++)
+        av_dict_set_int(&stream_opts[i], "max_pixels", max_pixels, 0);
+    ret = avformat_find_stream_info(fmt_ctx, stream_opts);
+    for (i = 0; i < fmt_ctx->nb_streams; i++)
+        av_dict_free(&stream_opts[i]);
+    av_free(stream_opts);
+    return ret;
+}
+
+/*
+挑选最佳帧
+在 [0, span) 内均匀取 nb 个时刻，各自 seek 到之前最近的关键帧解码一帧，按 frame_quality() 打分
+候选之间互不依赖，每个候选单独打开输入与解码器，在线程池中并行；输入数据只读共享，不为每个候选复制
+ */
+typedef struct mem_input {
+    const uint8_t *data;
+    int size;
+    int64_t pos;
+} mem_input_t;
+
+static int mem_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    mem_input_t *in = (mem_input_t *)opaque;
+    int n = (int)FFMIN(buf_size, in->size - in->pos);
+
+    if (n <= 0)
+        return AVERROR_EOF;
+    memcpy(buf, in->data + in->pos, n);
+    in->pos += n;
+    return n;
+}
+
+static int64_t mem_seek(void *opaque, int64_t offset, int whence)
+{
+    mem_input_t *in = (mem_input_t *)opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return in->size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += in->pos;
+        break;
+    case SEEK_END:
+        offset += in->size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (offset < 0 || offset > in->size)
+        return AVERROR(EINVAL);
+    in->pos = offset;
+    return offset;
+}
+
+typedef struct best_frame_job {
+    const uint8_t *data;
+    int size;
+    const gen_thumbnail_opts_t *opts;
+    int width;
+    double span; // 候选分布的时长（秒）
+    frame_pool_stats_t *stats; // 请求的帧缓存统计，任务在其他线程上也记到这里
+    AVFrame *frames[BEST_FRAME_MAX]; // 解码出的候选帧，失败的为 NULL
+    frame_quality_t quality[BEST_FRAME_MAX];
+} best_frame_job_t;
+
+// 解码第 job 个候选帧，失败只让这个候选落选，不影响其他候选
+static int decode_candidate(void *arg, int job, int nb_jobs)
+{
+    best_frame_job_t *j = (best_frame_job_t *)arg;
+    frame_pool_stats_t *prev_stats = frame_pool_stats_attach(j->stats);
+    gen_thumbnail_opts_t opts = *j->opts;
+    mem_input_t in = { j->data, j->size, 0 };
+    AVFormatContext *fmt_ctx = NULL;
+    AVIOContext *pb = NULL;
+    AVCodecContext *dec_ctx = NULL;
+    void *bctx = NULL;
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL;
+    uint8_t *iobuf = NULL;
+    int ret, idx = -1, got = 0;
+    double t = j->span * (job + 0.5) / nb_jobs;
+
+    // 候选帧只打分，选中后由 muxing 整帧缩放，不需要边解码边缩小
+    opts.band_scale = 0;
+    iobuf = (uint8_t *)av_malloc(BEST_FRAME_IO_SIZE);
+    if (iobuf)
+        pb = avio_alloc_context(iobuf, BEST_FRAME_IO_SIZE, 0, &in, mem_read, NULL, mem_seek);
+    fmt_ctx = avformat_alloc_context();
+    pkt = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!pb || !fmt_ctx || !pkt || !frame) {
+        if (!pb)
+            av_free(iobuf);
+        avformat_free_context(fmt_ctx);
+        fmt_ctx = NULL;
+        goto end;
+    }
+    fmt_ctx->pb = pb;
+    // 失败时 fmt_ctx 已被释放并置 NULL，pb 仍由这里释放
+    if (avformat_open_input(&fmt_ctx, NULL, NULL, NULL) < 0)
+        goto end;
+    if (find_stream_info(fmt_ctx, opts.max_pixels > 0 ? opts.max_pixels : k_max_pixels) < 0 ||
+        open_codec_context(&idx, &dec_ctx, &bctx, &opts, j->width, fmt_ctx, AVMEDIA_TYPE_VIDEO) < 0)
+        goto end;
+
+    if (t > 0) {
+        AVStream *st = fmt_ctx->streams[idx];
+        int64_t ts = av_rescale_q((int64_t)(t * AV_TIME_BASE), AV_TIME_BASE_Q, st->time_base);
+        if (st->start_time != AV_NOPTS_VALUE)
+            ts += st->start_time;
+        if (av_seek_frame(fmt_ctx, idx, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+            av_log(NULL, AV_LOG_WARNING, "best frame candidate %d: seek to %.2fs failed\n", job, t);
+            goto end;
+        }
+    }
+
+    while (!got) {
+        ret = av_read_frame(fmt_ctx, pkt);
+        if (ret >= 0 && pkt->stream_index != idx) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        // 读完时送空包 flush，取出解码器里剩下的帧
+        ret = avcodec_send_packet(dec_ctx, ret >= 0 ? pkt : NULL);
+        av_packet_unref(pkt);
+        if (ret < 0 && ret != AVERROR_EOF)
+            break;
+        ret = avcodec_receive_frame(dec_ctx, frame);
+        if (ret >= 0)
+            got = 1;
+        else if (ret != AVERROR(EAGAIN))
+            break;
+    }
+    if (got && frame_quality(frame, &j->quality[job]) >= 0) {
+        j->frames[job] = frame;
+        frame = NULL;
+    }
+
+end:
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec_ctx);
+    band_scale_free(bctx);
+    avformat_close_input(&fmt_ctx);
+    if (pb) {
+        av_freep(&pb->buffer);
+        av_freep(&pb);
+    }
+    frame_pool_stats_attach(prev_stats);
+    return 0;
+}
+
+/*
+视频流的时长（秒），未知时返回 0
+ */
+static double stream_duration(AVFormatContext *fmt_ctx, int idx)
+{
+    AVStream *st = fmt_ctx->streams[idx];
+
+    if (st->duration > 0 && st->duration != AV_NOPTS_VALUE)
+        return st->duration * av_q2d(st->time_base);
+    if (fmt_ctx->duration > 0 && fmt_ctx->duration != AV_NOPTS_VALUE)
+        return fmt_ctx->duration / (double)AV_TIME_BASE;
+    return 0;
+}
+
+/*
+选出最佳帧并写入 *mctx，返回 1；视频时长未知或候选全部失败时返回 0，由调用者按原来的方式取第一帧
+ */
+static int best_frame(void **mctx, const muxing_opts_t *mopts, const char *outformatname, int width,
+                      const void *data, int data_size, AVFormatContext *fmt_ctx, int idx,
+                      const gen_thumbnail_opts_t *opts, frame_pool_stats_t *stats)
+{
+    best_frame_job_t *job;
+    double span = stream_duration(fmt_ctx, idx);
+    int nb = FFMIN(opts->best_frame, BEST_FRAME_MAX), best = -1, i, ret = 0;
+
+    if (span <= 0)
+        return 0;
+    if (opts->best_frame_seconds > 0)
+        span = FFMIN(span, opts->best_frame_seconds);
+
+    job = (best_frame_job_t *)av_mallocz(sizeof(*job));
+    if (!job)
+        return AVERROR(ENOMEM);
+    job->data = (const uint8_t *)data;
+    job->size = data_size;
+    job->opts = opts;
+    job->width = width;
+    job->span = span;
+    job->stats = stats;
+    thread_pool_execute(decode_candidate, job, nb);
+
+    for (i = 0; i < nb; i++) {
+        if (!job->frames[i])
+            continue;
+        av_log(NULL, AV_LOG_DEBUG, "best frame candidate %d: score %.3f brightness %.1f contrast %.1f "
+               "sharpness %.1f colorfulness %.1f\n", i, job->quality[i].score, job->quality[i].brightness,
+               job->quality[i].contrast, job->quality[i].sharpness, job->quality[i].colorfulness);
+        if (best < 0 || job->quality[i].score > job->quality[best].score)
+            best = i;
+    }
+    if (best >= 0) {
+        AVFrame *frame = job->frames[best];
+        muxing_opts_t crop_opts = *mopts;
+        int w = frame->width, h = frame->height;
+
+        av_log(NULL, AV_LOG_INFO, "best frame: candidate %d/%d at %.2fs, score %.3f\n",
+               best, nb, span * (best + 0.5) / nb, job->quality[best].score);
+        // 黑边在各候选帧上取并集，比只看一帧可靠
+        plan_crop(job->frames, nb, frame, opts, &crop_opts, &w, &h);
+        // 与 decode() 一致，时间戳改为解码计数
+        frame->pts = 1;
+        *mctx = muxing_begin2(outformatname, NULL, 1, width, width * h / w, &crop_opts);
+        ret = muxing_write_video(*mctx, frame) < 0 ? -1 : 1;
+    }
+    for (i = 0; i < nb; i++)
+        av_frame_free(&job->frames[i]);
+    av_free(job);
+    return ret;
+}
+
+void gen_thumbnail_opts_default(gen_thumbnail_opts_t* opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->max_pixels = k_max_pixels;
+    opts->lowres = 1;
+}
+
+int gen_thumbnail(const char* formatname, const int width, void* data, int data_size, void* outbuff, int outbufflen, int *outsz)
+{
+    return gen_thumbnail2(formatname, width, data, data_size, outbuff, outbufflen, outsz, NULL);
+}
+
 /* 
 生成缩略图
 对ffmpeg支持的视频或图片格式的文件
+opts 为 NULL 时使用默认选项
  */
-int gen_thumbnail(const char* formatname, const int width, void* data, int data_size, void* outbuff, int outbufflen, int *outsz)
+int gen_thumbnail2(const char* formatname, const int width, void* data, int data_size, void* outbuff, int outbufflen, int *outsz, const gen_thumbnail_opts_t* opts)
 {
     AVCodecContext *video_dec_ctx = NULL; // 解码器上下文
     AVFormatContext *fmt_ctx = NULL; // AV 格式上下文
@@ -118,6 +468,23 @@ int gen_thumbnail(const char* formatname, const int width, void* data, int data_
     AVPacket *pkt = NULL; // AV 视频的压缩数据包的指针
     void* mctx = NULL; // 多路复用相关处理的指针，ffmpeg 中 视频文件输入后，会被"解复用 demux"为音频流与视频流，两者同时处理
     unsigned char *indata = NULL; // avcodec 的输入的指针
+    void* bctx = NULL; // 边解码边缩小的上下文
+    AVFrame *band_frame = NULL; // 边解码边缩小的结果
+    gen_thumbnail_opts_t def_opts;
+    muxing_opts_t mopts;
+    frame_pool_stats_t mem_stats; // 本次请求的帧缓存统计
+
+    if (!opts) {
+        gen_thumbnail_opts_default(&def_opts);
+        opts = &def_opts;
+    }
+    muxing_opts_default(&mopts);
+    mopts.max_bytes = opts->max_bytes;
+    mopts.watermark = opts->watermark;
+    mopts.watermark_size = opts->watermark_size;
+    mopts.watermark_position = opts->watermark_position;
+    mopts.watermark_percent = opts->watermark_percent;
+    frame_pool_stats_begin(&mem_stats);
 
     // 分配相关的内存
     fmt_ctx = avformat_alloc_context();
@@ -148,13 +515,14 @@ int gen_thumbnail(const char* formatname, const int width, void* data, int data_
 
     /* retrieve stream information */
     // 为了防止某些文件格式没有 header，于是从数据流中读取文件格式
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+    if (find_stream_info(fmt_ctx, opts->max_pixels > 0 ? opts->max_pixels : k_max_pixels) < 0) {
         av_log(NULL, AV_LOG_ERROR, "Could not find stream information\n");
         goto clean2;
     }
 
     // 找到第一个视频流的索引，获得解码器ID
-    if (open_codec_context(&video_stream_idx, &video_dec_ctx, fmt_ctx, AVMEDIA_TYPE_VIDEO) < 0) {
+    if (open_codec_context(&video_stream_idx, &video_dec_ctx, &bctx, opts, width,
+                           fmt_ctx, AVMEDIA_TYPE_VIDEO) < 0) {
         av_log(NULL, AV_LOG_ERROR, "Could not open codec context\n");
         goto clean3;
     }
@@ -166,11 +534,23 @@ int gen_thumbnail(const char* formatname, const int width, void* data, int data_
 
     // 分配 AV 帧 的内存，返回指针
     frame = av_frame_alloc();
-    if (!frame) {
+    band_frame = av_frame_alloc();
+    if (!frame || !band_frame) {
         av_log(NULL, AV_LOG_ERROR, "Could not allocate video frame\n");
         goto clean4;
     }
 
+    // 在多个候选帧中挑选画面质量最好的一帧
+    if (opts->best_frame > 1) {
+        ret = best_frame(&mctx, &mopts, formatname, width, data, data_size, fmt_ctx, video_stream_idx,
+                         opts, &mem_stats);
+        if (ret != 0) {
+            if (ret < 0)
+                av_log(NULL, AV_LOG_ERROR, "Error while writing best frame,err:%d\n", ret);
+            goto clean5;
+        }
+    }
+
     // 读取音视频文件流，获得下一帧数据的（一个原始的压缩数据包 packet）
     // get the next frame of a stream.
     while (av_read_frame(fmt_ctx, pkt) >= 0) {
@@ -181,7 +561,7 @@ int gen_thumbnail(const char* formatname, const int width, void* data, int data_
                 av_packet_unref(pkt);
                 continue;
             }
-            ret = decode(&mctx, formatname, width, video_dec_ctx, frame, pkt);
+            ret = decode(&mctx, bctx, &mopts, formatname, width, opts, video_dec_ctx, frame, band_frame, pkt);
             av_frame_unref(frame);
             av_packet_unref(pkt);
             if (ret < 0) {
@@ -198,15 +578,16 @@ int gen_thumbnail(const char* formatname, const int width, void* data, int data_
     // 缩略图片失败，flush output stream
     // packet = NULL 输入，触发解码器进行 flush interleaving queue
     // 题外话: 解码过程中，解出的 frame 可能是乱序的，解码器会确保它排序正确
-    decode(&mctx, formatname, width, video_dec_ctx, frame, NULL);
+    decode(&mctx, bctx, &mopts, formatname, width, opts, video_dec_ctx, frame, band_frame, NULL);
 
 // 清理工作，设置不同阶段的tag, 以便 goto 跳转
 clean5:
     // 结束视频解码工作，将缩略图的数据 memcpy 到 用户分配的 outbuff 指针上
     ret = muxing_end(mctx, outbuff, outbufflen, outsz);
+clean4:
     // 回收 tmp frame 内存
     av_frame_free(&frame);
-clean4:
+    av_frame_free(&band_frame);
     // 回收 tmp packet 内存
     av_packet_free(&pkt);
 clean3:
@@ -214,6 +595,7 @@ clean3:
     if (NULL != video_dec_ctx) {
         avcodec_free_context(&video_dec_ctx);
     }
+    band_scale_free(bctx);
 clean2:
     // 回收 AV pointer
     av_freep(&fmt_ctx->pb->buffer);
@@ -222,6 +604,11 @@ clean1:
     // 回收 AV format 的信息
     avformat_close_input(&fmt_ctx);
 end:
+    frame_pool_stats_end();
+    av_log(NULL, AV_LOG_INFO, "thumbnail peak frame memory %.1f MB, buffers %d\n",
+            mem_stats.peak / 1048576.0, mem_stats.nb_allocs);
+    if (opts->peak_mem)
+        *opts->peak_mem = mem_stats.peak;
     return ret;
 }
 
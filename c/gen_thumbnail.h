@@ -1,8 +1,27 @@
+#include <stdint.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct gen_thumbnail_opts {
+    int band_scale; // 解码器支持时，在 draw_horiz_band 回调中边解码边缩小
+    int64_t max_pixels; // 源图（lowres 之后）的像素数上限，超过时直接报错，0 表示默认值
+    int lowres; // 帧内编码的格式（JPEG 等）按 1/2^n 分辨率解码，只要不小于缩略图尺寸，0 关闭
+    int64_t *peak_mem; // 非 NULL 时返回本次请求帧缓存占用的峰值（字节）
+    int max_bytes; // 输出大小的上限，JPEG 超出时提高 qscale 重新编码一次，通常取 outbufflen，0 不限制
+    int best_frame; // 大于 1 时在视频中均匀取这么多个候选关键帧并行解码，按画面质量打分后只编码得分最高的一帧，0 关闭
+    double best_frame_seconds; // 候选帧分布在开头这么多秒内，0 表示整个视频
+    int crop; // 非 0 时检测画面中的黑边（有候选帧时在所有候选帧上检测），缩放前裁掉，此时不边解码边缩小
+    int aspect_w, aspect_h; // 都大于 0 时输出固定的宽高比（如 1:1、16:9）：按显著性选出这个宽高比的窗口，只缩放窗口内的部分
+    const void *watermark; // 水印图片的文件数据（PNG 等，可带透明度），NULL 不加，在编码前叠加到输出帧上
+    int watermark_size;
+    int watermark_position; // WATERMARK_*（watermark.h），默认右下角
+    int watermark_percent; // 水印宽度占输出宽度的百分比，0 为默认值
+} gen_thumbnail_opts_t;
+
+void gen_thumbnail_opts_default(gen_thumbnail_opts_t* opts);
 int gen_thumbnail(const char* formatname, const int width, void* data, int data_size, void* outbuff, int outbufflen, int *outsz);
+int gen_thumbnail2(const char* formatname, const int width, void* data, int data_size, void* outbuff, int outbufflen, int *outsz, const gen_thumbnail_opts_t* opts);
 
 
 #ifdef __cplusplus
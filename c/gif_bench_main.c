@@ -0,0 +1,257 @@
+#ifdef __GIF_BENCH_PROGRAM__
+/*
+GIF 编码与封装：libavcodec + libavformat 与自带写出器（gif_writer.c）的对比
+
+语料为固定的 50 帧 320x180（即 5fps 下 10 秒的 GIF）：缓慢平移的渐变背景、移动的方块，
+以及每帧随机变化的一小块噪声区，覆盖整帧编码、变化区域裁剪两种情况。
+两条路径输入相同的 PAL8 帧（255 色的自适应调色板 + 有序抖动，留出透明色），分别统计编码与封装的耗时、输出大小，
+自带写出器另外对比不使用透明色（只裁剪变化的矩形）与有损（lossy 80）的结果，
+并用 libavcodec 的 gif 解码器解出自带写出器的输出，逐像素与输入比较。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+
+#include "frame_pool.h"
+#include "gif_writer.h"
+#include "palette.h"
+
+#define WIDTH 320
+#define HEIGHT 180
+#define NB_FRAMES 50
+#define FRAMERATE 5
+#define ITERATIONS 10
+#define LOSSY 80
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static AVFrame *new_frame(int fmt, int w, int h)
+{
+    AVFrame *f = av_frame_alloc();
+    f->format = fmt;
+    f->width = w;
+    f->height = h;
+    if (frame_pool_get_frame(f) < 0) {
+        fprintf(stderr, "alloc frame fail\n");
+        exit(1);
+    }
+    return f;
+}
+
+static void fill_corpus(AVFrame *f, int n)
+{
+    int x, y;
+    unsigned seed = 12345 + n;
+
+    for (y = 0; y < HEIGHT; y++) {
+        uint8_t *p = f->data[0] + y * f->linesize[0];
+        for (x = 0; x < WIDTH; x++, p += 3) {
+            int inbox = x >= 40 + 4 * n && x < 90 + 4 * n && y >= 60 && y < 110;
+            int noise = x >= 250 && y >= 130;
+            if (noise) {
+                seed = seed * 1103515245 + 12345;
+                p[0] = p[1] = p[2] = (seed >> 16) & 0xFF;
+            } else if (inbox) {
+                p[0] = 220;
+                p[1] = 40 + 2 * n;
+                p[2] = 40;
+            } else {
+                p[0] = (x + n) * 255 / (WIDTH + NB_FRAMES);
+                p[1] = y * 255 / HEIGHT;
+                p[2] = 128;
+            }
+        }
+    }
+}
+
+static AVFrame **build_corpus(void)
+{
+    AVFrame **pal = (AVFrame **)calloc(NB_FRAMES, sizeof(AVFrame *));
+    AVFrame *rgb[NB_FRAMES];
+    void *p = palette_init(GIF_TRANSPARENT_INDEX);
+    int i;
+
+    for (i = 0; i < NB_FRAMES; i++) {
+        rgb[i] = new_frame(AV_PIX_FMT_RGB24, WIDTH, HEIGHT);
+        fill_corpus(rgb[i], i);
+        palette_add_frame(p, rgb[i], 0);
+    }
+    printf("palette %d colors\n", palette_build(p));
+    for (i = 0; i < NB_FRAMES; i++) {
+        pal[i] = new_frame(AV_PIX_FMT_PAL8, WIDTH, HEIGHT);
+        palette_map(p, rgb[i], pal[i], PALETTE_DITHER_ORDERED);
+        pal[i]->pts = i;
+        av_frame_free(&rgb[i]);
+    }
+    palette_free(p);
+    return pal;
+}
+
+static void report(const char *name, double ms, int size)
+{
+    printf("%-8s %8.3f ms/frame %8.1f Mpix/s  %8d bytes\n", name, ms / NB_FRAMES,
+            (double)WIDTH * HEIGHT * NB_FRAMES / ms / 1e3, size);
+}
+
+static int bench_lavc(AVFrame **frames, uint8_t **out)
+{
+    AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_GIF);
+    AVFormatContext *oc = NULL;
+    AVCodecContext *c;
+    AVStream *st;
+    AVPacket *pkt = av_packet_alloc();
+    int i, size;
+
+    avformat_alloc_output_context2(&oc, NULL, "gif", NULL);
+    st = avformat_new_stream(oc, NULL);
+    c = avcodec_alloc_context3(codec);
+    c->width = WIDTH;
+    c->height = HEIGHT;
+    c->pix_fmt = AV_PIX_FMT_PAL8;
+    c->time_base = (AVRational){1, FRAMERATE};
+    st->time_base = c->time_base;
+    if (avcodec_open2(c, codec, NULL) < 0) {
+        fprintf(stderr, "open gif encoder fail\n");
+        exit(1);
+    }
+    avcodec_parameters_from_context(st->codecpar, c);
+    avio_open_dyn_buf(&oc->pb);
+    avformat_write_header(oc, NULL);
+    for (i = 0; i < NB_FRAMES; i++) {
+        avcodec_send_frame(c, frames[i]);
+        while (avcodec_receive_packet(c, pkt) >= 0) {
+            av_packet_rescale_ts(pkt, c->time_base, st->time_base);
+            pkt->stream_index = st->index;
+            av_interleaved_write_frame(oc, pkt);
+        }
+    }
+    av_write_trailer(oc);
+    size = avio_close_dyn_buf(oc->pb, out);
+    avcodec_free_context(&c);
+    avformat_free_context(oc);
+    av_packet_free(&pkt);
+    return size;
+}
+
+static int bench_native(AVFrame **frames, int transparent, int lossy, uint8_t **out, int **offsets)
+{
+    void *g = gif_writer_init(WIDTH, HEIGHT, lossy);
+    AVIOContext *pb = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    int i;
+
+    avio_open_dyn_buf(&pb);
+    gif_writer_header(pb, WIDTH, HEIGHT, (const uint32_t *)frames[0]->data[1], 0);
+    for (i = 0; i < NB_FRAMES; i++) {
+        if (offsets)
+            (*offsets)[i] = (int)avio_tell(pb);
+        gif_writer_frame(g, frames[i], i ? frames[i - 1] : NULL, (const uint32_t *)frames[0]->data[1],
+                         100 / FRAMERATE, transparent, pkt);
+        avio_write(pb, pkt->data, pkt->size);
+        av_packet_unref(pkt);
+    }
+    if (offsets)
+        (*offsets)[NB_FRAMES] = (int)avio_tell(pb);
+    gif_writer_trailer(pb);
+    gif_writer_free(g);
+    av_packet_free(&pkt);
+    return avio_close_dyn_buf(pb, out);
+}
+
+// 用 libavcodec 的 gif 解码器逐帧解出，与输入帧的颜色比较
+static int verify(AVFrame **frames, const uint8_t *buf, const int *offsets)
+{
+    AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_GIF);
+    AVCodecContext *c = avcodec_alloc_context3(codec);
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *out = av_frame_alloc();
+    int i, x, y, bad = 0;
+
+    avcodec_open2(c, codec, NULL);
+    for (i = 0; i < NB_FRAMES; i++) {
+        // 第一个包带上文件头
+        int start = i ? offsets[i] : 0, size = offsets[i + 1] - start;
+        av_new_packet(pkt, size);
+        memcpy(pkt->data, buf + start, size);
+        if (avcodec_send_packet(c, pkt) < 0 || avcodec_receive_frame(c, out) < 0) {
+            av_packet_unref(pkt);
+            return -1;
+        }
+        av_packet_unref(pkt);
+        for (y = 0; y < HEIGHT; y++) {
+            const uint32_t *d = (const uint32_t *)(out->data[0] + y * out->linesize[0]);
+            const uint8_t *s = frames[i]->data[0] + y * frames[i]->linesize[0];
+            const uint32_t *pal = (const uint32_t *)frames[i]->data[1];
+            for (x = 0; x < WIDTH; x++)
+                bad += (d[x] & 0xFFFFFF) != (pal[s[x]] & 0xFFFFFF);
+        }
+        av_frame_unref(out);
+    }
+    av_frame_free(&out);
+    av_packet_free(&pkt);
+    avcodec_free_context(&c);
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    AVFrame **frames;
+    uint8_t *out = NULL;
+    int offsets[NB_FRAMES + 1], *poff = offsets;
+    int i, size = 0;
+    double t;
+
+    (void)argc;
+    (void)argv;
+    frames = build_corpus();
+
+    t = now_ms();
+    for (i = 0; i < ITERATIONS; i++) {
+        av_free(out);
+        size = bench_lavc(frames, &out);
+    }
+    report("lavc", (now_ms() - t) / ITERATIONS, size);
+
+    t = now_ms();
+    for (i = 0; i < ITERATIONS; i++) {
+        av_free(out);
+        size = bench_native(frames, -1, 0, &out, NULL);
+    }
+    report("opaque", (now_ms() - t) / ITERATIONS, size);
+
+    t = now_ms();
+    for (i = 0; i < ITERATIONS; i++) {
+        av_free(out);
+        size = bench_native(frames, GIF_TRANSPARENT_INDEX, 0, &out, NULL);
+    }
+    report("native", (now_ms() - t) / ITERATIONS, size);
+
+    t = now_ms();
+    for (i = 0; i < ITERATIONS; i++) {
+        av_free(out);
+        size = bench_native(frames, GIF_TRANSPARENT_INDEX, LOSSY, &out, NULL);
+    }
+    report("lossy", (now_ms() - t) / ITERATIONS, size);
+
+    av_free(out);
+    bench_native(frames, GIF_TRANSPARENT_INDEX, 0, &out, &poff);
+    printf("native decode check: %d mismatched pixels\n", verify(frames, out, offsets));
+    av_free(out);
+
+    for (i = 0; i < NB_FRAMES; i++)
+        av_frame_free(&frames[i]);
+    free(frames);
+    frame_pool_uninit();
+    return 0;
+}
+#endif
@@ -0,0 +1,305 @@
+/*
+GIF 读取器，直接从内存中的 GIF 文件读出每帧的调色板索引，不经过 libavcodec 的解码器
+
+libavcodec 的 gif 解码器输出合成后的 RGB32 画布，调色板、处置方式、透明色等信息都丢掉了；
+这里按文件中的原样读出每一帧（gif_image_t），供 GIF 到 GIF 的缩放在调色板索引上直接处理：
+    - 交错存放的帧按行序重排
+    - 数据不足时，缺的像素补透明色（没有透明色时补 0）
+    - 图形控制扩展只作用于下一帧
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+
+#include "gif_reader.h"
+
+#define LZW_MAX_CODES 4096
+// 单帧的像素数上限，超过时按错误处理
+#define MAX_PIXELS (1 << 26)
+
+typedef struct gif_reader {
+    const uint8_t *data, *end, *p; // 文件数据与当前的读取位置
+    gif_screen_t screen;
+    uint32_t global_pal[256];
+    uint32_t local_pal[256];
+    // 下一帧的图形控制扩展
+    int disposal, transparent, delay;
+    uint8_t *codes; // 一帧拼接后的 LZW 码流
+    unsigned codes_size;
+    uint8_t *pixels, *deint; // 一帧的索引，交错帧先解到 deint 再重排
+    unsigned pixels_size, deint_size;
+    // LZW 码表：前缀、末尾像素、串长与首像素
+    uint16_t prefix[LZW_MAX_CODES];
+    uint8_t suffix[LZW_MAX_CODES];
+    uint16_t length[LZW_MAX_CODES];
+    uint8_t first[LZW_MAX_CODES];
+} gif_reader_t;
+
+static void read_palette(const uint8_t *p, uint32_t *pal, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++, p += 3)
+        pal[i] = 0xFFU << 24 | AV_RB24(p);
+}
+
+void* gif_reader_open(const uint8_t* data, int size)
+{
+    gif_reader_t *r;
+    int flags;
+
+    if (size < 13 || (memcmp(data, "GIF87a", 6) && memcmp(data, "GIF89a", 6)))
+        return NULL;
+    r = (gif_reader_t *)av_mallocz(sizeof(gif_reader_t));
+    if (!r)
+        return NULL;
+    r->data = data;
+    r->end = data + size;
+    r->screen.width = AV_RL16(data + 6);
+    r->screen.height = AV_RL16(data + 8);
+    flags = data[10];
+    r->screen.bg = data[11];
+    r->screen.loop = -1;
+    r->transparent = -1;
+    r->p = data + 13;
+    if (flags & 0x80) {
+        r->screen.nb_colors = 2 << (flags & 7);
+        if (r->end - r->p < 3 * r->screen.nb_colors) {
+            av_free(r);
+            return NULL;
+        }
+        read_palette(r->p, r->global_pal, r->screen.nb_colors);
+        r->p += 3 * r->screen.nb_colors;
+    }
+    r->screen.pal = r->global_pal;
+    return r;
+}
+
+const gif_screen_t* gif_reader_screen(void* ctx)
+{
+    return &((gif_reader_t *)ctx)->screen;
+}
+
+void gif_reader_close(void* ctx)
+{
+    gif_reader_t *r = (gif_reader_t *)ctx;
+
+    if (!r)
+        return;
+    av_free(r->codes);
+    av_free(r->pixels);
+    av_free(r->deint);
+    av_free(r);
+}
+
+// 跳过或拼接一串数据子块，out 非 NULL 时拼接到 out，返回拼接的字节数，格式错误时返回 < 0
+static int read_sub_blocks(gif_reader_t *r, uint8_t *out)
+{
+    int len = 0;
+
+    for (;;) {
+        int n;
+        if (r->p >= r->end)
+            return AVERROR_INVALIDDATA;
+        n = *r->p++;
+        if (!n)
+            return len;
+        if (r->end - r->p < n)
+            return AVERROR_INVALIDDATA;
+        if (out)
+            memcpy(out + len, r->p, n);
+        len += n;
+        r->p += n;
+    }
+}
+
+static int read_extension(gif_reader_t *r)
+{
+    int label, n;
+
+    if (r->end - r->p < 2)
+        return AVERROR_INVALIDDATA;
+    label = *r->p++;
+    n = r->p[0];
+    if (label == 0xF9 && n >= 4 && r->end - r->p >= 5) {
+        int flags = r->p[1];
+        r->disposal = flags >> 2 & 7;
+        r->delay = AV_RL16(r->p + 2);
+        r->transparent = flags & 1 ? r->p[4] : -1;
+    } else if (label == 0xFF && n == 11 && r->end - r->p >= 16 &&
+               (!memcmp(r->p + 1, "NETSCAPE2.0", 11) || !memcmp(r->p + 1, "ANIMEXTS1.0", 11)) &&
+               r->p[12] >= 3 && r->p[13] == 1) {
+        r->screen.loop = AV_RL16(r->p + 14);
+    }
+    // 扩展的数据也是子块的形式，第一个子块就是上面解析的部分
+    return read_sub_blocks(r, NULL);
+}
+
+/*
+LZW 解码到 out 的 nb_pixels 个像素，返回解出的像素数
+码流在结束码之前耗尽或遇到非法的码时停止，已解出的像素保留
+ */
+static int lzw_decode(gif_reader_t *r, const uint8_t *src, int len, int min_bits, uint8_t *out, int nb_pixels)
+{
+    const uint8_t *end = src + len;
+    const int clear = 1 << min_bits;
+    int size = min_bits + 1, next = clear + 2, old = -1, pos = 0, i;
+    uint64_t bits = 0;
+    int nbits = 0;
+
+    for (i = 0; i < clear; i++) {
+        r->suffix[i] = r->first[i] = i;
+        r->length[i] = 1;
+    }
+    while (pos < nb_pixels) {
+        int code, c, l;
+        uint8_t *p;
+
+        while (nbits < size && src < end) {
+            bits |= (uint64_t)*src++ << nbits;
+            nbits += 8;
+        }
+        if (nbits < size)
+            break;
+        code = bits & ((1 << size) - 1);
+        bits >>= size;
+        nbits -= size;
+
+        if (code == clear) {
+            size = min_bits + 1;
+            next = clear + 2;
+            old = -1;
+            continue;
+        }
+        if (code == clear + 1)
+            break;
+        if (old < 0) {
+            if (code > clear)
+                break;
+            out[pos++] = code;
+            old = code;
+            continue;
+        }
+        if (code > next || (code == next && next >= LZW_MAX_CODES))
+            break;
+        if (next < LZW_MAX_CODES) {
+            // 新串 = old 的串 + code 的首像素（code 就是新串时为 old 的首像素）
+            r->prefix[next] = old;
+            r->suffix[next] = code < next ? r->first[code] : r->first[old];
+            r->length[next] = r->length[old] + 1;
+            r->first[next] = r->first[old];
+            next++;
+            if (next == 1 << size && size < 12)
+                size++;
+        }
+        // 从串尾向前写出
+        l = r->length[code];
+        p = out + pos + l - 1;
+        for (c = code; c >= clear; c = r->prefix[c], p--)
+            if (p - out < nb_pixels)
+                *p = r->suffix[c];
+        if (p - out < nb_pixels)
+            *p = c;
+        pos = FFMIN(pos + l, nb_pixels);
+        old = code;
+    }
+    return pos;
+}
+
+// 交错帧的行序：第 1 遍每 8 行从 0 开始，第 2 遍每 8 行从 4，第 3 遍每 4 行从 2，第 4 遍每 2 行从 1
+static void deinterlace(const uint8_t *src, uint8_t *dst, int w, int h)
+{
+    static const int start[4] = { 0, 4, 2, 1 }, step[4] = { 8, 8, 4, 2 };
+    int pass, y;
+
+    for (pass = 0; pass < 4; pass++)
+        for (y = start[pass]; y < h; y += step[pass], src += w)
+            memcpy(dst + (ptrdiff_t)y * w, src, w);
+}
+
+/*
+读出下一帧，返回 1；文件结束（结尾标记或数据耗尽）时返回 0，格式错误时返回 < 0
+img 中的指针在下一次调用前有效
+ */
+int gif_reader_next(void* ctx, gif_image_t* img)
+{
+    gif_reader_t *r = (gif_reader_t *)ctx;
+
+    while (r->p < r->end) {
+        int tag = *r->p++, ret;
+
+        if (tag == 0x3B)
+            return 0;
+        if (tag == 0x21) {
+            if ((ret = read_extension(r)) < 0)
+                return ret;
+        } else if (tag == 0x2C) {
+            int flags, interlaced, nb, len, min_bits;
+            uint8_t *dst;
+
+            if (r->end - r->p < 10)
+                return AVERROR_INVALIDDATA;
+            img->x = AV_RL16(r->p);
+            img->y = AV_RL16(r->p + 2);
+            img->width = AV_RL16(r->p + 4);
+            img->height = AV_RL16(r->p + 6);
+            flags = r->p[8];
+            r->p += 9;
+            interlaced = flags & 0x40;
+            nb = img->width * img->height;
+            if (!nb || nb > MAX_PIXELS)
+                return AVERROR_INVALIDDATA;
+            img->pal = NULL;
+            img->nb_colors = 0;
+            if (flags & 0x80) {
+                img->nb_colors = 2 << (flags & 7);
+                if (r->end - r->p < 3 * img->nb_colors)
+                    return AVERROR_INVALIDDATA;
+                read_palette(r->p, r->local_pal, img->nb_colors);
+                r->p += 3 * img->nb_colors;
+                img->pal = r->local_pal;
+            }
+            if (r->p >= r->end)
+                return AVERROR_INVALIDDATA;
+            min_bits = *r->p++;
+            if (min_bits < 2 || min_bits > 8)
+                return AVERROR_INVALIDDATA;
+
+            // 码流总长不超过剩余的数据
+            av_fast_malloc(&r->codes, &r->codes_size, FFMAX(r->end - r->p, 1));
+            av_fast_malloc(&r->pixels, &r->pixels_size, nb);
+            if (interlaced)
+                av_fast_malloc(&r->deint, &r->deint_size, nb);
+            if (!r->codes || !r->pixels || (interlaced && !r->deint))
+                return AVERROR(ENOMEM);
+            if ((len = read_sub_blocks(r, r->codes)) < 0)
+                return len;
+
+            dst = interlaced ? r->deint : r->pixels;
+            ret = lzw_decode(r, r->codes, len, min_bits, dst, nb);
+            if (ret < nb)
+                memset(dst + ret, r->transparent >= 0 ? r->transparent : 0, nb - ret);
+            if (interlaced)
+                deinterlace(r->deint, r->pixels, img->width, img->height);
+
+            img->disposal = r->disposal;
+            img->transparent = r->transparent;
+            img->delay = r->delay;
+            img->min_bits = min_bits;
+            img->pixels = r->pixels;
+            img->linesize = img->width;
+            r->disposal = 0;
+            r->transparent = -1;
+            r->delay = 0;
+            return 1;
+        } else {
+            return AVERROR_INVALIDDATA;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,24 @@
+
+#include <stdint.h>
+#include "gif_writer.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 逻辑屏幕（文件头）的描述
+typedef struct gif_screen {
+    int width, height;
+    const uint32_t *pal; // 全局调色板（0xAARRGGBB）
+    int nb_colors; // 全局调色板的项数，0 表示没有
+    int bg; // 背景色索引
+    int loop; // 循环播放扩展中的次数，-1 表示没有这个扩展
+} gif_screen_t;
+
+void* gif_reader_open(const uint8_t* data, int size);
+const gif_screen_t* gif_reader_screen(void* ctx);
+int gif_reader_next(void* ctx, gif_image_t* img);
+void gif_reader_close(void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
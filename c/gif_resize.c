@@ -0,0 +1,288 @@
+/*
+GIF 到 GIF 的缩放，在调色板索引上直接进行，不解码成 RGB、不重新生成调色板、不抖动
+
+每一帧按原样保留调色板（全局或局部）、处置方式、透明色与时长，只缩放帧的矩形：
+    - 输出的每个像素 dx 固定对应源画布上的像素 map[dx]（最近邻），帧的矩形映射为 map 落在其中的输出像素，
+      各帧的矩形在输出画布上拼接得与源画布一致，合成的结果就是源动画逐帧最近邻缩放的结果
+    - 缩小后矩形不包含任何输出像素的帧，时长并入上一帧（上一帧不需要恢复画布时）
+    - BOX 时同一矩形内按覆盖的源像素平均颜色，再查调色板中最近的颜色（RGB555 缓存）
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/common.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+
+#include "gif_reader.h" // 包含了 gif_writer.h
+#include "gif_resize.h"
+
+#define LUT_SIZE (1 << 15)
+#define LUT_EMPTY 0xFFFF
+
+typedef struct resize_context {
+    int *map_x, *map_y; // 输出像素对应的源像素（最近邻）
+    int *box_x, *box_y; // 输出像素覆盖的源像素从 box[d] 到 box[d + 1]
+    uint8_t *out; // 缩放后的矩形，行距为矩形宽度
+    // BOX 的最近色缓存，调色板或透明色变化时清空
+    uint16_t lut[LUT_SIZE];
+    uint32_t lut_pal[256];
+    int lut_nb, lut_transparent;
+} resize_context_t;
+
+static void free_resize(resize_context_t *r)
+{
+    av_free(r->map_x);
+    av_free(r->map_y);
+    av_free(r->box_x);
+    av_free(r->box_y);
+    av_free(r->out);
+    av_free(r);
+}
+
+static void init_map(int *map, int *box, int src, int dst)
+{
+    int d;
+
+    for (d = 0; d < dst; d++) {
+        map[d] = (int)FFMIN(src - 1, ((int64_t)2 * d + 1) * src / (2 * dst));
+        box[d] = (int)((int64_t)d * src / dst);
+    }
+    box[dst] = src;
+}
+
+static resize_context_t *alloc_resize(int sw, int sh, int dw, int dh)
+{
+    resize_context_t *r = (resize_context_t *)av_mallocz(sizeof(resize_context_t));
+
+    if (!r)
+        return NULL;
+    r->map_x = (int *)av_malloc(sizeof(int) * dw);
+    r->map_y = (int *)av_malloc(sizeof(int) * dh);
+    r->box_x = (int *)av_malloc(sizeof(int) * (dw + 1));
+    r->box_y = (int *)av_malloc(sizeof(int) * (dh + 1));
+    r->out = (uint8_t *)av_malloc((size_t)dw * dh);
+    if (!r->map_x || !r->map_y || !r->box_x || !r->box_y || !r->out) {
+        free_resize(r);
+        return NULL;
+    }
+    init_map(r->map_x, r->box_x, sw, dw);
+    init_map(r->map_y, r->box_y, sh, dh);
+    r->lut_nb = -1;
+    return r;
+}
+
+// map 落在 [s0, s1) 中的输出像素为 [*d0, *d1)
+static void map_range(const int *map, int n, int s0, int s1, int *d0, int *d1)
+{
+    int d = 0;
+
+    while (d < n && map[d] < s0)
+        d++;
+    *d0 = d;
+    while (d < n && map[d] < s1)
+        d++;
+    *d1 = d;
+}
+
+// 调色板中与 (r, g, b) 最近的颜色，跳过透明色
+static int nearest_color(const uint32_t *pal, int nb, int transparent, int r, int g, int b)
+{
+    int i, best = 0, best_d = INT32_MAX;
+
+    for (i = 0; i < nb; i++) {
+        int dr = (int)(pal[i] >> 16 & 0xFF) - r, dg = (int)(pal[i] >> 8 & 0xFF) - g, db = (int)(pal[i] & 0xFF) - b;
+        int d = dr * dr + dg * dg + db * db;
+        if (i != transparent && d < best_d) {
+            best_d = d;
+            best = i;
+        }
+    }
+    return best;
+}
+
+static void box_rect(resize_context_t *r, const gif_image_t *img, const uint32_t *pal, int nb,
+                     int dx0, int dy0, int w, int h)
+{
+    int dx, dy;
+
+    if (nb != r->lut_nb || img->transparent != r->lut_transparent || memcmp(pal, r->lut_pal, nb * sizeof(*pal))) {
+        memset(r->lut, 0xFF, sizeof(r->lut));
+        memcpy(r->lut_pal, pal, nb * sizeof(*pal));
+        r->lut_nb = nb;
+        r->lut_transparent = img->transparent;
+    }
+    for (dy = 0; dy < h; dy++) {
+        // 覆盖的源行限制在帧的矩形内，放大时没有覆盖的行，取最近邻的一行
+        int y0 = FFMAX(r->box_y[dy0 + dy], img->y), y1 = FFMIN(r->box_y[dy0 + dy + 1], img->y + img->height);
+        uint8_t *out = r->out + (ptrdiff_t)dy * w;
+        if (y1 <= y0) {
+            y0 = r->map_y[dy0 + dy];
+            y1 = y0 + 1;
+        }
+        for (dx = 0; dx < w; dx++) {
+            int x0 = FFMAX(r->box_x[dx0 + dx], img->x), x1 = FFMIN(r->box_x[dx0 + dx + 1], img->x + img->width);
+            int sum[3] = { 0, 0, 0 }, n = 0, nt = 0, x, y, idx;
+            if (x1 <= x0) {
+                x0 = r->map_x[dx0 + dx];
+                x1 = x0 + 1;
+            }
+            for (y = y0; y < y1; y++) {
+                const uint8_t *row = img->pixels + (ptrdiff_t)(y - img->y) * img->linesize - img->x;
+                for (x = x0; x < x1; x++) {
+                    uint32_t c;
+                    if (row[x] == img->transparent) {
+                        nt++;
+                        continue;
+                    }
+                    c = row[x] < nb ? pal[row[x]] : 0;
+                    sum[0] += c >> 16 & 0xFF;
+                    sum[1] += c >> 8 & 0xFF;
+                    sum[2] += c & 0xFF;
+                    n++;
+                }
+            }
+            if (nt > n) {
+                out[dx] = img->transparent;
+                continue;
+            }
+            idx = (sum[0] / n) >> 3 << 10 | (sum[1] / n) >> 3 << 5 | (sum[2] / n) >> 3;
+            if (r->lut[idx] == LUT_EMPTY)
+                r->lut[idx] = nearest_color(pal, nb, img->transparent,
+                                            (sum[0] / n) | 4, (sum[1] / n) | 4, (sum[2] / n) | 4);
+            out[dx] = r->lut[idx];
+        }
+    }
+}
+
+static void nearest_rect(resize_context_t *r, const gif_image_t *img, int dx0, int dy0, int w, int h)
+{
+    int dx, dy;
+
+    for (dy = 0; dy < h; dy++) {
+        const uint8_t *row = img->pixels + (ptrdiff_t)(r->map_y[dy0 + dy] - img->y) * img->linesize - img->x;
+        uint8_t *out = r->out + (ptrdiff_t)dy * w;
+        for (dx = 0; dx < w; dx++)
+            out[dx] = row[r->map_x[dx0 + dx]];
+    }
+}
+
+static int required_bits(int v)
+{
+    int bits = 2;
+
+    while (bits < 8 && v >= 1 << bits)
+        bits++;
+    return bits;
+}
+
+/*
+把内存中的 GIF（data, size）缩放为 width x height 写到 pb，返回写出的帧数
+max_duration 为最长的时长（1/100 秒），之后开始的帧不再写出，0 不限制
+filter 为 GIF_RESIZE_*，lossy 同 gif_writer_init()
+源文件格式错误时返回 < 0，pb 中可能已写出部分数据，调用者应丢弃
+ */
+int gif_resize(const uint8_t* data, int size, int width, int height, int max_duration, int filter, int lossy, AVIOContext* pb)
+{
+    void *reader = gif_reader_open(data, size);
+    const gif_screen_t *screen;
+    resize_context_t *r = NULL;
+    void *writer = NULL;
+    AVPacket *pending = NULL, *pkt = NULL;
+    gif_image_t img, out;
+    int64_t elapsed = 0;
+    int ret, nb_frames = 0;
+
+    if (!reader)
+        return AVERROR_INVALIDDATA;
+    screen = gif_reader_screen(reader);
+    if (screen->width <= 0 || screen->height <= 0 || width <= 0 || height <= 0) {
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    r = alloc_resize(screen->width, screen->height, width, height);
+    writer = gif_writer_init(width, height, lossy);
+    pending = av_packet_alloc();
+    pkt = av_packet_alloc();
+    if (!r || !writer || !pending || !pkt) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while ((ret = gif_reader_next(reader, &img)) > 0) {
+        const uint32_t *pal = img.pal ? img.pal : screen->pal;
+        int nb = img.pal ? img.nb_colors : screen->nb_colors;
+        int dx0, dx1, dy0, dy1, empty;
+
+        if (max_duration > 0 && elapsed >= max_duration)
+            break;
+        if (img.x >= screen->width || img.y >= screen->height || !nb) {
+            ret = AVERROR_INVALIDDATA;
+            break;
+        }
+        map_range(r->map_x, width, img.x, img.x + img.width, &dx0, &dx1);
+        map_range(r->map_y, height, img.y, img.y + img.height, &dy0, &dy1);
+        empty = dx1 <= dx0 || dy1 <= dy0;
+        if (empty && pending->size && (pending->data[3] >> 2 & 7) < 2) {
+            // 缩小后没有像素的帧，时长并入上一帧
+            AV_WL16(pending->data + 4, av_clip_uint16(AV_RL16(pending->data + 4) + img.delay));
+            elapsed += img.delay;
+            continue;
+        }
+        // 不能合并时（第一帧或上一帧要恢复画布）写出 1 个透明的像素，画布不变
+        if (empty) {
+            dx0 = FFMIN(dx0, width - 1);
+            dy0 = FFMIN(dy0, height - 1);
+            dx1 = dx0 + 1;
+            dy1 = dy0 + 1;
+        }
+
+        out = img;
+        out.x = dx0;
+        out.y = dy0;
+        out.width = dx1 - dx0;
+        out.height = dy1 - dy0;
+        out.pixels = r->out;
+        out.linesize = out.width;
+        if (empty) {
+            out.disposal = 1;
+            out.transparent = img.transparent >= 0 ? img.transparent : 0;
+            r->out[0] = out.transparent;
+        } else if (filter == GIF_RESIZE_BOX) {
+            box_rect(r, &img, pal, nb, dx0, dy0, out.width, out.height);
+            out.min_bits = FFMAX(out.min_bits, required_bits(nb - 1));
+        } else {
+            nearest_rect(r, &img, dx0, dy0, out.width, out.height);
+        }
+        if (out.transparent >= 0)
+            out.min_bits = FFMAX(out.min_bits, required_bits(out.transparent));
+
+        if (!nb_frames)
+            gif_writer_header2(pb, width, height, screen->pal, screen->nb_colors, screen->bg, screen->loop);
+        if ((ret = gif_writer_image(writer, &out, pal, pkt)) < 0)
+            break;
+        if (pending->size)
+            avio_write(pb, pending->data, pending->size);
+        av_packet_unref(pending);
+        av_packet_move_ref(pending, pkt);
+        elapsed += img.delay;
+        nb_frames++;
+    }
+    if (ret >= 0 && !nb_frames)
+        ret = AVERROR_INVALIDDATA;
+    if (ret >= 0) {
+        avio_write(pb, pending->data, pending->size);
+        gif_writer_trailer(pb);
+        ret = nb_frames;
+    }
+end:
+    av_packet_free(&pending);
+    av_packet_free(&pkt);
+    gif_writer_free(writer);
+    if (r)
+        free_resize(r);
+    gif_reader_close(reader);
+    return ret;
+}
@@ -0,0 +1,18 @@
+
+#include <stdint.h>
+#include <libavformat/avio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 调色板索引上的缩放方式
+enum {
+    GIF_RESIZE_NEAREST = 0, // 最近邻，直接取索引
+    GIF_RESIZE_BOX,         // 对覆盖的源像素按颜色平均，再取调色板中最近的颜色；透明像素过半时为透明
+};
+
+int gif_resize(const uint8_t* data, int size, int width, int height, int max_duration, int filter, int lossy, AVIOContext* pb);
+
+#ifdef __cplusplus
+}
+#endif
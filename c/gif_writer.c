@@ -0,0 +1,458 @@
+/*
+GIF 写出器，替代 libavcodec 的 gif 编码器与 libavformat 的 gif 封装
+
+输入为 PAL8 帧（调色板见 palette.c），每帧输出一个包含图形控制扩展、图像描述符、
+可选的局部调色板与 LZW 数据的包，按顺序写在 gif_writer_header() 之后即可：
+    - LZW 的字典是 8192 项的开放寻址哈希表，每项一个 uint32（20 位键 + 12 位码），共 32KB，放得进 L1
+    - 码字在 64 位寄存器中拼接，按 32 位整字写出，最后再切成 255 字节的子块
+    - 与上一帧调色板相同时只编码变化的矩形，矩形内与上一帧相同的像素可以换成透明色，
+      使静止的部分变成连续的同一索引；比较用 SSE2 每次 16 个像素，帧之间没有其他状态，各帧可以并行编码
+    - 哈希表与码流缓冲在初始化时按帧尺寸一次分配（arena），编码过程中不再分配内存
+码表的增长与清空时机与 libavcodec 的 lzwenc 一致
+
+有损模式（lossy > 0，思路同 gifsicle 的 --lossy）：当前串加上下一个像素不在字典中时，
+在当前串的子串里找末尾颜色与这个像素足够接近的一个，用它继续延长匹配，
+码字更少、更长，输出更小，编码也更快。每个像素的误差不超过容限，透明色只做精确匹配
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avio.h>
+#include <libavutil/common.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+
+#include "gif_writer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GIF_WRITER_X86 1
+#endif
+
+#define HASH_BITS 13
+#define HASH_SIZE (1 << HASH_BITS)
+#define LZW_MIN_BITS 8
+#define LZW_CLEAR (1 << LZW_MIN_BITS)
+#define LZW_FIRST (LZW_CLEAR + 2)
+#define LZW_MAX_CODE 4095
+#define GCE_SIZE 8
+#define DESC_SIZE 10
+
+typedef struct gif_writer {
+    int width, height;
+    uint8_t *arena;
+    uint32_t *table;    // 键 (prefix << 8 | pixel) << 12 | code，0 表示空位
+    uint8_t *codes;     // 未分块的 LZW 码流
+    uint8_t *delta;     // 变化矩形内换成透明色后的像素，行距为矩形宽度
+    int codes_size;
+    int tol2;           // 有损模式下每个像素允许的 RGB 距离的平方，0 为无损
+    // 有损模式按前缀遍历子串：每个码的第一个子串、下一个兄弟与末尾像素
+    uint16_t child[LZW_MAX_CODE + 1];
+    uint16_t sibling[LZW_MAX_CODE + 1];
+    uint8_t suffix[LZW_MAX_CODE + 1];
+} gif_writer_t;
+
+// 每个像素最多输出一个不超过 12 位的码，另有清空码、结束码与整字写出的余量
+static int max_codes_size(int nb_pixels)
+{
+    int64_t nb_codes = (int64_t)nb_pixels + nb_pixels / (LZW_MAX_CODE - LZW_FIRST) + 4;
+    return (int)((nb_codes * 12 + 7) / 8) + 16;
+}
+
+/*
+lossy 为 0 时无损，否则为有损的程度，取值 1 - 200，每个像素允许的 RGB 欧氏距离为 lossy / 4
+ */
+void* gif_writer_init(int width, int height, int lossy)
+{
+    gif_writer_t *g;
+
+    if (width <= 0 || height <= 0 || (int64_t)width * height > INT_MAX / 4)
+        return NULL;
+    g = (gif_writer_t *)av_mallocz(sizeof(gif_writer_t));
+    if (!g)
+        return NULL;
+    g->width = width;
+    g->height = height;
+    gif_writer_set_lossy(g, lossy);
+    g->codes_size = max_codes_size(width * height);
+    g->arena = (uint8_t *)av_malloc(HASH_SIZE * sizeof(uint32_t) + g->codes_size + width * height);
+    if (!g->arena) {
+        av_free(g);
+        return NULL;
+    }
+    g->table = (uint32_t *)g->arena;
+    g->codes = g->arena + HASH_SIZE * sizeof(uint32_t);
+    g->delta = g->codes + g->codes_size;
+    return g;
+}
+
+// 改变之后编码的帧的有损程度，取值同 gif_writer_init()
+void gif_writer_set_lossy(void* ctx, int lossy)
+{
+    gif_writer_t *g = (gif_writer_t *)ctx;
+
+    lossy = av_clip(lossy, 0, 200);
+    g->tol2 = lossy * lossy / 16;
+}
+
+void gif_writer_free(void* ctx)
+{
+    gif_writer_t *g = (gif_writer_t *)ctx;
+
+    if (!g)
+        return;
+    av_free(g->arena);
+    av_free(g);
+}
+
+static av_always_inline uint32_t hash(uint32_t key)
+{
+    return (key * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// prefix 的子串中末尾颜色与 pixel 最接近且在容限内的一个，没有时返回 0
+static int lossy_match(const gif_writer_t *g, int prefix, int pixel, const uint32_t *pal, int transparent)
+{
+    int r = pal[pixel] >> 16 & 0xFF, gr = pal[pixel] >> 8 & 0xFF, b = pal[pixel] & 0xFF;
+    int c, best = 0, best_d = g->tol2 + 1;
+
+    if (pixel == transparent)
+        return 0;
+    for (c = g->child[prefix]; c; c = g->sibling[c]) {
+        uint32_t v = pal[g->suffix[c]];
+        int dr = (int)(v >> 16 & 0xFF) - r, dg = (int)(v >> 8 & 0xFF) - gr, db = (int)(v & 0xFF) - b;
+        int d = dr * dr + dg * dg + db * db;
+        if (d < best_d && g->suffix[c] != transparent) {
+            best_d = d;
+            best = c;
+        }
+    }
+    return best;
+}
+
+/*
+把 w x h 的像素编码为 LZW 码流，返回字节数
+min_bits 为最小码长（像素都小于 1 << min_bits），pal 与 transparent 只用于有损模式
+ */
+static int lzw_encode(gif_writer_t *g, const uint8_t *src, int linesize, int w, int h, int min_bits,
+                      const uint32_t *pal, int transparent)
+{
+    uint32_t *table = g->table;
+    uint8_t *wp = g->codes;
+    uint64_t bits = 0;
+    const int clear = 1 << min_bits, first = clear + 2;
+    int nbits = 0, code_size = min_bits + 1, next_code = first;
+    int prefix = src[0], x = 1, y;
+
+#define PUT_CODE(code) do {                         \
+        bits |= (uint64_t)(code) << nbits;          \
+        nbits += code_size;                         \
+        if (nbits >= 32) {                          \
+            AV_WL32(wp, (uint32_t)bits);            \
+            wp += 4;                                \
+            bits >>= 32;                            \
+            nbits -= 32;                            \
+        }                                           \
+    } while (0)
+
+    memset(table, 0, HASH_SIZE * sizeof(uint32_t));
+    // 新码加入时清空自己的子串链表，清空码表时只需重置根
+    memset(g->child, 0, clear * sizeof(uint16_t));
+    PUT_CODE(clear);
+    for (y = 0; y < h; y++, x = 0) {
+        const uint8_t *row = src + (ptrdiff_t)y * linesize;
+        for (; x < w; x++) {
+            uint32_t key = (uint32_t)prefix << 8 | row[x];
+            uint32_t i = hash(key), e;
+
+            while ((e = table[i]) && (e >> 12) != key)
+                i = (i + 1) & (HASH_SIZE - 1);
+            if (e) {
+                prefix = e & 0xFFF;
+                continue;
+            }
+            if (g->tol2 && (e = lossy_match(g, prefix, row[x], pal, transparent))) {
+                prefix = e;
+                continue;
+            }
+            PUT_CODE(prefix);
+            table[i] = key << 12 | next_code;
+            if (g->tol2) {
+                g->child[next_code] = 0;
+                g->sibling[next_code] = g->child[prefix];
+                g->suffix[next_code] = row[x];
+                g->child[prefix] = next_code;
+            }
+            next_code++;
+            if (next_code >= (1 << code_size) + 1)
+                code_size++;
+            if (next_code >= LZW_MAX_CODE) {
+                PUT_CODE(clear);
+                memset(table, 0, HASH_SIZE * sizeof(uint32_t));
+                memset(g->child, 0, clear * sizeof(uint16_t));
+                code_size = min_bits + 1;
+                next_code = first;
+            }
+            prefix = row[x];
+        }
+    }
+    PUT_CODE(prefix);
+    PUT_CODE(clear + 1);
+#undef PUT_CODE
+    for (; nbits > 0; nbits -= 8, bits >>= 8)
+        *wp++ = (uint8_t)bits;
+    return (int)(wp - g->codes);
+}
+
+// 容纳 nb_colors 项的调色板的位数，调色板的项数总是 2 的幂
+static int palette_bits(int nb_colors)
+{
+    int bits = 1;
+
+    while (bits < 8 && (1 << bits) < nb_colors)
+        bits++;
+    return bits;
+}
+
+// 写出 1 << palette_bits(nb_colors) 项，多出的补黑色
+static uint8_t *put_palette(uint8_t *p, const uint32_t *pal, int nb_colors)
+{
+    int i, n = 1 << palette_bits(nb_colors);
+
+    for (i = 0; i < n; i++, p += 3)
+        AV_WB24(p, i < nb_colors ? pal[i] : 0);
+    return p;
+}
+
+// c[0, n) 与 p[0, n) 第一个不同的位置，全部相同时返回 n
+static int first_diff(const uint8_t *c, const uint8_t *p, int n)
+{
+    int x = 0;
+#ifdef GIF_WRITER_X86
+    for (; x + 16 <= n; x += 16) {
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(c + x)),
+                                                 _mm_loadu_si128((const __m128i *)(p + x))));
+        if (m != 0xFFFF)
+            return x + __builtin_ctz(~m & 0xFFFF);
+    }
+#endif
+    while (x < n && c[x] == p[x])
+        x++;
+    return x;
+}
+
+// c[0, n) 与 p[0, n) 最后一个不同的位置，全部相同时返回 -1
+static int last_diff(const uint8_t *c, const uint8_t *p, int n)
+{
+    int x = n;
+#ifdef GIF_WRITER_X86
+    for (; x >= 16; x -= 16) {
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(c + x - 16)),
+                                                 _mm_loadu_si128((const __m128i *)(p + x - 16))));
+        if (m != 0xFFFF)
+            return x - 16 + 31 - __builtin_clz(~m & 0xFFFF);
+    }
+#endif
+    while (x > 0 && c[x - 1] == p[x - 1])
+        x--;
+    return x - 1;
+}
+
+#define ROW(f, y) ((f)->data[0] + (ptrdiff_t)(y) * (f)->linesize[0])
+
+// 与上一帧不同的矩形，完全相同时取左上角的一个像素
+static void changed_rect(const AVFrame *cur, const AVFrame *prev, int *x0, int *y0, int *x1, int *y1)
+{
+    int w = cur->width, h = cur->height, top, bottom, left, right, y;
+
+    for (top = 0; top < h && !memcmp(ROW(cur, top), ROW(prev, top), w); top++)
+        ;
+    if (top == h) {
+        *x0 = *y0 = 0;
+        *x1 = *y1 = 1;
+        return;
+    }
+    for (bottom = h - 1; bottom > top && !memcmp(ROW(cur, bottom), ROW(prev, bottom), w); bottom--)
+        ;
+    left = w - 1;
+    right = 0;
+    for (y = top; y <= bottom; y++) {
+        const uint8_t *c = ROW(cur, y), *p = ROW(prev, y);
+        left = FFMIN(left, first_diff(c, p, left));
+        right = FFMAX(right, right + 1 + last_diff(c + right + 1, p + right + 1, w - right - 1));
+    }
+    *x0 = left;
+    *y0 = top;
+    *x1 = right + 1;
+    *y1 = bottom + 1;
+}
+
+// 把矩形内与上一帧相同的像素换成 transparent，写入 g->delta
+static void mask_unchanged(gif_writer_t *g, const AVFrame *cur, const AVFrame *prev,
+                           int x0, int y0, int w, int h, int transparent)
+{
+    int x, y;
+#ifdef GIF_WRITER_X86
+    const __m128i t = _mm_set1_epi8((char)transparent);
+#endif
+
+    for (y = 0; y < h; y++) {
+        const uint8_t *c = ROW(cur, y0 + y) + x0, *p = ROW(prev, y0 + y) + x0;
+        uint8_t *d = g->delta + (ptrdiff_t)y * w;
+        x = 0;
+#ifdef GIF_WRITER_X86
+        for (; x + 16 <= w; x += 16) {
+            __m128i vc = _mm_loadu_si128((const __m128i *)(c + x));
+            __m128i m = _mm_cmpeq_epi8(vc, _mm_loadu_si128((const __m128i *)(p + x)));
+            _mm_storeu_si128((__m128i *)(d + x), _mm_or_si128(_mm_andnot_si128(m, vc), _mm_and_si128(m, t)));
+        }
+#endif
+        for (; x < w; x++)
+            d[x] = c[x] == p[x] ? transparent : c[x];
+    }
+}
+#undef ROW
+
+/*
+按 img 的描述编码一帧，pkt 得到这一帧在文件中的全部字节
+pal 为这一帧实际使用的调色板（局部或全局），只用于有损模式
+ */
+static int write_image(gif_writer_t *g, const gif_image_t *img, const uint32_t *pal, AVPacket *pkt)
+{
+    int len, off, ret;
+    uint8_t *p;
+
+    if (img->x < 0 || img->y < 0 || img->width <= 0 || img->height <= 0 ||
+        (int64_t)img->width * img->height > (int64_t)g->width * g->height || img->min_bits < 2 || img->min_bits > 8)
+        return AVERROR(EINVAL);
+    len = lzw_encode(g, img->pixels, img->linesize, img->width, img->height, img->min_bits, pal, img->transparent);
+    ret = av_new_packet(pkt, GCE_SIZE + DESC_SIZE + (img->pal ? 3 * AVPALETTE_COUNT : 0) +
+                             1 + len + (len + 254) / 255 + 1);
+    if (ret < 0)
+        return ret;
+    p = pkt->data;
+
+    // 图形控制扩展
+    *p++ = 0x21;
+    *p++ = 0xF9;
+    *p++ = 0x04;
+    *p++ = (img->disposal & 7) << 2 | (img->transparent >= 0);
+    AV_WL16(p, av_clip_uint16(img->delay));
+    p += 2;
+    *p++ = img->transparent >= 0 ? img->transparent : 0;
+    *p++ = 0;
+
+    // 图像描述符
+    *p++ = 0x2C;
+    AV_WL16(p, img->x);
+    AV_WL16(p + 2, img->y);
+    AV_WL16(p + 4, img->width);
+    AV_WL16(p + 6, img->height);
+    p += 8;
+    *p++ = img->pal ? 0x80 | (palette_bits(img->nb_colors) - 1) : 0;
+    if (img->pal)
+        p = put_palette(p, img->pal, img->nb_colors);
+
+    *p++ = img->min_bits;
+    for (off = 0; off < len; off += 255) {
+        int n = FFMIN(255, len - off);
+        *p++ = n;
+        memcpy(p, g->codes + off, n);
+        p += n;
+    }
+    *p++ = 0;
+    av_shrink_packet(pkt, (int)(p - pkt->data));
+    return 0;
+}
+
+/*
+编码一帧 PAL8，pkt 得到这一帧在文件中的全部字节
+prev 为上一帧（第一帧为 NULL），global_pal 为文件头中的全局调色板，delay 的单位为 1/100 秒
+transparent 为帧中不会出现的索引，与上一帧相同的像素编码为这个索引并标记为透明，< 0 时不使用透明色
+ */
+int gif_writer_frame(void* ctx, const AVFrame* frame, const AVFrame* prev, const uint32_t* global_pal, int delay, int transparent, AVPacket* pkt)
+{
+    gif_writer_t *g = (gif_writer_t *)ctx;
+    const uint32_t *pal = (const uint32_t *)frame->data[1];
+    int local = memcmp(pal, global_pal, AVPALETTE_SIZE) != 0;
+    int x0 = 0, y0 = 0, x1 = g->width, y1 = g->height, delta = 0;
+    gif_image_t img;
+
+    if (frame->format != AV_PIX_FMT_PAL8 || frame->width != g->width || frame->height != g->height)
+        return AVERROR(EINVAL);
+    // 调色板相同时索引相同就是颜色相同，只需编码变化的部分
+    if (prev && !memcmp(pal, prev->data[1], AVPALETTE_SIZE)) {
+        changed_rect(frame, prev, &x0, &y0, &x1, &y1);
+        delta = transparent >= 0 && transparent < AVPALETTE_COUNT;
+    }
+
+    img.x = x0;
+    img.y = y0;
+    img.width = x1 - x0;
+    img.height = y1 - y0;
+    // 不处置（disposal 1），画布上保留的就是上一帧，透明的像素显示为上一帧的颜色
+    img.disposal = 1;
+    img.transparent = delta ? transparent : -1;
+    img.delay = delay;
+    img.min_bits = LZW_MIN_BITS;
+    img.pal = local ? pal : NULL;
+    img.nb_colors = AVPALETTE_COUNT;
+    if (delta) {
+        mask_unchanged(g, frame, prev, x0, y0, img.width, img.height, transparent);
+        img.pixels = g->delta;
+        img.linesize = img.width;
+    } else {
+        img.pixels = frame->data[0] + (ptrdiff_t)y0 * frame->linesize[0] + x0;
+        img.linesize = frame->linesize[0];
+    }
+    return write_image(g, &img, pal, pkt);
+}
+
+/*
+编码一帧已有的图像（如 gif_reader 读出后缩放过的），不做差分，按原样写出处置方式、透明色与时长
+img 的尺寸不超过 gif_writer_init() 的尺寸，global_pal 为文件头中的全局调色板（只用于有损模式）
+ */
+int gif_writer_image(void* ctx, const gif_image_t* img, const uint32_t* global_pal, AVPacket* pkt)
+{
+    return write_image((gif_writer_t *)ctx, img, img->pal ? img->pal : global_pal, pkt);
+}
+
+// 文件头：逻辑屏幕描述符、256 色的全局调色板，loop >= 0 时写循环播放扩展（0 为无限循环）
+void gif_writer_header(AVIOContext* pb, int width, int height, const uint32_t* pal, int loop)
+{
+    gif_writer_header2(pb, width, height, pal, AVPALETTE_COUNT, 0, loop);
+}
+
+// 同 gif_writer_header()，全局调色板为 nb_colors 项（0 表示没有全局调色板），bg 为背景色
+void gif_writer_header2(AVIOContext* pb, int width, int height, const uint32_t* pal, int nb_colors, int bg, int loop)
+{
+    uint8_t buf[3 * AVPALETTE_COUNT];
+    int bits = palette_bits(nb_colors);
+
+    avio_write(pb, (const unsigned char *)"GIF89a", 6);
+    avio_wl16(pb, width);
+    avio_wl16(pb, height);
+    // 有无全局调色板、8 位色深、调色板项数
+    avio_w8(pb, nb_colors > 0 ? 0xF0 | (bits - 1) : 0x70);
+    avio_w8(pb, bg);
+    avio_w8(pb, 0);     // 像素宽高比
+    if (nb_colors > 0)
+        avio_write(pb, buf, (int)(put_palette(buf, pal, nb_colors) - buf));
+    if (loop >= 0) {
+        avio_w8(pb, 0x21);
+        avio_w8(pb, 0xFF);
+        avio_w8(pb, 0x0B);
+        avio_write(pb, (const unsigned char *)"NETSCAPE2.0", 11);
+        avio_w8(pb, 0x03);
+        avio_w8(pb, 0x01);
+        avio_wl16(pb, loop);
+        avio_w8(pb, 0x00);
+    }
+}
+
+void gif_writer_trailer(AVIOContext* pb)
+{
+    avio_w8(pb, 0x3B);
+}
@@ -0,0 +1,37 @@
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 调色板最多 255 色时留给透明色的索引
+#define GIF_TRANSPARENT_INDEX (AVPALETTE_COUNT - 1)
+// gif_writer_header() 写出的字节数（含循环播放扩展）
+#define GIF_HEADER_SIZE (13 + 3 * AVPALETTE_COUNT + 19)
+
+// 一帧图像在文件中的描述，gif_reader 读出，gif_writer_image() 写出
+typedef struct gif_image {
+    int x, y, width, height; // 在逻辑屏幕中的位置
+    int disposal; // 处置方式 0 - 3
+    int transparent; // 透明色的索引，-1 表示没有
+    int delay; // 显示时长，单位 1/100 秒
+    int min_bits; // LZW 的最小码长 2 - 8，像素都小于 1 << min_bits
+    const uint32_t *pal; // 局部调色板（0xAARRGGBB），NULL 表示使用全局调色板
+    int nb_colors; // 局部调色板的项数
+    const uint8_t *pixels; // 逐行排列的调色板索引（不交错）
+    int linesize;
+} gif_image_t;
+
+void* gif_writer_init(int width, int height, int lossy);
+int gif_writer_frame(void* ctx, const AVFrame* frame, const AVFrame* prev, const uint32_t* global_pal, int delay, int transparent, AVPacket* pkt);
+int gif_writer_image(void* ctx, const gif_image_t* img, const uint32_t* global_pal, AVPacket* pkt);
+void gif_writer_set_lossy(void* ctx, int lossy);
+void gif_writer_free(void* ctx);
+void gif_writer_header(AVIOContext* pb, int width, int height, const uint32_t* pal, int loop);
+void gif_writer_header2(AVIOContext* pb, int width, int height, const uint32_t* pal, int nb_colors, int bg, int loop);
+void gif_writer_trailer(AVIOContext* pb);
+
+#ifdef __cplusplus
+}
+#endif
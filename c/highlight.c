@@ -0,0 +1,478 @@
+/*
+精彩片段的选择：按固定的间隔对帧打分（场景变化与画面活动程度），再挑出得分最高的一段或几段
+
+打分在缩小的亮度网格上进行，每帧只读 GRID_H * ROWS_PER_CELL 行：
+    - 网格每格取格内采样行的亮度均值（SIMD 按行求和），得到 GRID_W x GRID_H 的小图
+    - 得分 = 与上一个采样帧的亮度直方图差（场景切换、整体明暗变化）+ 网格的平均绝对差（运动）
+      + 采样所在的一秒内各帧运动矢量的平均运动强度（motion.c 的每秒时间线，解码器导出时才有），
+        所有帧都计入时间线，挑选片段时再加到各采样上
+highlight_scan() 单独打开输入做一遍低成本的解码：尽量用 lowres、跳过非参考帧与环路滤波，
+画面有误差也不影响相对的活动程度。解码器不支持 lowres（如 H.264）、缩不到 SCAN_MIN_WIDTH 附近时只解关键帧，
+否则几乎是一遍全分辨率的解码；关键帧的采样更稀疏，也没有运动矢量，只靠画面差打分。
+选出片段后由调用者 seek 到片段处正常解码。
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/pixdesc.h>
+
+#include "frame_pool.h"
+#include "highlight.h"
+#include "motion.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HIGHLIGHT_X86 1
+#endif
+
+#define GRID_W 64
+#define GRID_H 36
+#define GRID_SIZE (GRID_W * GRID_H)
+#define ROWS_PER_CELL 2
+#define HIST_BINS 64
+// 网格的平均绝对差为 SAD_SCALE 时，与直方图完全不同的得分相当
+#define SAD_SCALE 32.0
+// 运动矢量给出的运动强度（每帧移动画面宽度的百分比）为 MOTION_SCALE 时，与直方图完全不同的得分相当
+#define MOTION_SCALE 2.0
+// 打分解码时 lowres 缩小后的宽度不低于此值
+#define SCAN_MIN_WIDTH 128
+
+typedef struct highlight_sample {
+    double t;
+    float score;
+} highlight_sample_t;
+
+typedef struct highlight_context {
+    double interval; // 采样间隔（秒）
+    double next_t; // 下一个采样的时刻
+    uint8_t grid[2][GRID_SIZE];
+    uint16_t hist[2][HIST_BINS];
+    int cur; // 当前帧用 grid[cur]、hist[cur]，另一组是上一个采样帧
+    void *motion; // 每秒的运动强度（motion.c）
+    highlight_sample_t *samples;
+    int nb_samples, max_samples;
+} highlight_context_t;
+
+// 读取亮度的方式，RGB 格式用绿色分量近似
+typedef struct luma_src {
+    const uint8_t *base;
+    int linesize;
+    int step; // 相邻像素的字节距离
+    int depth, shift, be;
+} luma_src_t;
+
+static int luma_src_init(const AVFrame *frame, luma_src_t *src)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    const AVComponentDescriptor *c;
+
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)) ||
+        desc->nb_components < 1)
+        return AVERROR(EINVAL);
+    c = &desc->comp[(desc->flags & AV_PIX_FMT_FLAG_RGB) && desc->nb_components >= 3 ? 1 : 0];
+    if (c->depth > 16)
+        return AVERROR(EINVAL);
+    src->base = frame->data[c->plane] + c->offset;
+    src->linesize = frame->linesize[c->plane];
+    src->step = c->step;
+    src->depth = c->depth;
+    src->shift = c->shift;
+    src->be = !!(desc->flags & AV_PIX_FMT_FLAG_BE);
+    return 0;
+}
+
+static int sum_bytes(const uint8_t *p, int n)
+{
+    int sum = 0, x = 0;
+#ifdef HIGHLIGHT_X86
+    __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+
+    for (; x + 16 <= n; x += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(p + x)), zero));
+    sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for (; x < n; x++)
+        sum += p[x];
+    return sum;
+}
+
+// 一行中 [x0, x1) 的亮度之和（8 位）
+static int sum_luma(const luma_src_t *src, const uint8_t *row, int x0, int x1)
+{
+    int sum = 0, x;
+
+    if (src->depth <= 8) {
+        if (src->step == 1)
+            return sum_bytes(row + x0, x1 - x0);
+        for (x = x0; x < x1; x++)
+            sum += row[x * src->step];
+        return sum;
+    }
+    for (x = x0; x < x1; x++) {
+        int v = src->be ? AV_RB16(row + x * src->step) : AV_RL16(row + x * src->step);
+        sum += (v >> src->shift & ((1 << src->depth) - 1)) >> (src->depth - 8);
+    }
+    return sum;
+}
+
+static void build_grid(const luma_src_t *src, int width, int height, uint8_t *grid)
+{
+    int gx, gy, r;
+    int x0[GRID_W + 1];
+
+    for (gx = 0; gx <= GRID_W; gx++)
+        x0[gx] = gx * width / GRID_W;
+    for (gy = 0; gy < GRID_H; gy++) {
+        int sum[GRID_W] = { 0 }, cnt[GRID_W] = { 0 };
+        for (r = 0; r < ROWS_PER_CELL; r++) {
+            int y = (int)(((int64_t)gy * ROWS_PER_CELL + r) * 2 + 1) * height / (2 * GRID_H * ROWS_PER_CELL);
+            const uint8_t *row = src->base + (ptrdiff_t)FFMIN(y, height - 1) * src->linesize;
+            for (gx = 0; gx < GRID_W; gx++) {
+                // 画面比网格窄时每格至少取 1 个像素
+                int x1 = FFMAX(x0[gx + 1], x0[gx] + 1);
+                sum[gx] += sum_luma(src, row, x0[gx], x1);
+                cnt[gx] += x1 - x0[gx];
+            }
+        }
+        for (gx = 0; gx < GRID_W; gx++)
+            grid[gy * GRID_W + gx] = sum[gx] / cnt[gx];
+    }
+}
+
+static int hist_diff(const uint16_t *a, const uint16_t *b)
+{
+    int diff = 0, i = 0;
+#ifdef HIGHLIGHT_X86
+    __m128i acc = _mm_setzero_si128(), one = _mm_set1_epi16(1);
+    int32_t part[4];
+
+    // 直方图的值不超过 GRID_SIZE，按有符号 16 位相加不会溢出
+    for (; i + 8 <= HIST_BINS; i += 8) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i)), vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(d, one));
+    }
+    _mm_storeu_si128((__m128i *)part, acc);
+    diff = part[0] + part[1] + part[2] + part[3];
+#endif
+    for (; i < HIST_BINS; i++)
+        diff += FFABS(a[i] - b[i]);
+    return diff;
+}
+
+static int grid_sad(const uint8_t *a, const uint8_t *b)
+{
+    int sad = 0, i = 0;
+#ifdef HIGHLIGHT_X86
+    __m128i acc = _mm_setzero_si128();
+
+    for (; i + 16 <= GRID_SIZE; i += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                              _mm_loadu_si128((const __m128i *)(b + i))));
+    sad = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for (; i < GRID_SIZE; i++)
+        sad += FFABS(a[i] - b[i]);
+    return sad;
+}
+
+/*
+interval 为采样间隔（秒），两个采样之间的帧不打分
+ */
+void* highlight_init(double interval)
+{
+    highlight_context_t *h = (highlight_context_t *)av_mallocz(sizeof(highlight_context_t));
+
+    if (!h)
+        return NULL;
+    h->interval = interval > 0 ? interval : 0.5;
+    h->motion = motion_init();
+    if (!h->motion) {
+        av_free(h);
+        return NULL;
+    }
+    return h;
+}
+
+void highlight_free(void* ctx)
+{
+    highlight_context_t *h = (highlight_context_t *)ctx;
+
+    if (!h)
+        return;
+    av_free(h->samples);
+    motion_free(h->motion);
+    av_free(h);
+}
+
+static int grow_samples(highlight_context_t *h)
+{
+    if (h->nb_samples == h->max_samples) {
+        int n = FFMAX(h->max_samples * 2, 256);
+        highlight_sample_t *s = (highlight_sample_t *)av_realloc_array(h->samples, n, sizeof(*s));
+        if (!s)
+            return AVERROR(ENOMEM);
+        h->samples = s;
+        h->max_samples = n;
+    }
+    return 0;
+}
+
+/*
+t 为帧的时刻（秒），帧按时间顺序送入，所有解码的帧都应送入（未到采样时刻的帧只统计运动矢量）
+返回 1 表示采样并打分，0 表示未到采样时刻跳过，< 0 为错误（像素格式不支持等）
+ */
+int highlight_add_frame(void* ctx, const AVFrame* frame, double t)
+{
+    highlight_context_t *h = (highlight_context_t *)ctx;
+    luma_src_t src;
+    uint8_t *grid;
+    uint16_t *hist;
+    float score = 0;
+    int i, ret;
+
+    if ((ret = motion_add_frame(h->motion, frame, t, NULL)) < 0)
+        return ret;
+    if (h->nb_samples && t < h->next_t)
+        return 0;
+    if ((ret = luma_src_init(frame, &src)) < 0)
+        return ret;
+    if ((ret = grow_samples(h)) < 0)
+        return ret;
+
+    grid = h->grid[h->cur];
+    hist = h->hist[h->cur];
+    build_grid(&src, frame->width, frame->height, grid);
+    memset(hist, 0, sizeof(h->hist[0]));
+    for (i = 0; i < GRID_SIZE; i++)
+        hist[grid[i] * HIST_BINS >> 8]++;
+    if (h->nb_samples)
+        score = (float)(hist_diff(hist, h->hist[!h->cur]) / (2.0 * GRID_SIZE) +
+                        grid_sad(grid, h->grid[!h->cur]) / (SAD_SCALE * GRID_SIZE));
+
+    h->samples[h->nb_samples].t = t;
+    h->samples[h->nb_samples].score = score;
+    h->nb_samples++;
+    h->cur = !h->cur;
+    h->next_t = (h->nb_samples > 1 ? h->next_t : t) + h->interval;
+    if (h->next_t <= t)
+        h->next_t = t + h->interval;
+    return 1;
+}
+
+/*
+直接送入外部算出的得分（如 activity.c 的压缩域活动程度），t 按时间顺序，间隔与 highlight_init() 的一致
+ */
+int highlight_add_score(void* ctx, double t, double score)
+{
+    highlight_context_t *h = (highlight_context_t *)ctx;
+    int ret;
+
+    if ((ret = grow_samples(h)) < 0)
+        return ret;
+    h->samples[h->nb_samples].t = t;
+    h->samples[h->nb_samples].score = (float)score;
+    h->nb_samples++;
+    return 0;
+}
+
+static double frame_time(const AVFrame *frame, const AVStream *st)
+{
+    int64_t pts = frame->pts != AV_NOPTS_VALUE ? frame->pts : frame->best_effort_timestamp;
+
+    if (pts == AV_NOPTS_VALUE)
+        return -1;
+    if (st->start_time != AV_NOPTS_VALUE)
+        pts -= st->start_time;
+    return pts * av_q2d(st->time_base);
+}
+
+// 返回 1 表示已超过 max_seconds，不必继续
+static int scan_frames(highlight_context_t *h, AVCodecContext *c, AVStream *st, AVFrame *frame,
+                       const AVPacket *pkt, double max_seconds)
+{
+    int ret = avcodec_send_packet(c, pkt);
+
+    // 打分的解码容忍个别坏包
+    if (ret < 0 && ret != AVERROR_EOF)
+        return 0;
+    while ((ret = avcodec_receive_frame(c, frame)) >= 0) {
+        double t = frame_time(frame, st);
+        if (max_seconds > 0 && t > max_seconds) {
+            av_frame_unref(frame);
+            return 1;
+        }
+        if (t >= 0)
+            ret = highlight_add_frame(h, frame, t);
+        av_frame_unref(frame);
+        if (ret < 0)
+            return ret;
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/*
+单独打开内存中的视频（data, size），以低成本解码视频流的前 max_seconds 秒（0 为整个视频）并打分
+返回采样的帧数，< 0 为错误
+ */
+int highlight_scan(void* ctx, const uint8_t* data, int size, double max_seconds)
+{
+    highlight_context_t *h = (highlight_context_t *)ctx;
+    AVFormatContext *fmt_ctx = NULL;
+    AVIOContext *pb = NULL;
+    AVCodecContext *c = NULL;
+    AVCodec *dec = NULL;
+    AVStream *st;
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL;
+    uint8_t *indata;
+    int ret, idx, l = 0;
+
+    fmt_ctx = avformat_alloc_context();
+    indata = (uint8_t *)av_malloc(size);
+    if (!fmt_ctx || !indata) {
+        av_free(indata);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    memcpy(indata, data, size);
+    pb = avio_alloc_context(indata, size, 0, NULL, NULL, NULL, NULL);
+    if (!pb) {
+        av_free(indata);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    fmt_ctx->pb = pb;
+    // 打开失败时 fmt_ctx 会被释放，pb 由这里释放
+    if ((ret = avformat_open_input(&fmt_ctx, NULL, NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0 ||
+        (ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open input for highlight scan, err:%d\n", ret);
+        goto end;
+    }
+    idx = ret;
+    st = fmt_ctx->streams[idx];
+    c = avcodec_alloc_context3(dec);
+    if (!c) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avcodec_parameters_to_context(c, st->codecpar)) < 0)
+        goto end;
+    c->get_buffer2 = frame_pool_get_buffer2;
+    c->thread_safe_callbacks = 1;
+    // 只看相对的活动程度：缩小解码、不解非参考帧（缩不小时只解关键帧）、不做环路滤波，顺带导出运动矢量
+    while (l < dec->max_lowres && AV_CEIL_RSHIFT(c->width, l + 1) >= SCAN_MIN_WIDTH)
+        l++;
+    c->lowres = l;
+    c->skip_frame = AV_CEIL_RSHIFT(c->width, l) >= 2 * SCAN_MIN_WIDTH ? AVDISCARD_NONKEY : AVDISCARD_NONREF;
+    c->skip_loop_filter = AVDISCARD_ALL;
+    c->flags2 |= AV_CODEC_FLAG2_EXPORT_MVS;
+    if ((ret = avcodec_open2(c, dec, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to open codec for highlight scan, err:%d\n", ret);
+        goto end;
+    }
+
+    pkt = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!pkt || !frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    // 读取出错按读完处理
+    ret = 0;
+    while (!ret && av_read_frame(fmt_ctx, pkt) >= 0) {
+        if (pkt->stream_index == idx)
+            ret = scan_frames(h, c, st, frame, pkt, max_seconds);
+        av_packet_unref(pkt);
+    }
+    if (!ret)
+        ret = scan_frames(h, c, st, frame, NULL, max_seconds);
+    if (ret >= 0)
+        ret = h->nb_samples;
+
+end:
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&c);
+    avformat_close_input(&fmt_ctx);
+    if (pb) {
+        av_freep(&pb->buffer);
+        av_freep(&pb);
+    }
+    return ret;
+}
+
+/*
+挑出总长 duration 秒、分成 nb_segments 段（1 - HIGHLIGHT_MAX_SEGMENTS）的片段，写到 segs，按时间排序
+每段的得分为段内各采样的得分之和，依次取不与已选的段重叠的最高分的段
+返回选出的段数，视频不比 duration 长或没有打分时返回 0，调用者按原来的方式取开头
+ */
+int highlight_pick(void* ctx, double duration, int nb_segments, highlight_segment_t* segs)
+{
+    highlight_context_t *h = (highlight_context_t *)ctx;
+    const highlight_sample_t *s = h->samples;
+    const motion_second_t *sec;
+    int n = h->nb_samples, nb = 0, i, j, k, nb_sec;
+    double len, span_end, *prefix;
+
+    nb_segments = av_clip(nb_segments, 1, HIGHLIGHT_MAX_SEGMENTS);
+    if (n < 2 || duration <= 0)
+        return 0;
+    span_end = s[n - 1].t + h->interval;
+    if (span_end - s[0].t <= duration)
+        return 0;
+    len = duration / nb_segments;
+
+    prefix = (double *)av_malloc_array(n + 1, sizeof(double));
+    if (!prefix)
+        return AVERROR(ENOMEM);
+    // 采样的得分加上所在那一秒的运动强度
+    nb_sec = motion_timeline(h->motion, &sec);
+    prefix[0] = 0;
+    for (i = 0; i < n; i++) {
+        int t = (int)s[i].t;
+        double motion = t >= 0 && t < nb_sec && sec[t].nb_frames ? sec[t].motion / MOTION_SCALE : 0;
+        prefix[i + 1] = prefix[i] + s[i].score + motion;
+    }
+
+    for (k = 0; k < nb_segments; k++) {
+        double best = -1;
+        int best_i = -1;
+        // 从 s[i].t 开始的段，得分为 (s[i].t, s[i].t + len] 内的采样，s[i] 本身是与段之前的差
+        for (i = 0, j = 0; i < n && s[i].t + len <= span_end; i++) {
+            double sum;
+            int overlap = 0, m;
+            for (m = 0; m < nb; m++)
+                overlap |= s[i].t < segs[m].end && segs[m].start < s[i].t + len;
+            if (overlap)
+                continue;
+            j = FFMAX(j, i + 1);
+            while (j < n && s[j].t <= s[i].t + len)
+                j++;
+            sum = prefix[j] - prefix[i + 1];
+            if (sum > best) {
+                best = sum;
+                best_i = i;
+            }
+        }
+        if (best_i < 0)
+            break;
+        segs[nb].start = s[best_i].t;
+        segs[nb].end = s[best_i].t + len;
+        nb++;
+    }
+    av_free(prefix);
+
+    for (i = 1; i < nb; i++) {
+        highlight_segment_t seg = segs[i];
+        for (j = i; j > 0 && segs[j - 1].start > seg.start; j--)
+            segs[j] = segs[j - 1];
+        segs[j] = seg;
+    }
+    return nb;
+}
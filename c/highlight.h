@@ -0,0 +1,25 @@
+
+#include <stdint.h>
+#include <libavutil/frame.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 选出的片段，单位秒，从视频流的起点算起
+typedef struct highlight_segment {
+    double start;
+    double end;
+} highlight_segment_t;
+
+#define HIGHLIGHT_MAX_SEGMENTS 8
+
+void* highlight_init(double interval);
+int highlight_add_frame(void* ctx, const AVFrame* frame, double t);
+int highlight_add_score(void* ctx, double t, double score);
+int highlight_scan(void* ctx, const uint8_t* data, int size, double max_seconds);
+int highlight_pick(void* ctx, double duration, int nb_segments, highlight_segment_t* segs);
+void highlight_free(void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
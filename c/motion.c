@@ -0,0 +1,121 @@
+/*
+由解码器导出的运动矢量（AV_CODEC_FLAG2_EXPORT_MVS）计算运动强度，不做像素域的光流
+
+解码器打开前设置 AV_CODEC_FLAG2_EXPORT_MVS，H.264、MPEG-4、H.263 等的帧间编码帧带有 AV_FRAME_DATA_MOTION_VECTORS，
+运动矢量本来就在解码时算出，导出与这里的统计只是遍历每个宏块一次，相对解码可以忽略。
+运动强度 = 各块矢量长度按面积加权的和 / 画面面积，再除以画面宽度（百分比），与分辨率无关：
+双向预测的块有两个矢量，总面积超过画面时按总面积平均；帧内编码的块没有矢量，按静止计。
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <libavutil/motion_vector.h>
+
+#include "motion.h"
+
+// 时间线的最大长度，时间戳异常时不至于分配过多内存
+#define MAX_SECONDS (24 * 3600)
+
+typedef struct motion_context {
+    motion_second_t *seconds;
+    double *sums; // 各秒运动强度的和，结束前不除
+    int nb_seconds, max_seconds;
+} motion_context_t;
+
+/*
+一帧的运动强度（每帧移动画面宽度的百分之几），没有运动矢量时（关键帧、解码器不支持）返回 -1
+ */
+double motion_frame(const AVFrame* frame)
+{
+    const AVFrameSideData *sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+    const AVMotionVector *mv;
+    int64_t area = 0, frame_area = (int64_t)frame->width * frame->height;
+    double sum = 0;
+    int i, n;
+
+    if (!sd || frame_area <= 0)
+        return -1;
+    mv = (const AVMotionVector *)sd->data;
+    n = sd->size / sizeof(*mv);
+    for (i = 0; i < n; i++) {
+        int a = mv[i].w * mv[i].h;
+        double dx = mv[i].motion_x, dy = mv[i].motion_y;
+        if (mv[i].motion_scale > 1) {
+            dx /= mv[i].motion_scale;
+            dy /= mv[i].motion_scale;
+        }
+        // 参考帧隔了几帧时折算到每帧
+        sum += sqrt(dx * dx + dy * dy) * a / FFMAX(FFABS(mv[i].source), 1);
+        area += a;
+    }
+    return sum / FFMAX(area, frame_area) * 100.0 / frame->width;
+}
+
+void* motion_init(void)
+{
+    return av_mallocz(sizeof(motion_context_t));
+}
+
+void motion_free(void* ctx)
+{
+    motion_context_t *m = (motion_context_t *)ctx;
+
+    if (!m)
+        return;
+    av_free(m->seconds);
+    av_free(m->sums);
+    av_free(m);
+}
+
+/*
+累计 t 秒处的一帧，motion 不为 NULL 时写入该帧的运动强度（同 motion_frame()，没有运动矢量为 -1）
+返回 0，内存不足时返回 AVERROR(ENOMEM)
+ */
+int motion_add_frame(void* ctx, const AVFrame* frame, double t, double* motion)
+{
+    motion_context_t *m = (motion_context_t *)ctx;
+    double v = motion_frame(frame);
+    int idx = (int)t;
+
+    if (motion)
+        *motion = v;
+    if (v < 0 || t < 0 || t >= MAX_SECONDS)
+        return 0;
+    if (idx >= m->max_seconds) {
+        int max = FFMAX(idx + 1, m->max_seconds * 2);
+        motion_second_t *s = (motion_second_t *)av_realloc_array(m->seconds, max, sizeof(*s));
+        double *sums;
+        if (!s)
+            return AVERROR(ENOMEM);
+        m->seconds = s;
+        sums = (double *)av_realloc_array(m->sums, max, sizeof(*sums));
+        if (!sums)
+            return AVERROR(ENOMEM);
+        m->sums = sums;
+        m->max_seconds = max;
+    }
+    if (idx >= m->nb_seconds) {
+        memset(m->seconds + m->nb_seconds, 0, (idx + 1 - m->nb_seconds) * sizeof(*m->seconds));
+        memset(m->sums + m->nb_seconds, 0, (idx + 1 - m->nb_seconds) * sizeof(*m->sums));
+        m->nb_seconds = idx + 1;
+    }
+    m->sums[idx] += v;
+    m->seconds[idx].nb_frames++;
+    m->seconds[idx].motion = (float)(m->sums[idx] / m->seconds[idx].nb_frames);
+    return 0;
+}
+
+/*
+每秒的运动强度，*seconds 在 motion_free() 前有效，返回秒数
+ */
+int motion_timeline(void* ctx, const motion_second_t** seconds)
+{
+    motion_context_t *m = (motion_context_t *)ctx;
+
+    *seconds = m->seconds;
+    return m->nb_seconds;
+}
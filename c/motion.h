@@ -0,0 +1,21 @@
+
+#include <libavutil/frame.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 一秒内的运动强度
+typedef struct motion_second {
+    float motion; // 有运动矢量的帧的平均运动强度，单位为每帧移动画面宽度的百分之几
+    int nb_frames; // 有运动矢量的帧数
+} motion_second_t;
+
+double motion_frame(const AVFrame* frame);
+void* motion_init(void);
+int motion_add_frame(void* ctx, const AVFrame* frame, double t, double* motion);
+int motion_timeline(void* ctx, const motion_second_t** seconds);
+void motion_free(void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
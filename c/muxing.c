@@ -11,12 +11,61 @@
 #include <libavformat/avformat.h>
 #include <libavutil/avassert.h>
 #include <libavutil/channel_layout.h>
+#include <libavutil/imgutils.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/timestamp.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 
+#include "frame_pool.h"
+#include "downscale.h"
+#include "convert.h"
+#include "tonemap.h"
+#include "palette.h"
+#include "gif_writer.h"
+#include "thread_pool.h"
+#include "watermark.h"
+#include "muxing.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MUXING_X86 1
+#endif
+
+#define MAX_SLICES 16
+// 自适应调色板一次最多缓存的帧数，超过时提前为已缓存的帧生成调色板
+#define MAX_PAL_FRAMES 128
+// 并行编码 GIF 时最多的编码器数，每个编码器至少分到的帧数
+#define MAX_GIF_ENCODERS 16
+#define MIN_CHUNK_FRAMES 4
+
+// 源图不小于 1280x720 时才按条带并行，小图的线程调度开销比缩放本身还大
+#define SLICE_MIN_PIXELS (1280 * 720)
+
+// 字节预算下 JPEG 第一次编码的 qscale（2 - 31，越大越差）
+#define BUDGET_JPEG_Q 3
+
+// 字节预算下 GIF 的降级档位，size 为相对第 0 档输出大小的经验值，用于由实测大小一次选出目标档位
+typedef struct budget_level {
+    int colors;
+    int lossy; // 自带写出器的有损程度，不低于 muxing_opts_t.gif_lossy
+    int step; // 每 step 帧保留一帧，帧率降低，各帧的时长相应延长
+    double size;
+} budget_level_t;
+
+static const budget_level_t k_budget_levels[] = {
+    { 256,   0, 1, 1.00 },
+    { 128,  40, 1, 0.70 },
+    {  64,  80, 1, 0.50 },
+    {  64,  80, 2, 0.27 },
+    {  32, 120, 2, 0.20 },
+    {  32, 160, 3, 0.12 },
+    {  16, 200, 4, 0.07 },
+};
+#define NB_BUDGET_LEVELS ((int)FF_ARRAY_ELEMS(k_budget_levels))
+
 // a wrapper around a single output AVStream
 typedef struct OutputStream {
     AVStream *st;
@@ -27,10 +76,54 @@ typedef struct OutputStream {
     int samples_count;
 
     AVFrame *frame;
-    AVFrame *tmp_frame;
     AVPacket *pkt;
 
-    struct SwsContext *sws_ctx;
+    struct SwsContext *sws_ctx; // swscale 的上下文，整帧单线程处理，不参与切条带
+
+    int scaler; // MUXING_SCALER_*
+    int dither; // MUXING_DITHER_*
+    int tonemap; // HDR 源是否色调映射到 SDR
+    int deinterlace; // MUXING_DEINTERLACE_*
+    int palette; // MUXING_PALETTE_*
+    int transparency; // 自适应调色板保留最后一项作为透明色
+    int gif_lossy; // 自带写出器的有损程度，0 为无损
+    int dedup; // GIF 去重帧的阈值，0 不去重
+    AVFrame *dedup_ref; // 上一个保留的帧，去重时与它比较
+    int64_t end_pts; // 最后一帧（包括去掉的帧）之后的 pts，决定最后一个保留帧的显示时长
+    int nb_dropped;
+    int64_t max_bytes; // 输出大小的上限，0 不限制
+    int expected_frames; // 预计的总帧数，用于给分批编码的 GIF 分配字节数
+    int budget_level; // 当前的 k_budget_levels 档位，只升不降
+    int budget_full; // 字节数已用完，之后的帧全部丢弃
+    enum AVPixelFormat pix_fmt; // 缩放流水线的输出格式，自适应调色板、固定调色板加水印时为 RGB24，否则同编码器
+    int field; // 隔行源只取一场：0 不抽场，1 顶场，2 底场
+    AVFrame *field_frame; // 引用源帧的一场，行距加倍、高度减半，不复制像素
+    int crop[4]; // 缩放前裁掉的左、上、右、下的像素数
+    AVFrame *crop_frame; // 引用源帧裁剪后的部分，只偏移数据指针，不复制像素
+    int crop_skipped; // 当前的帧比裁剪量还小，没有裁剪
+    int has_wm; // 是否要求加水印，决定固定调色板时流水线的输出格式
+    void *wm; // 编码前叠加的水印（watermark.c 缓存的引用），NULL 不加
+    void *wm_cv; // 固定调色板加水印时，叠加后 RGB24 -> RGB8 的转换器
+    AVFrame *wm_frame; // 转换后送编码器的 RGB8 帧
+    int pipeline_ready; // 是否已建立缩放流水线，抽场的决定或源的尺寸、格式变化时重建
+    int pipe_w, pipe_h, pipe_fmt; // 建立流水线时（裁剪、抽场之后）源的尺寸与格式
+    int nb_slices; // 缩放时切分的条带数
+    void *ds_ctx; // 面积平均缩小的上下文，为 NULL 时不使用
+    AVFrame *scaled_frame; // 面积平均缩小后、像素格式转换前的帧
+    void *cv_ctx; // 同尺寸像素格式转换的专用转换器，为 NULL 时使用 swscale
+    void *tm_ctx; // HDR 转 SDR 的色调映射，为 NULL 时不做
+    AVFrame *sdr_frame; // 色调映射后、像素格式转换前的帧
+    void *pal_ctx; // 自适应调色板
+    AVFrame *pal_queue[MAX_PAL_FRAMES]; // 等待生成调色板的 RGB24 帧
+    int nb_queued;
+    AVCodecContext *chunk_enc[MAX_GIF_ENCODERS]; // 并行编码的 GIF 编码器，[0] 不用，第一段由 enc 编码
+    int64_t chunk_seq[MAX_GIF_ENCODERS]; // 各编码器最后编码的帧序号，0 表示还未编码过
+    int64_t pal_seq; // 已编码的 PAL8 帧数，帧序号从 1 开始
+    AVFrame *first_pal, *last_pal; // 第一帧与上一批的最后一帧，用于同步新的编码器状态
+    int gif_native; // 使用自带的 GIF 写出器，不经过 libavcodec/libavformat
+    int gif_started; // 是否已写出文件头
+    void *gif_writer[MAX_GIF_ENCODERS]; // 每段一个写出器
+    uint32_t gif_pal[AVPALETTE_COUNT]; // 文件头中的全局调色板
 } OutputStream;
 
 static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt) {
@@ -159,6 +252,11 @@ static void add_stream(OutputStream *ost, AVFormatContext *oc,
 /**************************************************************/
 /* video output */
 
+// 输出高度 h 切成 nb 个条带时第 k 个条带的起始行，按色度的纵向下采样对齐到偶数
+static int slice_row(int h, int k, int nb) {
+    return k >= nb ? h : (int)((int64_t)k * h / nb) & ~1;
+}
+
 static AVFrame *alloc_picture(enum AVPixelFormat pix_fmt, int width, int height) {
     AVFrame *picture;
     int ret;
@@ -172,7 +270,8 @@ static AVFrame *alloc_picture(enum AVPixelFormat pix_fmt, int width, int height)
     picture->height = height;
 
     /* allocate the buffers for the frame data */
-    ret = av_frame_get_buffer(picture, 32);
+    // 从进程级的缓存池中取帧缓存，避免每次请求都分配
+    ret = frame_pool_get_frame(picture);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Could not allocate frame data.\n");
         av_frame_free(&picture);
@@ -189,6 +288,19 @@ static void open_video(AVFormatContext *oc, AVCodec *codec, OutputStream *ost, A
 
     av_dict_copy(&opt, opt_arg, 0);
 
+    // 自适应调色板：缩放流水线输出 RGB24，按场景生成调色板并映射为 PAL8 后再编码
+    if (c->codec_id == AV_CODEC_ID_GIF && ost->palette != MUXING_PALETTE_FIXED)
+        c->pix_fmt = AV_PIX_FMT_PAL8;
+    ost->pix_fmt = c->pix_fmt == AV_PIX_FMT_PAL8 ? AV_PIX_FMT_RGB24 : c->pix_fmt;
+    // 水印不能叠加在 3:3:2 的 RGB8 上：固定调色板时流水线也输出 RGB24，叠加后再转 RGB8
+    if (c->pix_fmt == AV_PIX_FMT_RGB8 && ost->has_wm)
+        ost->pix_fmt = AV_PIX_FMT_RGB24;
+    // 字节预算：JPEG 按固定 qscale 编码，每帧的 quality 可以单独指定
+    if (c->codec_id == AV_CODEC_ID_MJPEG && ost->max_bytes > 0) {
+        c->flags |= AV_CODEC_FLAG_QSCALE;
+        c->global_quality = FF_QP2LAMBDA * BUDGET_JPEG_Q;
+    }
+
     /* open the codec */
     ret = avcodec_open2(c, codec, &opt);
     av_dict_free(&opt);
@@ -198,20 +310,21 @@ static void open_video(AVFormatContext *oc, AVCodec *codec, OutputStream *ost, A
     }
 
     /* allocate and init a re-usable frame */
-    ost->frame = alloc_picture(c->pix_fmt, c->width, c->height);
+    ost->frame = alloc_picture(ost->pix_fmt, c->width, c->height);
     if (!ost->frame) {
         av_log(NULL, AV_LOG_ERROR, "Could not allocate video frame\n");
         return;
     }
-
-    ost->tmp_frame = NULL;
-    if (c->pix_fmt != AV_PIX_FMT_YUV420P) {
-        ost->tmp_frame = alloc_picture(AV_PIX_FMT_YUV420P, c->width, c->height);
-        if (!ost->tmp_frame) {
-            av_log(NULL, AV_LOG_ERROR, "Could not allocate temporary picture\n");
+    if (ost->pix_fmt != c->pix_fmt && c->pix_fmt != AV_PIX_FMT_PAL8) {
+        ost->wm_frame = alloc_picture(c->pix_fmt, c->width, c->height);
+        ost->wm_cv = convert_init(ost->frame, c->pix_fmt,
+                ost->dither != MUXING_DITHER_NONE ? CONVERT_FLAG_DITHER : 0);
+        if (!ost->wm_frame || !ost->wm_cv) {
+            av_log(NULL, AV_LOG_ERROR, "Could not allocate watermark frame\n");
             return;
         }
     }
+
     ost->pkt = av_packet_alloc();
     if (!ost->pkt) {
         av_log(NULL, AV_LOG_ERROR, "Could not allocate video packet\n");
@@ -226,49 +339,397 @@ static void open_video(AVFormatContext *oc, AVCodec *codec, OutputStream *ost, A
     }
 }
 
+/*
+swscale 的上下文按整帧的源与输出尺寸创建
+把帧切成条带、每个条带单独建上下文时，纵向滤波在条带边界被截断，各条带的缩放比例也略有不同，
+缩小不到 2 倍的大图（如 4K -> 1080p）会出现接缝与错行；这一版的 swscale 只能从上到下按顺序喂入条带，
+输出不能按行切分，所以 swscale 整帧单线程处理，只有面积平均缩小、格式转换、色调映射切条带并行
+ */
+static int init_sws(OutputStream *ost, const AVFrame *src, int dst_fmt) {
+    AVCodecContext *c = ost->enc;
+
+    ost->sws_ctx = sws_getContext(src->width, src->height, src->format,
+                                  c->width, c->height, dst_fmt,
+                                  SWS_FAST_BILINEAR, NULL, NULL, NULL);
+    if (!ost->sws_ctx) {
+        av_log(NULL, AV_LOG_ERROR,
+                "Could not initialize the conversion context\n");
+        return -1;
+    }
+    return 0;
+}
+
+// 释放缩放流水线的各级上下文与中间帧
+static void free_pipeline(OutputStream *ost) {
+    sws_freeContext(ost->sws_ctx);
+    ost->sws_ctx = NULL;
+    downscale_free(ost->ds_ctx);
+    ost->ds_ctx = NULL;
+    tonemap_free(ost->tm_ctx);
+    ost->tm_ctx = NULL;
+    convert_free(ost->cv_ctx);
+    ost->cv_ctx = NULL;
+    av_frame_free(&ost->scaled_frame);
+    av_frame_free(&ost->sdr_frame);
+}
+
+/*
+HDR 源的流水线：缩放到输出尺寸（保持 8/10 位 YUV420）-> 色调映射为 TONEMAP_DST_FORMAT -> 专用格式转换
+色调映射在缩放之后执行，只处理输出分辨率的像素
+返回 1 表示已建立，0 表示不适用（走普通流水线），< 0 表示出错
+ */
+static int init_tonemap(OutputStream *ost, const AVFrame *frame) {
+    AVCodecContext *c = ost->enc;
+    const AVFrame *mid = frame;
+    int fmt;
+
+    if (!ost->tonemap || !tonemap_needed(frame))
+        return 0;
+    if (ost->pix_fmt != TONEMAP_DST_FORMAT && !convert_supported(TONEMAP_DST_FORMAT, ost->pix_fmt))
+        return 0;
+
+    if (frame->width != c->width || frame->height != c->height || !tonemap_format_supported(frame->format)) {
+        if (ost->scaler != MUXING_SCALER_SWS &&
+            (ost->scaler == MUXING_SCALER_AREA ||
+             (frame->width >= 2 * c->width && frame->height >= 2 * c->height)))
+            ost->ds_ctx = downscale_init(frame->format, frame->width, frame->height, c->width, c->height);
+        if (ost->ds_ctx && !tonemap_format_supported(downscale_dst_format(ost->ds_ctx))) {
+            downscale_free(ost->ds_ctx);
+            ost->ds_ctx = NULL;
+        }
+        if (ost->ds_ctx)
+            fmt = downscale_dst_format(ost->ds_ctx);
+        else
+            fmt = tonemap_format_supported(frame->format) ? frame->format : AV_PIX_FMT_YUV420P10LE;
+        ost->scaled_frame = alloc_picture(fmt, c->width, c->height);
+        if (!ost->scaled_frame)
+            goto fail;
+        // 色调映射需要源的色彩属性与亮度元数据
+        if (av_frame_copy_props(ost->scaled_frame, frame) < 0)
+            goto fail;
+        if (!ost->ds_ctx && init_sws(ost, frame, fmt) < 0)
+            goto fail;
+        mid = ost->scaled_frame;
+    }
+
+    ost->tm_ctx = tonemap_init(mid);
+    if (!ost->tm_ctx)
+        goto fail;
+    if (ost->pix_fmt != TONEMAP_DST_FORMAT) {
+        ost->sdr_frame = alloc_picture(TONEMAP_DST_FORMAT, c->width, c->height);
+        if (!ost->sdr_frame)
+            goto fail;
+        tonemap_dst_props(ost->sdr_frame);
+        ost->cv_ctx = convert_init(ost->sdr_frame, ost->pix_fmt,
+                ost->dither != MUXING_DITHER_NONE ? CONVERT_FLAG_DITHER : 0);
+        if (!ost->cv_ctx)
+            goto fail;
+    }
+    av_log(NULL, AV_LOG_INFO, "tonemap %dx%d %s -> %dx%d %s\n", frame->width, frame->height,
+            av_get_pix_fmt_name(frame->format), c->width, c->height, av_get_pix_fmt_name(ost->pix_fmt));
+    return 1;
+fail:
+    av_log(NULL, AV_LOG_WARNING, "tonemap unavailable for %s, fall back to plain scaling\n",
+            av_get_pix_fmt_name(frame->format));
+    free_pipeline(ost);
+    return 0;
+}
+
+/*
+根据第一帧确定缩放流水线：
+    - HDR 源（可选）：见 init_tonemap()
+    - 面积平均缩小（可选）：只负责缩小，输出 downscale_dst_format() 的格式
+    - 尺寸已与编码器一致时，常用的格式对走专用的转换函数
+    - 其余情况由 swscale 完成（缩放并转换，或只做同尺寸的格式转换）
+源图较大时把输出按行切成多个条带，面积平均缩小、格式转换、色调映射在进程级的线程池中并行处理，swscale 整帧处理
+ */
+static int init_pipeline(OutputStream *ost, const AVFrame *frame) {
+    AVCodecContext *c = ost->enc;
+    const AVFrame *mid = frame;
+    int nb;
+
+    ost->pipeline_ready = 1;
+    ost->pipe_w = frame->width;
+    ost->pipe_h = frame->height;
+    ost->pipe_fmt = frame->format;
+    nb = 1;
+    if ((int64_t)frame->width * frame->height >= SLICE_MIN_PIXELS) {
+        nb = FFMIN(thread_pool_threads(), c->height / 16);
+        nb = av_clip(nb, 1, MAX_SLICES);
+    }
+    ost->nb_slices = nb;
+
+    if (init_tonemap(ost, frame) > 0)
+        return 0;
+
+    if (ost->scaler != MUXING_SCALER_SWS &&
+        (ost->scaler == MUXING_SCALER_AREA ||
+         (frame->width >= 2 * c->width && frame->height >= 2 * c->height)))
+        ost->ds_ctx = downscale_init(frame->format, frame->width, frame->height, c->width, c->height);
+    if (ost->ds_ctx && downscale_dst_format(ost->ds_ctx) != ost->pix_fmt) {
+        ost->scaled_frame = alloc_picture(downscale_dst_format(ost->ds_ctx), c->width, c->height);
+        if (!ost->scaled_frame) {
+            downscale_free(ost->ds_ctx);
+            ost->ds_ctx = NULL;
+        } else {
+            // 后续的格式转换需要源的色彩属性
+            ost->scaled_frame->colorspace = frame->colorspace;
+            ost->scaled_frame->color_range = frame->color_range;
+            ost->scaled_frame->color_primaries = frame->color_primaries;
+            ost->scaled_frame->color_trc = frame->color_trc;
+            mid = ost->scaled_frame;
+        }
+    }
+    if (ost->ds_ctx)
+        av_log(NULL, AV_LOG_INFO, "area downscale %dx%d %s -> %dx%d\n", frame->width, frame->height,
+                av_get_pix_fmt_name(frame->format), c->width, c->height);
+
+    if (!(ost->ds_ctx && !ost->scaled_frame) && mid->width == c->width && mid->height == c->height)
+        ost->cv_ctx = convert_init(mid, ost->pix_fmt,
+                ost->dither != MUXING_DITHER_NONE ? CONVERT_FLAG_DITHER : 0);
+
+    // 需要 swscale 时，每个条带一个上下文
+    if (!(ost->ds_ctx && !ost->scaled_frame) && !ost->cv_ctx)
+        return init_sws(ost, mid, ost->pix_fmt);
+    return 0;
+}
+
+typedef struct scale_job {
+    OutputStream *ost;
+    const AVFrame *src;
+} scale_job_t;
+
+// 用 swscale 整帧缩放、转换
+static int sws_frame(OutputStream *ost, const AVFrame *src, AVFrame *dst) {
+    int h = sws_scale(ost->sws_ctx, (const uint8_t * const *)src->data, src->linesize, 0, src->height,
+                      dst->data, dst->linesize);
+    return h == dst->height ? 0 : AVERROR_EXTERNAL;
+}
+
+// HDR 源的一个条带：缩放 -> 色调映射 -> 格式转换；swscale 的缩放在切条带之前已整帧完成
+static int tonemap_slice(OutputStream *ost, const AVFrame *src, int y0, int y1) {
+    AVFrame *sdr = ost->sdr_frame ? ost->sdr_frame : ost->frame;
+    int ret;
+
+    if (ost->scaled_frame) {
+        if (ost->ds_ctx) {
+            ret = downscale_frame(ost->ds_ctx, src, ost->scaled_frame, y0, y1 - y0);
+            if (ret < 0)
+                return ret;
+        }
+        src = ost->scaled_frame;
+    }
+    ret = tonemap_frame(ost->tm_ctx, src, sdr, y0, y1 - y0);
+    if (ret < 0 || sdr == ost->frame)
+        return ret;
+    return convert_frame(ost->cv_ctx, sdr, ost->frame, y0, y1 - y0);
+}
+
+static int scale_slice(void *arg, int job, int nb_jobs) {
+    scale_job_t *s = (scale_job_t *)arg;
+    OutputStream *ost = s->ost;
+    const AVFrame *src = s->src;
+    int h = ost->enc->height;
+    int y0 = slice_row(h, job, nb_jobs), y1 = slice_row(h, job + 1, nb_jobs);
+    int ret;
+
+    if (ost->tm_ctx)
+        return tonemap_slice(ost, src, y0, y1);
+    if (ost->ds_ctx) {
+        AVFrame *dst = ost->scaled_frame ? ost->scaled_frame : ost->frame;
+        ret = downscale_frame(ost->ds_ctx, src, dst, y0, y1 - y0);
+        if (ret < 0 || dst == ost->frame)
+            return ret;
+        src = dst;
+    }
+    if (ost->cv_ctx)
+        return convert_frame(ost->cv_ctx, src, ost->frame, y0, y1 - y0);
+    // swscale 在条带全部完成之后整帧处理
+    return 0;
+}
+
+/*
+按流水线缩放、转换一帧到 ost->frame
+swscale 只能整帧处理：HDR 源先整帧缩放到 scaled_frame 再切条带；其余情况在条带（面积平均缩小）之后整帧转换
+ */
+static int scale_frame(OutputStream *ost, const AVFrame *src) {
+    scale_job_t job;
+    int ret;
+
+    if (ost->sws_ctx && ost->tm_ctx && (ret = sws_frame(ost, src, ost->scaled_frame)) < 0)
+        return ret;
+    if (ost->tm_ctx || ost->ds_ctx || ost->cv_ctx) {
+        job.ost = ost;
+        job.src = src;
+        if ((ret = thread_pool_execute(scale_slice, &job, ost->nb_slices)) < 0)
+            return ret;
+    }
+    if (ost->sws_ctx && !ost->tm_ctx)
+        return sws_frame(ost, ost->ds_ctx ? ost->scaled_frame : src, ost->frame);
+    return 0;
+}
+
+/*
+隔行源的抽场决定，每帧判断：interlaced_frame 可以逐帧变化（如 MPEG-2 的逐行、隔行混编），
+只按第一帧决定时之后的隔行帧会按逐行帧缩放，两场交错成梳状纹
+只取先显示的那一场，把源帧看成行距加倍、高度减半的逐行帧交给后面的缩放，
+抽场与缩小合在同一遍里，隔行源读的行数反而只有逐行源的一半
+ */
+static int select_field(OutputStream *ost, const AVFrame *frame) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+
+    if (ost->deinterlace == MUXING_DEINTERLACE_OFF || !frame->interlaced_frame || frame->height < 8)
+        return 0;
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)))
+        return 0;
+    // 行平均：纵向缩小一半以上时，缩放的纵向窗口已覆盖两场的相邻行，直接缩小整帧
+    if (ost->deinterlace == MUXING_DEINTERLACE_BLEND && frame->height >= 2 * ost->enc->height)
+        return 0;
+    return frame->top_field_first ? 1 : 2;
+}
+
+// 让 field_frame 引用 frame 的一场
+static int field_view(OutputStream *ost, const AVFrame *frame) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    AVFrame *f = ost->field_frame;
+    int p, ret;
+
+    if (!f && !(f = ost->field_frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    if ((ret = av_frame_ref(f, frame)) < 0)
+        return ret;
+    // 4:2:0 隔行源的色度同样按场交错，各平面统一处理
+    for (p = 0; p < 4 && f->data[p]; p++) {
+        if (ost->field == 2)
+            f->data[p] += f->linesize[p];
+        f->linesize[p] *= 2;
+    }
+    f->height = (frame->height >> 1) & ~((1 << desc->log2_chroma_h) - 1);
+    f->interlaced_frame = 0;
+    return 0;
+}
+
+/*
+让 crop_frame 引用 frame 裁掉黑边后的部分，在抽场之前，抽场看到的已经是裁剪后的帧
+裁剪量比帧还大时（中途变小的流）不裁剪，返回 0；未裁剪的帧尺寸与流水线不同，
+由 get_video_frame() 按新的尺寸重建流水线，不会把尺寸不符的帧交给按裁剪后尺寸建立的上下文
+ */
+static int crop_view(OutputStream *ost, const AVFrame *frame) {
+    AVFrame *f = ost->crop_frame;
+    int ret;
+
+    if (ost->crop[0] + ost->crop[2] >= frame->width || ost->crop[1] + ost->crop[3] >= frame->height) {
+        if (!ost->crop_skipped)
+            av_log(NULL, AV_LOG_WARNING, "crop %d,%d,%d,%d does not fit %dx%d, scale the whole frame\n",
+                    ost->crop[0], ost->crop[1], ost->crop[2], ost->crop[3], frame->width, frame->height);
+        ost->crop_skipped = 1;
+        return 0;
+    }
+    ost->crop_skipped = 0;
+    if (!f && !(f = ost->crop_frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    if ((ret = av_frame_ref(f, frame)) < 0)
+        return ret;
+    f->crop_left = ost->crop[0];
+    f->crop_top = ost->crop[1];
+    f->crop_right = ost->crop[2];
+    f->crop_bottom = ost->crop[3];
+    // 缩放与格式转换都用非对齐加载，按实际的裁剪量偏移，不向左上取整
+    if ((ret = av_frame_apply_cropping(f, AV_FRAME_CROP_UNALIGNED)) < 0) {
+        av_frame_unref(f);
+        return ret;
+    }
+    return 1;
+}
+
 static AVFrame *get_video_frame(OutputStream *ost, AVFrame *frame) {
     AVCodecContext *c = ost->enc;
+    AVFrame *src = frame;
+    int ret, field;
+
+    if (ost->crop[0] || ost->crop[1] || ost->crop[2] || ost->crop[3]) {
+        if ((ret = crop_view(ost, frame)) < 0)
+            return 0;
+        if (ret > 0)
+            src = ost->crop_frame;
+    }
+    // 抽场与否、取哪一场决定了流水线的输入尺寸与行距，变化时重建流水线
+    field = select_field(ost, src);
+    if (field != ost->field) {
+        av_log(NULL, AV_LOG_INFO, "%dx%d %s\n", src->width, src->height,
+                !field ? "progressive, scale the whole frame" :
+                field == 1 ? "interlaced, scale the top field only" : "interlaced, scale the bottom field only");
+        if (ost->pipeline_ready) {
+            free_pipeline(ost);
+            ost->pipeline_ready = 0;
+        }
+        ost->field = field;
+    }
+    if (ost->field) {
+        if (field_view(ost, src) < 0)
+            goto fail;
+        src = ost->field_frame;
+    }
 
-    if (c->pix_fmt != frame->format || c->width != frame->width) {
+    if (src != frame || ost->pix_fmt != frame->format || c->width != frame->width || c->height != frame->height ||
+        (ost->tonemap && tonemap_needed(frame))) {
         /* when we pass a frame to the encoder, it may keep a reference to it
          * internally; make sure we do not overwrite it here */
-        if (av_frame_make_writable(ost->frame) < 0)
-            return 0;
+        if (frame_pool_renew_frame(ost->frame) < 0)
+            goto fail;
 
-        if (!ost->sws_ctx) {
-            ost->sws_ctx = sws_getContext(frame->width, frame->height,
-                                          frame->format,
-                                          c->width, c->height,
-                                          c->pix_fmt,
-                                          SWS_FAST_BILINEAR, NULL, NULL, NULL);
-            if (!ost->sws_ctx) {
-                av_log(NULL, AV_LOG_ERROR,
-                        "Could not initialize the conversion context\n");
-                return 0;
-            }
+        // 各级上下文都按建立时的源尺寸、格式初始化，中途分辨率变化的流重建流水线继续缩放
+        if (ost->pipeline_ready &&
+            (src->width != ost->pipe_w || src->height != ost->pipe_h || src->format != ost->pipe_fmt)) {
+            av_log(NULL, AV_LOG_INFO, "source changed %dx%d %s -> %dx%d %s, rebuild the scaling pipeline\n",
+                    ost->pipe_w, ost->pipe_h, av_get_pix_fmt_name(ost->pipe_fmt),
+                    src->width, src->height, av_get_pix_fmt_name(src->format));
+            free_pipeline(ost);
+            ost->pipeline_ready = 0;
+        }
+
+        if (!ost->pipeline_ready && init_pipeline(ost, src) < 0)
+            goto fail;
+        ret = scale_frame(ost, src);
+        if (ost->field)
+            av_frame_unref(ost->field_frame);
+        av_frame_unref(ost->crop_frame);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not scale frame\n");
+            return 0;
         }
-        sws_scale(ost->sws_ctx, (const uint8_t *const *)frame->data,
-                  frame->linesize, 0, frame->height, ost->frame->data,
-                  ost->frame->linesize);
-        ost->frame->pts = ost->next_pts++;
-        return ost->frame;
+    } else if (ost->wm || ost->wm_cv) {
+        // 不需要缩放的帧是调用者的，加水印前复制一份
+        if (frame_pool_renew_frame(ost->frame) < 0 || av_frame_copy(ost->frame, frame) < 0)
+            goto fail;
     } else {
         frame->pts = ost->next_pts++;
         return frame;
     }
+    if (watermark_apply(ost->wm, ost->frame) < 0)
+        av_log(NULL, AV_LOG_WARNING, "Could not apply watermark\n");
+    if (ost->wm_cv) {
+        if (frame_pool_renew_frame(ost->wm_frame) < 0 ||
+            convert_frame(ost->wm_cv, ost->frame, ost->wm_frame, 0, ost->frame->height) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not convert watermarked frame\n");
+            return 0;
+        }
+        ost->wm_frame->pts = ost->next_pts++;
+        return ost->wm_frame;
+    }
+    ost->frame->pts = ost->next_pts++;
+    return ost->frame;
+fail:
+    if (ost->field)
+        av_frame_unref(ost->field_frame);
+    av_frame_unref(ost->crop_frame);
+    return 0;
 }
 
-/*
- * encode one video frame and send it to the muxer
- * return 1 when encoding is finished, 0 otherwise
- */
-static int write_video_frame(AVFormatContext *oc, OutputStream *ost, AVFrame *frame) {
+// 把一帧送进编码器，并写出所有已编码的包
+static int encode_video_frame(AVFormatContext *oc, OutputStream *ost, AVFrame *frame) {
+    AVCodecContext *c = ost->enc;
     int ret;
-    AVCodecContext *c;
-
-    c = ost->enc;
-
-    frame = get_video_frame(ost, frame);
 
     /* encode the image */
     ret = avcodec_send_frame(c, frame);
@@ -294,13 +755,459 @@ static int write_video_frame(AVFormatContext *oc, OutputStream *ost, AVFrame *fr
     return ret;
 }
 
+typedef struct pal_job {
+    OutputStream *ost;
+    AVFrame **out;
+    int dither;
+    int step; // out[i] 由 pal_queue[i * step] 映射
+} pal_job_t;
+
+// 各帧独立映射，在线程池中按帧并行
+static int map_palette_frame(void *arg, int job, int nb_jobs) {
+    pal_job_t *j = (pal_job_t *)arg;
+    OutputStream *ost = j->ost;
+    AVFrame *src = ost->pal_queue[job * j->step];
+    AVFrame *dst = alloc_picture(AV_PIX_FMT_PAL8, src->width, src->height);
+    int ret;
+
+    (void)nb_jobs;
+    if (!dst)
+        return AVERROR(ENOMEM);
+    ret = palette_map(ost->pal_ctx, src, dst, j->dither);
+    if (ret < 0) {
+        av_frame_free(&dst);
+        return ret;
+    }
+    dst->pts = src->pts;
+    j->out[job] = dst;
+    return 0;
+}
+
+// 按编码参数再打开一个 GIF 编码器
+static AVCodecContext *open_chunk_encoder(OutputStream *ost) {
+    AVCodecContext *c = ost->enc;
+    AVCodecContext *enc = avcodec_alloc_context3(c->codec);
+
+    if (!enc)
+        return NULL;
+    enc->width = c->width;
+    enc->height = c->height;
+    enc->pix_fmt = c->pix_fmt;
+    enc->time_base = c->time_base;
+    enc->flags = c->flags;
+    if (avcodec_open2(enc, c->codec, NULL) < 0)
+        avcodec_free_context(&enc);
+    return enc;
+}
+
+// 编码一帧，GIF 编码器没有延迟，每帧恰好输出一个包
+static int encode_packet(AVCodecContext *enc, AVFrame *frame, AVPacket *pkt) {
+    int ret = avcodec_send_frame(enc, frame);
+
+    if (ret < 0)
+        return ret;
+    ret = avcodec_receive_packet(enc, pkt);
+    return ret == AVERROR(EAGAIN) ? 0 : ret;
+}
+
+/*
+字节预算下编码一帧 JPEG 并写出
+超出预算时按实测大小估计 qscale，用同一帧（已缩放好）重新编码一次
+ */
+static int encode_jpeg_budget(AVFormatContext *oc, OutputStream *ost, AVFrame *frame) {
+    AVCodecContext *c = ost->enc;
+    int64_t pts = frame->pts;
+    double q = BUDGET_JPEG_Q;
+    int ret, attempt;
+
+    for (attempt = 0; ; attempt++) {
+        frame->quality = (int)(q * FF_QP2LAMBDA + 0.5);
+        // 编码器要求 pts 递增，重新编码的帧换一个 pts，写出时再改回来
+        frame->pts = pts + attempt;
+        ret = encode_packet(c, frame, ost->pkt);
+        if (ret < 0 || ost->pkt->size <= ost->max_bytes || attempt == 1 || q >= 31)
+            break;
+        // JPEG 的大小约与 qscale 的 0.7 次方成反比，留 10% 的余量
+        q = FFMIN(31, q * pow(ost->pkt->size / (0.9 * ost->max_bytes), 1 / 0.7));
+        av_log(NULL, AV_LOG_INFO, "jpeg %d bytes over budget %"PRId64", re-encode at qscale %.1f\n",
+               ost->pkt->size, ost->max_bytes, q);
+        av_packet_unref(ost->pkt);
+    }
+    frame->pts = pts;
+    ost->next_pts = FFMAX(ost->next_pts, pts + attempt + 1);
+    if (ret >= 0 && ost->pkt->size) {
+        ost->pkt->pts = ost->pkt->dts = pts;
+        ret = write_frame(oc, &c->time_base, ost->st, ost->pkt);
+        if (ret < 0)
+            av_log(NULL, AV_LOG_ERROR, "Error while writing video frame: %s\n", av_err2str(ret));
+    }
+    av_packet_unref(ost->pkt);
+    return ret;
+}
+
+typedef struct gif_job {
+    OutputStream *ost;
+    AVFrame **frames; // PAL8
+    AVPacket **pkts;
+    int64_t seq0; // frames[0] 的帧序号
+    int64_t end_pts; // frames[n - 1] 之后下一帧的 pts
+    int n;
+} gif_job_t;
+
+/*
+编码连续的一段帧
+GIF 编码器按上一帧裁剪变化的区域，并记住第一帧的调色板作为全局调色板，
+段首的编码器先编码（并丢弃）这两帧，使它的状态与顺序编码时一致，输出也就完全相同
+ */
+static int encode_chunk(void *arg, int job, int nb_jobs) {
+    gif_job_t *j = (gif_job_t *)arg;
+    OutputStream *ost = j->ost;
+    AVCodecContext *enc = job ? ost->chunk_enc[job] : ost->enc;
+    int64_t *last = &ost->chunk_seq[job];
+    int a = (int)((int64_t)job * j->n / nb_jobs), b = (int)((int64_t)(job + 1) * j->n / nb_jobs);
+    AVFrame *prev = a ? j->frames[a - 1] : ost->last_pal;
+    AVPacket *scratch = NULL;
+    int i, ret = 0;
+
+    if ((!*last && j->seq0 + a != 1) || (prev && *last != j->seq0 + a - 1)) {
+        scratch = av_packet_alloc();
+        if (!scratch)
+            return AVERROR(ENOMEM);
+    }
+    if (!*last && j->seq0 + a != 1) {
+        ret = encode_packet(enc, ost->first_pal, scratch);
+        av_packet_unref(scratch);
+        if (ret < 0)
+            goto end;
+        *last = 1;
+    }
+    if (prev && *last != j->seq0 + a - 1) {
+        ret = encode_packet(enc, prev, scratch);
+        av_packet_unref(scratch);
+        if (ret < 0)
+            goto end;
+    }
+    for (i = a; i < b; i++) {
+        ret = encode_packet(enc, j->frames[i], j->pkts[i]);
+        if (ret < 0)
+            goto end;
+    }
+    *last = j->seq0 + b - 1;
+end:
+    if (ret < 0)
+        *last = -1;
+    av_packet_free(&scratch);
+    return ret;
+}
+
+// 自带的写出器：各帧只依赖上一帧的像素，没有其他状态，每段一个写出器（各自的 arena）
+static int write_gif_chunk(void *arg, int job, int nb_jobs) {
+    gif_job_t *j = (gif_job_t *)arg;
+    OutputStream *ost = j->ost;
+    int a = (int)((int64_t)job * j->n / nb_jobs), b = (int)((int64_t)(job + 1) * j->n / nb_jobs);
+    int i, ret;
+
+    for (i = a; i < b; i++) {
+        AVFrame *prev = i ? j->frames[i - 1] : ost->last_pal;
+        int64_t next = i + 1 < j->n ? j->frames[i + 1]->pts : j->end_pts;
+        int delay = (int)av_rescale_q(next - j->frames[i]->pts, ost->enc->time_base, (AVRational){1, 100});
+        ret = gif_writer_frame(ost->gif_writer[job], j->frames[i], prev, ost->gif_pal, delay,
+                               ost->transparency ? GIF_TRANSPARENT_INDEX : -1, j->pkts[i]);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+// 把 n 帧 PAL8 分段，在线程池中并行编码，pkts[] 按帧的顺序返回
+static int encode_frames(OutputStream *ost, AVFrame **frames, AVPacket **pkts, int n, int64_t end_pts) {
+    gif_job_t job;
+    thread_pool_job_fn fn;
+    int i, nb;
+
+    for (i = 0; i < n; i++)
+        if (!(pkts[i] = av_packet_alloc()))
+            return AVERROR(ENOMEM);
+    if (ost->gif_native) {
+        nb = av_clip(FFMIN(thread_pool_threads(), n), 1, MAX_GIF_ENCODERS);
+        for (i = 0; i < nb; i++) {
+            if (!ost->gif_writer[i] && !(ost->gif_writer[i] = gif_writer_init(ost->enc->width, ost->enc->height, ost->gif_lossy))) {
+                if (!i)
+                    return AVERROR(ENOMEM);
+                nb = i;
+                break;
+            }
+            gif_writer_set_lossy(ost->gif_writer[i], FFMAX(ost->gif_lossy, k_budget_levels[ost->budget_level].lossy));
+        }
+        // 第一帧的调色板作为全局调色板
+        if (!ost->pal_seq)
+            memcpy(ost->gif_pal, frames[0]->data[1], AVPALETTE_SIZE);
+        fn = write_gif_chunk;
+    } else {
+        nb = av_clip(FFMIN(thread_pool_threads(), n / MIN_CHUNK_FRAMES), 1, MAX_GIF_ENCODERS);
+        for (i = 1; i < nb; i++) {
+            if (!ost->chunk_enc[i] && !(ost->chunk_enc[i] = open_chunk_encoder(ost))) {
+                nb = i;
+                break;
+            }
+        }
+        if (!ost->pal_seq && !(ost->first_pal = av_frame_clone(frames[0])))
+            return AVERROR(ENOMEM);
+        fn = encode_chunk;
+    }
+
+    job.ost = ost;
+    job.frames = frames;
+    job.pkts = pkts;
+    job.seq0 = ost->pal_seq + 1;
+    job.end_pts = end_pts;
+    job.n = n;
+    return thread_pool_execute(fn, &job, nb);
+}
+
+// 按当前的降级档位为已缓存的帧生成调色板，映射为 PAL8 并行编码，*m 返回编码的帧数
+static int encode_palette_frames(OutputStream *ost, AVFrame **out, AVPacket **pkts, int *m, int64_t end_pts) {
+    const budget_level_t *lv = &k_budget_levels[ost->budget_level];
+    pal_job_t job;
+    int n = ost->nb_queued, ret;
+
+    *m = 0;
+    ret = palette_build2(ost->pal_ctx, lv->colors);
+    if (ret < 0)
+        return ret;
+    av_log(NULL, AV_LOG_INFO, "palette %d colors for %d frames\n", ret, n);
+    job.ost = ost;
+    job.out = out;
+    job.dither = ost->dither == MUXING_DITHER_DIFFUSION ? PALETTE_DITHER_DIFFUSION :
+                 ost->dither == MUXING_DITHER_ORDERED ? PALETTE_DITHER_ORDERED : PALETTE_DITHER_NONE;
+    job.step = lv->step;
+    *m = (n + lv->step - 1) / lv->step;
+    ret = thread_pool_execute(map_palette_frame, &job, *m);
+    if (ret < 0)
+        return ret;
+    return encode_frames(ost, out, pkts, *m, end_pts);
+}
+
+/*
+字节预算：*remaining 为除去已写出的、文件头与结尾之后还能写的字节数，返回分给这一批的字节数
+不是最后一批时按帧数（pts 跨度）与预计的剩余帧数的比例分配
+ */
+static int64_t batch_budget(AVFormatContext *oc, OutputStream *ost, int64_t end_pts, int last, int64_t *remaining) {
+    int64_t start = ost->pal_queue[0]->pts, span = end_pts - start;
+
+    *remaining = ost->max_bytes - avio_tell(oc->pb) - (ost->gif_started ? 0 : GIF_HEADER_SIZE) - 1;
+    if (last || ost->expected_frames <= 0 || *remaining <= 0)
+        return *remaining;
+    return *remaining * span / FFMAX(ost->expected_frames - start, span);
+}
+
+// 实测第 level 档的输出为 size 字节，返回预计不超过 budget 的第一个档位
+static int next_budget_level(int level, int64_t size, int64_t budget) {
+    int i;
+
+    for (i = level + 1; i < NB_BUDGET_LEVELS - 1; i++)
+        if (size * k_budget_levels[i].size / k_budget_levels[level].size <= budget * 0.9)
+            break;
+    return i;
+}
+
+/*
+为已缓存的帧生成调色板，映射为 PAL8 并行编码后按顺序写出
+end_pts 为缓存的帧之后下一帧的 pts，last 表示之后不再有帧
+有字节预算时先按当前档位编码，超出这一批的预算时按实测大小选出档位，从缓存的帧重新编码一次，
+仍然超出剩余的字节数时截掉末尾的帧，之后的帧全部丢弃
+ */
+static int flush_palette(AVFormatContext *oc, OutputStream *ost, int64_t end_pts, int last) {
+    AVFrame *out[MAX_PAL_FRAMES] = {NULL};
+    AVPacket *pkts[MAX_PAL_FRAMES] = {NULL};
+    int64_t budget = 0, remaining = 0, size;
+    int i, n = ost->nb_queued, m = 0, attempt, ret;
+    int budgeted = ost->max_bytes > 0 && ost->gif_native;
+
+    if (!n)
+        return 0;
+    if (budgeted)
+        budget = batch_budget(oc, ost, end_pts, last, &remaining);
+    for (attempt = 0; ; attempt++) {
+        ret = encode_palette_frames(ost, out, pkts, &m, end_pts);
+        if (ret < 0 || !budgeted || attempt == 1 || ost->budget_level == NB_BUDGET_LEVELS - 1)
+            break;
+        for (i = 0, size = 0; i < m; i++)
+            size += pkts[i]->size;
+        if (size <= budget)
+            break;
+        ost->budget_level = next_budget_level(ost->budget_level, size, budget);
+        av_log(NULL, AV_LOG_INFO, "%d frames %"PRId64" bytes over budget %"PRId64", re-encode at level %d\n",
+               n, size, budget, ost->budget_level);
+        for (i = 0; i < m; i++) {
+            av_packet_free(&pkts[i]);
+            av_frame_free(&out[i]);
+        }
+    }
+    for (i = 0; i < n; i++)
+        av_frame_free(&ost->pal_queue[i]);
+    if (ret >= 0) {
+        ost->pal_seq += m;
+        av_frame_free(&ost->last_pal);
+        ost->last_pal = av_frame_clone(out[m - 1]);
+    }
+    if (ret >= 0 && budgeted) {
+        for (i = 0, size = 0; i < m && size + pkts[i]->size <= remaining; i++)
+            size += pkts[i]->size;
+        if (i < m) {
+            av_log(NULL, AV_LOG_WARNING, "byte budget exhausted, %d frames dropped\n", m - i);
+            ost->budget_full = 1;
+            for (; i < m; i++)
+                pkts[i]->size = 0;
+        }
+    }
+    if (ret >= 0 && ost->gif_native && !ost->gif_started) {
+        gif_writer_header(oc->pb, ost->enc->width, ost->enc->height, ost->gif_pal, 0);
+        ost->gif_started = 1;
+    }
+    for (i = 0; i < m; i++) {
+        if (ret >= 0 && pkts[i] && pkts[i]->size && ost->gif_native) {
+            avio_write(oc->pb, pkts[i]->data, pkts[i]->size);
+        } else if (ret >= 0 && pkts[i] && pkts[i]->size) {
+            ret = write_frame(oc, &ost->enc->time_base, ost->st, pkts[i]);
+            if (ret < 0)
+                av_log(NULL, AV_LOG_ERROR, "Error while writing video frame: %s\n", av_err2str(ret));
+        }
+        av_packet_free(&pkts[i]);
+        av_frame_free(&out[i]);
+    }
+    ost->nb_queued = 0;
+    palette_reset(ost->pal_ctx);
+    return ret;
+}
+
+// 缓存一帧 RGB24，分场景模式下遇到场景切换时先为之前的帧生成调色板
+static int queue_palette_frame(AVFormatContext *oc, OutputStream *ost, AVFrame *frame) {
+    AVFrame *ref;
+    int ret;
+
+    // 保留透明色时调色板少一项，映射后不会出现这个索引，
+    // 自带的写出器用它标记不变的像素，libavcodec 的编码器（transdiff）也会选中这个空位
+    if (!ost->pal_ctx && !(ost->pal_ctx = palette_init(ost->transparency ? GIF_TRANSPARENT_INDEX : AVPALETTE_COUNT)))
+        return AVERROR(ENOMEM);
+    ret = palette_add_frame(ost->pal_ctx, frame, ost->palette == MUXING_PALETTE_SCENE);
+    if (ret > 0 || ost->nb_queued == MAX_PAL_FRAMES) {
+        if ((ret = flush_palette(oc, ost, frame->pts, 0)) < 0)
+            return ret;
+        ret = palette_add_frame(ost->pal_ctx, frame, 0);
+    }
+    if (ret < 0)
+        return ret;
+
+    // 只增加引用，ost->frame 下次使用前会换成新的缓存
+    ref = av_frame_alloc();
+    if (!ref)
+        return AVERROR(ENOMEM);
+    if ((ret = av_frame_ref(ref, frame)) < 0) {
+        av_frame_free(&ref);
+        return ret;
+    }
+    ost->pal_queue[ost->nb_queued++] = ref;
+    return 0;
+}
+
+// 一行的绝对差之和
+static int64_t row_sad(const uint8_t *a, const uint8_t *b, int n) {
+    int64_t sad = 0;
+    int x = 0;
+#ifdef MUXING_X86
+    __m128i acc = _mm_setzero_si128();
+    int64_t part[2];
+
+    for (; x + 16 <= n; x += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + x)),
+                                              _mm_loadu_si128((const __m128i *)(b + x))));
+    _mm_storeu_si128((__m128i *)part, acc);
+    sad = part[0] + part[1];
+#endif
+    for (; x < n; x++)
+        sad += FFABS(a[x] - b[x]);
+    return sad;
+}
+
+/*
+是否与上一个保留的帧几乎相同：每一行的平均绝对差（按字节）都不超过 ost->dedup
+按行判断而不是整帧，局部的小变化（如屏幕录制中的鼠标）不会被平均掉；有一行超过即返回，变化的帧代价很小
+ */
+static int is_duplicate(const OutputStream *ost, const AVFrame *frame) {
+    const AVFrame *ref = ost->dedup_ref;
+    int n = av_image_get_linesize(frame->format, frame->width, 0), y;
+
+    if (!ref || ref->format != frame->format || ref->width != frame->width || ref->height != frame->height || n <= 0)
+        return 0;
+    for (y = 0; y < frame->height; y++)
+        if (row_sad(frame->data[0] + (ptrdiff_t)y * frame->linesize[0],
+                    ref->data[0] + (ptrdiff_t)y * ref->linesize[0], n) > (int64_t)ost->dedup * n)
+            return 0;
+    return 1;
+}
+
+/*
+ * encode one video frame and send it to the muxer
+ * return 1 when encoding is finished, 0 otherwise
+ */
+static int write_video_frame(AVFormatContext *oc, OutputStream *ost, AVFrame *frame) {
+    if (ost->budget_full)
+        return 0;
+    frame = get_video_frame(ost, frame);
+
+    // GIF 的帧时长由下一帧的 pts 决定，去掉重复的帧就是延长上一帧的显示时间
+    if (frame && ost->dedup && ost->enc->codec_id == AV_CODEC_ID_GIF) {
+        ost->end_pts = frame->pts + 1;
+        if (is_duplicate(ost, frame)) {
+            ost->nb_dropped++;
+            return 0;
+        }
+        av_frame_free(&ost->dedup_ref);
+        if (!(ost->dedup_ref = av_frame_clone(frame)))
+            return AVERROR(ENOMEM);
+    } else if (frame) {
+        ost->end_pts = frame->pts + 1;
+    }
+
+    if (ost->enc->pix_fmt == AV_PIX_FMT_PAL8) {
+        if (!frame)
+            return -1;
+        return queue_palette_frame(oc, ost, frame);
+    }
+    if (frame && ost->max_bytes > 0 && ost->enc->codec_id == AV_CODEC_ID_MJPEG)
+        return encode_jpeg_budget(oc, ost, frame);
+    return encode_video_frame(oc, ost, frame);
+}
+
 static void close_stream(AVFormatContext *oc, OutputStream *ost) {
+    int i;
+
     (void)oc;
+    for (i = 0; i < ost->nb_queued; i++)
+        av_frame_free(&ost->pal_queue[i]);
+    ost->nb_queued = 0;
+    palette_free(ost->pal_ctx);
+    ost->pal_ctx = NULL;
+    for (i = 1; i < MAX_GIF_ENCODERS; i++)
+        avcodec_free_context(&ost->chunk_enc[i]);
+    av_frame_free(&ost->first_pal);
+    av_frame_free(&ost->last_pal);
+    av_frame_free(&ost->dedup_ref);
+    for (i = 0; i < MAX_GIF_ENCODERS; i++)
+        gif_writer_free(ost->gif_writer[i]);
+    memset(ost->gif_writer, 0, sizeof(ost->gif_writer));
     avcodec_free_context(&ost->enc);
     av_frame_free(&ost->frame);
-    av_frame_free(&ost->tmp_frame);
     av_packet_free(&ost->pkt);
-    sws_freeContext(ost->sws_ctx);
+    av_frame_free(&ost->field_frame);
+    av_frame_free(&ost->crop_frame);
+    watermark_unref(ost->wm);
+    ost->wm = NULL;
+    convert_free(ost->wm_cv);
+    ost->wm_cv = NULL;
+    av_frame_free(&ost->wm_frame);
+    free_pipeline(ost);
 }
 
 /* end 从 github.com/FFmpeg/FFmpeg/doc/examples/muxing.c 摘抄的代码 */
@@ -316,6 +1223,7 @@ typedef struct muxing_context {
     AVFormatContext *oc; // 出流的 AV Format 的上下文
     AVCodec *audio_codec, *video_codec; // 音视频流的解码器
     AVDictionary *opt;
+    muxing_opts_t opts;
 } muxing_context_t;
 
 static void ensure_file_path(const char *filename) {
@@ -336,16 +1244,37 @@ static void ensure_file_path(const char *filename) {
     free(path);
 }
 
+void muxing_opts_default(muxing_opts_t* opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->scaler = MUXING_SCALER_AUTO;
+    opts->dither = MUXING_DITHER_ORDERED;
+    opts->tonemap = 1;
+    opts->palette = MUXING_PALETTE_FIXED;
+    opts->transparency = 1;
+    opts->dedup = 2;
+}
+
+void* muxing_begin(const char* formatname, const char* filename, const int dst_framerate, const int dst_width, const int dst_hight)
+{
+    return muxing_begin2(formatname, filename, dst_framerate, dst_width, dst_hight, NULL);
+}
+
 /* 
 视频文件，demux 将视频与音频文件分开解码（两者可以同时处理）
+opts 为 NULL 时使用默认选项
  */
-void* muxing_begin(const char* formatname, const char* filename, const int dst_framerate, const int dst_width, const int dst_hight)
+void* muxing_begin2(const char* formatname, const char* filename, const int dst_framerate, const int dst_width, const int dst_hight, const muxing_opts_t* opts)
 {
     int ret;
     // 使用 libavutil 提供的内存分配
     muxing_context_t* mctx = (muxing_context_t*)av_mallocz(sizeof(muxing_context_t));
     if (!mctx)
         goto end;
+    if (opts)
+        mctx->opts = *opts;
+    else
+        muxing_opts_default(&mctx->opts);
     // 准备输出的 media 文件的上下文，判断格式
     if (NULL != filename) {
         avformat_alloc_output_context2(&mctx->oc, NULL, NULL, filename);
@@ -388,6 +1317,24 @@ void* muxing_begin(const char* formatname, const char* filename, const int dst_f
     // demux 分开同时处理音频与视频
     if (mctx->fmt->video_codec != AV_CODEC_ID_NONE) {
         add_stream(&mctx->video_st, mctx->oc, &mctx->video_codec, mctx->fmt->video_codec, dst_framerate, dst_width, dst_hight);
+        mctx->video_st.scaler = mctx->opts.scaler;
+        mctx->video_st.dither = mctx->opts.dither;
+        mctx->video_st.tonemap = mctx->opts.tonemap;
+        mctx->video_st.deinterlace = mctx->opts.deinterlace;
+        mctx->video_st.palette = mctx->opts.palette;
+        mctx->video_st.transparency = mctx->opts.transparency;
+        mctx->video_st.gif_lossy = mctx->opts.gif_lossy;
+        mctx->video_st.dedup = mctx->opts.dedup;
+        mctx->video_st.max_bytes = mctx->opts.max_bytes;
+        mctx->video_st.expected_frames = mctx->opts.expected_frames;
+        mctx->video_st.crop[0] = mctx->opts.crop_left;
+        mctx->video_st.crop[1] = mctx->opts.crop_top;
+        mctx->video_st.crop[2] = mctx->opts.crop_right;
+        mctx->video_st.crop[3] = mctx->opts.crop_bottom;
+        mctx->video_st.has_wm = mctx->opts.watermark != NULL;
+        // 字节预算需要在写出前反复编码同一批帧，只有自带的写出器没有跨批的编码器状态
+        mctx->video_st.gif_native = (mctx->opts.gif_writer == MUXING_GIF_WRITER_NATIVE || mctx->opts.max_bytes > 0) &&
+                mctx->fmt->video_codec == AV_CODEC_ID_GIF && mctx->opts.palette != MUXING_PALETTE_FIXED;
     }
     if (mctx->fmt->audio_codec != AV_CODEC_ID_NONE) {
         add_stream(&mctx->audio_st, mctx->oc, &mctx->audio_codec, mctx->fmt->audio_codec, dst_framerate, dst_width, dst_hight);
@@ -395,8 +1342,14 @@ void* muxing_begin(const char* formatname, const char* filename, const int dst_f
 
     /* Now that all the parameters are set, we can open the audio and
      * video codecs and allocate the necessary encode buffers. */
-    if (mctx->fmt->video_codec != AV_CODEC_ID_NONE)
+    if (mctx->fmt->video_codec != AV_CODEC_ID_NONE) {
         open_video(mctx->oc, mctx->video_codec, &mctx->video_st, mctx->opt);
+        // 水印在缩放、格式转换之后直接叠加到编码前的帧上
+        if (mctx->opts.watermark && mctx->video_st.enc)
+            mctx->video_st.wm = watermark_get((const uint8_t *)mctx->opts.watermark, mctx->opts.watermark_size,
+                    mctx->opts.watermark_position, mctx->opts.watermark_percent,
+                    mctx->video_st.enc->width, mctx->video_st.enc->height, mctx->video_st.pix_fmt);
+    }
         
 
     av_dump_format(mctx->oc, 0, filename, 1);
@@ -421,7 +1374,8 @@ void* muxing_begin(const char* formatname, const char* filename, const int dst_f
     }
 
     /* Write the stream header, if any. */
-    ret = avformat_write_header(mctx->oc, &mctx->opt);
+    // 自带的 GIF 写出器在第一批帧编码时才知道全局调色板，文件头到那时再写
+    ret = mctx->video_st.gif_native ? 0 : avformat_write_header(mctx->oc, &mctx->opt);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Error occurred when opening output file: %s\n",
                 av_err2str(ret));
@@ -475,18 +1429,43 @@ int muxing_write_audio(void *ctx, AVFrame *frame) {
     return 0;
 }
 
+/*
+写出尾部、关闭流并取出输出
+最后一组帧编码、写出失败时仍然收尾释放，但 *outsz 置 0 并返回错误，不把截断的文件当作成功
+ */
 int muxing_end(void *ctx, void* outbuff, int outbufflen, int* outsz) {
     unsigned char *buffer;
+    int ret = 0;
     if (ctx == NULL) {
         return -1;
     }
 
     muxing_context_t *mctx = ctx;
+    // 自适应调色板缓存的最后一组帧
+    if (mctx->fmt->video_codec != AV_CODEC_ID_NONE && mctx->video_st.nb_queued)
+        ret = flush_palette(mctx->oc, &mctx->video_st, mctx->video_st.end_pts, 1);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Could not flush the last palette batch, err:%d\n", ret);
     /* Write the trailer, if any. The trailer must be written before you
      * close the CodecContexts open when you wrote the header; otherwise
      * av_write_trailer() may try to use memory that was freed on
      * av_codec_close(). */
-    av_write_trailer(mctx->oc);
+    if (mctx->video_st.nb_dropped)
+        av_log(NULL, AV_LOG_INFO, "dropped %d duplicate frames\n", mctx->video_st.nb_dropped);
+    if (mctx->video_st.gif_native) {
+        // 没有任何帧时也输出一个合法的空文件
+        if (!mctx->video_st.gif_started)
+            gif_writer_header(mctx->oc->pb, mctx->video_st.enc->width, mctx->video_st.enc->height,
+                              mctx->video_st.gif_pal, 0);
+        gif_writer_trailer(mctx->oc->pb);
+    } else {
+        // gif 封装按下一个包的 pts 计算时长，最后一帧之后去掉的帧由 final_delay 补上
+        if (mctx->video_st.nb_dropped && mctx->video_st.dedup_ref)
+            av_opt_set_int(mctx->oc->priv_data, "final_delay",
+                           av_rescale_q(mctx->video_st.end_pts - mctx->video_st.dedup_ref->pts,
+                                        mctx->video_st.enc->time_base, (AVRational){1, 100}), 0);
+        av_write_trailer(mctx->oc);
+    }
 
     /* Close each codec. */
     if (mctx->fmt->video_codec != AV_CODEC_ID_NONE)
@@ -502,7 +1481,9 @@ int muxing_end(void *ctx, void* outbuff, int outbufflen, int* outsz) {
         if (outsz && outbuff) {
             *outsz = avio_close_dyn_buf(mctx->oc->pb, &buffer);
             /* Out of buff len */
-            if (outbufflen < *outsz) {
+            if (ret < 0) {
+                *outsz = 0;
+            } else if (outbufflen < *outsz) {
                 av_log(NULL, AV_LOG_ERROR, "outsz:%d larger than outbufflen:%d", *outsz, outbufflen);
                 *outsz = 0;
             }
@@ -517,5 +1498,5 @@ int muxing_end(void *ctx, void* outbuff, int outbufflen, int* outsz) {
     avformat_free_context(mctx->oc);
 
     av_free(mctx);
-    return 0;
+    return ret;
 }
@@ -1,10 +1,67 @@
+#ifndef __MUXING_H__
+#define __MUXING_H__
 
 #include <libavcodec/avcodec.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// 缩放输出帧时使用的缩放器
+enum {
+    MUXING_SCALER_AUTO = 0, // 缩小比例不小于 2 且源像素格式支持时使用面积平均，否则使用 swscale
+    MUXING_SCALER_SWS,      // 总是使用 swscale（SWS_FAST_BILINEAR）
+    MUXING_SCALER_AREA,     // 尽量使用面积平均，源像素格式不支持时回退到 swscale
+};
+
+// 输出为调色板格式（GIF）时的抖动方式
+enum {
+    MUXING_DITHER_NONE = 0,
+    MUXING_DITHER_ORDERED,   // 4x4 Bayer 有序抖动
+    MUXING_DITHER_DIFFUSION, // Floyd-Steinberg 误差扩散，只用于自适应调色板，固定调色板时同 ORDERED
+};
+
+// GIF 的调色板
+enum {
+    MUXING_PALETTE_FIXED = 0, // 固定的 3:3:2 调色板（RGB8）
+    MUXING_PALETTE_GLOBAL,    // 按所有帧生成一个调色板
+    MUXING_PALETTE_SCENE,     // 每个场景一个调色板
+};
+
+// 隔行源（帧标记为 interlaced_frame）的去隔行方式，都在缩放的同一遍里完成
+enum {
+    MUXING_DEINTERLACE_AUTO = 0, // 只取先显示的一场（抽行）
+    MUXING_DEINTERLACE_OFF,      // 不处理，按逐行帧缩放
+    MUXING_DEINTERLACE_BLEND,    // 纵向缩小一半以上时由缩放窗口对两场做行平均，否则同 AUTO
+};
+
+// GIF 的编码与封装
+enum {
+    MUXING_GIF_WRITER_LAVC = 0, // libavcodec 的 gif 编码器与 libavformat 的 gif 封装
+    MUXING_GIF_WRITER_NATIVE,   // 自带的写出器（gif_writer.c），只用于自适应调色板
+};
+
+typedef struct muxing_opts {
+    int scaler; // MUXING_SCALER_*
+    int dither; // MUXING_DITHER_*
+    int tonemap; // 非 0 时 PQ/HLG 源色调映射为 BT.709 SDR，默认开启
+    int deinterlace; // MUXING_DEINTERLACE_*
+    int palette; // MUXING_PALETTE_*，默认 FIXED；自适应调色板画质高得多，但要缓存整批帧、统计直方图，256 色时文件比 RGB8 大
+    int gif_writer; // MUXING_GIF_WRITER_*
+    int gif_lossy; // 有损 LZW 的程度，0 为无损，1 - 200 越大越小、越失真，只用于自带的写出器
+    int dedup; // GIF 去掉与上一帧几乎相同的帧并延长上一帧的时长：每行的平均绝对差（按字节）都不超过该值时视为相同，0 不去重，默认 2
+    int64_t max_bytes; // 输出大小的上限，超出时降低质量：GIF 减少颜色、有损压缩、降低帧率（使用自带的写出器），JPEG 提高 qscale；0 不限制
+    int expected_frames; // 预计写入的总帧数，有字节预算时用于给分批编码的 GIF 分配字节数，0 表示未知
+    int transparency; // 非 0 时自适应调色板保留一个透明色，与上一帧相同的像素编码为透明，默认开启
+    int crop_left, crop_top, crop_right, crop_bottom; // 缩放前裁掉源帧各边的像素数（如 cropdetect.c 检测的黑边），只偏移数据指针，不复制
+    const void *watermark; // 水印图片的文件数据（PNG 等，可带透明度），NULL 不加；缩放、转换好的水印按输出尺寸缓存（watermark.c）
+    int watermark_size;
+    int watermark_position; // WATERMARK_*（watermark.h）
+    int watermark_percent; // 水印宽度占输出宽度的百分比，0 为默认值
+} muxing_opts_t;
+
+void muxing_opts_default(muxing_opts_t* opts);
 void* muxing_begin(const char* formatname, const char* filename, const int dst_framerate, const int dst_width, const int dst_hight);
+void* muxing_begin2(const char* formatname, const char* filename, const int dst_framerate, const int dst_width, const int dst_hight, const muxing_opts_t* opts);
 int muxing_write_video(void* ctx, AVFrame* frame) ;
 int muxing_write_audio(void* ctx, AVFrame* frame) ;
 int muxing_end(void* ctx, void* outbuff, int outbufflen, int* outsz);
@@ -13,3 +70,4 @@ int muxing_end(void* ctx, void* outbuff, int outbufflen, int* outsz);
 }
 #endif
 
+#endif
@@ -0,0 +1,547 @@
+/*
+GIF 的自适应调色板
+
+固定的 3:3:2 调色板（RGB8）偏色明显，色阶只能靠很强的抖动掩盖。
+自适应调色板的画质高得多；颜色数相同（256）时文件比 RGB8 大，要更小的文件需要减少颜色数。
+这里按内容生成调色板：
+    - 直方图：输出帧（RGB24）隔行隔列抽样，按 RGB555 计数，共 32768 个桶
+    - 量化：中位切分（median cut）得到初始调色板，再做几轮 k-means 修正
+    - 映射：预先生成 RGB555 -> 调色板索引的查找表（32KB），最近色搜索用 SSE2 一次比较 8 个颜色，
+      之后每个像素只查一次表；抖动可选有序（4x4 Bayer）或误差扩散（Floyd-Steinberg），
+      有序抖动的幅度按调色板颜色之间的间距确定
+    - 分场景：另外维护 4x4x4 的粗直方图，新帧与当前累计的颜色分布差异过大时报告场景切换，
+      由调用者决定是否为新场景另建调色板
+palette_build() 之后上下文只读，palette_map() 可以在多个线程中同时映射不同的帧
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/common.h>
+#include <libavutil/frame.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixfmt.h>
+
+#include "palette.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PALETTE_X86 1
+#endif
+
+#define HIST_BITS 5
+#define HIST_SIZE (1 << (3 * HIST_BITS))
+#define COARSE_SIZE 64
+#define SAMPLE_STEP 2       // 直方图隔行隔列抽样
+#define KMEANS_ITERS 2
+#define SCENE_THRESHOLD 0.6 // 归一化粗直方图的 L1 距离，取值 0 ~ 2
+#define FAR_COLOR 1024      // 补齐到 8 的倍数的空位，离任何颜色都足够远
+#define MIN_DITHER_STEP 8   // 有序抖动的幅度范围（每分量），下限为直方图的一个量化格
+#define MAX_DITHER_STEP 64
+
+// 4x4 Bayer 矩阵
+static const uint8_t bayer4[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+typedef struct palette_context {
+    int max_colors;
+    int nb_colors;
+    uint64_t total;                 // 当前直方图的样本数
+    uint32_t hist[HIST_SIZE];       // RGB555 直方图
+    uint32_t coarse[COARSE_SIZE];   // 每分量 2 位的粗直方图，用于检测场景切换
+    uint32_t pal[AVPALETTE_COUNT];  // 0xAARRGGBB
+    DECLARE_ALIGNED(16, int16_t, pr)[AVPALETTE_COUNT]; // 分量分开存放，供最近色搜索
+    DECLARE_ALIGNED(16, int16_t, pg)[AVPALETTE_COUNT];
+    DECLARE_ALIGNED(16, int16_t, pb)[AVPALETTE_COUNT];
+    uint8_t lut[HIST_SIZE];         // RGB555 -> 调色板索引
+    int8_t dither[16];              // 有序抖动时 Bayer 矩阵各级对应的偏移
+} palette_context_t;
+
+typedef struct bin {
+    uint8_t c[3];
+    uint32_t count;
+} bin_t;
+
+typedef struct box {
+    int start, end;     // 在 bins 中的范围
+    uint64_t count;
+    int axis, range;    // 跨度最大的分量及其跨度
+} box_t;
+
+static av_always_inline int hist_index(int r, int g, int b)
+{
+    return (r >> 3) << (2 * HIST_BITS) | (g >> 3) << HIST_BITS | b >> 3;
+}
+
+void* palette_init(int max_colors)
+{
+    palette_context_t *p = (palette_context_t *)av_mallocz(sizeof(palette_context_t));
+
+    if (!p)
+        return NULL;
+    p->max_colors = av_clip(max_colors, 1, AVPALETTE_COUNT);
+    return p;
+}
+
+// 清空直方图，开始统计新的一组帧
+void palette_reset(void* ctx)
+{
+    palette_context_t *p = (palette_context_t *)ctx;
+
+    memset(p->hist, 0, sizeof(p->hist));
+    memset(p->coarse, 0, sizeof(p->coarse));
+    p->total = 0;
+}
+
+void palette_free(void* ctx)
+{
+    av_free(ctx);
+}
+
+static double coarse_distance(const uint32_t *a, uint64_t na, const uint32_t *b, uint64_t nb)
+{
+    double d = 0;
+    int i;
+
+    for (i = 0; i < COARSE_SIZE; i++)
+        d += fabs((double)a[i] / na - (double)b[i] / nb);
+    return d;
+}
+
+/*
+把一帧 RGB24 加入直方图
+detect_cut 非 0 且该帧与已统计的帧颜色分布差异过大时，不加入直方图并返回 1
+ */
+int palette_add_frame(void* ctx, const AVFrame* frame, int detect_cut)
+{
+    palette_context_t *p = (palette_context_t *)ctx;
+    uint32_t coarse[COARSE_SIZE] = {0};
+    uint64_t n = 0;
+    int x, y, i;
+
+    if (frame->format != AV_PIX_FMT_RGB24)
+        return AVERROR(EINVAL);
+    for (y = 0; y < frame->height; y += SAMPLE_STEP) {
+        const uint8_t *row = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+        for (x = 0; x < frame->width; x += SAMPLE_STEP, row += 3 * SAMPLE_STEP) {
+            coarse[(row[0] >> 6) << 4 | (row[1] >> 6) << 2 | row[2] >> 6]++;
+            n++;
+        }
+    }
+    if (!n)
+        return 0;
+    if (detect_cut && p->total && coarse_distance(p->coarse, p->total, coarse, n) > SCENE_THRESHOLD)
+        return 1;
+
+    for (y = 0; y < frame->height; y += SAMPLE_STEP) {
+        const uint8_t *row = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+        for (x = 0; x < frame->width; x += SAMPLE_STEP, row += 3 * SAMPLE_STEP)
+            p->hist[hist_index(row[0], row[1], row[2])]++;
+    }
+    for (i = 0; i < COARSE_SIZE; i++)
+        p->coarse[i] += coarse[i];
+    p->total += n;
+    return 0;
+}
+
+/* 最近色搜索 */
+
+#ifdef PALETTE_X86
+static av_always_inline __m128i select_si128(__m128i m, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+// 一次计算 8 个调色板颜色的距离，各通道分别保留最小值，最后再归并
+static int nearest_sse2(const palette_context_t *p, int r, int g, int b)
+{
+    const __m128i vr = _mm_set1_epi16(r), vg = _mm_set1_epi16(g), vb = _mm_set1_epi16(b);
+    const __m128i zero = _mm_setzero_si128(), eight = _mm_set1_epi32(8);
+    __m128i idx_lo = _mm_setr_epi32(0, 1, 2, 3), idx_hi = _mm_setr_epi32(4, 5, 6, 7);
+    __m128i best_d = _mm_set1_epi32(INT32_MAX), best_i = zero;
+    int32_t d[4], idx[4];
+    int i, best;
+
+    for (i = 0; i < p->nb_colors; i += 8) {
+        __m128i dr = _mm_sub_epi16(_mm_load_si128((const __m128i *)(p->pr + i)), vr);
+        __m128i dg = _mm_sub_epi16(_mm_load_si128((const __m128i *)(p->pg + i)), vg);
+        __m128i db = _mm_sub_epi16(_mm_load_si128((const __m128i *)(p->pb + i)), vb);
+        __m128i rg, bz, dist, m;
+
+        rg = _mm_unpacklo_epi16(dr, dg);
+        bz = _mm_unpacklo_epi16(db, zero);
+        dist = _mm_add_epi32(_mm_madd_epi16(rg, rg), _mm_madd_epi16(bz, bz));
+        m = _mm_cmplt_epi32(dist, best_d);
+        best_d = select_si128(m, dist, best_d);
+        best_i = select_si128(m, idx_lo, best_i);
+
+        rg = _mm_unpackhi_epi16(dr, dg);
+        bz = _mm_unpackhi_epi16(db, zero);
+        dist = _mm_add_epi32(_mm_madd_epi16(rg, rg), _mm_madd_epi16(bz, bz));
+        m = _mm_cmplt_epi32(dist, best_d);
+        best_d = select_si128(m, dist, best_d);
+        best_i = select_si128(m, idx_hi, best_i);
+
+        idx_lo = _mm_add_epi32(idx_lo, eight);
+        idx_hi = _mm_add_epi32(idx_hi, eight);
+    }
+    _mm_storeu_si128((__m128i *)d, best_d);
+    _mm_storeu_si128((__m128i *)idx, best_i);
+    best = 0;
+    for (i = 1; i < 4; i++)
+        if (d[i] < d[best] || (d[i] == d[best] && idx[i] < idx[best]))
+            best = i;
+    return idx[best];
+}
+#else
+static int nearest_c(const palette_context_t *p, int r, int g, int b)
+{
+    int i, best = 0, best_d = INT32_MAX;
+
+    for (i = 0; i < p->nb_colors; i++) {
+        int dr = p->pr[i] - r, dg = p->pg[i] - g, db = p->pb[i] - b;
+        int d = dr * dr + dg * dg + db * db;
+        if (d < best_d) {
+            best_d = d;
+            best = i;
+        }
+    }
+    return best;
+}
+#endif
+
+static av_always_inline int nearest(const palette_context_t *p, int r, int g, int b)
+{
+#ifdef PALETTE_X86
+    return nearest_sse2(p, r, g, b);
+#else
+    return nearest_c(p, r, g, b);
+#endif
+}
+
+// 设置调色板颜色，空位补成远离所有颜色的值，使 SIMD 搜索可以按 8 个一组处理
+static void set_colors(palette_context_t *p, const uint8_t (*colors)[3], int nb)
+{
+    int i;
+
+    p->nb_colors = nb;
+    for (i = 0; i < AVPALETTE_COUNT; i++) {
+        if (i < nb) {
+            p->pal[i] = 0xFFU << 24 | colors[i][0] << 16 | colors[i][1] << 8 | colors[i][2];
+            p->pr[i] = colors[i][0];
+            p->pg[i] = colors[i][1];
+            p->pb[i] = colors[i][2];
+        } else {
+            // 不透明，避免编码器把空位当作透明色
+            p->pal[i] = 0xFFU << 24;
+            p->pr[i] = p->pg[i] = p->pb[i] = FAR_COLOR;
+        }
+    }
+}
+
+/* 中位切分 */
+
+static int cmp_r(const void *a, const void *b) { return ((const bin_t *)a)->c[0] - ((const bin_t *)b)->c[0]; }
+static int cmp_g(const void *a, const void *b) { return ((const bin_t *)a)->c[1] - ((const bin_t *)b)->c[1]; }
+static int cmp_b(const void *a, const void *b) { return ((const bin_t *)a)->c[2] - ((const bin_t *)b)->c[2]; }
+
+static void box_init(box_t *box, const bin_t *bins, int start, int end)
+{
+    int lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+    int i, c;
+
+    box->start = start;
+    box->end = end;
+    box->count = 0;
+    for (i = start; i < end; i++) {
+        box->count += bins[i].count;
+        for (c = 0; c < 3; c++) {
+            lo[c] = FFMIN(lo[c], bins[i].c[c]);
+            hi[c] = FFMAX(hi[c], bins[i].c[c]);
+        }
+    }
+    box->axis = 0;
+    for (c = 1; c < 3; c++)
+        if (hi[c] - lo[c] > hi[box->axis] - lo[box->axis])
+            box->axis = c;
+    box->range = hi[box->axis] - lo[box->axis];
+}
+
+static int median_cut(bin_t *bins, int nb_bins, box_t *boxes, int max_boxes)
+{
+    static int (*const cmp[3])(const void *, const void *) = { cmp_r, cmp_g, cmp_b };
+    int nb = 1;
+
+    box_init(&boxes[0], bins, 0, nb_bins);
+    while (nb < max_boxes) {
+        box_t *box = NULL;
+        uint64_t half, acc;
+        int i, m;
+
+        // 切分 跨度 x 像素数 最大的盒子
+        for (i = 0; i < nb; i++)
+            if (boxes[i].range > 0 && boxes[i].end - boxes[i].start > 1 &&
+                (!box || (uint64_t)boxes[i].range * boxes[i].count > (uint64_t)box->range * box->count))
+                box = &boxes[i];
+        if (!box)
+            break;
+        qsort(bins + box->start, box->end - box->start, sizeof(bin_t), cmp[box->axis]);
+        half = box->count / 2;
+        acc = 0;
+        for (m = box->start; m < box->end - 1; m++) {
+            acc += bins[m].count;
+            if (acc >= half)
+                break;
+        }
+        // 最后一个桶独占一半以上时从它前面切开
+        m = FFMIN(m + 1, box->end - 1);
+        box_init(&boxes[nb], bins, m, box->end);
+        box_init(box, bins, box->start, m);
+        nb++;
+    }
+    return nb;
+}
+
+// 以各盒子（或各聚类）的加权平均作为颜色
+static void mean_color(uint8_t *color, const uint64_t *sum, uint64_t count)
+{
+    int c;
+
+    for (c = 0; c < 3; c++)
+        color[c] = count ? (sum[c] + count / 2) / count : 0;
+}
+
+static void kmeans(palette_context_t *p, const bin_t *bins, int nb_bins, uint8_t (*colors)[3])
+{
+    uint64_t (*sum)[3] = (uint64_t (*)[3])av_malloc(sizeof(*sum) * p->nb_colors);
+    uint64_t *count = (uint64_t *)av_malloc(sizeof(*count) * p->nb_colors);
+    int it, i, c;
+
+    if (!sum || !count)
+        goto end;
+    for (it = 0; it < KMEANS_ITERS; it++) {
+        memset(sum, 0, sizeof(*sum) * p->nb_colors);
+        memset(count, 0, sizeof(*count) * p->nb_colors);
+        for (i = 0; i < nb_bins; i++) {
+            int k = nearest(p, bins[i].c[0], bins[i].c[1], bins[i].c[2]);
+            for (c = 0; c < 3; c++)
+                sum[k][c] += (uint64_t)bins[i].c[c] * bins[i].count;
+            count[k] += bins[i].count;
+        }
+        // 没有分到像素的颜色保持不变
+        for (i = 0; i < p->nb_colors; i++)
+            if (count[i])
+                mean_color(colors[i], sum[i], count[i]);
+        set_colors(p, (const uint8_t (*)[3])colors, p->nb_colors);
+    }
+end:
+    av_free(sum);
+    av_free(count);
+}
+
+/*
+有序抖动的幅度：偏移要让一个平坦的颜色在相邻的两个调色板颜色之间交替，覆盖的范围应等于颜色的间距，
+小了抖不到相邻的颜色，留下色带；大了是跨越多个颜色的噪声，LZW 也更难压缩
+间距取各颜色到最近的另一颜色的距离的中位数，偏移三个分量同加、沿灰轴，欧氏距离 d 对应每分量 d / sqrt(3)
+ */
+static void init_dither(palette_context_t *p)
+{
+    int nn[AVPALETTE_COUNT];
+    int i, j, step = MIN_DITHER_STEP;
+
+    if (p->nb_colors > 1) {
+        for (i = 0; i < p->nb_colors; i++) {
+            nn[i] = INT32_MAX;
+            for (j = 0; j < p->nb_colors; j++) {
+                int dr = p->pr[i] - p->pr[j], dg = p->pg[i] - p->pg[j], db = p->pb[i] - p->pb[j];
+                if (j != i)
+                    nn[i] = FFMIN(nn[i], dr * dr + dg * dg + db * db);
+            }
+        }
+        // 部分选择出中位数
+        for (i = 0; i <= p->nb_colors / 2; i++)
+            for (j = i + 1; j < p->nb_colors; j++)
+                if (nn[j] < nn[i])
+                    FFSWAP(int, nn[i], nn[j]);
+        step = av_clip(lrint(sqrt(nn[p->nb_colors / 2] / 3.0)), MIN_DITHER_STEP, MAX_DITHER_STEP);
+    }
+    // Bayer 的 16 级均匀分布在 [-step / 2, step / 2) 中
+    for (i = 0; i < 16; i++)
+        p->dither[i] = ((2 * i + 1) * step >> 5) - step / 2;
+}
+
+int palette_build(void* ctx)
+{
+    return palette_build2(ctx, ((palette_context_t *)ctx)->max_colors);
+}
+
+/*
+由直方图生成调色板与映射表，返回颜色数
+max_colors 不超过 palette_init() 时的值，直方图不变，可以换一个颜色数重新生成
+颜色数不超过 max_colors 时直接使用直方图中的颜色
+ */
+int palette_build2(void* ctx, int max_colors)
+{
+    palette_context_t *p = (palette_context_t *)ctx;
+    uint8_t colors[AVPALETTE_COUNT][3];
+    bin_t *bins;
+    box_t *boxes = NULL;
+    int i, nb_bins = 0, nb, ret = 0;
+
+    max_colors = av_clip(max_colors, 1, p->max_colors);
+    for (i = 0; i < HIST_SIZE; i++)
+        nb_bins += p->hist[i] != 0;
+    bins = (bin_t *)av_malloc(sizeof(bin_t) * FFMAX(nb_bins, 1));
+    if (!bins)
+        return AVERROR(ENOMEM);
+    nb_bins = 0;
+    for (i = 0; i < HIST_SIZE; i++) {
+        if (!p->hist[i])
+            continue;
+        // 取桶的中心
+        bins[nb_bins].c[0] = (i >> (2 * HIST_BITS)) << 3 | 4;
+        bins[nb_bins].c[1] = ((i >> HIST_BITS) & ((1 << HIST_BITS) - 1)) << 3 | 4;
+        bins[nb_bins].c[2] = (i & ((1 << HIST_BITS) - 1)) << 3 | 4;
+        bins[nb_bins].count = p->hist[i];
+        nb_bins++;
+    }
+
+    if (!nb_bins) {
+        memset(colors, 0, sizeof(colors[0]));
+        set_colors(p, (const uint8_t (*)[3])colors, 1);
+    } else if (nb_bins <= max_colors) {
+        for (i = 0; i < nb_bins; i++)
+            memcpy(colors[i], bins[i].c, 3);
+        set_colors(p, (const uint8_t (*)[3])colors, nb_bins);
+    } else {
+        boxes = (box_t *)av_malloc(sizeof(box_t) * max_colors);
+        if (!boxes) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        nb = median_cut(bins, nb_bins, boxes, max_colors);
+        for (i = 0; i < nb; i++) {
+            uint64_t sum[3] = {0, 0, 0};
+            int j, c;
+            for (j = boxes[i].start; j < boxes[i].end; j++)
+                for (c = 0; c < 3; c++)
+                    sum[c] += (uint64_t)bins[j].c[c] * bins[j].count;
+            mean_color(colors[i], sum, boxes[i].count);
+        }
+        set_colors(p, (const uint8_t (*)[3])colors, nb);
+        kmeans(p, bins, nb_bins, colors);
+    }
+
+    for (i = 0; i < HIST_SIZE; i++)
+        p->lut[i] = nearest(p, (i >> (2 * HIST_BITS)) << 3 | 4,
+                ((i >> HIST_BITS) & ((1 << HIST_BITS) - 1)) << 3 | 4,
+                (i & ((1 << HIST_BITS) - 1)) << 3 | 4);
+    init_dither(p);
+    ret = p->nb_colors;
+end:
+    av_free(bins);
+    av_free(boxes);
+    return ret;
+}
+
+/* 映射 */
+
+static void map_plain(const palette_context_t *p, const AVFrame *src, AVFrame *dst)
+{
+    int x, y;
+
+    for (y = 0; y < src->height; y++) {
+        const uint8_t *s = src->data[0] + (ptrdiff_t)y * src->linesize[0];
+        uint8_t *d = dst->data[0] + (ptrdiff_t)y * dst->linesize[0];
+        for (x = 0; x < src->width; x++, s += 3)
+            d[x] = p->lut[hist_index(s[0], s[1], s[2])];
+    }
+}
+
+// 抖动幅度为调色板颜色的间距（见 init_dither()），相邻像素落到相邻的颜色，平均后接近原色
+static void map_ordered(const palette_context_t *p, const AVFrame *src, AVFrame *dst)
+{
+    int x, y;
+
+    for (y = 0; y < src->height; y++) {
+        const uint8_t *s = src->data[0] + (ptrdiff_t)y * src->linesize[0];
+        uint8_t *d = dst->data[0] + (ptrdiff_t)y * dst->linesize[0];
+        const uint8_t *bayer = bayer4[y & 3];
+        for (x = 0; x < src->width; x++, s += 3) {
+            int o = p->dither[bayer[x & 3]];
+            d[x] = p->lut[hist_index(av_clip_uint8(s[0] + o), av_clip_uint8(s[1] + o), av_clip_uint8(s[2] + o))];
+        }
+    }
+}
+
+// 误差按 16 倍保存在两行缓冲中，左右各留一个像素的边
+static int map_diffusion(const palette_context_t *p, const AVFrame *src, AVFrame *dst)
+{
+    int w = src->width, stride = 3 * (w + 2);
+    int16_t *buf = (int16_t *)av_malloc(sizeof(int16_t) * 2 * stride);
+    int16_t *cur, *nxt;
+    int x, y, c;
+
+    if (!buf)
+        return AVERROR(ENOMEM);
+    cur = buf + 3;
+    nxt = buf + stride + 3;
+    memset(buf, 0, sizeof(int16_t) * stride);
+    for (y = 0; y < src->height; y++) {
+        const uint8_t *s = src->data[0] + (ptrdiff_t)y * src->linesize[0];
+        uint8_t *d = dst->data[0] + (ptrdiff_t)y * dst->linesize[0];
+        int16_t *tmp;
+
+        memset(nxt - 3, 0, sizeof(int16_t) * stride);
+        for (x = 0; x < w; x++, s += 3) {
+            int v[3], e, i;
+            for (c = 0; c < 3; c++)
+                v[c] = av_clip_uint8(s[c] + ((cur[3 * x + c] + 8) >> 4));
+            i = p->lut[hist_index(v[0], v[1], v[2])];
+            d[x] = i;
+            for (c = 0; c < 3; c++) {
+                e = v[c] - (c == 0 ? p->pr[i] : c == 1 ? p->pg[i] : p->pb[i]);
+                cur[3 * (x + 1) + c] += e * 7;
+                nxt[3 * (x - 1) + c] += e * 3;
+                nxt[3 * x + c] += e * 5;
+                nxt[3 * (x + 1) + c] += e;
+            }
+        }
+        tmp = cur;
+        cur = nxt;
+        nxt = tmp;
+    }
+    av_free(buf);
+    return 0;
+}
+
+/*
+把 RGB24 的 src 映射为 PAL8 的 dst（尺寸相同），调色板写入 dst->data[1]
+需先调用 palette_build()
+ */
+int palette_map(void* ctx, const AVFrame* src, AVFrame* dst, int dither)
+{
+    const palette_context_t *p = (const palette_context_t *)ctx;
+
+    if (src->format != AV_PIX_FMT_RGB24 || dst->format != AV_PIX_FMT_PAL8 ||
+        src->width != dst->width || src->height != dst->height || !p->nb_colors)
+        return AVERROR(EINVAL);
+    memcpy(dst->data[1], p->pal, AVPALETTE_SIZE);
+    switch (dither) {
+    case PALETTE_DITHER_ORDERED:
+        map_ordered(p, src, dst);
+        break;
+    case PALETTE_DITHER_DIFFUSION:
+        return map_diffusion(p, src, dst);
+    default:
+        map_plain(p, src, dst);
+        break;
+    }
+    return 0;
+}
@@ -0,0 +1,24 @@
+
+#include <libavutil/frame.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// palette_map() 的抖动方式
+enum {
+    PALETTE_DITHER_NONE = 0,
+    PALETTE_DITHER_ORDERED,   // 4x4 Bayer，幅度为调色板颜色的间距
+    PALETTE_DITHER_DIFFUSION, // Floyd-Steinberg 误差扩散
+};
+
+void* palette_init(int max_colors);
+int palette_add_frame(void* ctx, const AVFrame* frame, int detect_cut);
+int palette_build(void* ctx);
+int palette_build2(void* ctx, int max_colors);
+int palette_map(void* ctx, const AVFrame* src, AVFrame* dst, int dither);
+void palette_reset(void* ctx);
+void palette_free(void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
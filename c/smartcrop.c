@@ -0,0 +1,232 @@
+/*
+固定宽高比缩略图的智能裁剪：在画面中选出目标宽高比的最大窗口，窗口位置按显著性选取
+
+显著性在缩小的亮度网格（长边不超过 GRID_MAX 格，每格取中间一行的均值）上计算：
+    - 边缘能量：网格上横向、纵向中心差分的绝对值之和（SIMD，每次 16 格）
+    - 肤色：格中心的色度落在 YCbCr 的肤色范围内时加分，人物不会被裁掉
+    - 中心偏好：按到中心的距离平方降低权重，窗口的位置越偏得分也打一点折扣，显著性平坦时取中间
+窗口总是占满一个方向，只需在另一个方向上滑动：把显著性投影到滑动方向上，用前缀和找总和最大的位置。
+网格只读 GRID_MAX 行左右，相比缩放整帧的开销很小；不支持的像素格式取中间的窗口。
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libavutil/common.h>
+#include <libavutil/log.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+
+#include "smartcrop.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SMARTCROP_X86 1
+#endif
+
+#define GRID_MAX 96
+// 肤色格的加分，与明显边缘的能量相当
+#define SKIN_BONUS 64
+// 肤色的亮度下限，太暗的格色度不可靠
+#define SKIN_MIN_LUMA 40
+// 画面边缘的权重比中心低这么多
+#define CENTER_BIAS 0.5
+// 窗口在一端时得分打的折扣，窗口都完整包含显著区域时取最靠中间的
+#define POSITION_BIAS 0.1
+
+static int sum_bytes(const uint8_t *p, int n)
+{
+    int sum = 0, x = 0;
+#ifdef SMARTCROP_X86
+    __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+
+    for (; x + 16 <= n; x += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(p + x)), zero));
+    sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for (; x < n; x++)
+        sum += p[x];
+    return sum;
+}
+
+// 网格一行内部各格 [1, gw - 1) 的边缘能量
+static void edge_row(const uint8_t *up, const uint8_t *row, const uint8_t *down, int gw, uint16_t *sal)
+{
+    int x = 1;
+#ifdef SMARTCROP_X86
+    __m128i zero = _mm_setzero_si128();
+
+    for (; x + 16 <= gw - 1; x += 16) {
+        __m128i l = _mm_loadu_si128((const __m128i *)(row + x - 1));
+        __m128i r = _mm_loadu_si128((const __m128i *)(row + x + 1));
+        __m128i u = _mm_loadu_si128((const __m128i *)(up + x));
+        __m128i d = _mm_loadu_si128((const __m128i *)(down + x));
+        __m128i dx = _mm_or_si128(_mm_subs_epu8(l, r), _mm_subs_epu8(r, l));
+        __m128i dy = _mm_or_si128(_mm_subs_epu8(u, d), _mm_subs_epu8(d, u));
+        _mm_storeu_si128((__m128i *)(sal + x),
+                         _mm_add_epi16(_mm_unpacklo_epi8(dx, zero), _mm_unpacklo_epi8(dy, zero)));
+        _mm_storeu_si128((__m128i *)(sal + x + 8),
+                         _mm_add_epi16(_mm_unpackhi_epi8(dx, zero), _mm_unpackhi_epi8(dy, zero)));
+    }
+#endif
+    for (; x < gw - 1; x++)
+        sal[x] = FFABS(row[x + 1] - row[x - 1]) + FFABS(down[x] - up[x]);
+}
+
+static double center_weight(int i, int n)
+{
+    double d = (i + 0.5) / n * 2 - 1;
+    return 1 - CENTER_BIAS * d * d;
+}
+
+/*
+在 [x0, x0 + bw) x [y0, y0 + bh) 内计算网格的显著性，cs 为每格的边长（像素）
+返回 0 成功，AVERROR(ENOSYS) 表示像素格式不支持
+ */
+static int saliency(const AVFrame *frame, int x0, int y0, int cs, int gw, int gh, uint16_t *sal)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    const AVComponentDescriptor *c;
+    const uint8_t *luma, *cb = NULL, *cr = NULL;
+    uint8_t *grid;
+    int gx, gy, x, chroma;
+
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM |
+                                 AV_PIX_FMT_FLAG_HWACCEL)) ||
+        desc->comp[0].depth != 8 || desc->comp[0].shift)
+        return AVERROR(ENOSYS);
+    chroma = desc->nb_components >= 3 && desc->comp[1].depth == 8 && desc->comp[2].depth == 8 &&
+             !desc->comp[1].shift && !desc->comp[2].shift;
+    grid = (uint8_t *)av_malloc(gw * gh);
+    if (!grid)
+        return AVERROR(ENOMEM);
+
+    c = &desc->comp[0];
+    for (gy = 0; gy < gh; gy++) {
+        int y = y0 + gy * cs + cs / 2;
+        luma = frame->data[c->plane] + c->offset + (ptrdiff_t)y * frame->linesize[c->plane];
+        if (chroma) {
+            int cy = y >> desc->log2_chroma_h;
+            cb = frame->data[desc->comp[1].plane] + desc->comp[1].offset + (ptrdiff_t)cy * frame->linesize[desc->comp[1].plane];
+            cr = frame->data[desc->comp[2].plane] + desc->comp[2].offset + (ptrdiff_t)cy * frame->linesize[desc->comp[2].plane];
+        }
+        for (gx = 0; gx < gw; gx++) {
+            const uint8_t *p = luma + (ptrdiff_t)(x0 + gx * cs) * c->step;
+            int sum = 0;
+            if (c->step == 1) {
+                sum = sum_bytes(p, cs);
+            } else {
+                for (x = 0; x < cs; x++)
+                    sum += p[x * c->step];
+            }
+            grid[gy * gw + gx] = sum / cs;
+        }
+        memset(sal + gy * gw, 0, gw * sizeof(*sal));
+        if (!chroma)
+            continue;
+        for (gx = 0; gx < gw; gx++) {
+            int cx = (x0 + gx * cs + cs / 2) >> desc->log2_chroma_w;
+            int u = cb[cx * desc->comp[1].step], v = cr[cx * desc->comp[2].step];
+            if (u >= 77 && u <= 127 && v >= 133 && v <= 173 && grid[gy * gw + gx] >= SKIN_MIN_LUMA)
+                sal[gy * gw + gx] = SKIN_BONUS;
+        }
+    }
+    for (gy = 1; gy < gh - 1; gy++) {
+        uint16_t edge[GRID_MAX];
+        edge_row(grid + (gy - 1) * gw, grid + gy * gw, grid + (gy + 1) * gw, gw, edge);
+        for (gx = 1; gx < gw - 1; gx++)
+            sal[gy * gw + gx] += edge[gx];
+    }
+    av_free(grid);
+    return 0;
+}
+
+/*
+在 frame 除去 rect 之后的区域内选出 aspect_w:aspect_h 的最大窗口，结果写回 rect（各边裁掉的像素数）
+rect 传入时为已有的裁剪（黑边），全 0 表示整帧
+返回 1 表示按显著性选取，0 表示取中间（像素格式不支持、区域太小），< 0 为错误
+ */
+int smartcrop(const AVFrame* frame, int aspect_w, int aspect_h, crop_rect_t* rect)
+{
+    int bx = rect->left, by = rect->top;
+    int bw = frame->width - rect->left - rect->right, bh = frame->height - rect->top - rect->bottom;
+    int slide_x, win, len, off, cs, gw, gh, n, wc, i, j, best, ret = 0;
+    uint16_t *sal = NULL;
+    double *proj = NULL, sum, best_sum;
+
+    if (aspect_w <= 0 || aspect_h <= 0 || bw <= 0 || bh <= 0)
+        return AVERROR(EINVAL);
+    // 区域比目标宽时窗口占满高度、横向滑动，否则占满宽度、纵向滑动
+    slide_x = (int64_t)bw * aspect_h > (int64_t)bh * aspect_w;
+    len = slide_x ? bw : bh;
+    win = slide_x ? (int)((int64_t)bh * aspect_w / aspect_h) : (int)((int64_t)bw * aspect_h / aspect_w);
+    win = FFMAX(win & ~1, 2);
+    if (win >= len)
+        return 0;
+    off = (len - win) / 2;
+
+    cs = FFMAX((FFMAX(bw, bh) + GRID_MAX - 1) / GRID_MAX, 1);
+    gw = FFMIN(bw / cs, GRID_MAX);
+    gh = FFMIN(bh / cs, GRID_MAX);
+    if (gw >= 3 && gh >= 3) {
+        sal = (uint16_t *)av_malloc_array(gw * gh, sizeof(*sal));
+        proj = (double *)av_malloc_array(GRID_MAX + 1, sizeof(*proj));
+        if (!sal || !proj) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        ret = saliency(frame, bx, by, cs, gw, gh, sal);
+        if (ret == AVERROR(ENOSYS)) {
+            ret = 0;
+        } else if (ret >= 0) {
+            // 投影到滑动方向上，proj 为前缀和
+            n = slide_x ? gw : gh;
+            proj[0] = 0;
+            for (i = 0; i < n; i++) {
+                sum = 0;
+                if (slide_x) {
+                    for (j = 0; j < gh; j++)
+                        sum += sal[j * gw + i] * center_weight(j, gh);
+                } else {
+                    for (j = 0; j < gw; j++)
+                        sum += sal[i * gw + j] * center_weight(j, gw);
+                }
+                proj[i + 1] = proj[i] + sum * center_weight(i, n);
+            }
+            wc = av_clip((int)lrint((double)win / cs), 1, n);
+            best = -1;
+            best_sum = 0;
+            for (i = 0; i + wc <= n; i++) {
+                sum = (proj[i + wc] - proj[i]) * (1 - POSITION_BIAS * fabs(2.0 * i / FFMAX(n - wc, 1) - 1));
+                if (best < 0 || sum > best_sum) {
+                    best = i;
+                    best_sum = sum;
+                }
+            }
+            if (best_sum > 0) {
+                // 网格化的窗口与实际窗口中心对齐
+                off = av_clip(best * cs + (wc * cs - win) / 2, 0, len - win) & ~1;
+                ret = 1;
+            }
+        }
+    }
+
+    if (ret < 0)
+        goto end;
+    if (slide_x) {
+        rect->left = bx + off;
+        rect->right = frame->width - rect->left - win;
+    } else {
+        rect->top = by + off;
+        rect->bottom = frame->height - rect->top - win;
+    }
+    av_log(NULL, AV_LOG_INFO, "smart crop %dx%d -> %dx%d at (%d, %d)%s\n", frame->width, frame->height,
+           frame->width - rect->left - rect->right, frame->height - rect->top - rect->bottom,
+           rect->left, rect->top, ret > 0 ? "" : ", centered");
+
+end:
+    av_free(sal);
+    av_free(proj);
+    return ret;
+}
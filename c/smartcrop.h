@@ -0,0 +1,12 @@
+
+#include <libavutil/frame.h>
+#include "cropdetect.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int smartcrop(const AVFrame* frame, int aspect_w, int aspect_h, crop_rect_t* rect);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,172 @@
+/*
+进程级的工作线程池
+
+缩放、格式转换、滤镜等按条带切分后的任务都提交到这里，所有请求共享同一组线程，
+不会因为并发的请求数而成倍地创建线程。
+每次 thread_pool_execute() 提交一批任务，调用线程自己也参与执行，全部完成后返回。
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+#define MAX_THREADS 32
+
+typedef struct batch {
+    thread_pool_job_fn fn;
+    void *arg;
+    int nb_jobs;
+    int next_job;   // 下一个未领取的任务
+    int pending;    // 未完成的任务数
+    int ret;
+    pthread_cond_t done;
+    struct batch *next;
+} batch_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static batch_t *queue_head, *queue_tail;
+static int nb_threads; // 包含调用线程在内的并行度，0 表示还未初始化
+
+// 领取队首批次的一个任务，需持有 pool_lock
+static batch_t *take_job(int *job)
+{
+    batch_t *b = queue_head;
+
+    if (!b)
+        return NULL;
+    *job = b->next_job++;
+    if (b->next_job == b->nb_jobs) {
+        queue_head = b->next;
+        if (!queue_head)
+            queue_tail = NULL;
+    }
+    return b;
+}
+
+// 执行一个任务并登记完成，调用前不持有锁
+static void run_job(batch_t *b, int job)
+{
+    int ret = b->fn(b->arg, job, b->nb_jobs);
+
+    pthread_mutex_lock(&pool_lock);
+    if (ret < 0 && b->ret >= 0)
+        b->ret = ret;
+    if (--b->pending == 0)
+        pthread_cond_signal(&b->done);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void *worker(void *arg)
+{
+    batch_t *b;
+    int job;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (!(b = take_job(&job)))
+            pthread_cond_wait(&work_cond, &pool_lock);
+        pthread_mutex_unlock(&pool_lock);
+        run_job(b, job);
+    }
+    return NULL;
+}
+
+// 按 CPU 核数启动工作线程，只执行一次
+static void init_pool(void)
+{
+    pthread_t tid;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, n;
+
+    n = cpus > 0 ? (int)cpus : 1;
+    if (n > MAX_THREADS)
+        n = MAX_THREADS;
+    // 调用线程自身也参与执行，只需再启动 n - 1 个
+    for (i = 1; i < n; i++) {
+        if (pthread_create(&tid, NULL, worker, NULL) != 0)
+            break;
+        pthread_detach(tid);
+    }
+    nb_threads = i;
+}
+
+int thread_pool_threads(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, init_pool);
+    return nb_threads;
+}
+
+/*
+并行执行 nb_jobs 个任务，返回第一个出错任务的返回值，全部成功时返回 0
+只有一个任务或只有一个线程时直接在调用线程中执行
+ */
+int thread_pool_execute(thread_pool_job_fn fn, void* arg, int nb_jobs)
+{
+    batch_t b;
+    int job, ret = 0;
+
+    if (nb_jobs <= 0)
+        return 0;
+    if (nb_jobs == 1 || thread_pool_threads() <= 1) {
+        for (job = 0; job < nb_jobs; job++) {
+            int r = fn(arg, job, nb_jobs);
+            if (r < 0 && ret >= 0)
+                ret = r;
+        }
+        return ret;
+    }
+
+    b.fn = fn;
+    b.arg = arg;
+    b.nb_jobs = nb_jobs;
+    b.next_job = 0;
+    b.pending = nb_jobs;
+    b.ret = 0;
+    b.next = NULL;
+    pthread_cond_init(&b.done, NULL);
+
+    pthread_mutex_lock(&pool_lock);
+    if (queue_tail)
+        queue_tail->next = &b;
+    else
+        queue_head = &b;
+    queue_tail = &b;
+    pthread_cond_broadcast(&work_cond);
+
+    // 调用线程只领取自己这一批中剩下的任务，不执行其他请求的任务
+    while (b.next_job < b.nb_jobs) {
+        batch_t *own;
+        job = b.next_job++;
+        if (b.next_job == b.nb_jobs) {
+            // 最后一个任务已被领取，把这一批从队列中摘掉（不一定在队首）
+            if (queue_head == &b) {
+                queue_head = b.next;
+                if (!queue_head)
+                    queue_tail = NULL;
+            } else {
+                for (own = queue_head; own && own->next != &b; own = own->next)
+                    ;
+                if (own) {
+                    own->next = b.next;
+                    if (queue_tail == &b)
+                        queue_tail = own;
+                }
+            }
+        }
+        pthread_mutex_unlock(&pool_lock);
+        run_job(&b, job);
+        pthread_mutex_lock(&pool_lock);
+    }
+    while (b.pending > 0)
+        pthread_cond_wait(&b.done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+
+    pthread_cond_destroy(&b.done);
+    return b.ret;
+}
@@ -0,0 +1,16 @@
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+job 为 [0, nb_jobs) 中的序号，返回负数表示出错
+ */
+typedef int (*thread_pool_job_fn)(void* arg, int job, int nb_jobs);
+
+int thread_pool_threads(void);
+int thread_pool_execute(thread_pool_job_fn fn, void* arg, int nb_jobs);
+
+#ifdef __cplusplus
+}
+#endif
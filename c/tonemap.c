@@ -0,0 +1,473 @@
+/*
+HDR（PQ/HLG）转 SDR 的色调映射
+
+手机拍的 HDR10/HLG 视频直接按 BT.709 显示会发灰、发白。libavfilter 的 zscale + tonemap 逐像素做
+EOTF、色域转换、色调映射、OETF，对缩略图/GIF 的时延预算太慢。
+整条变换只与流的色彩属性有关，这里把它预先算成 YUV -> YUV 的 33x33x33 三维查找表：
+    - 源：PQ/HLG，BT.2020（或 P3）色域，8/10 位 4:2:0
+    - 目标：BT.709 limited range 的 YUV420P，随后走普通的像素格式转换
+    - 查找表按 (传输特性, 色域, 矩阵, 范围, 位深, 峰值亮度) 缓存，进程内各生成一次，所有请求共享
+    - 每个像素一次三线性插值（SSE，一个向量处理 YUV 三个分量）
+在缩放之后、以输出分辨率执行，只多一遍对缩略图像素的处理
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <libavutil/common.h>
+#include <libavutil/frame.h>
+#include <libavutil/mastering_display_metadata.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixfmt.h>
+
+#include "tonemap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TONEMAP_X86 1
+#endif
+
+#define GRID 33
+#define MAX_LUTS 8
+#define REF_WHITE 100.0     // SDR 参考白的亮度（nits）
+#define DEFAULT_PEAK 1000.0 // 没有亮度元数据时假定的峰值（nits）
+
+typedef struct lut_key {
+    int trc, primaries, matrix, full, depth, peak;
+} lut_key_t;
+
+typedef struct lut_entry {
+    lut_key_t key;
+    float *data;    // GRID^3 个格点，每个格点 4 个 float（Y/U/V/填充），16 字节对齐
+} lut_entry_t;
+
+static lut_entry_t luts[MAX_LUTS];
+static int nb_luts;
+static pthread_mutex_t luts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct tonemap_context {
+    int src_fmt;
+    int depth;
+    float scale;        // 码值 -> 格点坐标
+    const float *lut;
+    float *own_lut;     // 缓存已满时自己生成的表，随上下文释放
+} tonemap_context_t;
+
+int tonemap_needed(const AVFrame* frame)
+{
+    return frame->color_trc == AVCOL_TRC_SMPTE2084 || frame->color_trc == AVCOL_TRC_ARIB_STD_B67;
+}
+
+int tonemap_format_supported(int fmt)
+{
+    return fmt == AV_PIX_FMT_YUV420P || fmt == AV_PIX_FMT_YUV420P10LE;
+}
+
+// 输出帧的色彩属性，格式为 TONEMAP_DST_FORMAT
+void tonemap_dst_props(AVFrame* dst)
+{
+    dst->colorspace = AVCOL_SPC_BT709;
+    dst->color_range = AVCOL_RANGE_MPEG;
+    dst->color_primaries = AVCOL_PRI_BT709;
+    dst->color_trc = AVCOL_TRC_BT709;
+}
+
+// PQ 的 EOTF，返回绝对亮度（nits）
+static double pq_eotf(double e)
+{
+    const double m1 = 2610.0 / 16384, m2 = 2523.0 / 4096 * 128;
+    const double c1 = 3424.0 / 4096, c2 = 2413.0 / 4096 * 32, c3 = 2392.0 / 4096 * 32;
+    double p = pow(e, 1 / m2);
+    return 10000 * pow(FFMAX(p - c1, 0) / (c2 - c3 * p), 1 / m1);
+}
+
+// HLG 的逆 OETF，返回场景线性光 [0, 1]
+static double hlg_inv_oetf(double e)
+{
+    const double a = 0.17883277, b = 0.28466892, c = 0.55991073;
+    return e <= 0.5 ? e * e / 3 : (exp((e - c) / a) + b) / 12;
+}
+
+static double bt709_oetf(double l)
+{
+    return l < 0.018 ? 4.5 * l : 1.099 * pow(l, 0.45) - 0.099;
+}
+
+// Hable（Uncharted 2）曲线，与 libavfilter tonemap 的 hable 相同
+static double hable(double x)
+{
+    const double a = 0.15, b = 0.50, c = 0.10, d = 0.20, e = 0.02, f = 0.30;
+    return (x * (x * a + b * c) + d * e) / (x * (x * a + b) + d * f) - e / f;
+}
+
+static void matrix_coeffs(int matrix, double *kr, double *kb)
+{
+    switch (matrix) {
+    case AVCOL_SPC_BT2020_NCL:
+    case AVCOL_SPC_BT2020_CL:
+        *kr = 0.2627;
+        *kb = 0.0593;
+        break;
+    case AVCOL_SPC_BT709:
+        *kr = 0.2126;
+        *kb = 0.0722;
+        break;
+    default:
+        *kr = 0.299;
+        *kb = 0.114;
+        break;
+    }
+}
+
+// 线性光下源色域到 BT.709 的转换矩阵，源已是 BT.709 时返回 NULL
+static const double (*gamut_matrix(int primaries))[3]
+{
+    static const double bt2020[3][3] = {
+        {  1.6605, -0.5876, -0.0728 },
+        { -0.1246,  1.1329, -0.0083 },
+        { -0.0182, -0.1006,  1.1187 },
+    };
+    static const double p3[3][3] = {
+        {  1.2249, -0.2247,  0.0000 },
+        { -0.0420,  1.0419,  0.0000 },
+        { -0.0197, -0.0786,  1.0979 },
+    };
+
+    if (primaries == AVCOL_PRI_BT2020)
+        return bt2020;
+    if (primaries == AVCOL_PRI_SMPTE432)
+        return p3;
+    return NULL;
+}
+
+static void build_lut(float *lut, const lut_key_t *k)
+{
+    const double (*gm)[3] = gamut_matrix(k->primaries);
+    const double maxc = (1 << k->depth) - 1, sc = 1 << (k->depth - 8);
+    const double peak = k->peak / REF_WHITE;
+    // HLG 的系统 gamma 随显示峰值调整（BT.2100）
+    const double hlg_gamma = 1.2 + 0.42 * log10(k->peak / 1000.0);
+    double kr, kb, kg;
+    int iy, iu, iv;
+
+    matrix_coeffs(k->matrix, &kr, &kb);
+    kg = 1 - kr - kb;
+
+    for (iy = 0; iy < GRID; iy++) {
+        for (iu = 0; iu < GRID; iu++) {
+            for (iv = 0; iv < GRID; iv++) {
+                double cy = iy * maxc / (GRID - 1), cu = iu * maxc / (GRID - 1), cv = iv * maxc / (GRID - 1);
+                double y, u, v, rgb[3], out[3], sig, yo;
+                float *e = lut + ((iy * GRID + iu) * GRID + iv) * 4;
+                int c;
+
+                if (k->full) {
+                    y = cy / maxc;
+                    u = (cu - 128 * sc) / maxc;
+                    v = (cv - 128 * sc) / maxc;
+                } else {
+                    y = (cy - 16 * sc) / (219 * sc);
+                    u = (cu - 128 * sc) / (224 * sc);
+                    v = (cv - 128 * sc) / (224 * sc);
+                }
+                rgb[0] = y + 2 * (1 - kr) * v;
+                rgb[2] = y + 2 * (1 - kb) * u;
+                rgb[1] = (y - kr * rgb[0] - kb * rgb[2]) / kg;
+
+                // 非线性 -> 相对参考白的线性光
+                for (c = 0; c < 3; c++)
+                    rgb[c] = av_clipd(rgb[c], 0, 1);
+                if (k->trc == AVCOL_TRC_SMPTE2084) {
+                    for (c = 0; c < 3; c++)
+                        rgb[c] = pq_eotf(rgb[c]) / REF_WHITE;
+                } else {
+                    double ys, gain;
+                    for (c = 0; c < 3; c++)
+                        rgb[c] = hlg_inv_oetf(rgb[c]);
+                    ys = 0.2627 * rgb[0] + 0.6780 * rgb[1] + 0.0593 * rgb[2];
+                    gain = ys > 0 ? k->peak / REF_WHITE * pow(ys, hlg_gamma - 1) : 0;
+                    for (c = 0; c < 3; c++)
+                        rgb[c] *= gain;
+                }
+
+                // 按三个分量的最大值映射，保持色相
+                sig = FFMAX3(rgb[0], rgb[1], rgb[2]);
+                if (sig > 1e-6) {
+                    double scale = hable(sig) / hable(peak) / sig;
+                    for (c = 0; c < 3; c++)
+                        rgb[c] *= scale;
+                }
+
+                for (c = 0; c < 3; c++) {
+                    out[c] = gm ? gm[c][0] * rgb[0] + gm[c][1] * rgb[1] + gm[c][2] * rgb[2] : rgb[c];
+                    out[c] = bt709_oetf(av_clipd(out[c], 0, 1));
+                }
+
+                // BT.709 limited range，8 位码值
+                yo = 0.2126 * out[0] + 0.7152 * out[1] + 0.0722 * out[2];
+                e[0] = (float)(16 + 219 * yo);
+                e[1] = (float)(128 + 224 * (out[2] - yo) / 1.8556);
+                e[2] = (float)(128 + 224 * (out[0] - yo) / 1.5748);
+                e[3] = 0;
+            }
+        }
+    }
+}
+
+// 从亮度元数据取峰值，按 100 nits 取整，便于共享查找表
+static int signal_peak(const AVFrame *f)
+{
+    AVFrameSideData *sd;
+    double peak = DEFAULT_PEAK;
+
+    if (f->color_trc == AVCOL_TRC_SMPTE2084) {
+        if ((sd = av_frame_get_side_data(f, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL)) &&
+            ((AVContentLightMetadata *)sd->data)->MaxCLL) {
+            peak = ((AVContentLightMetadata *)sd->data)->MaxCLL;
+        } else if ((sd = av_frame_get_side_data(f, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA))) {
+            AVMasteringDisplayMetadata *m = (AVMasteringDisplayMetadata *)sd->data;
+            if (m->has_luminance && m->max_luminance.num > 0)
+                peak = av_q2d(m->max_luminance);
+        }
+    }
+    return av_clip((int)lrint(peak / 100) * 100, 100, 10000);
+}
+
+static float *new_lut(const lut_key_t *key)
+{
+    float *data = (float *)av_malloc(GRID * GRID * GRID * 4 * sizeof(float));
+    if (data)
+        build_lut(data, key);
+    return data;
+}
+
+// 从缓存取查找表，没有时生成并放入缓存；缓存已满时返回 NULL
+static const float *get_lut(const lut_key_t *key)
+{
+    const float *lut = NULL;
+    int i;
+
+    pthread_mutex_lock(&luts_lock);
+    for (i = 0; i < nb_luts; i++) {
+        if (!memcmp(&luts[i].key, key, sizeof(*key))) {
+            lut = luts[i].data;
+            break;
+        }
+    }
+    if (!lut && nb_luts < MAX_LUTS) {
+        float *data = new_lut(key);
+        if (data) {
+            luts[nb_luts].key = *key;
+            luts[nb_luts].data = data;
+            nb_luts++;
+            lut = data;
+        }
+    }
+    pthread_mutex_unlock(&luts_lock);
+    return lut;
+}
+
+/*
+按第一帧的色彩属性初始化，不需要或不支持时返回 NULL
+ */
+void* tonemap_init(const AVFrame* src)
+{
+    tonemap_context_t *ctx;
+    lut_key_t key;
+
+    if (!tonemap_needed(src) || !tonemap_format_supported(src->format))
+        return NULL;
+    memset(&key, 0, sizeof(key));
+    key.trc = src->color_trc;
+    key.primaries = src->color_primaries;
+    key.matrix = src->colorspace;
+    key.full = src->color_range == AVCOL_RANGE_JPEG;
+    key.depth = src->format == AV_PIX_FMT_YUV420P10LE ? 10 : 8;
+    key.peak = signal_peak(src);
+
+    ctx = (tonemap_context_t *)av_mallocz(sizeof(tonemap_context_t));
+    if (!ctx)
+        return NULL;
+    ctx->src_fmt = src->format;
+    ctx->depth = key.depth;
+    ctx->scale = (float)(GRID - 1) / ((1 << key.depth) - 1);
+    ctx->lut = get_lut(&key);
+    if (!ctx->lut)
+        ctx->lut = ctx->own_lut = new_lut(&key);
+    if (!ctx->lut) {
+        av_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void tonemap_free(void* ctx)
+{
+    tonemap_context_t *tctx = (tonemap_context_t *)ctx;
+
+    if (!tctx)
+        return;
+    av_free(tctx->own_lut);
+    av_free(tctx);
+}
+
+// 格点坐标拆成整数部分与权重，最后一个格子的右边界归入该格子
+static av_always_inline int split(float f, float *w)
+{
+    int i = (int)f;
+    if (i > GRID - 2)
+        i = GRID - 2;
+    *w = f - i;
+    return i;
+}
+
+#ifdef TONEMAP_X86
+static av_always_inline __m128 lerp(__m128 a, __m128 b, __m128 w)
+{
+    return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), w));
+}
+
+// 三线性插值，一个向量同时处理 YUV 三个分量
+static av_always_inline __m128 lookup(const float *lut, float fy, float fu, float fv)
+{
+    float wy, wu, wv;
+    int iy = split(fy, &wy), iu = split(fu, &wu), iv = split(fv, &wv);
+    const float *p = lut + ((iy * GRID + iu) * GRID + iv) * 4;
+    const int du = GRID * 4, dy = GRID * GRID * 4;
+    __m128 vwv = _mm_set1_ps(wv), vwu = _mm_set1_ps(wu);
+    __m128 c00 = lerp(_mm_load_ps(p), _mm_load_ps(p + 4), vwv);
+    __m128 c01 = lerp(_mm_load_ps(p + du), _mm_load_ps(p + du + 4), vwv);
+    __m128 c10 = lerp(_mm_load_ps(p + dy), _mm_load_ps(p + dy + 4), vwv);
+    __m128 c11 = lerp(_mm_load_ps(p + dy + du), _mm_load_ps(p + dy + du + 4), vwv);
+    return lerp(lerp(c00, c01, vwu), lerp(c10, c11, vwu), _mm_set1_ps(wy));
+}
+
+typedef __m128 pix_t;
+#define PIX_ZERO _mm_setzero_ps()
+#define PIX_ADD(a, b) _mm_add_ps(a, b)
+static av_always_inline float pix_get(pix_t p, int c)
+{
+    float f[4];
+    _mm_storeu_ps(f, p);
+    return f[c];
+}
+#else
+typedef struct { float v[4]; } pix_t;
+
+static av_always_inline pix_t lookup(const float *lut, float fy, float fu, float fv)
+{
+    float wy, wu, wv;
+    int iy = split(fy, &wy), iu = split(fu, &wu), iv = split(fv, &wv);
+    const float *p = lut + ((iy * GRID + iu) * GRID + iv) * 4;
+    const int du = GRID * 4, dy = GRID * GRID * 4;
+    pix_t r;
+    int c;
+
+    for (c = 0; c < 3; c++) {
+        float c00 = p[c] + (p[4 + c] - p[c]) * wv;
+        float c01 = p[du + c] + (p[du + 4 + c] - p[du + c]) * wv;
+        float c10 = p[dy + c] + (p[dy + 4 + c] - p[dy + c]) * wv;
+        float c11 = p[dy + du + c] + (p[dy + du + 4 + c] - p[dy + du + c]) * wv;
+        float c0 = c00 + (c01 - c00) * wu, c1 = c10 + (c11 - c10) * wu;
+        r.v[c] = c0 + (c1 - c0) * wy;
+    }
+    r.v[3] = 0;
+    return r;
+}
+
+#define PIX_ZERO ((pix_t){ { 0, 0, 0, 0 } })
+static av_always_inline pix_t PIX_ADD(pix_t a, pix_t b)
+{
+    int c;
+    for (c = 0; c < 4; c++)
+        a.v[c] += b.v[c];
+    return a;
+}
+static av_always_inline float pix_get(pix_t p, int c)
+{
+    return p.v[c];
+}
+#endif
+
+static av_always_inline int load(const uint8_t *row, int i, const int depth)
+{
+    return depth > 8 ? ((const uint16_t *)row)[i] : row[i];
+}
+
+/*
+处理一对 luma 行（第二行可能不存在）与对应的一行色度
+输出的色度取 2x2 块内四个像素映射结果的平均
+ */
+static av_always_inline void map_rows(const tonemap_context_t *ctx, const uint8_t *y0, const uint8_t *y1,
+                                      const uint8_t *us, const uint8_t *vs, uint8_t *d0, uint8_t *d1,
+                                      uint8_t *du, uint8_t *dv, int w, const int depth)
+{
+    const float s = ctx->scale;
+    int c, x;
+
+    for (c = 0; c < (w + 1) >> 1; c++) {
+        float fu = load(us, c, depth) * s, fv = load(vs, c, depth) * s;
+        pix_t acc = PIX_ZERO;
+        int n = 0;
+
+        for (x = 2 * c; x < FFMIN(2 * c + 2, w); x++) {
+            pix_t p = lookup(ctx->lut, load(y0, x, depth) * s, fu, fv);
+            d0[x] = av_clip_uint8((int)(pix_get(p, 0) + 0.5f));
+            acc = PIX_ADD(acc, p);
+            n++;
+            if (y1) {
+                p = lookup(ctx->lut, load(y1, x, depth) * s, fu, fv);
+                d1[x] = av_clip_uint8((int)(pix_get(p, 0) + 0.5f));
+                acc = PIX_ADD(acc, p);
+                n++;
+            }
+        }
+        du[c] = av_clip_uint8((int)(pix_get(acc, 1) / n + 0.5f));
+        dv[c] = av_clip_uint8((int)(pix_get(acc, 2) / n + 0.5f));
+    }
+}
+
+static void map_rows8(const tonemap_context_t *ctx, const uint8_t *y0, const uint8_t *y1, const uint8_t *us,
+                      const uint8_t *vs, uint8_t *d0, uint8_t *d1, uint8_t *du, uint8_t *dv, int w)
+{
+    map_rows(ctx, y0, y1, us, vs, d0, d1, du, dv, w, 8);
+}
+
+static void map_rows10(const tonemap_context_t *ctx, const uint8_t *y0, const uint8_t *y1, const uint8_t *us,
+                       const uint8_t *vs, uint8_t *d0, uint8_t *d1, uint8_t *du, uint8_t *dv, int w)
+{
+    map_rows(ctx, y0, y1, us, vs, d0, d1, du, dv, w, 10);
+}
+
+/*
+映射 [y, y + h) 行，y 需为偶数，便于按条带并行
+src 与 dst 尺寸相同，dst 为 TONEMAP_DST_FORMAT
+ */
+int tonemap_frame(void* ctx, const AVFrame* src, AVFrame* dst, int y, int h)
+{
+    tonemap_context_t *tctx = (tonemap_context_t *)ctx;
+    int j;
+
+    if (!tctx || src->format != tctx->src_fmt || dst->format != TONEMAP_DST_FORMAT ||
+        src->width != dst->width || src->height != dst->height || (y & 1) || y + h > src->height)
+        return AVERROR(EINVAL);
+
+    for (j = y; j < y + h; j += 2) {
+        int second = j + 1 < y + h;
+        const uint8_t *y0 = src->data[0] + (ptrdiff_t)j * src->linesize[0];
+        const uint8_t *y1 = second ? y0 + src->linesize[0] : NULL;
+        const uint8_t *us = src->data[1] + (ptrdiff_t)(j >> 1) * src->linesize[1];
+        const uint8_t *vs = src->data[2] + (ptrdiff_t)(j >> 1) * src->linesize[2];
+        uint8_t *d0 = dst->data[0] + (ptrdiff_t)j * dst->linesize[0];
+        uint8_t *d1 = second ? d0 + dst->linesize[0] : NULL;
+        uint8_t *du = dst->data[1] + (ptrdiff_t)(j >> 1) * dst->linesize[1];
+        uint8_t *dv = dst->data[2] + (ptrdiff_t)(j >> 1) * dst->linesize[2];
+
+        if (tctx->depth > 8)
+            map_rows10(tctx, y0, y1, us, vs, d0, d1, du, dv, src->width);
+        else
+            map_rows8(tctx, y0, y1, us, vs, d0, d1, du, dv, src->width);
+    }
+    return 0;
+}
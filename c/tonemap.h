@@ -0,0 +1,19 @@
+
+#include <libavutil/frame.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 色调映射输出帧的像素格式
+#define TONEMAP_DST_FORMAT AV_PIX_FMT_YUV420P
+
+int tonemap_needed(const AVFrame* frame);
+int tonemap_format_supported(int fmt);
+void* tonemap_init(const AVFrame* src);
+void tonemap_dst_props(AVFrame* dst);
+int tonemap_frame(void* ctx, const AVFrame* src, AVFrame* dst, int y, int h);
+void tonemap_free(void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
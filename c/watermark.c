@@ -0,0 +1,440 @@
+/*
+水印：在编码前的输出帧上叠加一张带透明度的图片（logo）
+
+同一张 logo 在同样的输出尺寸、像素格式下，缩放与颜色转换的结果总是相同的，
+所以按（logo 内容，位置，大小，输出尺寸，像素格式）缓存预先处理好的水印，所有请求共享：
+    - logo 只在第一次用到时解码、按输出宽度的百分比缩放（双三次），转换到输出的像素格式
+    - 按输出帧的字节布局存成两张表：预乘了透明度的颜色 pre、255 - 透明度 inv，
+      色度平面按子采样对透明度与预乘的颜色取平均
+    - 叠加只剩逐字节的 dst = pre + dst * inv / 255（SIMD，每次 16 字节），不区分平面、打包格式
+缓存的水印是引用计数的 AVBufferRef，淘汰时正在使用的请求不受影响。
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include "watermark.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WATERMARK_X86 1
+#endif
+
+// 缓存的水印数，超过时淘汰最久未用的
+#define CACHE_SIZE 16
+
+typedef struct overlay {
+    enum AVPixelFormat format;
+    int width, height; // 输出帧的尺寸
+    int nb_planes;
+    int x[4], y[4]; // 各平面中水印区域的起始字节列、行
+    int w[4], h[4]; // 各平面中水印区域的字节宽、行数
+    uint8_t *pre[4]; // 预乘了透明度的颜色，行距为 w
+    uint8_t *inv[4]; // 255 - 透明度，行距为 w
+} overlay_t;
+
+typedef struct cache_entry {
+    uint64_t hash; // logo 内容的哈希
+    int logo_size, position, percent, width, height;
+    enum AVPixelFormat format;
+    AVBufferRef *buf; // overlay_t，NULL 为空位
+    int64_t last_use;
+} cache_entry_t;
+
+static cache_entry_t cache[CACHE_SIZE];
+static int64_t use_clock;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// FNV-1a
+static uint64_t hash_bytes(const uint8_t *p, int n)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < n; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// dst = pre + dst * inv / 255；t = dst * inv + 128 时 (t + (t >> 8)) >> 8 即四舍五入的 dst * inv / 255
+static void blend_row(uint8_t *dst, const uint8_t *pre, const uint8_t *inv, int n)
+{
+    int x = 0;
+#ifdef WATERMARK_X86
+    __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16(128);
+
+    for (; x + 16 <= n; x += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + x));
+        __m128i a = _mm_loadu_si128((const __m128i *)(inv + x));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(a, zero)), round);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(a, zero)), round);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        d = _mm_adds_epu8(_mm_packus_epi16(lo, hi), _mm_loadu_si128((const __m128i *)(pre + x)));
+        _mm_storeu_si128((__m128i *)(dst + x), d);
+    }
+#endif
+    for (; x < n; x++) {
+        int t = dst[x] * inv[x] + 128;
+        dst[x] = av_clip_uint8(pre[x] + ((t + (t >> 8)) >> 8));
+    }
+}
+
+/*
+解码 logo 的第一帧，缩放为 width x height 的 RGBA（双三次），写到 rgba
+width 或 height 为 0 时按 logo 的宽高比由另一个算出
+ */
+static int decode_logo(const uint8_t *logo, int logo_size, int width, int height, AVFrame *rgba)
+{
+    AVFormatContext *fmt_ctx = NULL;
+    AVIOContext *pb = NULL;
+    AVCodecContext *c = NULL;
+    AVCodec *dec = NULL;
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL;
+    struct SwsContext *sws = NULL;
+    uint8_t *indata;
+    int ret, idx, got = 0;
+
+    fmt_ctx = avformat_alloc_context();
+    indata = (uint8_t *)av_malloc(logo_size);
+    if (!fmt_ctx || !indata) {
+        av_free(indata);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    memcpy(indata, logo, logo_size);
+    pb = avio_alloc_context(indata, logo_size, 0, NULL, NULL, NULL, NULL);
+    if (!pb) {
+        av_free(indata);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    fmt_ctx->pb = pb;
+    // 打开失败时 fmt_ctx 会被释放，pb 由这里释放
+    if ((ret = avformat_open_input(&fmt_ctx, NULL, NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0 ||
+        (ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open watermark image, err:%d\n", ret);
+        goto end;
+    }
+    idx = ret;
+    c = avcodec_alloc_context3(dec);
+    if (!c) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avcodec_parameters_to_context(c, fmt_ctx->streams[idx]->codecpar)) < 0 ||
+        (ret = avcodec_open2(c, dec, NULL)) < 0)
+        goto end;
+
+    pkt = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!pkt || !frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    while (!got && av_read_frame(fmt_ctx, pkt) >= 0) {
+        if (pkt->stream_index == idx && avcodec_send_packet(c, pkt) >= 0)
+            got = avcodec_receive_frame(c, frame) >= 0;
+        av_packet_unref(pkt);
+    }
+    if (!got && avcodec_send_packet(c, NULL) >= 0)
+        got = avcodec_receive_frame(c, frame) >= 0;
+    if (!got || frame->width <= 0 || frame->height <= 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not decode watermark image\n");
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    if (!width)
+        width = FFMAX((int)((int64_t)height * frame->width / frame->height), 1);
+    if (!height)
+        height = FFMAX((int)((int64_t)width * frame->height / frame->width), 1);
+    rgba->format = AV_PIX_FMT_RGBA;
+    rgba->width = width;
+    rgba->height = height;
+    if ((ret = av_frame_get_buffer(rgba, 0)) < 0)
+        goto end;
+    sws = sws_getContext(frame->width, frame->height, frame->format, width, height, AV_PIX_FMT_RGBA,
+                         SWS_BICUBIC, NULL, NULL, NULL);
+    if (!sws) {
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+    sws_scale(sws, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height,
+              rgba->data, rgba->linesize);
+    ret = 0;
+
+end:
+    sws_freeContext(sws);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&c);
+    avformat_close_input(&fmt_ctx);
+    if (pb) {
+        av_freep(&pb->buffer);
+        av_freep(&pb);
+    }
+    return ret;
+}
+
+// logo 的一个像素转换到输出格式第 i 个分量的值，full 为 YUV 是否全范围
+static int component_value(const uint8_t *px, int rgb, int full, int i)
+{
+    int r = px[0], g = px[1], b = px[2], v;
+
+    if (rgb)
+        return px[i];
+    // BT.601，定点 16 位
+    if (i == 0) {
+        v = (19595 * r + 38470 * g + 7471 * b + 32768) >> 16;
+        return full ? v : 16 + (v * 219 + 127) / 255;
+    }
+    if (i == 1)
+        v = (-11059 * r - 21709 * g + 32768 * b + 32768) >> 16;
+    else
+        v = (32768 * r - 27439 * g - 5329 * b + 32768) >> 16;
+    return 128 + (full ? v : (v * 224 + (v < 0 ? -127 : 127)) / 255);
+}
+
+static int is_full_range(enum AVPixelFormat format)
+{
+    return format == AV_PIX_FMT_YUVJ420P || format == AV_PIX_FMT_YUVJ422P || format == AV_PIX_FMT_YUVJ444P ||
+           format == AV_PIX_FMT_YUVJ440P || format == AV_PIX_FMT_YUVJ411P;
+}
+
+static void overlay_free(void *opaque, uint8_t *data)
+{
+    (void)opaque;
+    av_free(data);
+}
+
+// 按输出格式的字节布局生成水印，rgba 的左上角放在输出帧的 (x0, y0)
+static AVBufferRef* render(const AVFrame *rgba, int x0, int y0, int width, int height, enum AVPixelFormat format)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    int rgb = !!(desc->flags & AV_PIX_FMT_FLAG_RGB), full = is_full_range(format);
+    int nb_comps = FFMIN(desc->nb_components, 3) == 2 ? 1 : FFMIN(desc->nb_components, 3);
+    int step[4] = {0}, sw[4] = {0}, sh[4] = {0};
+    int p, i, size = sizeof(overlay_t);
+    overlay_t *o;
+    uint8_t *mem;
+    AVBufferRef *buf;
+
+    o = (overlay_t *)av_mallocz(sizeof(overlay_t));
+    if (!o)
+        return NULL;
+    o->format = format;
+    o->width = width;
+    o->height = height;
+    o->nb_planes = av_pix_fmt_count_planes(format);
+    for (i = 0; i < desc->nb_components; i++)
+        step[desc->comp[i].plane] = FFMAX(step[desc->comp[i].plane], desc->comp[i].step);
+    for (p = 0; p < o->nb_planes; p++) {
+        if (!rgb && (p == 1 || p == 2)) {
+            sw[p] = desc->log2_chroma_w;
+            sh[p] = desc->log2_chroma_h;
+        }
+        o->x[p] = (x0 >> sw[p]) * step[p];
+        o->y[p] = y0 >> sh[p];
+        o->w[p] = AV_CEIL_RSHIFT(rgba->width, sw[p]) * step[p];
+        o->h[p] = AV_CEIL_RSHIFT(rgba->height, sh[p]);
+        size += 2 * o->w[p] * o->h[p];
+    }
+    mem = (uint8_t *)av_realloc(o, size);
+    if (!mem) {
+        av_free(o);
+        return NULL;
+    }
+    o = (overlay_t *)mem;
+    mem += sizeof(overlay_t);
+    for (p = 0; p < o->nb_planes; p++) {
+        o->pre[p] = mem;
+        o->inv[p] = mem + o->w[p] * o->h[p];
+        mem += 2 * o->w[p] * o->h[p];
+        // 不属于颜色分量的字节（alpha、填充）保持原样
+        memset(o->pre[p], 0, o->w[p] * o->h[p]);
+        memset(o->inv[p], 255, o->w[p] * o->h[p]);
+    }
+
+    for (i = 0; i < nb_comps; i++) {
+        const AVComponentDescriptor *c = &desc->comp[i];
+        int px, py, sx, sy;
+        p = c->plane;
+        for (py = 0; py < o->h[p]; py++) {
+            for (px = 0; px < o->w[p] / step[p]; px++) {
+                // 子采样的平面对覆盖的 logo 像素取平均
+                int sum_a = 0, sum_v = 0, n = 0;
+                for (sy = py << sh[p]; sy < FFMIN((py + 1) << sh[p], rgba->height); sy++) {
+                    for (sx = px << sw[p]; sx < FFMIN((px + 1) << sw[p], rgba->width); sx++) {
+                        const uint8_t *s = rgba->data[0] + (ptrdiff_t)sy * rgba->linesize[0] + sx * 4;
+                        sum_a += s[3];
+                        sum_v += component_value(s, rgb, full, i) * s[3];
+                        n++;
+                    }
+                }
+                o->pre[p][py * o->w[p] + px * step[p] + c->offset] = (sum_v + n * 255 / 2) / (n * 255);
+                o->inv[p][py * o->w[p] + px * step[p] + c->offset] = 255 - (sum_a + n / 2) / n;
+            }
+        }
+    }
+
+    buf = av_buffer_create((uint8_t *)o, size, overlay_free, NULL, 0);
+    if (!buf)
+        av_free(o);
+    return buf;
+}
+
+static int format_supported(enum AVPixelFormat format)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    int i;
+
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)))
+        return 0;
+    for (i = 0; i < desc->nb_components; i++)
+        if (desc->comp[i].depth != 8 || desc->comp[i].shift)
+            return 0;
+    return 1;
+}
+
+/*
+取（logo，位置，宽度百分比）在 width x height、format 的输出帧上的水印，缓存中没有时生成并加入缓存
+返回水印的引用，用完 watermark_unref()；输出格式不支持（调色板、非 8 位）或 logo 无法解码时返回 NULL
+ */
+void* watermark_get(const uint8_t* logo, int logo_size, int position, int percent,
+                    int width, int height, enum AVPixelFormat format)
+{
+    uint64_t hash;
+    AVBufferRef *ref = NULL, *buf;
+    AVFrame *rgba = NULL;
+    cache_entry_t *e, *slot = NULL;
+    int i, lw, lh, margin, x0, y0;
+
+    if (!logo || logo_size <= 0 || width <= 0 || height <= 0)
+        return NULL;
+    if (!format_supported(format)) {
+        av_log(NULL, AV_LOG_WARNING, "watermark is not supported on %s output\n", av_get_pix_fmt_name(format));
+        return NULL;
+    }
+    if (percent <= 0 || percent > 100)
+        percent = WATERMARK_DEFAULT_PERCENT;
+    hash = hash_bytes(logo, logo_size);
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < CACHE_SIZE; i++) {
+        e = &cache[i];
+        if (e->buf && e->hash == hash && e->logo_size == logo_size && e->position == position &&
+            e->percent == percent && e->width == width && e->height == height && e->format == format) {
+            e->last_use = ++use_clock;
+            ref = av_buffer_ref(e->buf);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (ref)
+        return ref;
+
+    // 缓存未命中，在锁外解码、缩放，不阻塞其他请求
+    rgba = av_frame_alloc();
+    if (!rgba)
+        return NULL;
+    lw = FFMAX(width * percent / 100, 1);
+    if (decode_logo(logo, logo_size, lw, 0, rgba) < 0)
+        goto end;
+    // 太高的 logo 按高度缩小
+    if (rgba->height > height / 2) {
+        lh = FFMAX(height / 2, 1);
+        av_frame_unref(rgba);
+        if (decode_logo(logo, logo_size, 0, lh, rgba) < 0 || rgba->width > width)
+            goto end;
+    }
+    lw = rgba->width;
+    lh = rgba->height;
+    margin = FFMIN(width, height) / 32;
+    x0 = position == WATERMARK_BOTTOM_LEFT || position == WATERMARK_TOP_LEFT ? margin :
+         position == WATERMARK_CENTER ? (width - lw) / 2 : width - lw - margin;
+    y0 = position == WATERMARK_TOP_LEFT || position == WATERMARK_TOP_RIGHT ? margin :
+         position == WATERMARK_CENTER ? (height - lh) / 2 : height - lh - margin;
+    // 起点对齐到偶数，子采样的色度平面与亮度对齐
+    x0 = av_clip(x0, 0, width - lw) & ~1;
+    y0 = av_clip(y0, 0, height - lh) & ~1;
+    buf = render(rgba, x0, y0, width, height, format);
+    if (!buf)
+        goto end;
+    av_log(NULL, AV_LOG_INFO, "watermark %dx%d at (%d, %d) on %dx%d %s\n", lw, lh, x0, y0,
+           width, height, av_get_pix_fmt_name(format));
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < CACHE_SIZE; i++) {
+        e = &cache[i];
+        if (!slot || !e->buf || (slot->buf && e->last_use < slot->last_use))
+            slot = e;
+        if (!e->buf)
+            break;
+    }
+    av_buffer_unref(&slot->buf);
+    slot->hash = hash;
+    slot->logo_size = logo_size;
+    slot->position = position;
+    slot->percent = percent;
+    slot->width = width;
+    slot->height = height;
+    slot->format = format;
+    slot->last_use = ++use_clock;
+    slot->buf = buf;
+    ref = av_buffer_ref(buf);
+    pthread_mutex_unlock(&cache_lock);
+
+end:
+    av_frame_free(&rgba);
+    return ref;
+}
+
+/*
+把水印叠加到 frame 上，frame 需可写，格式与尺寸和 watermark_get() 时的一致
+ */
+int watermark_apply(void* wm, AVFrame* frame)
+{
+    const overlay_t *o;
+    int p, y;
+
+    if (!wm)
+        return 0;
+    o = (const overlay_t *)((AVBufferRef *)wm)->data;
+    if (frame->format != o->format || frame->width != o->width || frame->height != o->height)
+        return AVERROR(EINVAL);
+    for (p = 0; p < o->nb_planes; p++)
+        for (y = 0; y < o->h[p]; y++)
+            blend_row(frame->data[p] + (ptrdiff_t)(o->y[p] + y) * frame->linesize[p] + o->x[p],
+                      o->pre[p] + y * o->w[p], o->inv[p] + y * o->w[p], o->w[p]);
+    return 0;
+}
+
+void watermark_unref(void* wm)
+{
+    AVBufferRef *buf = (AVBufferRef *)wm;
+
+    av_buffer_unref(&buf);
+}
+
+/*
+清空缓存，正在使用的水印在最后一个引用释放时回收
+ */
+void watermark_uninit(void)
+{
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < CACHE_SIZE; i++)
+        av_buffer_unref(&cache[i].buf);
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,28 @@
+
+#include <stdint.h>
+#include <libavutil/frame.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 水印的位置
+enum {
+    WATERMARK_BOTTOM_RIGHT = 0,
+    WATERMARK_BOTTOM_LEFT,
+    WATERMARK_TOP_RIGHT,
+    WATERMARK_TOP_LEFT,
+    WATERMARK_CENTER,
+};
+
+// 水印的默认宽度，占输出宽度的百分比
+#define WATERMARK_DEFAULT_PERCENT 20
+
+void* watermark_get(const uint8_t* logo, int logo_size, int position, int percent,
+                    int width, int height, enum AVPixelFormat format);
+int watermark_apply(void* wm, AVFrame* frame);
+void watermark_unref(void* wm);
+void watermark_uninit(void);
+
+#ifdef __cplusplus
+}
+#endif